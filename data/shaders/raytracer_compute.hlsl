@@ -1,5 +1,4 @@
 #define PI 3.1415926f
-#define SAMPLES 50
 
 struct Ray {
     float3 origin;
@@ -41,12 +40,31 @@ struct Properties {
     int frame_count;
     int sphere_count;
     Camera camera;
+    int bvh_node_count;
+    int light_count;
+    int light_sampling;
+    int samples;
+    int max_depth;
+    int roulette_depth;
+};
+
+struct BVHNode {
+    float3 bounds_min;
+    int left_first;
+    float3 bounds_max;
+    int primitive_count;
 };
 
 RWTexture2D<float4> pixels : register(u0);
 StructuredBuffer<Properties> properties_list : register(t0);
 StructuredBuffer<Sphere> spheres : register(t1);
 StructuredBuffer<Material> materials : register(t2);
+StructuredBuffer<BVHNode> bvh_nodes : register(t3);
+StructuredBuffer<int> bvh_primitive_indices : register(t4);
+StructuredBuffer<int> lights : register(t5);
+
+#define BVH_STACK_SIZE 32 // a path through the BVH needs BVH_MAX_DEPTH + 1 entries, see bvh.h
+#define NO_HIT 1.0e30f
 
 uint wang_hash(inout uint seed) {
     seed = (seed ^ 61) ^ (seed >> 16);
@@ -204,7 +222,73 @@ bool scatter(inout uint state, Material material, Ray incoming_ray, Hit hit, ino
     return false;
 }
 
+float aabb_hit(float3 bounds_min, float3 bounds_max, Ray ray, float3 inv_dir, float t_min, float t_max) {
+    float3 t0 = (bounds_min - ray.origin) * inv_dir;
+    float3 t1 = (bounds_max - ray.origin) * inv_dir;
+    float3 t_small = min(t0, t1);
+    float3 t_big = max(t0, t1);
+
+    float enter = max(max(t_small.x, t_small.y), max(t_small.z, t_min));
+    float exit = min(min(t_big.x, t_big.y), min(t_big.z, t_max));
+
+    return enter <= exit ? enter : NO_HIT;
+}
+
+int bvh_check_object_hit(Ray ray, float t_min, float t_max, inout Hit hit) {
+    float3 inv_dir = 1.0f / ray.direction;
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    int selected_index = -1;
+    float closest_hit_distance = t_max;
+
+    if (aabb_hit(bvh_nodes[0].bounds_min, bvh_nodes[0].bounds_max, ray, inv_dir, t_min, t_max) == NO_HIT) {
+        return -1;
+    }
+
+    // Out of range reads return zero, so a malformed BVH from a scene file only needs the loops bounded, like
+    // bvh_traverse on the CPU.
+    int node_count = properties_list[0].bvh_node_count;
+    int visited = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0 && visited++ < node_count) {
+        BVHNode node = bvh_nodes[stack[--stack_size]];
+        if (node.primitive_count > 0) {
+            int primitive_count = min(node.primitive_count, properties_list[0].sphere_count);
+            for (int i = 0; i < primitive_count; i++) {
+                int prim = bvh_primitive_indices[node.left_first + i];
+                if (sphere_hit(spheres[prim], ray, t_min, closest_hit_distance, hit)) {
+                    selected_index = prim;
+                    closest_hit_distance = hit.t;
+                }
+            }
+        }
+        else {
+            BVHNode left = bvh_nodes[node.left_first];
+            BVHNode right = bvh_nodes[node.left_first + 1];
+            float left_t = aabb_hit(left.bounds_min, left.bounds_max, ray, inv_dir, t_min, closest_hit_distance);
+            float right_t = aabb_hit(right.bounds_min, right.bounds_max, ray, inv_dir, t_min, closest_hit_distance);
+
+            // Push the farther child first so the nearer one is visited next.
+            bool right_first = right_t < left_t;
+            float far_t = right_first ? left_t : right_t;
+            float near_t = right_first ? right_t : left_t;
+            if (far_t != NO_HIT && stack_size < BVH_STACK_SIZE) {
+                stack[stack_size++] = right_first ? node.left_first : node.left_first + 1;
+            }
+            if (near_t != NO_HIT && stack_size < BVH_STACK_SIZE) {
+                stack[stack_size++] = right_first ? node.left_first + 1 : node.left_first;
+            }
+        }
+    }
+
+    return selected_index;
+}
+
 int check_object_hit(int sphere_count, Ray ray, float t_min, float t_max, inout Hit hit) {
+    if (properties_list[0].bvh_node_count > 0) {
+        return bvh_check_object_hit(ray, t_min, t_max, hit);
+    }
+
     Hit closest_hit;
     int selected_index = -1;
     float closest_hit_distance = t_max;
@@ -223,24 +307,126 @@ int check_object_hit(int sphere_count, Ray ray, float t_min, float t_max, inout
     return selected_index;
 }
 
+float power_heuristic(float pdf, float other_pdf) {
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+float sphere_light_pdf(Sphere sphere, float3 from) {
+    float3 to_center = sphere.center - from;
+    float sin2_theta_max = sphere.radius * sphere.radius / dot(to_center, to_center);
+    if (sin2_theta_max >= 1.0f) {
+        return 0.0f;
+    }
+    float one_minus_cos_theta_max = sin2_theta_max / (1.0f + sqrt(1.0f - sin2_theta_max));
+    return 1.0f / (2.0f * PI * one_minus_cos_theta_max);
+}
+
+bool sample_sphere_light(inout uint state, Sphere sphere, float3 from, out float3 direction, out float pdf) {
+    float u1 = random_float(state);
+    float u2 = random_float(state);
+    direction = 0;
+    pdf = 0;
+    float3 to_center = sphere.center - from;
+    float distance2 = dot(to_center, to_center);
+    float sin2_theta_max = sphere.radius * sphere.radius / distance2;
+    if (sin2_theta_max >= 1.0f) {
+        return false;
+    }
+    float one_minus_cos_theta_max = sin2_theta_max / (1.0f + sqrt(1.0f - sin2_theta_max));
+
+    float one_minus_cos_theta = u1 * one_minus_cos_theta_max;
+    float cos_theta = 1.0f - one_minus_cos_theta;
+    float sin_theta = sqrt(max(0.0f, one_minus_cos_theta * (2.0f - one_minus_cos_theta)));
+    float phi = 2.0f * PI * u2;
+
+    float3 w = to_center / sqrt(distance2);
+    float s = w.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (s + w.z);
+    float b = w.x * w.y * a;
+    float3 u = float3(1.0f + s * w.x * w.x * a, s * b, -s * w.x);
+    float3 v = float3(b, s + w.y * w.y * a, -w.y);
+
+    direction = u * (cos(phi) * sin_theta) + v * (sin(phi) * sin_theta) + w * cos_theta;
+    pdf = 1.0f / (2.0f * PI * one_minus_cos_theta_max);
+    return true;
+}
+
+float lambertian_pdf(Hit hit, float3 direction) {
+    float length_squared = dot(direction, direction);
+    return length_squared > 0.0f ? max(0.0f, dot(direction, hit.normal)) / (sqrt(length_squared) * PI) : 0.0f;
+}
+
+float3 sample_direct_light(inout uint state, int sphere_count, int light_count, Hit hit, Material material) {
+    int light = lights[min((int)(random_float(state) * light_count), light_count - 1)];
+    Sphere sphere = spheres[light];
+
+    float3 direction;
+    float cone_pdf;
+    if (!sample_sphere_light(state, sphere, hit.pos, direction, cone_pdf)) {
+        return float3(0, 0, 0);
+    }
+    float cosine = dot(direction, hit.normal);
+    if (cosine <= 0.0f) {
+        return float3(0, 0, 0);
+    }
+
+    Ray shadow_ray;
+    shadow_ray.origin = hit.pos;
+    shadow_ray.direction = direction;
+    Hit shadow_hit;
+    if (check_object_hit(sphere_count, shadow_ray, 0.001f, length(sphere.center - hit.pos), shadow_hit) != light) {
+        return float3(0, 0, 0);
+    }
+
+    float light_pdf = cone_pdf / light_count;
+    float weight = power_heuristic(light_pdf, cosine / PI);
+    return material.albedo * emit(materials[light]) * (cosine / PI / light_pdf * weight);
+}
+
 float3 trace_ray(inout uint state, int sphere_count, Ray ray) {
     float3 result = 0;
     float3 cumilative_attenuation = float3(1.0, 1.0, 1.0);
-
-    for (int depth = 0; depth < 50; depth++) {
+    int light_count = properties_list[0].light_count;
+    bool light_sampling = properties_list[0].light_sampling != 0 && light_count > 0;
+    float bsdf_pdf = 0.0f;
+    float3 bounce_origin = 0;
+    int max_depth = properties_list[0].max_depth;
+    int roulette_depth = properties_list[0].roulette_depth;
+
+    for (int depth = 0; depth < max_depth; depth++) {
         Hit hit;
         int obj_index = check_object_hit(sphere_count, ray, 0.001f, 1.0e7f, hit);
         if (obj_index != -1) {
             Ray outgoing_ray;
             float3 attenuation;
-            float3 emitted = emit(materials[obj_index]);
-
-            if (scatter(state, materials[obj_index], ray, hit, attenuation, outgoing_ray)) {
+            Material material = materials[obj_index];
+            float3 emitted = emit(material);
+
+            if (scatter(state, material, ray, hit, attenuation, outgoing_ray)) {
+                bsdf_pdf = 0.0f;
+                if (light_sampling && material.type == 1) {
+                    result += cumilative_attenuation * sample_direct_light(state, sphere_count, light_count, hit, material);
+                    bsdf_pdf = lambertian_pdf(hit, outgoing_ray.direction);
+                    bounce_origin = hit.pos;
+                }
                 cumilative_attenuation *= attenuation;
                 ray = outgoing_ray;
+
+                if (depth >= roulette_depth) {
+                    float survival = min(1.0f, max(cumilative_attenuation.x, max(cumilative_attenuation.y, cumilative_attenuation.z)));
+                    if (random_float(state) >= survival) {
+                        break;
+                    }
+                    cumilative_attenuation /= survival;
+                }
             }
             else {
-                result += cumilative_attenuation * emitted;
+                float weight = 1.0f;
+                if (bsdf_pdf > 0.0f) {
+                    float light_pdf = sphere_light_pdf(spheres[obj_index], bounce_origin) / light_count;
+                    weight = power_heuristic(bsdf_pdf, light_pdf);
+                }
+                result += cumilative_attenuation * emitted * weight;
                 break;
             }
         }
@@ -259,18 +445,22 @@ float3 trace_ray(inout uint state, int sphere_count, Ray ray) {
 void CS(uint3 id : SV_DispatchThreadID)
 {
     Properties properties = properties_list[0];
+    if (id.x >= (uint)properties.width || id.y >= (uint)properties.height) {
+        return; // the last group in each direction overhangs when the size isn't a multiple of 8
+    }
+
     Camera camera = properties.camera;
     float3 color = 0;
     uint random_state = (id.x * 1973 + id.y * 9277 + properties.frame_count * 26699) | 1;
 
-    for (int i = 0; i < SAMPLES; i++) {
+    for (int i = 0; i < properties.samples; i++) {
         float u = float(id.x + random_float(random_state)) / float(properties.width);
         float v = (properties.height - float(id.y + random_float(random_state))) / float(properties.height);
         Ray ray = get_camera_ray(random_state, camera, u, v);
         color += trace_ray(random_state, properties.sphere_count, ray);
     }
 
-    color /= float(SAMPLES);
+    color /= float(properties.samples);
 
     pixels[id.xy] = lerp(float4(color, 1), pixels[id.xy], float(properties.frame_count) / float(properties.frame_count + 1));
 }
\ No newline at end of file
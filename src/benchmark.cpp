@@ -0,0 +1,1580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "bvh_refit.h"
+#include "cpu_raytracer.h"
+#include "denoiser.h"
+#include "reprojection.h"
+#include "scene_file.h"
+#include "scene_store.h"
+#include "tile_farm.h"
+
+// Command line benchmark for the CPU tracer. Doesn't need D3D11, so it also runs on the render boxes.
+// Without arguments it prints the comparison tables below. "throughput" runs the regression suite instead: it sweeps
+// scene size, samples per pixel and thread count, can write the results as JSON and compares them against a
+// baseline written by an earlier run. "lights" compares next event estimation with BSDF sampling alone, "denoise" the
+// first passes of a frame with and without the denoiser, "reproject" restarting after a camera move with reprojecting,
+// "compressed" the binary BVH against the quantized scene of compressed_bvh.h up to scenes larger than the caches.
+// "farm" checks that a tile farm of playground-render workers, one of which fails, gives the image of a local render.
+
+typedef std::chrono::high_resolution_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+// Spheres scattered in a cube that grows with the count, so density (and hit distance) stays the same.
+static std::vector<Sphere> random_spheres(int count, uint32_t seed) {
+	std::vector<Sphere> spheres;
+	spheres.reserve(count);
+	float extent = std::cbrt((float)count);
+	for (int i = 0; i < count; i++) {
+		Vector3 center(random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent));
+		spheres.push_back(Sphere(center, random_float_between(seed, 0.2f, 1.0f)));
+	}
+	return spheres;
+}
+
+static std::vector<Ray> random_rays(int count, float extent, uint32_t seed) {
+	std::vector<Ray> rays;
+	rays.reserve(count);
+	for (int i = 0; i < count; i++) {
+		Vector3 origin(random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent));
+		rays.push_back(Ray(origin, random_unit_vector(seed)));
+	}
+	return rays;
+}
+
+// Returns ns per ray. checksum sums the hit sphere indices, so two paths can be compared and the work isn't optimized away.
+static double trace_rays(const RaytracerData& data, const std::vector<Ray>& rays, long long& checksum) {
+	checksum = 0;
+	auto start = bench_clock::now();
+	for (const Ray& ray : rays) {
+		Hit hit;
+		checksum += check_object_hit(data, ray, 0.001f, 1.0e7f, hit) + 1;
+	}
+	return elapsed_ms(start) * 1.0e6 / rays.size();
+}
+
+static void bvh_benchmark() {
+	const int counts[] = { 100, 1000, 10000, 100000, 500000 };
+	const int ray_count = 100000;
+	const int brute_force_limit = 10000;
+
+	printf("BVH scaling, %d random rays per scene\n", ray_count);
+	printf("%10s %10s %12s %14s %14s %10s\n", "spheres", "nodes", "build ms", "bvh ns/ray", "brute ns/ray", "speedup");
+
+	for (int count : counts) {
+		std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+		std::vector<Material> materials(count);
+		std::vector<Ray> rays = random_rays(ray_count, std::cbrt((float)count), 0x89abcdefu);
+
+		auto start = bench_clock::now();
+		BVH bvh = build_bvh(spheres.data(), count);
+		double build_ms = elapsed_ms(start);
+
+		RaytracerData data = {};
+		data.properties.sphere_count = count;
+		data.spheres = spheres.data();
+		data.materials = materials.data();
+		set_bvh(data, bvh);
+
+		long long bvh_checksum = 0;
+		double bvh_ns = trace_rays(data, rays, bvh_checksum);
+
+		if (count <= brute_force_limit) {
+			data.properties.bvh_node_count = 0;
+			long long brute_checksum = 0;
+			double brute_ns = trace_rays(data, rays, brute_checksum);
+			if (brute_checksum != bvh_checksum) {
+				printf("result mismatch between bvh and brute force\n");
+			}
+			printf("%10d %10zu %12.2f %14.1f %14.1f %9.1fx\n", count, bvh.nodes.size(), build_ms, bvh_ns, brute_ns, brute_ns / bvh_ns);
+		}
+		else {
+			printf("%10d %10zu %12.2f %14.1f %14s %10s\n", count, bvh.nodes.size(), build_ms, bvh_ns, "-", "-");
+		}
+	}
+}
+
+// One sphere dragged in small steps, a new direction every 50 steps, as the playground's sphere widgets do. Each step
+// either rebuilds the BVH or updates it with bvh_update_spheres; SAH costs are per unit of root area, after all steps.
+// Then updates of several spheres at once, each moved once.
+static void refit_benchmark() {
+	const int counts[] = { 1000, 100000, 500000 };
+	const int steps = 500;
+
+	printf("\nBVH updates, %d drag steps of one sphere\n", steps);
+	printf("%10s %12s %12s %10s %12s %12s %12s %14s\n", "spheres", "build ms", "update us", "speedup", "rotations", "rebuilt/step",
+		"update SAH", "rebuilt SAH");
+
+	for (int count : counts) {
+		std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+		float extent = std::cbrt((float)count);
+		auto start = bench_clock::now();
+		BVH bvh = build_bvh(spheres.data(), count);
+		double build_ms = elapsed_ms(start);
+		BVHUpdater updater = create_bvh_updater(bvh, spheres.data(), count);
+
+		uint32_t seed = 0x2468aceu;
+		int dragged = 0;
+		Vector3 step;
+		long long rotations = 0, rebuilt = 0;
+		double update_ms = 0;
+		for (int i = 0; i < steps; i++) {
+			if (i % 50 == 0) {
+				dragged = (int)(wang_hash(seed) % (uint32_t)count);
+				step = Vector3(random_float_between(seed, -1, 1), random_float_between(seed, -1, 1), random_float_between(seed, -1, 1)) * (0.02f * extent);
+			}
+			spheres[dragged].center += step;
+			start = bench_clock::now();
+			bvh_update_spheres(bvh, updater, spheres.data(), &dragged, 1);
+			update_ms += elapsed_ms(start);
+			rotations += updater.rotations;
+			rebuilt += updater.rebuilt_primitives;
+		}
+		double update_us = update_ms * 1000.0 / steps;
+		BVH rebuilt_bvh = build_bvh(spheres.data(), count);
+		printf("%10d %12.2f %12.2f %9.0fx %12lld %12.1f %12.2f %14.2f\n", count, build_ms, update_us, build_ms * 1000.0 / update_us, rotations,
+			(double)rebuilt / steps, bvh_sah_cost(bvh), bvh_sah_cost(rebuilt_bvh));
+	}
+
+	const int count = 100000;
+	std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+	printf("%10s %12s %12s\n", "edited", "update us", "us/sphere");
+	for (int edited_count : { 1, 16, 256, 4096 }) {
+		BVH bvh = build_bvh(spheres.data(), count);
+		BVHUpdater updater = create_bvh_updater(bvh, spheres.data(), count);
+		uint32_t seed = 0x13579bdu;
+		std::vector<int> edited;
+		for (int i = 0; i < edited_count; i++) {
+			edited.push_back((int)(wang_hash(seed) % (uint32_t)count));
+			spheres[edited.back()].center += Vector3(random_float_between(seed, -0.5f, 0.5f), random_float_between(seed, -0.5f, 0.5f), random_float_between(seed, -0.5f, 0.5f));
+		}
+		auto start = bench_clock::now();
+		bvh_update_spheres(bvh, updater, spheres.data(), edited.data(), edited_count);
+		double us = elapsed_ms(start) * 1000.0;
+		printf("%10d %12.1f %12.2f\n", edited_count, us, us / edited_count);
+	}
+}
+
+// Scalar sphere_hit loop against the SoA kernel of every level the CPU supports, brute force and inside BVH leaves
+// as wide as the kernel. Speedups are relative to the first row of each scene.
+static void simd_benchmark() {
+	const int ray_count = 100000;
+	const int counts[] = { 8, 64, 512, 4096, 10000, 100000 };
+	const int brute_force_limit = 4096;
+	const SphereSoAKernel dispatched = sphere_soa_kernel();
+	std::vector<SimdLevel> levels;
+	for (int level = SIMD_LEVEL_SSE4; level <= std::min(detect_simd_level(), SIMD_LEVEL_AVX2); level++) {
+		levels.push_back((SimdLevel)level);
+	}
+
+	printf("\nSoA kernel, %s picked at runtime, %d random rays per scene\n", simd_level_name(dispatched.level), ray_count);
+	printf("%10s %-34s %12s %10s\n", "spheres", "layout", "ns/ray", "speedup");
+
+	for (int count : counts) {
+		std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+		std::vector<Material> materials(count);
+		std::vector<Ray> rays = random_rays(ray_count, std::cbrt((float)count), 0x89abcdefu);
+
+		RaytracerData data = {};
+		data.properties.sphere_count = count;
+		data.spheres = spheres.data();
+		data.materials = materials.data();
+
+		long long baseline_checksum = 0, checksum = 0;
+		double baseline_ns = 0, ns = 0;
+		SphereSoA soa;
+		char layout[64];
+
+		if (count <= brute_force_limit) {
+			baseline_ns = trace_rays(data, rays, baseline_checksum);
+			printf("%10d %-34s %12.1f %10s\n", count, "brute force, scalar", baseline_ns, "-");
+
+			set_sphere_soa(data, soa);
+			for (SimdLevel level : levels) {
+				sphere_soa_kernel() = get_sphere_soa_kernel(level);
+				ns = trace_rays(data, rays, checksum);
+				snprintf(layout, sizeof(layout), "brute force, soa %s", simd_level_name(level));
+				printf("%10d %-34s %12.1f %9.1fx%s\n", count, layout, ns, baseline_ns / ns, checksum != baseline_checksum ? " (result mismatch)" : "");
+			}
+			data.sphere_soa = nullptr;
+			continue;
+		}
+
+		BVH narrow_bvh = build_bvh(spheres.data(), count);
+		set_bvh(data, narrow_bvh);
+		baseline_ns = trace_rays(data, rays, baseline_checksum);
+		printf("%10d %-34s %12.1f %10s\n", count, "bvh, scalar, default leaves", baseline_ns, "-");
+
+		for (SimdLevel level : levels) {
+			sphere_soa_kernel() = get_sphere_soa_kernel(level);
+			int lanes = sphere_soa_kernel().lanes;
+			BVH wide_bvh = build_bvh(spheres.data(), count, lanes, 1.0f / lanes);
+			set_bvh(data, wide_bvh);
+			data.sphere_soa = nullptr;
+			ns = trace_rays(data, rays, checksum);
+			snprintf(layout, sizeof(layout), "bvh, scalar, %d-sphere leaves", lanes);
+			printf("%10d %-34s %12.1f %9.1fx%s\n", count, layout, ns, baseline_ns / ns, checksum != baseline_checksum ? " (result mismatch)" : "");
+
+			set_sphere_soa(data, soa);
+			ns = trace_rays(data, rays, checksum);
+			snprintf(layout, sizeof(layout), "bvh, soa %s, %d-sphere leaves", simd_level_name(level), lanes);
+			printf("%10d %-34s %12.1f %9.1fx%s\n", count, layout, ns, baseline_ns / ns, checksum != baseline_checksum ? " (result mismatch)" : "");
+		}
+	}
+	sphere_soa_kernel() = dispatched;
+}
+
+// Scalar Vector3 loops against the batched Vector3x8 kernels at every level the CPU supports.
+// Results are compared bit for bit against the scalar loop.
+static void vector_benchmark() {
+	const int batch_count = 1 << 11; // small enough to stay in L2, so this measures the maths rather than memory
+	const int vector_count = batch_count * 8;
+	const int repeats = 1000;
+	const char* op_names[] = { "dot", "cross", "unit_vector", "reflect", "lerp" };
+
+	std::vector<Vector3> a(vector_count), b(vector_count), out(vector_count);
+	std::vector<float> t(vector_count), out_float(vector_count);
+	std::vector<Vector3x8, AlignedAllocator<Vector3x8>> a8(batch_count), b8(batch_count), out8(batch_count);
+	std::vector<float, AlignedAllocator<float>> t8(vector_count), out_float8(vector_count);
+
+	uint32_t seed = 0x2468aceu;
+	for (int i = 0; i < vector_count; i++) {
+		a[i] = Vector3(random_float_between(seed, -1, 1), random_float_between(seed, -1, 1), random_float_between(seed, -1, 1));
+		b[i] = Vector3(random_float_between(seed, -1, 1), random_float_between(seed, -1, 1), random_float_between(seed, -1, 1));
+		t[i] = t8[i] = random_float(seed);
+		a8[i / 8].set(i % 8, a[i]);
+		b8[i / 8].set(i % 8, b[i]);
+	}
+
+	SimdLevel detected = detect_simd_level();
+	printf("\nBatched vector maths, %d vectors, detected %s\n", vector_count, simd_level_name(detected));
+	printf("%-12s %12s", "op", "scalar ns");
+	for (int level = SIMD_LEVEL_SCALAR; level <= detected; level++) {
+		printf(" %12s", simd_level_name((SimdLevel)level));
+	}
+	printf("\n");
+
+	for (int op = 0; op < 5; op++) {
+		auto start = bench_clock::now();
+		for (int r = 0; r < repeats; r++) {
+			for (int i = 0; i < vector_count; i++) {
+				switch (op) {
+				case 0: out_float[i] = dot(a[i], b[i]); break;
+				case 1: out[i] = cross(a[i], b[i]); break;
+				case 2: out[i] = unit_vector(a[i]); break;
+				case 3: out[i] = reflect(a[i], b[i]); break;
+				case 4: out[i] = lerp(a[i], b[i], t[i]); break;
+				}
+			}
+		}
+		double scalar_ns = elapsed_ms(start) * 1.0e6 / ((double)vector_count * repeats);
+		printf("%-12s %12.2f", op_names[op], scalar_ns);
+
+		for (int level = SIMD_LEVEL_SCALAR; level <= detected; level++) {
+			VectorBatchKernels kernels = get_vector_batch_kernels((SimdLevel)level);
+			start = bench_clock::now();
+			for (int r = 0; r < repeats; r++) {
+				switch (op) {
+				case 0: kernels.dot(a8.data(), b8.data(), out_float8.data(), batch_count); break;
+				case 1: kernels.cross(a8.data(), b8.data(), out8.data(), batch_count); break;
+				case 2: kernels.unit_vector(a8.data(), out8.data(), batch_count); break;
+				case 3: kernels.reflect(a8.data(), b8.data(), out8.data(), batch_count); break;
+				case 4: kernels.lerp(a8.data(), b8.data(), t8.data(), out8.data(), batch_count); break;
+				}
+			}
+			double ns = elapsed_ms(start) * 1.0e6 / ((double)vector_count * repeats);
+
+			bool match = true;
+			for (int i = 0; i < vector_count && match; i++) {
+				if (op == 0) {
+					match = out_float8[i] == out_float[i];
+				}
+				else {
+					Vector3 v = out8[i / 8].get(i % 8);
+					match = v.x == out[i].x && v.y == out[i].y && v.z == out[i].z;
+				}
+			}
+			printf(" %7.2f %3.1fx%s", ns, scalar_ns / ns, match ? "" : "!");
+		}
+		printf("\n");
+	}
+}
+
+static bool recorded_matches(const SceneStore& store, SceneBufferType type, const void* data, int count, int element_size) {
+	return count == 0 || memcmp(recorded_contents(store.buffers[type].gpu), data, (size_t)count * element_size) == 0;
+}
+
+// Replays a few editing sessions against RecordingUploadDevice and reports the scene upload traffic per frame,
+// next to what re-uploading every array each frame would cost. Buffer contents are checked against the scene.
+static void upload_benchmark() {
+	const int count = 10000;
+	const int frames = 10;
+
+	std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+	std::vector<Material> materials(count);
+	BVH bvh = build_bvh(spheres.data(), count);
+
+	RaytracerData data = {};
+	data.properties.sphere_count = count;
+	data.spheres = spheres.data();
+	data.materials = materials.data();
+	set_bvh(data, bvh);
+
+	RecordingUploadDevice device;
+	SceneStore store = create_scene_store(&device);
+
+	printf("\nScene uploads, %d spheres\n", count);
+	printf("%-28s %16s %16s %10s\n", "frames", "bytes/frame", "full bytes/frame", "buffers");
+
+	auto run = [&](const char* name, auto edit) {
+		size_t bytes = 0, full_bytes = 0;
+		int created = device.created_count;
+		for (int frame = 0; frame < frames; frame++) {
+			edit(frame);
+			scene_store_upload(store, data);
+			bytes += store.frame_uploaded_bytes;
+			full_bytes += sizeof(RaytracerProperties) + data.properties.sphere_count * (sizeof(Sphere) + sizeof(Material) + sizeof(int))
+				+ data.properties.bvh_node_count * sizeof(BVHNode);
+			data.properties.frame_count++;
+		}
+
+		int n = data.properties.sphere_count;
+		bool match = recorded_matches(store, SCENE_BUFFER_SPHERES, data.spheres, n, sizeof(Sphere))
+			&& recorded_matches(store, SCENE_BUFFER_MATERIALS, data.materials, n, sizeof(Material))
+			&& recorded_matches(store, SCENE_BUFFER_BVH_NODES, data.bvh_nodes, data.properties.bvh_node_count, sizeof(BVHNode))
+			&& recorded_matches(store, SCENE_BUFFER_BVH_PRIMITIVE_INDICES, data.bvh_primitive_indices, n, sizeof(int));
+		printf("%-28s %16zu %16zu %10d%s\n", name, bytes / frames, full_bytes / frames, device.created_count - created, match ? "" : " (contents mismatch)");
+	};
+
+	run("first upload + idle", [&](int) {});
+	run("idle", [&](int) {});
+	run("material edits", [&](int frame) {
+		materials[frame * 17].albedo = Vector3(1, 0, 0);
+		scene_store_mark_material_dirty(store, frame * 17);
+	});
+	run("sphere edits + bvh rebuild", [&](int frame) {
+		spheres[frame * 31].center += Vector3(0.01f, 0, 0);
+		bvh = build_bvh(spheres.data(), count);
+		set_bvh(data, bvh);
+		scene_store_mark_sphere_dirty(store, frame * 31);
+		scene_store_mark_bvh_dirty(store);
+	});
+
+	// Growth keeps the buffers in step with the arrays, so the vectors are reserved up front.
+	spheres.reserve(count * 4);
+	materials.reserve(count * 4);
+	run("adding 2000 spheres/frame", [&](int frame) {
+		for (int i = 0; i < 2000; i++) {
+			spheres.push_back(Sphere(Vector3((float)frame, (float)i, 0), 0.5f));
+			materials.push_back(Material());
+		}
+		data.properties.sphere_count = (int)spheres.size();
+		data.spheres = spheres.data();
+		data.materials = materials.data();
+		bvh = build_bvh(spheres.data(), (int)spheres.size());
+		set_bvh(data, bvh);
+		scene_store_mark_bvh_dirty(store);
+	});
+
+	release_scene_store(store);
+}
+
+// Full CPU passes over a scene where the cube of spheres covers part of the image and the rest is cheap sky,
+// at increasing thread counts. Pixels must come out identical for every thread count.
+static void scheduler_benchmark() {
+	const int count = 10000;
+	const int width = 160, height = 90;
+	int max_threads = std::max(4, (int)std::thread::hardware_concurrency());
+
+	std::vector<Sphere> spheres = random_spheres(count, 0x1234567u);
+	std::vector<Material> materials(count);
+	uint32_t seed = 0x13579bdu;
+	for (Material& material : materials) {
+		material.type = random_float(seed) < 0.5f ? 1 : 2;
+		material.albedo = Vector3(0.8f, 0.8f, 0.8f);
+		material.fuzziness = 0.2f;
+	}
+	BVH bvh = build_bvh(spheres.data(), count);
+
+	float extent = std::cbrt((float)count);
+	RaytracerData data = {};
+	data.properties.width = width;
+	data.properties.height = height;
+	data.properties.sphere_count = count;
+	data.properties.camera = Camera(Vector3(extent * 2, extent, extent * 3), Vector3(extent, 0, 0), Vector3(0, 1, 0), (float)width / height, 60, 0.0f, 1.0f);
+	data.spheres = spheres.data();
+	data.materials = materials.data();
+	set_bvh(data, bvh);
+	SphereSoA soa;
+	set_sphere_soa(data, soa);
+
+	printf("\nTile scheduler, %dx%d, %d spp, %d hardware threads\n", width, height, data.properties.samples, (int)std::thread::hardware_concurrency());
+	printf("%10s %12s %10s %10s\n", "threads", "ms/pass", "speedup", "steals");
+
+	std::vector<Vector4> reference;
+	double single_ms = 0;
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		CpuRenderer renderer = create_cpu_renderer(width, height, threads);
+		data.properties.frame_count = 0;
+		auto start = bench_clock::now();
+		cpu_raytracer_render(renderer, data);
+		double ms = elapsed_ms(start);
+
+		bool match = true;
+		if (threads == 1) {
+			reference = renderer.pixels;
+			single_ms = ms;
+		}
+		else {
+			match = memcmp(reference.data(), renderer.pixels.data(), reference.size() * sizeof(Vector4)) == 0;
+		}
+		printf("%10d %12.1f %9.2fx %10d%s\n", threads, ms, single_ms / ms, renderer.scheduler->steal_count.load(), match ? "" : " (pixels differ)");
+	}
+}
+
+// One row of the throughput suite. id names the configuration and is what baselines are matched on.
+struct ThroughputResult {
+	std::string id;
+	int spheres;
+	int spp; // 0 for ray queries
+	int threads;
+	double mrays_per_s; // every closest hit query counts, including the bounces of a path
+	double ns_per_intersection; // brute force kernels only, 0 otherwise
+	double ms;
+};
+
+struct ThroughputOptions {
+	bool quick;
+	const char* json_path;
+	const char* baseline_path;
+	double threshold_percent;
+};
+
+// Best of a few runs, the minimum is the least noisy estimate of what the code can do.
+template <typename Run>
+static double best_ms(int runs, Run run) {
+	double best = 1.0e30;
+	for (int i = 0; i < runs; i++) {
+		auto start = bench_clock::now();
+		run();
+		best = std::min(best, elapsed_ms(start));
+	}
+	return best;
+}
+
+static void add_result(std::vector<ThroughputResult>& results, const char* kind, int spheres, int spp, int threads, double mrays_per_s, double ns_per_intersection, double ms) {
+	char id[128];
+	snprintf(id, sizeof(id), "%s/spheres=%d/spp=%d/threads=%d", kind, spheres, spp, threads);
+	results.push_back({ id, spheres, spp, threads, mrays_per_s, ns_per_intersection, ms });
+	printf("%-44s %12.3f %14.3f %12.2f\n", id, mrays_per_s, ns_per_intersection, ms);
+}
+
+// Rays counted by all threads since the last call.
+static uint64_t take_counted_rays() {
+	FrameStats stats = create_frame_stats();
+	take_thread_counters(stats, 0.0);
+	return stats.rays;
+}
+
+// The random sphere cube with a diffuse/metal mix, seen from outside, as in scheduler_benchmark.
+static void setup_frame_scene(std::vector<Sphere>& spheres, std::vector<Material>& materials, BVH& bvh, SphereSoA& soa, RaytracerData& data, int count, int width, int height) {
+	spheres = random_spheres(count, 0x1234567u);
+	materials.resize(count);
+	uint32_t seed = 0x13579bdu;
+	for (Material& material : materials) {
+		material.type = random_float(seed) < 0.5f ? 1 : 2;
+		material.albedo = Vector3(0.8f, 0.8f, 0.8f);
+		material.fuzziness = 0.2f;
+	}
+	int lanes = sphere_soa_kernel().lanes;
+	bvh = build_bvh(spheres.data(), count, lanes, 1.0f / lanes);
+
+	float extent = std::cbrt((float)count);
+	data = RaytracerData();
+	data.properties.width = width;
+	data.properties.height = height;
+	data.properties.sphere_count = count;
+	data.properties.camera = Camera(Vector3(extent * 2, extent, extent * 3), Vector3(extent, 0, 0), Vector3(0, 1, 0), (float)width / height, 60, 0.0f, 1.0f);
+	data.spheres = spheres.data();
+	data.materials = materials.data();
+	set_bvh(data, bvh);
+	set_sphere_soa(data, soa);
+}
+
+static void run_throughput_suite(const ThroughputOptions& options, std::vector<ThroughputResult>& results) {
+	std::vector<int> counts = { 10, 100, 1000, 10000, 100000, 1000000 };
+	if (options.quick) {
+		counts = { 10, 1000, 100000 };
+	}
+	const int brute_force_limit = 10000;
+	const int kernel_rays = options.quick ? 20000 : 100000;
+	const int path_count = options.quick ? 20000 : 100000;
+	const int width = 64, height = 36;
+	const int runs = 5;
+	const double kernel_intersections = options.quick ? 5.0e6 : 2.0e7; // per run, so short kernels still take milliseconds
+	int hardware_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+	printf("Throughput suite, %s, %d hardware threads, best of %d runs\n", simd_level_name(detect_simd_level()), hardware_threads, runs);
+	printf("%-44s %12s %14s %12s\n", "configuration", "Mrays/s", "ns/intersect", "ms");
+
+	for (int count : counts) {
+		std::vector<Sphere> spheres;
+		std::vector<Material> materials;
+		BVH bvh;
+		SphereSoA soa;
+		RaytracerData data;
+		setup_frame_scene(spheres, materials, bvh, soa, data, count, width, height);
+		float extent = std::cbrt((float)count);
+		std::vector<Ray> rays = random_rays(kernel_rays, extent, 0x89abcdefu);
+		long long checksum = 0;
+
+		// Intersection kernels: every ray against every sphere, so the cost per sphere_hit is known exactly.
+		if (count <= brute_force_limit) {
+			int ray_count = std::max(100, std::min(kernel_rays, (int)(kernel_intersections / count)));
+			int repeats = std::max(1, (int)(kernel_intersections / ((double)ray_count * count)));
+			std::vector<Ray> kernel_ray_subset(rays.begin(), rays.begin() + ray_count);
+			double ray_total = (double)ray_count * repeats;
+			auto run_kernel = [&]() {
+				for (int r = 0; r < repeats; r++) {
+					trace_rays(data, kernel_ray_subset, checksum);
+				}
+			};
+
+			data.properties.bvh_node_count = 0;
+			data.sphere_soa = nullptr;
+			double ms = best_ms(runs, run_kernel);
+			add_result(results, "kernel/scalar", count, 0, 1, ray_total / (ms * 1000.0), ms * 1.0e6 / (ray_total * count), ms);
+
+			data.sphere_soa = &soa;
+			soa = build_sphere_soa(data.spheres, count, nullptr);
+			ms = best_ms(runs, run_kernel);
+			add_result(results, "kernel/soa", count, 0, 1, ray_total / (ms * 1000.0), ms * 1.0e6 / (ray_total * count), ms);
+			set_bvh(data, bvh);
+			set_sphere_soa(data, soa);
+		}
+
+		// Closest hit queries through the BVH, the way trace_ray issues them.
+		double ms = best_ms(runs, [&]() { trace_rays(data, rays, checksum); });
+		add_result(results, "bvh", count, 0, 1, rays.size() / (ms * 1000.0), 0.0, ms);
+
+		// Full paths from the camera, single threaded. Rays are counted by the frame_stats.h counters.
+		take_counted_rays();
+		ms = best_ms(runs, [&]() {
+			PathSampler state = {};
+			state.mode = SAMPLER_WANG;
+			state.state = 0x2468aceu;
+			Vector3 sum;
+			for (int i = 0; i < path_count; i++) {
+				Ray ray = get_camera_ray(state, data.properties.camera, random_float(state), random_float(state));
+				sum += trace_ray(state, data, ray);
+			}
+			checksum += (long long)sum.x;
+		});
+		double rays_per_run = (double)take_counted_rays() / runs;
+		add_result(results, "trace_ray", count, 1, 1, rays_per_run / (ms * 1000.0), 0.0, ms);
+
+		// Whole frames on every hardware thread.
+		CpuRenderer renderer = create_cpu_renderer(width, height, hardware_threads);
+		double frame_rays = 0;
+		ms = best_ms(runs, [&]() {
+			data.properties.frame_count = 0;
+			cpu_raytracer_render(renderer, data);
+			frame_rays += renderer.stats.rays;
+		});
+		add_result(results, "frame", count, data.properties.samples, hardware_threads, frame_rays / runs / (ms * 1000.0), 0.0, ms);
+
+		// The same frames through the wavefront stages.
+		renderer.wavefront = true;
+		frame_rays = 0;
+		ms = best_ms(runs, [&]() {
+			data.properties.frame_count = 0;
+			cpu_raytracer_render(renderer, data);
+			frame_rays += renderer.stats.rays;
+		});
+		add_result(results, "frame_wavefront", count, data.properties.samples, hardware_threads, frame_rays / runs / (ms * 1000.0), 0.0, ms);
+	}
+
+	// Sample count and thread count sweeps on a mid-sized scene. Samples per pixel grow by rendering more
+	// progressive passes, data.properties.samples each.
+	const int sweep_count = 10000;
+	std::vector<Sphere> spheres;
+	std::vector<Material> materials;
+	BVH bvh;
+	SphereSoA soa;
+	RaytracerData data;
+	setup_frame_scene(spheres, materials, bvh, soa, data, sweep_count, width, height);
+
+	for (int passes = 1; passes <= 4; passes *= 2) {
+		CpuRenderer renderer = create_cpu_renderer(width, height, hardware_threads);
+		double frame_rays = 0;
+		double ms = best_ms(runs, [&]() {
+			data.properties.frame_count = 0;
+			for (int pass = 0; pass < passes; pass++) {
+				cpu_raytracer_render(renderer, data);
+				frame_rays += renderer.stats.rays;
+			}
+		});
+		add_result(results, "frame_spp", sweep_count, passes * data.properties.samples, hardware_threads, frame_rays / runs / (ms * 1000.0), 0.0, ms);
+	}
+
+	for (int threads = 1; threads <= std::max(4, hardware_threads); threads *= 2) {
+		CpuRenderer renderer = create_cpu_renderer(width, height, threads);
+		double frame_rays = 0;
+		double ms = best_ms(runs, [&]() {
+			data.properties.frame_count = 0;
+			cpu_raytracer_render(renderer, data);
+			frame_rays += renderer.stats.rays;
+		});
+		add_result(results, "frame_threads", sweep_count, data.properties.samples, threads, frame_rays / runs / (ms * 1000.0), 0.0, ms);
+	}
+}
+
+// One result per line, which is also what read_throughput_baseline relies on.
+static bool write_throughput_json(const char* path, const std::vector<ThroughputResult>& results) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "%s: can't create file\n", path);
+		return false;
+	}
+	fprintf(file, "{\n  \"version\": 1,\n  \"simd_level\": \"%s\",\n  \"hardware_threads\": %d,\n  \"results\": [\n",
+		simd_level_name(detect_simd_level()), (int)std::thread::hardware_concurrency());
+	for (size_t i = 0; i < results.size(); i++) {
+		const ThroughputResult& r = results[i];
+		fprintf(file, "    { \"id\": \"%s\", \"spheres\": %d, \"spp\": %d, \"threads\": %d, \"mrays_per_s\": %.6f, \"ns_per_intersection\": %.6f, \"ms\": %.6f }%s\n",
+			r.id.c_str(), r.spheres, r.spp, r.threads, r.mrays_per_s, r.ns_per_intersection, r.ms, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	return fclose(file) == 0;
+}
+
+// Reads the id and throughput of every result line of a file written by write_throughput_json.
+static bool read_throughput_baseline(const char* path, std::map<std::string, double>& baseline) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "%s: can't open baseline\n", path);
+		return false;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), file)) {
+		char id[256];
+		const char* throughput = strstr(line, "\"mrays_per_s\":");
+		if (sscanf(line, " { \"id\": \"%255[^\"]\"", id) == 1 && throughput) {
+			baseline[id] = atof(throughput + strlen("\"mrays_per_s\":"));
+		}
+	}
+	fclose(file);
+	return !baseline.empty() || (fprintf(stderr, "%s: no results in baseline\n", path), false);
+}
+
+// Returns the number of results that are more than threshold_percent slower than the baseline.
+static int compare_throughput(const std::vector<ThroughputResult>& results, const std::map<std::string, double>& baseline, double threshold_percent) {
+	int regressions = 0;
+	printf("\nAgainst baseline, threshold %.1f%%\n", threshold_percent);
+	printf("%-44s %12s %12s %10s\n", "configuration", "baseline", "now", "change");
+	for (const ThroughputResult& r : results) {
+		auto found = baseline.find(r.id);
+		if (found == baseline.end() || found->second <= 0.0) {
+			printf("%-44s %12s %12.3f %10s\n", r.id.c_str(), "-", r.mrays_per_s, "new");
+			continue;
+		}
+		double change = (r.mrays_per_s / found->second - 1.0) * 100.0;
+		bool regressed = change < -threshold_percent;
+		regressions += regressed ? 1 : 0;
+		printf("%-44s %12.3f %12.3f %+9.1f%%%s\n", r.id.c_str(), found->second, r.mrays_per_s, change, regressed ? "  REGRESSION" : "");
+	}
+	return regressions;
+}
+
+static int throughput_main(const ThroughputOptions& options) {
+	std::map<std::string, double> baseline;
+	if (options.baseline_path && !read_throughput_baseline(options.baseline_path, baseline)) {
+		return 2;
+	}
+
+	std::vector<ThroughputResult> results;
+	run_throughput_suite(options, results);
+
+	if (options.json_path) {
+		if (!write_throughput_json(options.json_path, results)) {
+			return 2;
+		}
+		printf("\nwrote %s\n", options.json_path);
+	}
+	if (options.baseline_path) {
+		int regressions = compare_throughput(results, baseline, options.threshold_percent);
+		if (regressions > 0) {
+			printf("%d configurations regressed\n", regressions);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double rmse(const std::vector<Vector4>& pixels, const std::vector<Vector4>& reference) {
+	double sum = 0;
+	for (size_t i = 0; i < pixels.size(); i++) {
+		Vector4 diff = pixels[i] - reference[i];
+		sum += (double)diff.x * diff.x + (double)diff.y * diff.y + (double)diff.z * diff.z;
+	}
+	return std::sqrt(sum / (pixels.size() * 3.0));
+}
+
+struct ConvergencePoint {
+	double ms; // render time up to and including this pass
+	double rmse;
+};
+
+// Progressive passes from frame 0, with the error against reference after each one.
+static std::vector<ConvergencePoint> measure_convergence(CpuRenderer& renderer, RaytracerData& data, const std::vector<Vector4>& reference, int passes) {
+	std::vector<ConvergencePoint> points;
+	double ms = 0;
+	data.properties.frame_count = 0;
+	for (int i = 0; i < passes; i++) {
+		auto start = bench_clock::now();
+		cpu_raytracer_render(renderer, data);
+		ms += elapsed_ms(start);
+		points.push_back({ ms, rmse(renderer.pixels, reference) });
+	}
+	return points;
+}
+
+// Loads a scene file and points data at it the way main.cpp does. BVH, SoA and light list storage is owned by the caller.
+static bool setup_file_scene(const char* path, Scene& scene, RaytracerData& data, BVH& bvh, SphereSoA& soa, std::vector<int>& lights, int width, int height) {
+	if (!load_scene(path, scene)) {
+		return false;
+	}
+	data = RaytracerData();
+	data.properties.width = width;
+	data.properties.height = height;
+	data.properties.camera = create_camera(scene.camera, (float)width / height);
+	set_scene(data, scene);
+	if (!scene.bvh_nodes) {
+		bvh = build_bvh(scene.spheres, scene.sphere_count);
+		set_bvh(data, bvh);
+	}
+	set_sphere_soa(data, soa);
+	lights = build_light_list(scene.materials, scene.sphere_count);
+	set_lights(data, lights);
+	return true;
+}
+
+// RMSE against a high sample count reference with and without next event estimation, compared at equal render time
+// and by how much longer BSDF sampling alone needs for the error light sampling reaches after a few passes.
+static int light_sampling_main(const char* scene_path) {
+	const int width = 96, height = 54;
+	const int reference_passes = 256;
+	const int passes = 32;
+	const int compared_passes = 4; // of the light sampling run
+	// The reference starts at this frame so its random seeds differ from the compared passes, which start at 0. Its
+	// pixels then hold the sum of the passes over (offset + passes), which is scaled back below.
+	const int reference_frame_offset = 1000;
+
+	Scene scene;
+	RaytracerData data;
+	BVH bvh;
+	SphereSoA soa;
+	std::vector<int> lights;
+	if (!setup_file_scene(scene_path, scene, data, bvh, soa, lights, width, height)) {
+		return 2;
+	}
+	if (lights.empty()) {
+		fprintf(stderr, "%s: no emissive spheres to sample\n", scene_path);
+		return 2;
+	}
+
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+	printf("Light sampling, '%s' at %dx%d, %d lights, %d threads, reference %d spp\n", scene_path, width, height, (int)lights.size(),
+		renderer.thread_count, reference_passes * data.properties.samples);
+
+	data.properties.light_sampling = 1;
+	data.properties.frame_count = reference_frame_offset;
+	for (int i = 0; i < reference_passes; i++) {
+		cpu_raytracer_render(renderer, data);
+	}
+	std::vector<Vector4> reference = renderer.pixels;
+	float reference_scale = (float)(reference_frame_offset + reference_passes) / reference_passes;
+	for (Vector4& pixel : reference) {
+		pixel = pixel * reference_scale;
+	}
+
+	data.properties.light_sampling = 0;
+	std::vector<ConvergencePoint> bsdf = measure_convergence(renderer, data, reference, passes);
+	data.properties.light_sampling = 1;
+	std::vector<ConvergencePoint> nee = measure_convergence(renderer, data, reference, passes);
+
+	printf("%8s %8s %12s %12s %12s %12s\n", "passes", "spp", "bsdf ms", "bsdf RMSE", "nee ms", "nee RMSE");
+	for (int i = 0; i < passes; i++) {
+		if ((i & (i + 1)) == 0 || i + 1 == passes) { // 1, 2, 4, 8, ...
+			printf("%8d %8d %12.1f %12.5f %12.1f %12.5f\n", i + 1, (i + 1) * data.properties.samples, bsdf[i].ms, bsdf[i].rmse, nee[i].ms, nee[i].rmse);
+		}
+	}
+
+	const ConvergencePoint& target = nee[compared_passes - 1];
+	int equal_time = 0;
+	while (equal_time + 1 < passes && bsdf[equal_time + 1].ms <= target.ms) {
+		equal_time++;
+	}
+	printf("\nequal time, %.0f ms: bsdf RMSE %.5f after %d passes, nee RMSE %.5f after %d passes\n", target.ms, bsdf[equal_time].rmse,
+		equal_time + 1, target.rmse, compared_passes);
+
+	int equal_quality = 0;
+	while (equal_quality < passes && bsdf[equal_quality].rmse > target.rmse) {
+		equal_quality++;
+	}
+	if (equal_quality < passes) {
+		printf("equal quality: bsdf needs %d passes and %.1fx the time of nee's %d\n", equal_quality + 1, bsdf[equal_quality].ms / target.ms, compared_passes);
+	}
+	else {
+		printf("equal quality: bsdf doesn't reach nee's RMSE after %d passes within %d passes\n", compared_passes, passes);
+	}
+
+	free_scene(scene);
+	return 0;
+}
+
+// RMSE against a high sample count reference after each of the first passes, as accumulated and denoised, and how
+// many passes the accumulated image needs to get as close as one denoised pass. Then the denoiser's time at 1080p.
+static int denoise_main(const char* scene_path) {
+	const int width = 160, height = 90;
+	const int reference_passes = 128;
+	const int passes = 16;
+	const int reference_frame_offset = 1000; // see light_sampling_main
+
+	Scene scene;
+	RaytracerData data;
+	BVH bvh;
+	SphereSoA soa;
+	std::vector<int> lights;
+	if (!setup_file_scene(scene_path, scene, data, bvh, soa, lights, width, height)) {
+		return 2;
+	}
+	data.properties.light_sampling = 1;
+
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+	renderer.write_aovs = true;
+	printf("Denoiser, '%s' at %dx%d, %d threads, reference %d spp\n", scene_path, width, height, renderer.thread_count,
+		reference_passes * data.properties.samples);
+
+	data.properties.frame_count = reference_frame_offset;
+	for (int i = 0; i < reference_passes; i++) {
+		cpu_raytracer_render(renderer, data);
+	}
+	std::vector<Vector4> reference = renderer.pixels;
+	float reference_scale = (float)(reference_frame_offset + reference_passes) / reference_passes;
+	for (Vector4& pixel : reference) {
+		pixel = pixel * reference_scale;
+	}
+
+	Denoiser denoiser;
+	DenoiseSettings settings;
+	std::vector<double> raw_rmse, denoised_rmse;
+	printf("%8s %8s %12s %14s %12s\n", "passes", "spp", "raw RMSE", "denoised RMSE", "denoise ms");
+	data.properties.frame_count = 0;
+	for (int i = 0; i < passes; i++) {
+		cpu_raytracer_render(renderer, data);
+		cpu_denoise(denoiser, renderer, settings);
+		raw_rmse.push_back(rmse(renderer.pixels, reference));
+		denoised_rmse.push_back(rmse(denoiser.output, reference));
+		if ((i & (i + 1)) == 0 || i + 1 == passes) { // 1, 2, 4, 8, ...
+			printf("%8d %8d %12.5f %14.5f %12.2f\n", i + 1, (i + 1) * data.properties.samples, raw_rmse[i], denoised_rmse[i], denoiser.seconds * 1000.0);
+		}
+	}
+
+	int equal_quality = 0;
+	while (equal_quality < passes && raw_rmse[equal_quality] > denoised_rmse[0]) {
+		equal_quality++;
+	}
+	if (equal_quality < passes) {
+		printf("\nequal quality: the accumulated image needs %d passes for the RMSE of 1 denoised pass\n", equal_quality + 1);
+	}
+	else {
+		printf("\nequal quality: the accumulated image doesn't reach the RMSE of 1 denoised pass within %d passes\n", passes);
+	}
+
+	// The filter's cost only depends on the image size, so one sample per pixel is enough to time it.
+	const int timed_width = 1920, timed_height = 1080;
+	data.properties.width = timed_width;
+	data.properties.height = timed_height;
+	data.properties.camera = create_camera(scene.camera, (float)timed_width / timed_height);
+	data.properties.samples = 1;
+	data.properties.frame_count = 0;
+	CpuRenderer timed_renderer = create_cpu_renderer(timed_width, timed_height);
+	timed_renderer.write_aovs = true;
+	cpu_raytracer_render(timed_renderer, data);
+	double ms = best_ms(3, [&]() { cpu_denoise(denoiser, timed_renderer, settings); });
+	printf("denoise at %dx%d: %.1f ms on %d threads, %d iterations, %d lanes\n", timed_width, timed_height, ms, timed_renderer.thread_count,
+		settings.iterations, SIMD_WIDTH);
+
+	free_scene(scene);
+	return 0;
+}
+
+// Converges a frame, orbits the camera around its target and compares the RMSE after a few passes against a
+// reference at the new camera when the frame restarts and when it is reprojected. Also how many restarted passes match
+// one pass after reprojection, the share of pixels that kept history and the reprojection's time.
+static int reproject_main(const char* scene_path) {
+	const int width = 160, height = 90;
+	const int reference_passes = 128;
+	const int converged_passes = 32;
+	const int passes = 16;
+	const int reference_frame_offset = 1000; // see light_sampling_main
+
+	Scene scene;
+	RaytracerData data;
+	BVH bvh;
+	SphereSoA soa;
+	std::vector<int> lights;
+	if (!setup_file_scene(scene_path, scene, data, bvh, soa, lights, width, height)) {
+		return 2;
+	}
+	data.properties.light_sampling = 1;
+	const float aspect_ratio = (float)width / height;
+
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+	printf("Reprojection, '%s' at %dx%d, %d threads, %d passes before the move, reference %d spp\n", scene_path, width, height,
+		renderer.thread_count, converged_passes, reference_passes * data.properties.samples);
+	printf("%8s %8s %10s %14s %14s %14s %14s\n", "orbit", "kept", "ms", "restart 1", "reproject 1", "reproject 4", "restart equal");
+
+	for (float degrees : { 1.0f, 4.0f }) {
+		float angle = deg2rad(degrees);
+		CameraPlacement placement = scene.camera;
+		Vector3 offset = placement.position - placement.look_at;
+		placement.position = placement.look_at + Vector3(offset.x * std::cos(angle) + offset.z * std::sin(angle), offset.y,
+			-offset.x * std::sin(angle) + offset.z * std::cos(angle));
+		Camera moved = create_camera(placement, aspect_ratio);
+
+		renderer.reproject = false;
+		renderer.pixels.assign(renderer.pixels.size(), Vector4()); // the offset reference blends into what is there
+		data.properties.camera = moved;
+		data.properties.frame_count = reference_frame_offset;
+		for (int i = 0; i < reference_passes; i++) {
+			cpu_raytracer_render(renderer, data);
+		}
+		std::vector<Vector4> reference = renderer.pixels;
+		float reference_scale = (float)(reference_frame_offset + reference_passes) / reference_passes;
+		for (Vector4& pixel : reference) {
+			pixel = pixel * reference_scale;
+		}
+
+		std::vector<double> restart_rmse;
+		data.properties.frame_count = 0;
+		for (int i = 0; i < passes; i++) {
+			cpu_raytracer_render(renderer, data);
+			restart_rmse.push_back(rmse(renderer.pixels, reference));
+		}
+
+		renderer.reproject = true;
+		data.properties.camera = create_camera(scene.camera, aspect_ratio);
+		data.properties.frame_count = 0;
+		for (int i = 0; i < converged_passes; i++) {
+			cpu_raytracer_render(renderer, data);
+		}
+		auto start = bench_clock::now();
+		float kept = cpu_reproject(renderer, data, moved);
+		double ms = elapsed_ms(start);
+		std::vector<double> reprojected_rmse;
+		for (int i = 0; i < 4; i++) {
+			cpu_raytracer_render(renderer, data);
+			reprojected_rmse.push_back(rmse(renderer.pixels, reference));
+		}
+
+		int equal_quality = 0;
+		while (equal_quality < passes && restart_rmse[equal_quality] > reprojected_rmse[0]) {
+			equal_quality++;
+		}
+		char equal[32];
+		if (equal_quality < passes) {
+			snprintf(equal, sizeof(equal), "%d passes", equal_quality + 1);
+		}
+		else {
+			snprintf(equal, sizeof(equal), "> %d passes", passes);
+		}
+		printf("%7.1fd %7.1f%% %10.2f %14.5f %14.5f %14.5f %14s\n", degrees, kept * 100.0f, ms, restart_rmse[0], reprojected_rmse[0],
+			reprojected_rmse[3], equal);
+	}
+
+	free_scene(scene);
+	return 0;
+}
+
+// Camera rays only, one per pixel at 1080p, traced ray by ray with check_object_hit and as CPU_PACKET_SIZE
+// square packets with packet_check_object_hit; then a whole 1 spp frame at the same size, where every bounce after
+// the first is traced the same way in both modes.
+// rmse of both images blurred by a 3x3 box, which mostly leaves the low frequency part of the error that the eye sees
+// as blotches. Blue noise moves the error to high frequencies, so it scores lower here at the same RMSE.
+static double blurred_rmse(const std::vector<Vector4>& pixels, const std::vector<Vector4>& reference, int width, int height) {
+	std::vector<Vector4> error(pixels.size());
+	for (size_t i = 0; i < pixels.size(); i++) {
+		error[i] = pixels[i] - reference[i];
+	}
+	double sum = 0;
+	for (int y = 1; y + 1 < height; y++) {
+		for (int x = 1; x + 1 < width; x++) {
+			Vector4 blurred;
+			for (int j = -1; j <= 1; j++) {
+				for (int i = -1; i <= 1; i++) {
+					blurred = blurred + error[(size_t)(y + j) * width + x + i];
+				}
+			}
+			blurred = blurred * (1.0f / 9.0f);
+			sum += (double)blurred.x * blurred.x + (double)blurred.y * blurred.y + (double)blurred.z * blurred.z;
+		}
+	}
+	return std::sqrt(sum / ((width - 2) * (height - 2) * 3.0));
+}
+
+// RMSE against a high sample count reference after 1, 2, 4, ... samples per pixel for every sampler, the same with
+// the error blurred, and the time of a pass. The reference is drawn with SAMPLER_WANG from other seeds.
+static int samplers_main(const char* scene_path) {
+	const int width = 160, height = 90;
+	const int reference_passes = 256;
+	const int reference_samples = 16;
+	const int passes = 64; // of 1 spp each
+	const int reference_frame_offset = 1000; // see light_sampling_main
+
+	Scene scene;
+	RaytracerData data;
+	BVH bvh;
+	SphereSoA soa;
+	std::vector<int> lights;
+	if (!setup_file_scene(scene_path, scene, data, bvh, soa, lights, width, height)) {
+		return 2;
+	}
+	data.properties.light_sampling = 1;
+
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+	printf("Samplers, '%s' at %dx%d, %d threads, reference %d spp\n", scene_path, width, height, renderer.thread_count,
+		reference_passes * reference_samples);
+
+	data.sampler = SAMPLER_WANG;
+	data.properties.samples = reference_samples;
+	data.properties.frame_count = reference_frame_offset;
+	for (int i = 0; i < reference_passes; i++) {
+		cpu_raytracer_render(renderer, data);
+	}
+	std::vector<Vector4> reference = renderer.pixels;
+	float reference_scale = (float)(reference_frame_offset + reference_passes) / reference_passes;
+	for (Vector4& pixel : reference) {
+		pixel = pixel * reference_scale;
+	}
+
+	data.properties.samples = 1;
+	std::vector<ConvergencePoint> points[SAMPLER_COUNT];
+	std::vector<double> blurred[SAMPLER_COUNT];
+	blue_noise_tile(); // built on first use, not part of the timing
+	for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+		data.sampler = mode;
+		data.properties.frame_count = 0;
+		double ms = 0;
+		for (int i = 0; i < passes; i++) {
+			auto start = bench_clock::now();
+			cpu_raytracer_render(renderer, data);
+			ms += elapsed_ms(start);
+			points[mode].push_back({ ms, rmse(renderer.pixels, reference) });
+			blurred[mode].push_back(blurred_rmse(renderer.pixels, reference, width, height));
+		}
+	}
+
+	printf("%8s", "spp");
+	for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+		printf(" %12s", sampler_name(mode));
+	}
+	printf("   RMSE, then blurred RMSE\n");
+	for (int i = 0; i < passes; i++) {
+		if ((i & (i + 1)) == 0) { // 1, 2, 4, ...
+			printf("%8d", i + 1);
+			for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+				printf(" %12.5f", points[mode][i].rmse);
+			}
+			printf("  ");
+			for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+				printf(" %12.5f", blurred[mode][i]);
+			}
+			printf("\n");
+		}
+	}
+	printf("%8s", "ms/pass");
+	for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+		printf(" %12.2f", points[mode].back().ms / passes);
+	}
+	printf("\n");
+
+	// How many wang samples reach the error the others have at 16 spp, and how long they take against the 16 passes
+	// of the other sampler, which cost more per pass.
+	const int compared = 16;
+	for (int mode = 1; mode < SAMPLER_COUNT; mode++) {
+		int equal_quality = 0;
+		while (equal_quality < passes && points[SAMPLER_WANG][equal_quality].rmse > points[mode][compared - 1].rmse) {
+			equal_quality++;
+		}
+		if (equal_quality < passes) {
+			printf("%s at %d spp: wang needs %d spp for the same RMSE, %.2fx the time\n", sampler_name(mode), compared, equal_quality + 1,
+				points[SAMPLER_WANG][equal_quality].ms / points[mode][compared - 1].ms);
+		}
+		else {
+			printf("%s at %d spp: wang doesn't reach its RMSE within %d spp\n", sampler_name(mode), compared, passes);
+		}
+	}
+
+	free_scene(scene);
+	return 0;
+}
+
+static void packet_benchmark() {
+	const int width = 1920, height = 1080;
+
+	printf("\nPrimary ray packets, %dx%d packets, %dx%d\n", CPU_PACKET_SIZE, CPU_PACKET_SIZE, width, height);
+	printf("%-20s %12s %12s %10s %14s %14s %10s %10s\n", "scene", "single ns", "packet ns", "speedup", "single nodes", "packet nodes",
+		"frame ms", "speedup");
+
+	for (int count : { 1000, 100000 }) {
+		std::vector<Sphere> spheres;
+		std::vector<Material> materials;
+		BVH bvh;
+		SphereSoA soa;
+		RaytracerData data;
+		setup_frame_scene(spheres, materials, bvh, soa, data, count, width, height);
+
+		// The same rays for both, generated up front in packet order.
+		const int packet_rays = CPU_PACKET_SIZE * CPU_PACKET_SIZE;
+		std::vector<Ray> rays;
+		PathSampler state = {};
+		state.mode = SAMPLER_WANG;
+		state.state = 0x2468aceu;
+		for (int by = 0; by < height; by += CPU_PACKET_SIZE) {
+			for (int bx = 0; bx < width; bx += CPU_PACKET_SIZE) {
+				for (int y = by; y < by + CPU_PACKET_SIZE; y++) {
+					for (int x = bx; x < bx + CPU_PACKET_SIZE; x++) {
+						float u = float(x + random_float(state)) / float(width);
+						float v = (height - float(y + random_float(state))) / float(height);
+						rays.push_back(get_camera_ray(state, data.properties.camera, u, v));
+					}
+				}
+			}
+		}
+
+		std::vector<int> single_objects(rays.size()), packet_objects(rays.size());
+		std::vector<Hit> hits(rays.size());
+		FrameStats stats = create_frame_stats();
+		take_thread_counters(stats, 0.0);
+		double single_ms = best_ms(3, [&]() {
+			for (size_t i = 0; i < rays.size(); i++) {
+				single_objects[i] = check_object_hit(data, rays[i], 0.001f, 1.0e7f, hits[i]);
+			}
+		});
+		take_thread_counters(stats, 0.0);
+		double single_nodes = (double)stats.bvh_nodes_visited / (3.0 * rays.size());
+		double packet_ms = best_ms(3, [&]() {
+			for (size_t i = 0; i < rays.size(); i += packet_rays) {
+				packet_check_object_hit(data, &rays[i], packet_rays, 0.001f, 1.0e7f, &packet_objects[i], &hits[i]);
+			}
+		});
+		take_thread_counters(stats, 0.0);
+		double packet_nodes = (double)stats.bvh_nodes_visited / (3.0 * rays.size());
+		bool match = single_objects == packet_objects;
+
+		data.properties.samples = 1;
+		CpuRenderer renderer = create_cpu_renderer(width, height);
+		double frame_ms[2];
+		std::vector<Vector4> frame_pixels[2];
+		for (int mode = 0; mode < 2; mode++) {
+			renderer.packets = mode == 1;
+			data.properties.frame_count = 0;
+			auto start = bench_clock::now();
+			cpu_raytracer_render(renderer, data);
+			frame_ms[mode] = elapsed_ms(start);
+			frame_pixels[mode] = renderer.pixels;
+		}
+		match = match && memcmp(frame_pixels[0].data(), frame_pixels[1].data(), frame_pixels[0].size() * sizeof(Vector4)) == 0;
+
+		char name[64];
+		snprintf(name, sizeof(name), "cube, %d spheres", count);
+		printf("%-20s %12.1f %12.1f %9.2fx %14.1f %14.1f %10.1f %9.2fx%s\n", name, single_ms * 1.0e6 / rays.size(), packet_ms * 1.0e6 / rays.size(),
+			single_ms / packet_ms, single_nodes, packet_nodes, frame_ms[1], frame_ms[0] / frame_ms[1], match ? "" : " (results differ)");
+	}
+}
+
+// Mean of all pixel channels, to check that two renders of the same scene agree.
+static double mean_pixel_value(const std::vector<Vector4>& pixels) {
+	double sum = 0;
+	for (const Vector4& pixel : pixels) {
+		sum += (double)pixel.x + pixel.y + pixel.z;
+	}
+	return sum / (pixels.size() * 3.0);
+}
+
+// The per-pixel trace_ray loop, with camera ray packets like a normal render, against the wavefront stages over the
+// same passes. The two modes draw different random numbers, so their images only agree in the mean. The stages are
+// what treelet scenes are traced with, and this table is what --wavefront is measured with for scenes in memory.
+static void wavefront_benchmark() {
+	const int width = 160, height = 90;
+	const int passes = 4;
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+
+	printf("\nWavefront, %dx%d, %d passes, %d threads\n", width, height, passes, renderer.thread_count);
+	printf("%-28s %14s %14s %10s %12s\n", "scene", "per-pixel ms", "wavefront ms", "speedup", "mean diff");
+
+	auto compare = [&](const char* name, RaytracerData& data) {
+		double ms[2], mean[2];
+		for (int mode = 0; mode < 2; mode++) {
+			renderer.wavefront = mode == 1;
+			data.properties.frame_count = 0;
+			auto start = bench_clock::now();
+			for (int pass = 0; pass < passes; pass++) {
+				cpu_raytracer_render(renderer, data);
+			}
+			ms[mode] = elapsed_ms(start) / passes;
+			mean[mode] = mean_pixel_value(renderer.pixels);
+		}
+		renderer.wavefront = false;
+		printf("%-28s %14.1f %14.1f %9.2fx %+11.2f%%\n", name, ms[0], ms[1], ms[0] / ms[1], (mean[1] / mean[0] - 1.0) * 100.0);
+	};
+
+	for (int count : { 1000, 100000 }) {
+		std::vector<Sphere> spheres;
+		std::vector<Material> materials;
+		BVH bvh;
+		SphereSoA soa;
+		RaytracerData data;
+		setup_frame_scene(spheres, materials, bvh, soa, data, count, width, height);
+		char name[64];
+		snprintf(name, sizeof(name), "cube, %d spheres", count);
+		compare(name, data);
+	}
+
+	// Scene files with lights, rendered with light sampling so the shadow ray queue is part of the comparison.
+	const char* scene_paths[] = { "data/scenes/default.txt", "data/scenes/mirrors.txt" };
+	for (const char* path : scene_paths) {
+		Scene scene;
+		RaytracerData data;
+		BVH bvh;
+		SphereSoA soa;
+		std::vector<int> lights;
+		if (!setup_file_scene(path, scene, data, bvh, soa, lights, width, height)) {
+			continue;
+		}
+		data.properties.light_sampling = 1;
+		compare(path, data);
+		free_scene(scene);
+	}
+}
+
+static std::string kernel_feature_names(int features) {
+	static const char* names[] = { "emissive", "lambertian", "metal", "dof", "nee", "roulette" };
+	std::string result;
+	for (int i = 0; i < 6; i++) {
+		if (features & (1 << i)) {
+			result += result.empty() ? names[i] : std::string("+") + names[i];
+		}
+	}
+	return result;
+}
+
+// Every pass once with the generic kernel and once with the one select_cpu_kernel picks for the scene. Both trace the
+// same paths, so the images have to match bit for bit.
+static void kernel_benchmark() {
+	const int width = 160, height = 90;
+	const int passes = 4;
+	const int runs = 5; // alternating, best of
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+
+	printf("\nSpecialized kernels, %dx%d, %d passes, %d threads\n", width, height, passes, renderer.thread_count);
+	printf("%-34s %-42s %12s %14s %10s\n", "scene", "features", "generic ms", "specialized ms", "speedup");
+
+	auto compare = [&](const char* name, RaytracerData& data) {
+		double ms[2] = { 1.0e30, 1.0e30 };
+		std::vector<Vector4> pixels[2];
+		for (int run = 0; run < runs; run++) {
+			for (int mode = 0; mode < 2; mode++) {
+				renderer.specialize = mode == 1;
+				data.properties.frame_count = 0;
+				auto start = bench_clock::now();
+				for (int pass = 0; pass < passes; pass++) {
+					cpu_raytracer_render(renderer, data);
+				}
+				ms[mode] = std::min(ms[mode], elapsed_ms(start) / passes);
+				pixels[mode] = renderer.pixels;
+			}
+		}
+		bool match = memcmp(pixels[0].data(), pixels[1].data(), pixels[0].size() * sizeof(Vector4)) == 0;
+		printf("%-34s %-42s %12.1f %14.1f %9.2fx%s\n", name, kernel_feature_names(renderer.kernel_features).c_str(), ms[0], ms[1],
+			ms[0] / ms[1], match ? "" : " (results differ)");
+	};
+
+	{
+		std::vector<Sphere> spheres;
+		std::vector<Material> materials;
+		BVH bvh;
+		SphereSoA soa;
+		RaytracerData data;
+		setup_frame_scene(spheres, materials, bvh, soa, data, 1000, width, height);
+		data.properties.samples = 4;
+		compare("cube, 1000 spheres", data);
+		data.properties.roulette_depth = data.properties.max_depth;
+		compare("cube, no roulette", data);
+		data.properties.roulette_depth = DEFAULT_ROULETTE_DEPTH;
+		for (Material& material : materials) {
+			material.type = 1;
+		}
+		compare("cube, lambertian only", data);
+	}
+
+	const char* scene_paths[] = { "data/scenes/default.txt", "data/scenes/mirrors.txt" };
+	for (const char* path : scene_paths) {
+		Scene scene;
+		RaytracerData data;
+		BVH bvh;
+		SphereSoA soa;
+		std::vector<int> lights;
+		if (!setup_file_scene(path, scene, data, bvh, soa, lights, width, height)) {
+			continue;
+		}
+		data.properties.samples = 4;
+		compare(path, data);
+		data.properties.light_sampling = 1;
+		std::string name = std::string(path) + ", nee";
+		compare(name.c_str(), data);
+		scene.camera.aperture = 0.1f;
+		data.properties.camera = create_camera(scene.camera, (float)width / height);
+		name = std::string(path) + ", nee, dof";
+		compare(name.c_str(), data);
+		free_scene(scene);
+	}
+}
+
+// Bytes per sphere and ray throughput of the binary BVH with its SoA copy against the compressed scene, on sphere
+// cubes from cache sized to several times the last level cache. Random rays are the incoherent closest hit queries
+// of later bounces, paths are trace_ray from the camera. Compressed spheres are a little smaller or moved, so a few
+// random rays find another sphere.
+static int compressed_main(bool quick) {
+	std::vector<int> counts = { 10000, 100000, 1000000, 4000000, 8000000 };
+	if (quick) {
+		counts = { 10000, 1000000 };
+	}
+	const int ray_count = quick ? 200000 : 1000000;
+	const int path_count = quick ? 20000 : 100000;
+	const int runs = 3;
+
+	printf("Compressed scenes, %s, best of %d runs, %d random rays and %d paths per scene\n", simd_level_name(detect_simd_level()), runs, ray_count, path_count);
+	printf("%10s %8s %8s %8s %8s %10s %10s %8s %10s %10s %8s %8s\n", "spheres", "bvh B", "comp B", "mat B", "comp B", "rays ns", "comp ns",
+		"speedup", "paths Mr/s", "comp Mr/s", "speedup", "same");
+
+	for (int count : counts) {
+		std::vector<Sphere> spheres;
+		std::vector<Material> materials;
+		BVH bvh;
+		SphereSoA soa;
+		RaytracerData data;
+		setup_frame_scene(spheres, materials, bvh, soa, data, count, 64, 36);
+		CompressedScene compressed;
+		build_compressed_scene(compressed, data);
+		RaytracerData compressed_data = data;
+		set_compressed_scene(compressed_data, compressed);
+		std::vector<Ray> rays = random_rays(ray_count, std::cbrt((float)count), 0x89abcdefu);
+
+		double ray_ns[2], path_mrays[2];
+		std::vector<int> objects[2];
+		for (int mode = 0; mode < 2; mode++) {
+			const RaytracerData& mode_data = mode == 0 ? data : compressed_data;
+			objects[mode].resize(rays.size());
+			ray_ns[mode] = best_ms(runs, [&]() {
+				for (size_t i = 0; i < rays.size(); i++) {
+					Hit hit;
+					objects[mode][i] = check_object_hit(mode_data, rays[i], 0.001f, 1.0e7f, hit);
+				}
+			}) * 1.0e6 / rays.size();
+
+			take_counted_rays();
+			double ms = best_ms(runs, [&]() {
+				PathSampler state = {};
+				state.mode = SAMPLER_WANG;
+				state.state = 0x2468aceu;
+				for (int i = 0; i < path_count; i++) {
+					trace_ray(state, mode_data, get_camera_ray(state, mode_data.properties.camera, random_float(state), random_float(state)));
+				}
+			});
+			path_mrays[mode] = (double)take_counted_rays() / runs / (ms * 1000.0);
+		}
+		int same = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			same += objects[0][i] == objects[1][i];
+		}
+
+		printf("%10d %8.1f %8.1f %8.1f %8.1f %10.1f %10.1f %7.2fx %10.2f %10.2f %7.2fx %7.3f%%\n", count,
+			uncompressed_bvh_bytes_per_sphere((int)bvh.nodes.size(), count), compressed_bvh_bytes_per_sphere(compressed.bvh),
+			(double)sizeof(Material), compressed_material_bytes_per_sphere(compressed), ray_ns[0], ray_ns[1], ray_ns[0] / ray_ns[1],
+			path_mrays[0], path_mrays[1], path_mrays[1] / path_mrays[0], 100.0 * same / rays.size());
+	}
+	return 0;
+}
+
+// playground-render next to this executable.
+static std::string default_render_executable(const char* benchmark_path) {
+	std::string path(benchmark_path);
+	size_t separator = path.find_last_of("/\\");
+	path = separator == std::string::npos ? "" : path.substr(0, separator + 1);
+#if defined(_WIN32)
+	return path + "playground-render.exe";
+#else
+	return path + "playground-render";
+#endif
+}
+
+// Renders a frame here and on a tile farm of render_executable workers and compares the two bit for bit. The first
+// worker exits after one tile, so at least one job has to be given out again. Exit code 1 if the images differ, the
+// farm fails or nothing was retried.
+static int farm_main(const char* render_executable, const char* scene_path) {
+	const int width = 160, height = 96, tile_size = 16;
+	const int passes = 4;
+	const int local_workers = 2;
+
+	Scene scene;
+	RaytracerData data;
+	BVH bvh;
+	SphereSoA soa;
+	std::vector<int> lights;
+	if (!setup_file_scene(scene_path, scene, data, bvh, soa, lights, width, height)) {
+		return 2;
+	}
+	data.properties.samples = 2;
+	data.properties.light_sampling = 1;
+	data.sampler = SAMPLER_WANG;
+
+	FarmSettings settings = {};
+	if (strlen(scene_path) >= sizeof(settings.scene)) {
+		fprintf(stderr, "%s: path too long for the farm\n", scene_path);
+		return 2;
+	}
+	strcpy(settings.scene, scene_path);
+	settings.width = width;
+	settings.height = height;
+	settings.samples = data.properties.samples;
+	settings.max_depth = data.properties.max_depth;
+	settings.roulette_depth = data.properties.roulette_depth;
+	settings.light_sampling = data.properties.light_sampling;
+	settings.sampler = data.sampler;
+	settings.wavefront = 0;
+	settings.packets = 1;
+	settings.specialize = 1;
+	settings.compressed = 0;
+
+	CpuRenderer renderer = create_cpu_renderer(width, height);
+	data.properties.frame_count = 0;
+	for (int pass = 0; pass < passes; pass++) {
+		cpu_raytracer_render(renderer, data);
+	}
+
+	// The failing worker is started alone and has the queue to itself at first, the others join once it is ready.
+	FarmCoordinator farm;
+	bool ok = start_farm_coordinator(farm, "127.0.0.1:0", settings, tile_size, 60.0)
+		&& spawn_farm_workers(farm, render_executable, { "--worker", farm.address, "--threads", "1", "--worker-exit-after", "1" }, 1);
+	if (ok) {
+		std::unique_lock<std::mutex> lock(farm.mutex);
+		ok = farm.changed.wait_for(lock, std::chrono::seconds(60), [&]() { return farm.connections > 0; });
+	}
+	for (int i = 0; i < local_workers && ok; i++) {
+		FarmProcess process;
+		ok = spawn_farm_process({ render_executable, "--worker", farm.address, "--threads", "1" }, process);
+		if (ok) {
+			farm.processes.push_back(process);
+		}
+	}
+	std::vector<Vector4> farm_pixels;
+	ok = ok && farm_render_frame(farm, 0, data.properties.camera, passes, 0, farm_pixels);
+	int retries = farm.retries;
+	stop_farm_coordinator(farm);
+	free_scene(scene);
+	if (!ok) {
+		fprintf(stderr, "farm: the render failed, is %s built?\n", render_executable);
+		return 1;
+	}
+
+	int different = 0;
+	for (size_t i = 0; i < farm_pixels.size(); i++) {
+		different += memcmp(&farm_pixels[i], &renderer.pixels[i], sizeof(Vector4)) != 0 ? 1 : 0;
+	}
+	printf("Tile farm, '%s' at %dx%d, %d spp, %d tiles of %d, %d local workers and one that exits after a tile\n", scene_path, width,
+		height, passes * settings.samples, farm.tiles_x * ((height + tile_size - 1) / tile_size), tile_size, local_workers);
+	printf("%d jobs retried, %d of %d pixels differ from the local render\n", retries, different, width * height);
+	if (retries == 0) {
+		fprintf(stderr, "farm: no job was retried, the failing worker didn't get a second tile\n");
+	}
+	return different == 0 && retries > 0 ? 0 : 1;
+}
+
+static void print_usage() {
+	printf(
+		"usage: playground-benchmark                 comparison tables\n"
+		"       playground-benchmark throughput [options]\n"
+		"  --quick             fewer scene sizes and rays\n"
+		"  --json PATH         write the results as JSON\n"
+		"  --baseline PATH     compare against a JSON file from an earlier run, exit code 1 on a regression\n"
+		"  --threshold PERCENT allowed throughput loss against the baseline (default 10)\n"
+		"       playground-benchmark lights [SCENE]   next event estimation against BSDF sampling, RMSE at equal time\n"
+		"       playground-benchmark denoise [SCENE]  RMSE of the first passes with and without the denoiser, and its time\n"
+		"       playground-benchmark reproject [SCENE] RMSE after a camera orbit, restarted and reprojected, and its time\n"
+		"       playground-benchmark samplers [SCENE]  RMSE per sample count of the random number samplers\n"
+		"       playground-benchmark compressed [--quick] bytes per sphere and throughput of compressed scenes\n"
+		"       playground-benchmark farm [RENDER] [SCENE] a tile farm of RENDER workers with one failing against a local\n"
+		"                                                  render, exit code 1 unless identical with a retried job\n"
+		"                                                  (default: playground-render next to this program)\n");
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "lights") == 0) {
+		return light_sampling_main(argc > 2 ? argv[2] : "data/scenes/default.txt");
+	}
+	if (argc > 1 && strcmp(argv[1], "denoise") == 0) {
+		return denoise_main(argc > 2 ? argv[2] : "data/scenes/default.txt");
+	}
+	if (argc > 1 && strcmp(argv[1], "reproject") == 0) {
+		return reproject_main(argc > 2 ? argv[2] : "data/scenes/default.txt");
+	}
+	if (argc > 1 && strcmp(argv[1], "samplers") == 0) {
+		return samplers_main(argc > 2 ? argv[2] : "data/scenes/default.txt");
+	}
+	if (argc > 1 && strcmp(argv[1], "compressed") == 0) {
+		return compressed_main(argc > 2 && strcmp(argv[2], "--quick") == 0);
+	}
+	if (argc > 1 && strcmp(argv[1], "farm") == 0) {
+		std::string render_executable = argc > 2 ? argv[2] : default_render_executable(argv[0]);
+		return farm_main(render_executable.c_str(), argc > 3 ? argv[3] : "data/scenes/default.txt");
+	}
+	if (argc > 1) {
+		if (strcmp(argv[1], "throughput") != 0) {
+			print_usage();
+			return 2;
+		}
+		ThroughputOptions options = { false, nullptr, nullptr, 10.0 };
+		for (int i = 2; i < argc; i++) {
+			bool has_value = i + 1 < argc;
+			if (strcmp(argv[i], "--quick") == 0) options.quick = true;
+			else if (strcmp(argv[i], "--json") == 0 && has_value) options.json_path = argv[++i];
+			else if (strcmp(argv[i], "--baseline") == 0 && has_value) options.baseline_path = argv[++i];
+			else if (strcmp(argv[i], "--threshold") == 0 && has_value) options.threshold_percent = atof(argv[++i]);
+			else {
+				print_usage();
+				return 2;
+			}
+		}
+		return throughput_main(options);
+	}
+
+	bvh_benchmark();
+	refit_benchmark();
+	simd_benchmark();
+	vector_benchmark();
+	upload_benchmark();
+	scheduler_benchmark();
+	wavefront_benchmark();
+	packet_benchmark();
+	kernel_benchmark();
+	return 0;
+}
@@ -0,0 +1,654 @@
+#pragma once
+#include <assert.h>
+#include <float.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "maths.h"
+
+// Binned SAH BVH over the sphere array, and over the triangles of each mesh (mesh.h). Nodes are stored flat,
+// 32 bytes each, with the two children of an interior node next to each other, so the node array can be walked
+// directly by the CPU tracer and uploaded as-is into a StructuredBuffer<BVHNode> (see raytracer_compute.hlsl).
+
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+#define BVH_TRAVERSAL_COST 1.0f
+// Deepest leaf below the root, which is at depth 0. Traversal stacks hold at most BVH_MAX_DEPTH + 1 entries, the
+// shader's has room for 32. Builds switch to median splits where SAH splits would go deeper, and bvh_refit.h keeps it.
+#define BVH_MAX_DEPTH 31
+
+static_assert(BVH_MAX_DEPTH + 1 <= BVH_STACK_SIZE, "traversal stacks must hold a path of BVH_MAX_DEPTH");
+
+struct BVHNode {
+	Vector3 bounds_min;
+	int left_first; // interior: index of the left child, right child is left_first + 1. leaf: first entry in primitive_indices
+	Vector3 bounds_max;
+	int primitive_count; // 0 for interior nodes
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must match the HLSL layout");
+
+struct BVH {
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitive_indices; // leaf ranges point here, entries are indices into the primitive array
+};
+
+struct AABB {
+	Vector3 min;
+	Vector3 max;
+
+	AABB() : min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+
+	void grow(const Vector3& p) {
+		min = Vector3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max = Vector3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+
+	void grow(const AABB& b) {
+		min = Vector3(std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z));
+		max = Vector3(std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z));
+	}
+
+	float area() const {
+		Vector3 e = max - min;
+		return e.x < 0 ? 0 : 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+inline float axis(const Vector3& v, int a) { return a == 0 ? v.x : (a == 1 ? v.y : v.z); }
+
+inline AABB sphere_bounds(const Sphere& sphere) {
+	AABB b;
+	Vector3 r(sphere.radius, sphere.radius, sphere.radius);
+	b.min = sphere.center - r;
+	b.max = sphere.center + r;
+	return b;
+}
+
+inline AABB bvh_node_box(const BVHNode& node) {
+	AABB b;
+	b.min = node.bounds_min;
+	b.max = node.bounds_max;
+	return b;
+}
+
+inline void bvh_update_node_bounds(BVH& bvh, const std::vector<AABB>& prim_bounds, int node_index) {
+	BVHNode& node = bvh.nodes[node_index];
+	AABB b;
+	for (int i = 0; i < node.primitive_count; i++) {
+		b.grow(prim_bounds[bvh.primitive_indices[node.left_first + i]]);
+	}
+	node.bounds_min = b.min;
+	node.bounds_max = b.max;
+}
+
+// Finds the cheapest binned SAH split of a leaf. Returns the cost, or FLT_MAX when the centroids are all equal.
+inline float bvh_find_split(const BVH& bvh, const std::vector<AABB>& prim_bounds, const std::vector<Vector3>& centroids, const BVHNode& node, int& best_axis, float& best_position) {
+	AABB centroid_bounds;
+	for (int i = 0; i < node.primitive_count; i++) {
+		centroid_bounds.grow(centroids[bvh.primitive_indices[node.left_first + i]]);
+	}
+
+	float best_cost = FLT_MAX;
+	for (int a = 0; a < 3; a++) {
+		float lo = axis(centroid_bounds.min, a);
+		float hi = axis(centroid_bounds.max, a);
+		if (lo == hi) {
+			continue;
+		}
+
+		AABB bin_bounds[BVH_BIN_COUNT];
+		int bin_counts[BVH_BIN_COUNT] = {};
+		float scale = BVH_BIN_COUNT / (hi - lo);
+		for (int i = 0; i < node.primitive_count; i++) {
+			int prim = bvh.primitive_indices[node.left_first + i];
+			int bin = std::min(BVH_BIN_COUNT - 1, (int)((axis(centroids[prim], a) - lo) * scale));
+			bin_counts[bin]++;
+			bin_bounds[bin].grow(prim_bounds[prim]);
+		}
+
+		// Sweep from both sides to get the area and count of every split plane.
+		float left_area[BVH_BIN_COUNT - 1], right_area[BVH_BIN_COUNT - 1];
+		int left_count[BVH_BIN_COUNT - 1], right_count[BVH_BIN_COUNT - 1];
+		AABB left_box, right_box;
+		int left_sum = 0, right_sum = 0;
+		for (int i = 0; i < BVH_BIN_COUNT - 1; i++) {
+			left_sum += bin_counts[i];
+			left_count[i] = left_sum;
+			left_box.grow(bin_bounds[i]);
+			left_area[i] = left_box.area();
+
+			right_sum += bin_counts[BVH_BIN_COUNT - 1 - i];
+			right_count[BVH_BIN_COUNT - 2 - i] = right_sum;
+			right_box.grow(bin_bounds[BVH_BIN_COUNT - 1 - i]);
+			right_area[BVH_BIN_COUNT - 2 - i] = right_box.area();
+		}
+
+		for (int i = 0; i < BVH_BIN_COUNT - 1; i++) {
+			float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+			if (left_count[i] > 0 && right_count[i] > 0 && cost < best_cost) {
+				best_cost = cost;
+				best_axis = a;
+				best_position = lo + (i + 1) / scale;
+			}
+		}
+	}
+
+	return best_cost;
+}
+
+// Levels of median splits that bring count primitives down to leaves of max_leaf_size.
+inline int bvh_median_levels(int count, int max_leaf_size) {
+	int levels = 0;
+	for (long long size = std::max(max_leaf_size, 1); size < count; size *= 2) {
+		levels++;
+	}
+	return levels;
+}
+
+// Builds over any primitive type given each primitive's bounds and centroid. intersection_cost is the price of
+// one primitive test relative to one node visit. No leaf ends up deeper than max_depth: nodes with just enough
+// levels left for median splits to reach max_leaf_size are split at the median of their widest centroid axis, and
+// nodes at max_depth stay leaves whatever their size.
+inline BVH build_bvh_from_bounds(const std::vector<AABB>& prim_bounds, const std::vector<Vector3>& centroids, int max_leaf_size, float intersection_cost, int max_depth = BVH_MAX_DEPTH) {
+	BVH bvh;
+	int prim_count = (int)prim_bounds.size();
+	if (prim_count <= 0) {
+		return bvh;
+	}
+
+	bvh.primitive_indices.resize(prim_count);
+	for (int i = 0; i < prim_count; i++) {
+		bvh.primitive_indices[i] = i;
+	}
+
+	bvh.nodes.reserve(2 * prim_count - 1);
+	BVHNode root = {};
+	root.left_first = 0;
+	root.primitive_count = prim_count;
+	bvh.nodes.push_back(root);
+	bvh_update_node_bounds(bvh, prim_bounds, 0);
+
+	std::vector<std::pair<int, int>> stack; // node, depth
+	stack.push_back(std::make_pair(0, 0));
+	while (!stack.empty()) {
+		int node_index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		BVHNode node = bvh.nodes[node_index];
+		if (node.primitive_count <= 1 || depth >= max_depth) {
+			continue;
+		}
+
+		int* first = bvh.primitive_indices.data() + node.left_first;
+		int left_count;
+		if (bvh_median_levels(node.primitive_count, max_leaf_size) >= max_depth - depth) {
+			AABB centroid_bounds;
+			for (int i = 0; i < node.primitive_count; i++) {
+				centroid_bounds.grow(centroids[first[i]]);
+			}
+			Vector3 extent = centroid_bounds.max - centroid_bounds.min;
+			int split_axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+			left_count = node.primitive_count / 2;
+			std::nth_element(first, first + left_count, first + node.primitive_count, [&](int a, int b) {
+				return axis(centroids[a], split_axis) < axis(centroids[b], split_axis);
+			});
+		}
+		else {
+			int split_axis = 0;
+			float split_position = 0;
+			float split_cost = bvh_find_split(bvh, prim_bounds, centroids, node, split_axis, split_position);
+			if (split_cost == FLT_MAX) {
+				continue; // coincident centroids, nothing to split on
+			}
+
+			AABB node_box;
+			node_box.min = node.bounds_min;
+			node_box.max = node.bounds_max;
+			float leaf_cost = node.primitive_count * intersection_cost * node_box.area();
+			split_cost = split_cost * intersection_cost + BVH_TRAVERSAL_COST * node_box.area();
+			if (split_cost >= leaf_cost && node.primitive_count <= max_leaf_size) {
+				continue;
+			}
+
+			int* middle = std::partition(first, first + node.primitive_count, [&](int prim) {
+				return axis(centroids[prim], split_axis) < split_position;
+			});
+			left_count = (int)(middle - first);
+			if (left_count == 0 || left_count == node.primitive_count) {
+				continue;
+			}
+		}
+
+		int left_index = (int)bvh.nodes.size();
+		BVHNode left = {};
+		left.left_first = node.left_first;
+		left.primitive_count = left_count;
+		BVHNode right = {};
+		right.left_first = node.left_first + left_count;
+		right.primitive_count = node.primitive_count - left_count;
+		bvh.nodes.push_back(left);
+		bvh.nodes.push_back(right);
+		bvh_update_node_bounds(bvh, prim_bounds, left_index);
+		bvh_update_node_bounds(bvh, prim_bounds, left_index + 1);
+
+		bvh.nodes[node_index].left_first = left_index;
+		bvh.nodes[node_index].primitive_count = 0;
+
+		stack.push_back(std::make_pair(left_index + 1, depth + 1));
+		stack.push_back(std::make_pair(left_index, depth + 1));
+	}
+
+	return bvh;
+}
+
+// Checks a BVH that came from a file before it is traversed: every node reachable from the root lies in the node
+// array, is reached once and no deeper than BVH_MAX_DEPTH, and its leaves cover entries of the index array, which
+// has index_count entries. primitive_indices may be null when leaves index the primitives directly; otherwise every
+// entry has to be a primitive in [0, primitive_count).
+inline bool bvh_valid(const BVHNode* nodes, int node_count, const int* primitive_indices, int index_count, int primitive_count) {
+	if (node_count <= 0) {
+		return node_count == 0 && index_count == 0;
+	}
+	if (primitive_indices) {
+		for (int i = 0; i < index_count; i++) {
+			if (primitive_indices[i] < 0 || primitive_indices[i] >= primitive_count) {
+				return false;
+			}
+		}
+	}
+
+	std::vector<bool> reached(node_count, false);
+	std::vector<std::pair<int, int>> stack(1, std::make_pair(0, 0)); // node, depth
+	while (!stack.empty()) {
+		int node_index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (reached[node_index] || depth > BVH_MAX_DEPTH) {
+			return false;
+		}
+		reached[node_index] = true;
+		const BVHNode& node = nodes[node_index];
+		if (node.primitive_count < 0 || node.left_first < 0) {
+			return false;
+		}
+		if (node.primitive_count > 0) {
+			if (node.primitive_count > index_count - node.left_first) {
+				return false;
+			}
+			continue;
+		}
+		if (node.left_first >= node_count - 1) {
+			return false;
+		}
+		stack.push_back(std::make_pair(node.left_first, depth + 1));
+		stack.push_back(std::make_pair(node.left_first + 1, depth + 1));
+	}
+	return true;
+}
+
+// The SoA kernel tests sphere_soa_kernel().lanes spheres for about the price of one, so pass
+// that as max_leaf_size and its inverse as intersection_cost there.
+inline BVH build_bvh(const Sphere* spheres, int sphere_count, int max_leaf_size = BVH_MAX_LEAF_SIZE, float intersection_cost = 1.0f) {
+	std::vector<AABB> prim_bounds(std::max(sphere_count, 0));
+	std::vector<Vector3> centroids(std::max(sphere_count, 0));
+	for (int i = 0; i < sphere_count; i++) {
+		prim_bounds[i] = sphere_bounds(spheres[i]);
+		centroids[i] = spheres[i].center;
+	}
+	return build_bvh_from_bounds(prim_bounds, centroids, max_leaf_size, intersection_cost);
+}
+
+// Slab test. Returns the entry distance, or FLT_MAX when the box is missed within [t_min, t_max].
+inline float aabb_hit(const Vector3& bounds_min, const Vector3& bounds_max, const Vector3& origin, const Vector3& inv_dir, float t_min, float t_max) {
+	float tx0 = (bounds_min.x - origin.x) * inv_dir.x, tx1 = (bounds_max.x - origin.x) * inv_dir.x;
+	float ty0 = (bounds_min.y - origin.y) * inv_dir.y, ty1 = (bounds_max.y - origin.y) * inv_dir.y;
+	float tz0 = (bounds_min.z - origin.z) * inv_dir.z, tz1 = (bounds_max.z - origin.z) * inv_dir.z;
+
+	float enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), t_min));
+	float exit = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max));
+
+	return enter <= exit ? enter : FLT_MAX;
+}
+
+// Walks the BVH nearest child first. intersect_leaf(first, count, closest) tests the primitives of one leaf
+// (entries [first, first + count) of the primitive index array) and lowers closest for every nearer hit.
+// Nodes that start behind closest are skipped. Returns the number of nodes visited.
+// Binary scenes are mapped without reading their BVH first, so the walk only trusts what it checks on the way: children
+// outside the node_count nodes are skipped, leaves are cut to the index_count entries, a full stack drops the farther
+// child and the walk ends after node_count nodes. A malformed BVH then misses spheres instead of reading out of bounds
+// or looping; a valid one is walked as before.
+template <typename LeafTest>
+inline int bvh_traverse(const BVHNode* nodes, int node_count, int index_count, const Ray& ray, float t_min, float& closest, LeafTest intersect_leaf) {
+	Vector3 inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+	int stack[BVH_STACK_SIZE];
+	float stack_t[BVH_STACK_SIZE];
+	int stack_size = 0;
+
+	if (aabb_hit(nodes[0].bounds_min, nodes[0].bounds_max, ray.origin_point, inv_dir, t_min, closest) == FLT_MAX) {
+		return 1;
+	}
+
+	int node_index = 0;
+	int visited = 0;
+	while (visited < node_count) {
+		const BVHNode& node = nodes[node_index];
+		visited++;
+		if (node.primitive_count > 0) {
+			if (node.left_first >= 0 && node.left_first <= index_count) {
+				intersect_leaf(node.left_first, std::min(node.primitive_count, index_count - node.left_first), closest);
+			}
+		}
+		else if (node.left_first >= 0 && node.left_first < node_count - 1) {
+			// Visit the nearer child first and push the other one.
+			const BVHNode& left = nodes[node.left_first];
+			const BVHNode& right = nodes[node.left_first + 1];
+			float left_t = aabb_hit(left.bounds_min, left.bounds_max, ray.origin_point, inv_dir, t_min, closest);
+			float right_t = aabb_hit(right.bounds_min, right.bounds_max, ray.origin_point, inv_dir, t_min, closest);
+			int near_index = node.left_first, far_index = node.left_first + 1;
+			if (right_t < left_t) {
+				std::swap(left_t, right_t);
+				std::swap(near_index, far_index);
+			}
+
+			if (left_t != FLT_MAX) {
+				if (right_t != FLT_MAX && stack_size < BVH_STACK_SIZE) {
+					stack[stack_size] = far_index;
+					stack_t[stack_size++] = right_t;
+				}
+				node_index = near_index;
+				continue;
+			}
+		}
+
+		// Skip pushed nodes that start behind the closest hit found since they were pushed.
+		while (stack_size > 0 && stack_t[stack_size - 1] >= closest) {
+			stack_size--;
+		}
+		if (stack_size == 0) {
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return visited;
+}
+
+#define BVH_PACKET_MAX_RAYS 256
+
+// Bounds of a packet of rays from one origin for culling whole boxes, in interval arithmetic: per axis the inverse
+// directions of all rays lie in [inv_min, inv_max], so the entry and exit distances of every ray lie in what the
+// interval ends give. Axes where the directions change sign are left unbounded.
+struct PacketFrustum {
+	Vector3 origin;
+	Vector3 inv_min;
+	Vector3 inv_max;
+	bool bounded[3];
+};
+
+inline PacketFrustum packet_frustum(const Vector3& origin, const Vector3* inv_dirs, int count) {
+	PacketFrustum frustum;
+	frustum.origin = origin;
+	frustum.inv_min = frustum.inv_max = inv_dirs[0];
+	for (int i = 1; i < count; i++) {
+		const Vector3& v = inv_dirs[i];
+		frustum.inv_min = Vector3(std::min(frustum.inv_min.x, v.x), std::min(frustum.inv_min.y, v.y), std::min(frustum.inv_min.z, v.z));
+		frustum.inv_max = Vector3(std::max(frustum.inv_max.x, v.x), std::max(frustum.inv_max.y, v.y), std::max(frustum.inv_max.z, v.z));
+	}
+	for (int a = 0; a < 3; a++) {
+		float low = axis(frustum.inv_min, a), high = axis(frustum.inv_max, a);
+		frustum.bounded[a] = std::abs(low) < FLT_MAX && std::abs(high) < FLT_MAX && (low > 0.0f) == (high > 0.0f);
+	}
+	return frustum;
+}
+
+// Lowest entry distance of any packet ray into the box, or FLT_MAX when no ray can hit it within [t_min, t_max].
+// Float multiplication is monotonic, so the bounds hold exactly and no box a ray hits with aabb_hit is culled.
+inline float packet_frustum_hit(const PacketFrustum& frustum, const Vector3& bounds_min, const Vector3& bounds_max, float t_min, float t_max) {
+	float enter = t_min, exit = t_max;
+	for (int a = 0; a < 3; a++) {
+		if (!frustum.bounded[a]) {
+			continue;
+		}
+		float low = axis(frustum.inv_min, a), high = axis(frustum.inv_max, a);
+		float near_offset = axis(low > 0.0f ? bounds_min : bounds_max, a) - axis(frustum.origin, a);
+		float far_offset = axis(low > 0.0f ? bounds_max : bounds_min, a) - axis(frustum.origin, a);
+		enter = std::max(enter, near_offset * (near_offset >= 0.0f ? low : high));
+		exit = std::min(exit, far_offset * (far_offset >= 0.0f ? high : low));
+	}
+	return enter <= exit ? enter : FLT_MAX;
+}
+
+inline bool packet_ray_hits(const BVHNode& node, const Ray& ray, const Vector3& inv_dir, float t_min, float closest) {
+	return aabb_hit(node.bounds_min, node.bounds_max, ray.origin_point, inv_dir, t_min, closest) != FLT_MAX;
+}
+
+// Narrows [first, end) to the range between the first and the last ray that enter the box before their closest hit.
+// Returns false if none does.
+inline bool packet_active_range(const BVHNode& node, const Ray* rays, const Vector3* inv_dirs, float t_min, const float* closest, int& first, int& end) {
+	while (first < end && !packet_ray_hits(node, rays[first], inv_dirs[first], t_min, closest[first])) {
+		first++;
+	}
+	while (end > first + 1 && !packet_ray_hits(node, rays[end - 1], inv_dirs[end - 1], t_min, closest[end - 1])) {
+		end--;
+	}
+	return first < end;
+}
+
+// bvh_traverse for up to BVH_PACKET_MAX_RAYS rays that all start at rays[0].origin_point, such as the camera rays of
+// a block of pixels without depth of field. A child is culled for the whole packet when it is outside the packet
+// frustum, and otherwise when none of the parent's active rays hits it. Active rays are kept as the range from the
+// first to the last ray that hits the node, and leaves test the rays of that range one by one with aabb_hit and then
+// intersect_leaf(first, count, ray, closest[ray]). Every ray ends with the closest hit bvh_traverse would find, and
+// node_count and index_count bound the walk the same way. Returns the number of nodes the packet visited.
+template <typename LeafTest>
+inline int bvh_traverse_packet(const BVHNode* nodes, int node_count, int index_count, const Ray* rays, int ray_count, float t_min, float* closest, LeafTest intersect_leaf) {
+	assert(ray_count > 0 && ray_count <= BVH_PACKET_MAX_RAYS);
+	Vector3 inv_dirs[BVH_PACKET_MAX_RAYS];
+	float farthest = t_min; // closest hit of the ray whose hit is farthest away, nodes beyond it can't matter
+	for (int i = 0; i < ray_count; i++) {
+		inv_dirs[i] = Vector3(1.0f / rays[i].direction.x, 1.0f / rays[i].direction.y, 1.0f / rays[i].direction.z);
+		farthest = std::max(farthest, closest[i]);
+	}
+	PacketFrustum frustum = packet_frustum(rays[0].origin_point, inv_dirs, ray_count);
+
+	int stack[BVH_STACK_SIZE];
+	int stack_first[BVH_STACK_SIZE];
+	int stack_end[BVH_STACK_SIZE];
+	float stack_t[BVH_STACK_SIZE];
+	int stack_size = 0;
+	if (packet_frustum_hit(frustum, nodes[0].bounds_min, nodes[0].bounds_max, t_min, farthest) == FLT_MAX) {
+		return 1;
+	}
+	int first_active = 0, end_active = ray_count;
+	if (!packet_active_range(nodes[0], rays, inv_dirs, t_min, closest, first_active, end_active)) {
+		return 1;
+	}
+
+	int node_index = 0;
+	int visited = 0;
+	while (visited < node_count) {
+		const BVHNode& node = nodes[node_index];
+		visited++;
+		if (node.primitive_count > 0) {
+			bool in_range = node.left_first >= 0 && node.left_first <= index_count;
+			int primitive_count = in_range ? std::min(node.primitive_count, index_count - node.left_first) : 0;
+			for (int i = first_active; i < end_active && primitive_count > 0; i++) {
+				if (packet_ray_hits(node, rays[i], inv_dirs[i], t_min, closest[i])) {
+					intersect_leaf(node.left_first, primitive_count, i, closest[i]);
+				}
+			}
+			farthest = t_min;
+			for (int i = 0; i < ray_count; i++) {
+				farthest = std::max(farthest, closest[i]);
+			}
+		}
+		else if (node.left_first >= 0 && node.left_first < node_count - 1) {
+			int near_index = node.left_first, far_index = node.left_first + 1;
+			float near_t = packet_frustum_hit(frustum, nodes[near_index].bounds_min, nodes[near_index].bounds_max, t_min, farthest);
+			float far_t = packet_frustum_hit(frustum, nodes[far_index].bounds_min, nodes[far_index].bounds_max, t_min, farthest);
+			int near_first = first_active, near_end = end_active, far_first = first_active, far_end = end_active;
+			if (near_t != FLT_MAX && !packet_active_range(nodes[near_index], rays, inv_dirs, t_min, closest, near_first, near_end)) {
+				near_t = FLT_MAX;
+			}
+			if (far_t != FLT_MAX && !packet_active_range(nodes[far_index], rays, inv_dirs, t_min, closest, far_first, far_end)) {
+				far_t = FLT_MAX;
+			}
+			if (far_t < near_t) {
+				std::swap(near_t, far_t);
+				std::swap(near_index, far_index);
+				std::swap(near_first, far_first);
+				std::swap(near_end, far_end);
+			}
+
+			if (near_t != FLT_MAX) {
+				if (far_t != FLT_MAX && stack_size < BVH_STACK_SIZE) {
+					stack[stack_size] = far_index;
+					stack_first[stack_size] = far_first;
+					stack_end[stack_size] = far_end;
+					stack_t[stack_size++] = far_t;
+				}
+				node_index = near_index;
+				first_active = near_first;
+				end_active = near_end;
+				continue;
+			}
+		}
+
+		while (stack_size > 0 && stack_t[stack_size - 1] >= farthest) {
+			stack_size--;
+		}
+		if (stack_size == 0) {
+			break;
+		}
+		stack_size--;
+		node_index = stack[stack_size];
+		first_active = stack_first[stack_size];
+		end_active = stack_end[stack_size];
+	}
+	return visited;
+}
+
+#define BVH_STREAM_STACK_SIZE (2 * BVH_STACK_SIZE) // every level of a BVH_MAX_DEPTH path leaves at most two runs queued
+
+struct BVHStreamEntry {
+	int node;
+	int first; // the rays lists[first, end) of BVHStream wait at node
+	int end;
+};
+
+// Scratch of bvh_traverse_stream, kept by the caller so a traversal doesn't allocate.
+struct BVHStream {
+	std::vector<Vector3> inv_dirs; // indexed like the rays
+	std::vector<int> lists; // ray indices, one run per entry on the stack
+	std::vector<float> list_t; // distance at which each ray of lists enters the node it waits at
+	std::vector<BVHStreamEntry> stack;
+};
+
+// bvh_traverse for rays that share nothing, such as the bounce rays of a wavefront tile: rays[ray_indices[i]] go
+// through the BVH together instead of one by one, and a leaf hands all the rays that reach it to
+// intersect_leaf(first, count, leaf_rays, leaf_ray_count), which lowers closest[ray] for the rays it hits. Each ray
+// still visits the children of a node nearer first: the rays of a node are split by the child they enter first, and
+// the children are visited as left (the rays entering it first), right (all), left (the rays entering the right one first).
+// A queued ray drops out once it found a hit in front of the node, so every ray visits the nodes bvh_traverse visits
+// and ends with the closest hit it would find. closest is indexed like rays. node_count and index_count bound the walk
+// like in bvh_traverse, per ray. Returns how many rays entered a node, summed over the nodes.
+template <typename LeafTest>
+inline int bvh_traverse_stream(const BVHNode* nodes, int node_count, int index_count, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float* closest,
+	BVHStream& stream, LeafTest intersect_leaf) {
+	int ray_end = 0;
+	for (int i = 0; i < ray_count; i++) {
+		ray_end = std::max(ray_end, ray_indices[i] + 1);
+	}
+	stream.inv_dirs.resize(ray_end);
+	stream.lists.clear();
+	stream.list_t.clear();
+	for (int i = 0; i < ray_count; i++) {
+		int ray = ray_indices[i];
+		const Vector3& direction = rays[ray].direction;
+		stream.inv_dirs[ray] = Vector3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+		float t = aabb_hit(nodes[0].bounds_min, nodes[0].bounds_max, rays[ray].origin_point, stream.inv_dirs[ray], t_min, closest[ray]);
+		if (t != FLT_MAX) {
+			stream.lists.push_back(ray);
+			stream.list_t.push_back(t);
+		}
+	}
+	stream.stack.clear();
+	stream.stack.push_back({ 0, 0, (int)stream.lists.size() });
+
+	int visited = 0;
+	long long entries_left = (long long)node_count * ray_count;
+	while (!stream.stack.empty() && entries_left > 0) {
+		BVHStreamEntry entry = stream.stack.back();
+		stream.stack.pop_back();
+		const BVHNode& node = nodes[entry.node];
+		const int count = entry.end - entry.first;
+		entries_left -= std::max(count, 1);
+
+		// Runs are appended in the reverse order of their visits, so what lies past this run belongs to nodes that
+		// are done. Rays that found a hit in front of the node since it was queued are skipped.
+		if (node.primitive_count > 0) {
+			int* list = stream.lists.data();
+			const float* list_t = stream.list_t.data();
+			int end = entry.first;
+			for (int i = entry.first; i < entry.end; i++) {
+				if (list_t[i] < closest[list[i]]) {
+					list[end++] = list[i];
+				}
+			}
+			visited += end - entry.first;
+			if (end > entry.first && node.left_first >= 0 && node.left_first <= index_count) {
+				intersect_leaf(node.left_first, std::min(node.primitive_count, index_count - node.left_first), list + entry.first, end - entry.first);
+			}
+			stream.lists.resize(entry.first);
+			stream.list_t.resize(entry.first);
+			continue;
+		}
+		if (node.left_first < 0 || node.left_first >= node_count - 1 || stream.stack.size() + 3 > BVH_STREAM_STACK_SIZE) {
+			continue;
+		}
+
+		// Three runs behind this one, room for every ray in each: left for the rays entering the right child
+		// first, right for all, left for the rays entering it first.
+		const int left_index = node.left_first, right_index = node.left_first + 1;
+		const BVHNode& left = nodes[left_index];
+		const BVHNode& right = nodes[right_index];
+		const int second_left = entry.end, both_right = second_left + count, first_left = both_right + count;
+		stream.lists.resize(first_left + count);
+		stream.list_t.resize(first_left + count);
+		int* list = stream.lists.data();
+		float* list_t = stream.list_t.data();
+		int a = second_left, b = both_right, c = first_left;
+		for (int i = entry.first; i < entry.end; i++) {
+			int ray = list[i];
+			if (!(list_t[i] < closest[ray])) {
+				continue;
+			}
+			visited++;
+			float left_t = aabb_hit(left.bounds_min, left.bounds_max, rays[ray].origin_point, stream.inv_dirs[ray], t_min, closest[ray]);
+			float right_t = aabb_hit(right.bounds_min, right.bounds_max, rays[ray].origin_point, stream.inv_dirs[ray], t_min, closest[ray]);
+			if (right_t != FLT_MAX) {
+				list[b] = ray;
+				list_t[b++] = right_t;
+			}
+			if (left_t != FLT_MAX) {
+				bool right_first = right_t < left_t;
+				int& slot = right_first ? a : c;
+				list[slot] = ray;
+				list_t[slot++] = left_t;
+			}
+		}
+		stream.lists.resize(c);
+		stream.list_t.resize(c);
+		if (a > second_left) {
+			stream.stack.push_back({ left_index, second_left, a });
+		}
+		if (b > both_right) {
+			stream.stack.push_back({ right_index, both_right, b });
+		}
+		if (c > first_left) {
+			stream.stack.push_back({ left_index, first_left, c });
+		}
+	}
+	return visited;
+}
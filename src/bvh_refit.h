@@ -0,0 +1,375 @@
+#pragma once
+#include <float.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "bvh.h"
+
+// Incremental updates of the sphere BVH for interactive edits. Moving a sphere refits the bounds from its leaf up to
+// the root, and every node on the way tries a tree rotation (Kensler 2008): swapping one child with a grandchild
+// under the other child when that shrinks the other child's box, which is the SAH gain of the swap. Each node also
+// remembers its subtree's SAH cost per unit of its own area from when it was last built; a node that ends up more
+// than BVH_REBUILD_THRESHOLD times worse than that is rebuilt with build_bvh_from_bounds, the highest such node on the
+// edited path (or, if its leaves aren't one contiguous range of primitive_indices any more after rotations, its
+// nearest ancestor whose are). An update touches O(depth) nodes per edited sphere plus what it rebuilds.
+// Rotations that would put a leaf deeper than BVH_MAX_DEPTH are skipped, and rebuilds get the depth left below their root.
+// The flat layout stays valid for traversal and upload: rotations swap node records, a rebuilt subtree reuses its
+// node pairs and appends pairs when it needs more, and pairs it leaves over are kept for later rebuilds.
+
+#define BVH_REBUILD_THRESHOLD 1.25f
+
+struct BVHUpdater {
+	std::vector<int> parents; // per node, -1 for the root and for unused pairs
+	std::vector<int> leaf_of_primitive;
+	std::vector<int> entry_of_primitive; // position in primitive_indices, which is also the SphereSoA slot
+	std::vector<float> costs; // SAH cost of each node's subtree
+	std::vector<float> built_ratios; // costs / area when the subtree was last built
+	std::vector<int> heights; // levels below each node, 0 for leaves
+	std::vector<int> free_pairs; // left indices of node pairs no subtree uses
+	int max_leaf_size;
+	float intersection_cost;
+
+	// Of the last bvh_update_spheres: what has to be copied to the SoA and GPU buffers, and what was done.
+	int dirty_node_first, dirty_node_end;
+	int dirty_entry_first, dirty_entry_end;
+	int rotations;
+	int rebuilt_primitives;
+};
+
+inline void bvh_mark_node_dirty(BVHUpdater& updater, int node) {
+	updater.dirty_node_first = std::min(updater.dirty_node_first, node);
+	updater.dirty_node_end = std::max(updater.dirty_node_end, node + 1);
+}
+
+inline void bvh_mark_entries_dirty(BVHUpdater& updater, int first, int count) {
+	updater.dirty_entry_first = std::min(updater.dirty_entry_first, first);
+	updater.dirty_entry_end = std::max(updater.dirty_entry_end, first + count);
+}
+
+// Recomputes the bounds of node from its children or spheres, and its subtree cost.
+inline void bvh_refit_node(BVH& bvh, BVHUpdater& updater, const Sphere* spheres, int node_index) {
+	BVHNode& node = bvh.nodes[node_index];
+	AABB b;
+	if (node.primitive_count > 0) {
+		for (int i = 0; i < node.primitive_count; i++) {
+			b.grow(sphere_bounds(spheres[bvh.primitive_indices[node.left_first + i]]));
+		}
+		updater.costs[node_index] = updater.intersection_cost * node.primitive_count * b.area();
+		updater.heights[node_index] = 0;
+	}
+	else {
+		b.grow(bvh_node_box(bvh.nodes[node.left_first]));
+		b.grow(bvh_node_box(bvh.nodes[node.left_first + 1]));
+		updater.costs[node_index] = BVH_TRAVERSAL_COST * b.area() + updater.costs[node.left_first] + updater.costs[node.left_first + 1];
+		updater.heights[node_index] = 1 + std::max(updater.heights[node.left_first], updater.heights[node.left_first + 1]);
+	}
+	node.bounds_min = b.min;
+	node.bounds_max = b.max;
+	bvh_mark_node_dirty(updater, node_index);
+}
+
+// Points the parents of node's children, or the leaf of node's primitives, at node_index after the record moved there.
+inline void bvh_adopt_node(const BVH& bvh, BVHUpdater& updater, int node_index) {
+	const BVHNode& node = bvh.nodes[node_index];
+	if (node.primitive_count > 0) {
+		for (int i = 0; i < node.primitive_count; i++) {
+			updater.leaf_of_primitive[bvh.primitive_indices[node.left_first + i]] = node_index;
+		}
+	}
+	else {
+		updater.parents[node.left_first] = node_index;
+		updater.parents[node.left_first + 1] = node_index;
+	}
+}
+
+inline int bvh_node_depth(const BVHUpdater& updater, int node_index) {
+	int depth = 0;
+	for (int n = updater.parents[node_index]; n != -1; n = updater.parents[n]) {
+		depth++;
+	}
+	return depth;
+}
+
+// Tries the four child/grandchild swaps under node_index and applies the one that shrinks a child's box the most.
+// The node's own bounds and the set of primitives under it stay the same. Returns true if it rotated.
+inline bool bvh_rotate_node(BVH& bvh, BVHUpdater& updater, const Sphere* spheres, int node_index) {
+	const int first_child = bvh.nodes[node_index].left_first;
+	const int grandchild_depth = bvh_node_depth(updater, node_index) + 2; // where the moved child ends up
+	float best_gain = 0.0f;
+	int best_child = -1, best_grandchild = -1, best_receiver = -1;
+	for (int side = 0; side < 2; side++) {
+		int child = first_child + side;
+		int receiver = first_child + 1 - side; // gets child in place of one of its children
+		const BVHNode& other = bvh.nodes[receiver];
+		if (other.primitive_count > 0 || grandchild_depth + updater.heights[child] > BVH_MAX_DEPTH) {
+			continue;
+		}
+		float area = bvh_node_box(other).area();
+		for (int k = 0; k < 2; k++) {
+			AABB b = bvh_node_box(bvh.nodes[child]);
+			b.grow(bvh_node_box(bvh.nodes[other.left_first + 1 - k]));
+			float gain = area - b.area();
+			if (gain > best_gain) {
+				best_gain = gain;
+				best_child = child;
+				best_grandchild = other.left_first + k;
+				best_receiver = receiver;
+			}
+		}
+	}
+	if (best_child < 0) {
+		return false;
+	}
+
+	std::swap(bvh.nodes[best_child], bvh.nodes[best_grandchild]);
+	std::swap(updater.costs[best_child], updater.costs[best_grandchild]);
+	std::swap(updater.built_ratios[best_child], updater.built_ratios[best_grandchild]);
+	std::swap(updater.heights[best_child], updater.heights[best_grandchild]);
+	bvh_adopt_node(bvh, updater, best_child);
+	bvh_adopt_node(bvh, updater, best_grandchild);
+	bvh_mark_node_dirty(updater, best_child);
+	bvh_mark_node_dirty(updater, best_grandchild);
+	bvh_refit_node(bvh, updater, spheres, best_receiver);
+	bvh_refit_node(bvh, updater, spheres, node_index);
+	updater.rotations++;
+	return true;
+}
+
+// Cost and built ratio of every node under node_index, children before parents.
+inline void bvh_init_subtree_costs(BVH& bvh, BVHUpdater& updater, const Sphere* spheres, int node_index) {
+	const BVHNode& node = bvh.nodes[node_index];
+	if (node.primitive_count == 0) {
+		bvh_init_subtree_costs(bvh, updater, spheres, node.left_first);
+		bvh_init_subtree_costs(bvh, updater, spheres, node.left_first + 1);
+	}
+	bvh_refit_node(bvh, updater, spheres, node_index);
+	float area = bvh_node_box(bvh.nodes[node_index]).area();
+	updater.built_ratios[node_index] = area > 0.0f ? updater.costs[node_index] / area : 0.0f;
+}
+
+// bvh has to have been built over spheres with the same max_leaf_size and intersection_cost.
+inline BVHUpdater create_bvh_updater(BVH& bvh, const Sphere* spheres, int sphere_count, int max_leaf_size = BVH_MAX_LEAF_SIZE, float intersection_cost = 1.0f) {
+	BVHUpdater updater;
+	updater.max_leaf_size = max_leaf_size;
+	updater.intersection_cost = intersection_cost;
+	updater.parents.assign(bvh.nodes.size(), -1);
+	updater.leaf_of_primitive.assign(sphere_count, -1);
+	updater.entry_of_primitive.assign(sphere_count, -1);
+	updater.costs.assign(bvh.nodes.size(), 0.0f);
+	updater.built_ratios.assign(bvh.nodes.size(), 0.0f);
+	updater.heights.assign(bvh.nodes.size(), 0);
+	updater.dirty_node_first = updater.dirty_entry_first = INT32_MAX;
+	updater.dirty_node_end = updater.dirty_entry_end = 0;
+	updater.rotations = 0;
+	updater.rebuilt_primitives = 0;
+	for (int i = 0; i < (int)bvh.primitive_indices.size(); i++) {
+		updater.entry_of_primitive[bvh.primitive_indices[i]] = i;
+	}
+	if (bvh.nodes.empty()) {
+		return updater;
+	}
+
+	std::vector<bool> reachable(bvh.nodes.size(), false);
+	std::vector<int> stack(1, 0);
+	while (!stack.empty()) {
+		int node_index = stack.back();
+		stack.pop_back();
+		reachable[node_index] = true;
+		bvh_adopt_node(bvh, updater, node_index);
+		if (bvh.nodes[node_index].primitive_count == 0) {
+			stack.push_back(bvh.nodes[node_index].left_first);
+			stack.push_back(bvh.nodes[node_index].left_first + 1);
+		}
+	}
+	for (int i = 1; i + 1 < (int)bvh.nodes.size(); i += 2) {
+		if (!reachable[i]) {
+			updater.free_pairs.push_back(i); // left over by an earlier updater
+		}
+	}
+	bvh_init_subtree_costs(bvh, updater, spheres, 0);
+	return updater;
+}
+
+// Adds the left indices of the node pairs under node_index to pairs, and the entry range its leaves span to
+// [first, end) and count of primitives.
+inline void bvh_collect_subtree(const BVH& bvh, int node_index, std::vector<int>& pairs, int& first, int& end, int& count) {
+	const BVHNode& node = bvh.nodes[node_index];
+	if (node.primitive_count > 0) {
+		first = std::min(first, node.left_first);
+		end = std::max(end, node.left_first + node.primitive_count);
+		count += node.primitive_count;
+		return;
+	}
+	pairs.push_back(node.left_first);
+	bvh_collect_subtree(bvh, node.left_first, pairs, first, end, count);
+	bvh_collect_subtree(bvh, node.left_first + 1, pairs, first, end, count);
+}
+
+// Whether the leaves under node_index cover one contiguous range of primitive_indices, which bvh_rebuild_subtree
+// needs. Rotations can scatter them.
+inline bool bvh_subtree_contiguous(const BVH& bvh, int node_index) {
+	std::vector<int> pairs;
+	int first = INT32_MAX, end = 0, count = 0;
+	bvh_collect_subtree(bvh, node_index, pairs, first, end, count);
+	return end - first == count;
+}
+
+// Rebuilds the subtree under node_index in place. Its leaves have to be bvh_subtree_contiguous.
+inline void bvh_rebuild_subtree(BVH& bvh, BVHUpdater& updater, const Sphere* spheres, int node_index) {
+	std::vector<int> old_pairs;
+	int first = INT32_MAX, end = 0, count = 0;
+	bvh_collect_subtree(bvh, node_index, old_pairs, first, end, count);
+	assert(end - first == count);
+
+	std::vector<AABB> prim_bounds(count);
+	std::vector<Vector3> centroids(count);
+	for (int i = 0; i < count; i++) {
+		const Sphere& sphere = spheres[bvh.primitive_indices[first + i]];
+		prim_bounds[i] = sphere_bounds(sphere);
+		centroids[i] = sphere.center;
+	}
+	int max_depth = BVH_MAX_DEPTH - bvh_node_depth(updater, node_index);
+	BVH local = build_bvh_from_bounds(prim_bounds, centroids, updater.max_leaf_size, updater.intersection_cost, max_depth);
+
+	std::vector<int> entries(bvh.primitive_indices.begin() + first, bvh.primitive_indices.begin() + end);
+	for (int i = 0; i < count; i++) {
+		int prim = entries[local.primitive_indices[i]];
+		bvh.primitive_indices[first + i] = prim;
+		updater.entry_of_primitive[prim] = first + i;
+	}
+	bvh_mark_entries_dirty(updater, first, count);
+
+	// Local node 0 becomes node_index, local pair (1 + 2j, 2 + 2j) goes to an old pair, a free one or the end.
+	std::vector<int> global_index(local.nodes.size());
+	global_index[0] = node_index;
+	for (size_t j = 1; j < local.nodes.size(); j += 2) {
+		int pair;
+		if (!old_pairs.empty()) {
+			pair = old_pairs.back();
+			old_pairs.pop_back();
+		}
+		else if (!updater.free_pairs.empty()) {
+			pair = updater.free_pairs.back();
+			updater.free_pairs.pop_back();
+		}
+		else {
+			pair = (int)bvh.nodes.size();
+			bvh.nodes.resize(bvh.nodes.size() + 2);
+			updater.parents.resize(bvh.nodes.size(), -1);
+			updater.costs.resize(bvh.nodes.size(), 0.0f);
+			updater.built_ratios.resize(bvh.nodes.size(), 0.0f);
+			updater.heights.resize(bvh.nodes.size(), 0);
+		}
+		global_index[j] = pair;
+		global_index[j + 1] = pair + 1;
+	}
+	for (int pair : old_pairs) {
+		// Unreachable from the root from now on. Empty bounds, so the records don't look like part of the tree.
+		for (int i = pair; i < pair + 2; i++) {
+			BVHNode empty = {};
+			empty.bounds_min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+			empty.bounds_max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			bvh.nodes[i] = empty;
+			updater.parents[i] = -1;
+			bvh_mark_node_dirty(updater, i);
+		}
+		updater.free_pairs.push_back(pair);
+	}
+
+	for (size_t j = 0; j < local.nodes.size(); j++) {
+		BVHNode node = local.nodes[j];
+		if (node.primitive_count > 0) {
+			node.left_first += first;
+		}
+		else {
+			node.left_first = global_index[node.left_first];
+		}
+		bvh.nodes[global_index[j]] = node;
+	}
+	for (size_t j = 0; j < local.nodes.size(); j++) {
+		bvh_adopt_node(bvh, updater, global_index[j]);
+	}
+	bvh_init_subtree_costs(bvh, updater, spheres, node_index);
+	updater.rebuilt_primitives += count;
+}
+
+inline bool bvh_node_degraded(const BVH& bvh, const BVHUpdater& updater, int node_index) {
+	float area = bvh_node_box(bvh.nodes[node_index]).area();
+	return updater.costs[node_index] > BVH_REBUILD_THRESHOLD * updater.built_ratios[node_index] * area;
+}
+
+inline bool bvh_is_ancestor(const BVHUpdater& updater, int ancestor, int node_index) {
+	for (int n = updater.parents[node_index]; n != -1; n = updater.parents[n]) {
+		if (n == ancestor) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Updates bvh after the spheres listed in edited changed. Node records may move and the node array may grow,
+// so call set_bvh afterwards and copy the dirty ranges of the updater to the SoA and GPU buffers.
+inline void bvh_update_spheres(BVH& bvh, BVHUpdater& updater, const Sphere* spheres, const int* edited, int edited_count) {
+	updater.dirty_node_first = updater.dirty_entry_first = INT32_MAX;
+	updater.dirty_node_end = updater.dirty_entry_end = 0;
+	updater.rotations = 0;
+	updater.rebuilt_primitives = 0;
+
+	for (int e = 0; e < edited_count; e++) {
+		int prim = edited[e];
+		bvh_mark_entries_dirty(updater, updater.entry_of_primitive[prim], 1);
+		int node_index = updater.leaf_of_primitive[prim];
+		bvh_refit_node(bvh, updater, spheres, node_index);
+		for (node_index = updater.parents[node_index]; node_index != -1; node_index = updater.parents[node_index]) {
+			bvh_refit_node(bvh, updater, spheres, node_index);
+			bvh_rotate_node(bvh, updater, spheres, node_index);
+		}
+	}
+
+	// Once the rotations are done, the highest degraded node above each edited leaf, moved up to a subtree that can be
+	// rebuilt in place. The root always can.
+	std::vector<int> degraded;
+	for (int e = 0; e < edited_count; e++) {
+		int highest = -1;
+		for (int n = updater.parents[updater.leaf_of_primitive[edited[e]]]; n != -1; n = updater.parents[n]) {
+			if (bvh_node_degraded(bvh, updater, n)) {
+				highest = n;
+			}
+		}
+		if (highest == -1 || std::find(degraded.begin(), degraded.end(), highest) != degraded.end()) {
+			continue;
+		}
+		while (!bvh_subtree_contiguous(bvh, highest)) {
+			highest = updater.parents[highest];
+		}
+		degraded.push_back(highest);
+	}
+
+	// Subtrees inside another one that gets rebuilt are left to that one, so the rest don't overlap.
+	std::vector<int> rebuilds;
+	for (size_t i = 0; i < degraded.size(); i++) {
+		bool covered = false;
+		for (size_t j = 0; j < degraded.size() && !covered; j++) {
+			covered = degraded[j] == degraded[i] ? j < i : bvh_is_ancestor(updater, degraded[j], degraded[i]);
+		}
+		if (!covered) {
+			rebuilds.push_back(degraded[i]);
+		}
+	}
+	for (int node_index : rebuilds) {
+		bvh_rebuild_subtree(bvh, updater, spheres, node_index);
+		for (int n = updater.parents[node_index]; n != -1; n = updater.parents[n]) {
+			bvh_refit_node(bvh, updater, spheres, n); // same bounds, lower cost
+		}
+	}
+}
+
+// SAH cost of the whole tree per unit of root area, the expected cost of a ray that hits the root box.
+inline float bvh_sah_cost(const BVH& bvh, int node_index = 0, float intersection_cost = 1.0f) {
+	const BVHNode& node = bvh.nodes[node_index];
+	float area = bvh_node_box(node).area();
+	float cost = node.primitive_count > 0 ? intersection_cost * node.primitive_count * area
+		: BVH_TRAVERSAL_COST * area + bvh_sah_cost(bvh, node.left_first, intersection_cost) * bvh_node_box(bvh.nodes[node.left_first]).area()
+			+ bvh_sah_cost(bvh, node.left_first + 1, intersection_cost) * bvh_node_box(bvh.nodes[node.left_first + 1]).area();
+	return area > 0.0f ? cost / area : 0.0f;
+}
@@ -0,0 +1,555 @@
+#pragma once
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "bvh.h"
+#include "maths.h"
+#include "scene.h"
+#include "simd.h"
+
+// Compressed sphere scenes for the CPU tracer, for scenes too large for the last level cache, where rays wait on
+// memory rather than on arithmetic. The sphere BVH is collapsed into 8-wide nodes of 88 bytes that store their
+// children's boxes as bytes on a grid over the node's own box, the spheres as 16-bit centers and radii on a grid over
+// their leaf's box, and the materials once per distinct material with a 16-bit index per sphere. The boxes decode
+// to at least the boxes of the binary BVH and the spheres to within a step of their grid, which is 1/65535 of their
+// leaf's size, so images differ from the uncompressed tracer only at sphere silhouettes.
+//
+// Every grid step is a power of two, so decoding (origin + q * step) rounds once the same way in the vector kernel
+// and in the builder, which checks the boxes with the values traversal will see. CPU only, the shader traces the
+// binary BVH. The float spheres stay in RaytracerData for next event estimation, which samples lights by index.
+
+#define COMPRESSED_BVH_WIDTH 8
+#define COMPRESSED_BVH_STACK_SIZE 512
+#define COMPRESSED_BVH_MAX_LEAF_SIZE 255 // leaf_count is a byte, larger leaves of the binary BVH are split
+#define COMPRESSED_MAX_MATERIALS 65536 // material indices are 16 bits, scenes with more keep a material per sphere
+
+struct CompressedBVHNode {
+	Vector3 origin; // child box corners are origin + q * 2^exponent, per axis
+	int8_t exponent[3];
+	uint8_t interior_mask; // bit i: child i is a node, otherwise a leaf, or unused with lo_x > hi_x
+	int child_first; // the interior children are nodes child_first, child_first + 1, ... in child order
+	int slot_first; // first sphere slot of the first leaf child, the leaves' spheres follow each other in child order
+	uint8_t leaf_count[COMPRESSED_BVH_WIDTH];
+	int8_t leaf_exponent[COMPRESSED_BVH_WIDTH]; // sphere grid of leaf i: its decoded box min + q * 2^leaf_exponent[i]
+	uint8_t lo_x[COMPRESSED_BVH_WIDTH];
+	uint8_t lo_y[COMPRESSED_BVH_WIDTH];
+	uint8_t lo_z[COMPRESSED_BVH_WIDTH];
+	uint8_t hi_x[COMPRESSED_BVH_WIDTH];
+	uint8_t hi_y[COMPRESSED_BVH_WIDTH];
+	uint8_t hi_z[COMPRESSED_BVH_WIDTH];
+};
+
+static_assert(sizeof(CompressedBVHNode) == 88, "CompressedBVHNode should stay at 88 bytes");
+
+typedef std::vector<uint16_t, AlignedAllocator<uint16_t>> aligned_u16_vector;
+
+struct CompressedBVH {
+	std::vector<CompressedBVHNode> nodes;
+	Vector3 bounds_min; // of the root, which has no parent to store it
+	Vector3 bounds_max;
+	int count = 0;
+	aligned_u16_vector center_x; // per slot, in leaf order; all four are padded by SIMD_WIDTH zeros for the vector leaf test
+	aligned_u16_vector center_y;
+	aligned_u16_vector center_z;
+	aligned_u16_vector radius;
+	std::vector<int> sphere_index; // slot -> index into the sphere array
+	float max_center_error = 0.0f; // largest decoding errors over all spheres, relative to their radius
+	float max_radius_error = 0.0f;
+};
+
+struct CompressedScene {
+	CompressedBVH bvh;
+	std::vector<Material> materials; // distinct materials
+	std::vector<uint16_t> material_indices; // sphere -> materials, empty when the scene has more than COMPRESSED_MAX_MATERIALS
+};
+
+// 2^exponent, built from the bits so traversal doesn't call ldexp per node.
+inline float grid_step(int exponent) {
+	uint32_t bits = (uint32_t)(exponent + 127) << 23;
+	float step;
+	memcpy(&step, &bits, sizeof(step));
+	return step;
+}
+
+inline float grid_value(float origin, int q, float step) {
+	return origin + (float)q * step;
+}
+
+// Smallest exponent whose grid of steps + 1 points from origin reaches past end.
+inline int grid_exponent(float origin, float end, int steps) {
+	int exponent;
+	frexpf((end - origin) / steps, &exponent);
+	exponent = std::max(exponent, -100);
+	while (exponent < 100 && grid_value(origin, steps, grid_step(exponent)) < end) {
+		exponent++;
+	}
+	return exponent;
+}
+
+inline uint8_t quantize_lower(float value, float origin, float step) {
+	int q = std::min(std::max((int)floorf((value - origin) / step), 0), 255);
+	while (q > 0 && grid_value(origin, q, step) > value) {
+		q--;
+	}
+	return (uint8_t)q;
+}
+
+inline uint8_t quantize_upper(float value, float origin, float step) {
+	int q = std::min(std::max((int)ceilf((value - origin) / step), 0), 255);
+	while (q < 255 && grid_value(origin, q, step) < value) {
+		q++;
+	}
+	return (uint8_t)q;
+}
+
+inline int bit_count(unsigned int bits) {
+	int count = 0;
+	for (; bits; bits &= bits - 1) {
+		count++;
+	}
+	return count;
+}
+
+// Decoded box of child i of node, as traversal sees it.
+inline void compressed_child_bounds(const CompressedBVHNode& node, int i, Vector3& bounds_min, Vector3& bounds_max) {
+	float step_x = grid_step(node.exponent[0]), step_y = grid_step(node.exponent[1]), step_z = grid_step(node.exponent[2]);
+	bounds_min = Vector3(grid_value(node.origin.x, node.lo_x[i], step_x), grid_value(node.origin.y, node.lo_y[i], step_y), grid_value(node.origin.z, node.lo_z[i], step_z));
+	bounds_max = Vector3(grid_value(node.origin.x, node.hi_x[i], step_x), grid_value(node.origin.y, node.hi_y[i], step_y), grid_value(node.origin.z, node.hi_z[i], step_z));
+}
+
+// First slot of leaf child i: the leaves before it in child order come first, interior children have no spheres.
+inline int compressed_leaf_first(const CompressedBVHNode& node, int i) {
+	int first = node.slot_first;
+	for (int j = 0; j < i; j++) {
+		first += node.leaf_count[j];
+	}
+	return first;
+}
+
+inline Sphere decode_compressed_sphere(const CompressedBVH& bvh, int slot, const Vector3& leaf_min, float step) {
+	Vector3 center(grid_value(leaf_min.x, bvh.center_x[slot], step), grid_value(leaf_min.y, bvh.center_y[slot], step), grid_value(leaf_min.z, bvh.center_z[slot], step));
+	return Sphere(center, (float)bvh.radius[slot] * step);
+}
+
+// Quantizes the spheres of one leaf child of node onto the grid of its decoded box and appends them at the next slots.
+inline void compress_leaf(CompressedBVH& compressed, CompressedBVHNode& node, int child, const Sphere* spheres, const int* primitives, int count) {
+	Vector3 leaf_min, leaf_max;
+	compressed_child_bounds(node, child, leaf_min, leaf_max);
+	int exponent = std::max(std::max(grid_exponent(leaf_min.x, leaf_max.x, 65535), grid_exponent(leaf_min.y, leaf_max.y, 65535)),
+		grid_exponent(leaf_min.z, leaf_max.z, 65535));
+	float step = grid_step(exponent);
+	node.leaf_count[child] = (uint8_t)count;
+	node.leaf_exponent[child] = (int8_t)exponent;
+
+	auto quantize = [&](float value) {
+		return (uint16_t)std::min(std::max((int)floorf(value / step + 0.5f), 0), 65535);
+	};
+	for (int i = 0; i < count; i++) {
+		const Sphere& sphere = spheres[primitives[i]];
+		uint16_t x = quantize(sphere.center.x - leaf_min.x), y = quantize(sphere.center.y - leaf_min.y), z = quantize(sphere.center.z - leaf_min.z);
+		Vector3 center(grid_value(leaf_min.x, x, step), grid_value(leaf_min.y, y, step), grid_value(leaf_min.z, z, step));
+		// The rounded center moved the sphere by up to half a step, shrink it back into the box traversal culls with.
+		float room = std::min(std::min(std::min(center.x - leaf_min.x, leaf_max.x - center.x), std::min(center.y - leaf_min.y, leaf_max.y - center.y)),
+			std::min(center.z - leaf_min.z, leaf_max.z - center.z));
+		int r = std::min((int)quantize(sphere.radius), std::max((int)floorf(room / step), 0));
+		if (sphere.radius > 0.0f) {
+			r = std::max(r, 1);
+		}
+
+		compressed.center_x.push_back(x);
+		compressed.center_y.push_back(y);
+		compressed.center_z.push_back(z);
+		compressed.radius.push_back((uint16_t)r);
+		compressed.sphere_index.push_back(primitives[i]);
+		if (sphere.radius > 0.0f) {
+			compressed.max_center_error = std::max(compressed.max_center_error, length(center - sphere.center) / sphere.radius);
+			compressed.max_radius_error = std::max(compressed.max_radius_error, std::abs(r * step - sphere.radius) / sphere.radius);
+		}
+	}
+}
+
+// Collapses the binary BVH over spheres into 8-wide nodes: every node takes the binary nodes below it and keeps opening
+// the interior one with the largest surface until it has eight children or only leaves.
+inline CompressedBVH build_compressed_bvh(const Sphere* spheres, int sphere_count, const BVHNode* nodes, int node_count, const int* primitive_indices) {
+	CompressedBVH compressed;
+	compressed.count = sphere_count;
+	if (sphere_count <= 0 || node_count <= 0) {
+		size_t padded = SIMD_WIDTH;
+		compressed.center_x.assign(padded, 0);
+		compressed.center_y.assign(padded, 0);
+		compressed.center_z.assign(padded, 0);
+		compressed.radius.assign(padded, 0);
+		compressed.count = 0;
+		return compressed;
+	}
+
+	// Split leaves too large for a byte count in halves, in primitive order. Children get higher indices as in bvh.
+	std::vector<BVHNode> binary(nodes, nodes + node_count);
+	for (size_t i = 0; i < binary.size(); i++) {
+		BVHNode node = binary[i];
+		if (node.primitive_count <= COMPRESSED_BVH_MAX_LEAF_SIZE) {
+			continue;
+		}
+		int left_index = (int)binary.size();
+		int half = node.primitive_count / 2;
+		BVHNode children[2] = { { Vector3(), node.left_first, Vector3(), half }, { Vector3(), node.left_first + half, Vector3(), node.primitive_count - half } };
+		for (BVHNode& child : children) {
+			AABB box;
+			for (int p = 0; p < child.primitive_count; p++) {
+				box.grow(sphere_bounds(spheres[primitive_indices[child.left_first + p]]));
+			}
+			child.bounds_min = box.min;
+			child.bounds_max = box.max;
+			binary.push_back(child);
+		}
+		binary[i].left_first = left_index;
+		binary[i].primitive_count = 0;
+	}
+
+	compressed.center_x.reserve((size_t)sphere_count + SIMD_WIDTH);
+	compressed.center_y.reserve((size_t)sphere_count + SIMD_WIDTH);
+	compressed.center_z.reserve((size_t)sphere_count + SIMD_WIDTH);
+	compressed.radius.reserve((size_t)sphere_count + SIMD_WIDTH);
+	compressed.sphere_index.reserve(sphere_count);
+	compressed.bounds_min = binary[0].bounds_min;
+	compressed.bounds_max = binary[0].bounds_max;
+
+	// Breadth first, so the interior children of every node can be given consecutive indices when it is written.
+	std::vector<int> sources(1, 0); // binary node each compressed node is built from
+	compressed.nodes.resize(1);
+	for (size_t n = 0; n < compressed.nodes.size(); n++) {
+		const BVHNode& source = binary[sources[n]];
+		std::vector<int> children;
+		if (source.primitive_count > 0) {
+			children.push_back(sources[n]);
+		}
+		else {
+			children.push_back(source.left_first);
+			children.push_back(source.left_first + 1);
+		}
+		while ((int)children.size() < COMPRESSED_BVH_WIDTH) {
+			int widest = -1;
+			float widest_area = -1.0f;
+			for (int i = 0; i < (int)children.size(); i++) {
+				const BVHNode& child = binary[children[i]];
+				float area = bvh_node_box(child).area();
+				if (child.primitive_count == 0 && area > widest_area) {
+					widest = i;
+					widest_area = area;
+				}
+			}
+			if (widest < 0) {
+				break;
+			}
+			int opened = binary[children[widest]].left_first;
+			children[widest] = opened;
+			children.insert(children.begin() + widest + 1, opened + 1);
+		}
+
+		CompressedBVHNode node = {};
+		AABB box = bvh_node_box(source);
+		node.origin = box.min;
+		node.exponent[0] = (int8_t)grid_exponent(box.min.x, box.max.x, 255);
+		node.exponent[1] = (int8_t)grid_exponent(box.min.y, box.max.y, 255);
+		node.exponent[2] = (int8_t)grid_exponent(box.min.z, box.max.z, 255);
+		float step_x = grid_step(node.exponent[0]), step_y = grid_step(node.exponent[1]), step_z = grid_step(node.exponent[2]);
+		memset(node.lo_x, 255, sizeof(node.lo_x)); // unused children
+		for (int i = 0; i < (int)children.size(); i++) {
+			const BVHNode& child = binary[children[i]];
+			node.lo_x[i] = quantize_lower(child.bounds_min.x, node.origin.x, step_x);
+			node.lo_y[i] = quantize_lower(child.bounds_min.y, node.origin.y, step_y);
+			node.lo_z[i] = quantize_lower(child.bounds_min.z, node.origin.z, step_z);
+			node.hi_x[i] = quantize_upper(child.bounds_max.x, node.origin.x, step_x);
+			node.hi_y[i] = quantize_upper(child.bounds_max.y, node.origin.y, step_y);
+			node.hi_z[i] = quantize_upper(child.bounds_max.z, node.origin.z, step_z);
+		}
+
+		node.child_first = (int)compressed.nodes.size();
+		node.slot_first = (int)compressed.sphere_index.size();
+		for (int i = 0; i < (int)children.size(); i++) {
+			const BVHNode& child = binary[children[i]];
+			if (child.primitive_count == 0) {
+				node.interior_mask |= 1 << i;
+				sources.push_back(children[i]);
+				compressed.nodes.push_back(CompressedBVHNode());
+			}
+			else {
+				compress_leaf(compressed, node, i, spheres, primitive_indices + child.left_first, child.primitive_count);
+			}
+		}
+		compressed.nodes[n] = node;
+	}
+
+	for (int i = 0; i < SIMD_WIDTH; i++) {
+		compressed.center_x.push_back(0);
+		compressed.center_y.push_back(0);
+		compressed.center_z.push_back(0);
+		compressed.radius.push_back(0);
+	}
+	return compressed;
+}
+
+struct MaterialBytesLess {
+	bool operator()(const Material& a, const Material& b) const { return memcmp(&a, &b, sizeof(Material)) < 0; }
+};
+
+// One entry per distinct material, in order of first use. Leaves indices empty when there are too many for 16 bits.
+inline void build_material_table(const Material* materials, int count, std::vector<Material>& table, std::vector<uint16_t>& indices) {
+	std::map<Material, int, MaterialBytesLess> index_of;
+	table.clear();
+	indices.resize(count);
+	for (int i = 0; i < count; i++) {
+		auto inserted = index_of.insert(std::make_pair(materials[i], (int)table.size()));
+		if (inserted.second) {
+			if ((int)table.size() == COMPRESSED_MAX_MATERIALS) {
+				table.assign(materials, materials + count);
+				indices.clear();
+				return;
+			}
+			table.push_back(materials[i]);
+		}
+		indices[i] = (uint16_t)inserted.first->second;
+	}
+}
+
+// Compresses the spheres, materials and BVH raytracer_data points at (see set_scene and set_bvh).
+inline void build_compressed_scene(CompressedScene& scene, const RaytracerData& raytracer_data) {
+	const RaytracerProperties& properties = raytracer_data.properties;
+	scene.bvh = build_compressed_bvh(raytracer_data.spheres, properties.sphere_count, raytracer_data.bvh_nodes, properties.bvh_node_count, raytracer_data.bvh_primitive_indices);
+	build_material_table(raytracer_data.materials, properties.sphere_count, scene.materials, scene.material_indices);
+}
+
+// Bytes the tracer reads per sphere: nodes, spheres and slot indices, and materials with their indices. The
+// uncompressed tracer reads the binary BVH with its primitive indices, the SoA copy and the float sphere of the hit.
+inline double uncompressed_bvh_bytes_per_sphere(int node_count, int sphere_count) {
+	return sphere_count > 0 ? (node_count * sizeof(BVHNode) + sphere_count * (sizeof(int) + 4 * sizeof(float) + sizeof(int) + sizeof(Sphere))) / (double)sphere_count : 0.0;
+}
+
+inline double compressed_bvh_bytes_per_sphere(const CompressedBVH& bvh) {
+	return bvh.count > 0 ? (bvh.nodes.size() * sizeof(CompressedBVHNode) + bvh.count * (4 * sizeof(uint16_t) + sizeof(int))) / (double)bvh.count : 0.0;
+}
+
+inline double compressed_material_bytes_per_sphere(const CompressedScene& scene) {
+	int count = scene.bvh.count;
+	return count > 0 ? (scene.materials.size() * sizeof(Material) + scene.material_indices.size() * sizeof(uint16_t)) / (double)count : 0.0;
+}
+
+// Traces raytracer_data's spheres with scene in place of its BVH and SoA copy. Call after set_lights; the float
+// spheres stay in use for the lights.
+inline void set_compressed_scene(RaytracerData& raytracer_data, CompressedScene& scene) {
+	raytracer_data.compressed_bvh = &scene.bvh;
+	if (!scene.material_indices.empty()) {
+		raytracer_data.materials = scene.materials.data();
+		raytracer_data.material_indices = scene.material_indices.data();
+	}
+	raytracer_data.properties.bvh_node_count = 0;
+	raytracer_data.bvh_nodes = nullptr;
+	raytracer_data.bvh_primitive_indices = nullptr;
+	raytracer_data.sphere_soa = nullptr;
+}
+
+// Entry distances of the children of node into entry, returns a bit per child whose box the ray enters in
+// [t_min, t_max].
+inline int compressed_node_hit(const CompressedBVHNode& node, const Vector3& origin, const Vector3& inv_dir, float t_min, float t_max, float* entry) {
+#if SIMD_WIDTH > 1
+	const simd_float node_x = simd_set(node.origin.x), node_y = simd_set(node.origin.y), node_z = simd_set(node.origin.z);
+	const simd_float step_x = simd_set(grid_step(node.exponent[0])), step_y = simd_set(grid_step(node.exponent[1])), step_z = simd_set(grid_step(node.exponent[2]));
+	const simd_float origin_x = simd_set(origin.x), origin_y = simd_set(origin.y), origin_z = simd_set(origin.z);
+	const simd_float inv_x = simd_set(inv_dir.x), inv_y = simd_set(inv_dir.y), inv_z = simd_set(inv_dir.z);
+	const simd_float t_min_v = simd_set(t_min), t_max_v = simd_set(t_max);
+
+	int bits = 0;
+	for (int base = 0; base < COMPRESSED_BVH_WIDTH; base += SIMD_WIDTH) {
+		simd_float q_lo_x = simd_load_u8(node.lo_x + base), q_hi_x = simd_load_u8(node.hi_x + base);
+		simd_float tx0 = simd_mul(simd_sub(simd_add(node_x, simd_mul(q_lo_x, step_x)), origin_x), inv_x);
+		simd_float tx1 = simd_mul(simd_sub(simd_add(node_x, simd_mul(q_hi_x, step_x)), origin_x), inv_x);
+		simd_float ty0 = simd_mul(simd_sub(simd_add(node_y, simd_mul(simd_load_u8(node.lo_y + base), step_y)), origin_y), inv_y);
+		simd_float ty1 = simd_mul(simd_sub(simd_add(node_y, simd_mul(simd_load_u8(node.hi_y + base), step_y)), origin_y), inv_y);
+		simd_float tz0 = simd_mul(simd_sub(simd_add(node_z, simd_mul(simd_load_u8(node.lo_z + base), step_z)), origin_z), inv_z);
+		simd_float tz1 = simd_mul(simd_sub(simd_add(node_z, simd_mul(simd_load_u8(node.hi_z + base), step_z)), origin_z), inv_z);
+
+		simd_float enter = simd_max(simd_max(simd_min(tx0, tx1), simd_min(ty0, ty1)), simd_max(simd_min(tz0, tz1), t_min_v));
+		simd_float exit = simd_min(simd_min(simd_max(tx0, tx1), simd_max(ty0, ty1)), simd_min(simd_max(tz0, tz1), t_max_v));
+		int missed = simd_mask_bits(simd_greater(enter, exit)) | simd_mask_bits(simd_less(q_hi_x, q_lo_x));
+		simd_store(entry + base, enter);
+		bits |= (~missed & ((1 << SIMD_WIDTH) - 1)) << base;
+	}
+	return bits;
+#else
+	int bits = 0;
+	for (int i = 0; i < COMPRESSED_BVH_WIDTH; i++) {
+		Vector3 bounds_min, bounds_max;
+		compressed_child_bounds(node, i, bounds_min, bounds_max);
+		entry[i] = aabb_hit(bounds_min, bounds_max, origin, inv_dir, t_min, t_max);
+		if (node.lo_x[i] <= node.hi_x[i] && entry[i] != FLT_MAX) {
+			bits |= 1 << i;
+		}
+	}
+	return bits;
+#endif
+}
+
+// soa_closest_hit for the slots [first, first + count) of one leaf, decoding the spheres on the leaf's grid.
+inline int compressed_leaf_closest_hit(const CompressedBVH& bvh, int first, int count, const Vector3& leaf_min, float step, const Ray& ray, float t_min, float& t_max) {
+#if SIMD_WIDTH > 1
+	const simd_float origin_x = simd_set(ray.origin_point.x);
+	const simd_float origin_y = simd_set(ray.origin_point.y);
+	const simd_float origin_z = simd_set(ray.origin_point.z);
+	const simd_float dir_x = simd_set(ray.direction.x);
+	const simd_float dir_y = simd_set(ray.direction.y);
+	const simd_float dir_z = simd_set(ray.direction.z);
+	const simd_float leaf_x = simd_set(leaf_min.x);
+	const simd_float leaf_y = simd_set(leaf_min.y);
+	const simd_float leaf_z = simd_set(leaf_min.z);
+	const simd_float step_v = simd_set(step);
+	const float a_scalar = dot(ray.direction, ray.direction);
+	const simd_float a = simd_set(a_scalar);
+	const simd_float inv_a = simd_set(1.0f / a_scalar);
+	const simd_float t_min_v = simd_set(t_min);
+	const simd_float zero = simd_set(0.0f);
+	const simd_float no_hit = simd_set(FLT_MAX);
+	const simd_float lane_index = simd_lane_index();
+
+	int selected_slot = -1;
+	int end = first + count;
+	for (int base = first; base < end; base += SIMD_WIDTH) {
+		simd_float diff_x = simd_sub(origin_x, simd_add(leaf_x, simd_mul(simd_load_u16(&bvh.center_x[base]), step_v)));
+		simd_float diff_y = simd_sub(origin_y, simd_add(leaf_y, simd_mul(simd_load_u16(&bvh.center_y[base]), step_v)));
+		simd_float diff_z = simd_sub(origin_z, simd_add(leaf_z, simd_mul(simd_load_u16(&bvh.center_z[base]), step_v)));
+		simd_float radius = simd_mul(simd_load_u16(&bvh.radius[base]), step_v);
+
+		simd_float b = simd_add(simd_add(simd_mul(diff_x, dir_x), simd_mul(diff_y, dir_y)), simd_mul(diff_z, dir_z));
+		simd_float c = simd_sub(simd_add(simd_add(simd_mul(diff_x, diff_x), simd_mul(diff_y, diff_y)), simd_mul(diff_z, diff_z)), simd_mul(radius, radius));
+		simd_float discriminant = simd_sub(simd_mul(b, b), simd_mul(a, c));
+		simd_float discriminant_sqrt = simd_sqrt(simd_max(discriminant, zero));
+
+		simd_float neg_b = simd_sub(zero, b);
+		simd_float first_root = simd_mul(simd_sub(neg_b, discriminant_sqrt), inv_a);
+		simd_float second_root = simd_mul(simd_add(neg_b, discriminant_sqrt), inv_a);
+
+		simd_float t_max_v = simd_set(t_max);
+		simd_float first_valid = simd_and(simd_greater(first_root, t_min_v), simd_less(first_root, t_max_v));
+		simd_float second_valid = simd_and(simd_greater(second_root, t_min_v), simd_less(second_root, t_max_v));
+		simd_float valid = simd_and(simd_greater(discriminant, zero), simd_or(first_valid, second_valid));
+		valid = simd_and(valid, simd_less(lane_index, simd_set((float)(end - base))));
+
+		int valid_bits = simd_mask_bits(valid);
+		if (valid_bits == 0) {
+			continue;
+		}
+
+		simd_float t = simd_select(valid, simd_select(first_valid, first_root, second_root), no_hit);
+		float closest = simd_horizontal_min(t);
+		int closest_bits = simd_mask_bits(simd_equal(t, simd_set(closest))) & valid_bits;
+		selected_slot = base + lowest_set_bit(closest_bits);
+		t_max = closest;
+	}
+
+	return selected_slot;
+#else
+	float a = dot(ray.direction, ray.direction);
+	int selected_slot = -1;
+	for (int slot = first; slot < first + count; slot++) {
+		Sphere sphere = decode_compressed_sphere(bvh, slot, leaf_min, step);
+		Vector3 diff = ray.origin_point - sphere.center;
+		float b = dot(diff, ray.direction);
+		float c = dot(diff, diff) - sphere.radius * sphere.radius;
+		float discriminant = b * b - a * c;
+		if (discriminant > 0) {
+			float discriminant_sqrt = std::sqrt(discriminant);
+			float first_root = (-b - discriminant_sqrt) / a;
+			float second_root = (-b + discriminant_sqrt) / a;
+			float t = (first_root > t_min && first_root < t_max) ? first_root : second_root;
+			if (t > t_min && t < t_max) {
+				selected_slot = slot;
+				t_max = t;
+			}
+		}
+	}
+	return selected_slot;
+#endif
+}
+
+// Nearest child first, like bvh_traverse. Leaves go on the stack with the nodes, as ~(node * 8 + child), so they
+// are tested in order of distance too. Returns the closest slot hit in (t_min, t_max), lowers t_max to its
+// distance and decodes its sphere into sphere, or returns -1.
+inline int compressed_closest_hit(const CompressedBVH& bvh, const Ray& ray, float t_min, float& t_max, Sphere& sphere, int& visited, int& tests) {
+	visited = 0;
+	tests = 0;
+	if (bvh.nodes.empty()) {
+		return -1;
+	}
+	Vector3 inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+	visited = 1;
+	if (aabb_hit(bvh.bounds_min, bvh.bounds_max, ray.origin_point, inv_dir, t_min, t_max) == FLT_MAX) {
+		return -1;
+	}
+
+	int stack[COMPRESSED_BVH_STACK_SIZE];
+	float stack_t[COMPRESSED_BVH_STACK_SIZE];
+	int stack_size = 1;
+	stack[0] = 0;
+	stack_t[0] = t_min;
+	visited = 0;
+
+	int selected_slot = -1;
+	Vector3 selected_min;
+	float selected_step = 0.0f;
+	while (stack_size > 0) {
+		stack_size--;
+		int entry = stack[stack_size];
+		if (stack_t[stack_size] >= t_max) {
+			continue;
+		}
+
+		if (entry < 0) {
+			int node_index = ~entry / COMPRESSED_BVH_WIDTH, child = ~entry % COMPRESSED_BVH_WIDTH;
+			const CompressedBVHNode& node = bvh.nodes[node_index];
+			Vector3 leaf_min, leaf_max;
+			compressed_child_bounds(node, child, leaf_min, leaf_max);
+			float step = grid_step(node.leaf_exponent[child]);
+			tests += node.leaf_count[child];
+			int slot = compressed_leaf_closest_hit(bvh, compressed_leaf_first(node, child), node.leaf_count[child], leaf_min, step, ray, t_min, t_max);
+			if (slot != -1) {
+				selected_slot = slot;
+				selected_min = leaf_min;
+				selected_step = step;
+			}
+			continue;
+		}
+
+		const CompressedBVHNode& node = bvh.nodes[entry];
+		visited++;
+		float entry_t[COMPRESSED_BVH_WIDTH];
+		int bits = compressed_node_hit(node, ray.origin_point, inv_dir, t_min, t_max, entry_t);
+
+		// Hit children sorted far to near, then pushed in that order so the nearest is popped next.
+		int order[COMPRESSED_BVH_WIDTH];
+		int hit_count = 0;
+		for (; bits; bits &= bits - 1) {
+			int child = lowest_set_bit(bits);
+			int i = hit_count++;
+			for (; i > 0 && entry_t[order[i - 1]] < entry_t[child]; i--) {
+				order[i] = order[i - 1];
+			}
+			order[i] = child;
+		}
+		assert(stack_size + hit_count <= COMPRESSED_BVH_STACK_SIZE);
+		for (int i = 0; i < hit_count; i++) {
+			int child = order[i];
+			bool interior = (node.interior_mask >> child) & 1;
+			stack[stack_size] = interior ? node.child_first + bit_count(node.interior_mask & ((1u << child) - 1)) : ~(entry * COMPRESSED_BVH_WIDTH + child);
+			stack_t[stack_size++] = entry_t[child];
+		}
+	}
+
+	if (selected_slot != -1) {
+		sphere = decode_compressed_sphere(bvh, selected_slot, selected_min, selected_step);
+	}
+	return selected_slot;
+}
@@ -0,0 +1,1108 @@
+#pragma once
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "compressed_bvh.h"
+#include "frame_stats.h"
+#include "mesh.h"
+#include "sampler.h"
+#include "scene.h"
+#include "tile_scheduler.h"
+
+// CPU port of raytracer_compute.hlsl. Every function below mirrors the shader function
+// with the same name, so a change to one side should be made on the other as well.
+// The CPU side also feeds the frame_stats.h counters, which have no shader equivalent.
+
+#define CPU_TILE_SIZE 16
+#define CPU_PACKET_SIZE 8 // primary ray packets cover CPU_PACKET_SIZE x CPU_PACKET_SIZE pixels, at most BVH_PACKET_MAX_RAYS
+#define ADAPTIVE_MIN_PASSES 2 // before a pixel's variance is trusted
+#define ADAPTIVE_LUMINANCE_FLOOR 0.1f // errors in darker pixels are measured relative to this
+#define AOV_MISS_DEPTH 1.0e7f // depth AOV of camera rays that hit nothing, their t_max
+#define AOV_MIRROR_FUZZINESS 0.1f // metal below this is looked through for the AOVs, see add_first_hit_aov
+#define AOV_MAX_MIRROR_BOUNCES 4
+
+// Scene features the tracing kernels are specialized on, see scene_kernel_features. A kernel compiled without one
+// leaves its branches out of the path loop; KERNEL_ALL_FEATURES checks everything at run time like the shader does.
+#define KERNEL_EMISSIVE 0x1
+#define KERNEL_LAMBERTIAN 0x2
+#define KERNEL_METAL 0x4
+#define KERNEL_MATERIALS (KERNEL_EMISSIVE | KERNEL_LAMBERTIAN | KERNEL_METAL)
+#define KERNEL_DEPTH_OF_FIELD 0x8 // lens_radius > 0
+#define KERNEL_LIGHT_SAMPLING 0x10 // light_sampling on and at least one light
+#define KERNEL_ROULETTE 0x20 // roulette_depth < max_depth
+#define KERNEL_ALL_FEATURES 0x3f
+#define KERNEL_VARIANT_COUNT (KERNEL_ALL_FEATURES + 1)
+
+struct Hit {
+	Vector3 pos;
+	Vector3 normal;
+	float t;
+};
+
+// Running luminance statistics of one pixel's samples (Welford), for adaptive sampling.
+struct PixelVariance {
+	float mean;
+	float m2; // sum of squared differences from the mean
+	int samples;
+};
+
+// First hit features of a pixel for the denoiser, averaged over the samples of a pass. CPU only.
+struct PixelAov {
+	Vector3 albedo; // material albedo, the sky color for misses
+	Vector3 normal;
+	float depth = 0.0f; // distance along the camera ray
+};
+
+struct CpuRenderer {
+	int width;
+	int height;
+	int thread_count;
+	std::vector<Vector4> pixels; // float4 accumulation buffer, row 0 is the top of the image
+	float adaptive_threshold; // relative standard error a pixel stops being sampled at, 0 samples every pixel every pass
+	std::vector<PixelVariance> variance; // per pixel, only used with adaptive_threshold > 0
+	bool wavefront; // trace tiles with trace_tile_wavefront instead of pixel by pixel, not with adaptive sampling; slower, for comparisons only
+	bool packets; // trace camera rays in packets with trace_pixel_block when packets_usable, same image either way
+	bool write_aovs; // fill aovs in the first pass of every frame, later passes see the same first hits
+	std::vector<PixelAov> aovs; // per pixel, see denoiser.h
+	bool specialize; // trace with the kernel compiled for the scene's features, see select_cpu_kernel, same image either way
+	int material_features; // KERNEL_MATERIALS bits of the scene, gathered by the first pass of every frame
+	int kernel_features; // of the kernel the last pass started with
+	bool reproject; // keep history across camera moves with cpu_reproject, not with adaptive sampling
+	std::vector<float> history; // passes accumulated per pixel, only kept with reproject
+	bool refresh_aovs; // the next pass rewrites aovs, set when cpu_reproject moved the camera mid-frame
+	std::vector<Vector4> previous_pixels; // scratch buffers of cpu_reproject
+	std::vector<float> previous_history;
+	std::vector<PixelAov> previous_aovs;
+	std::unique_ptr<TileScheduler> scheduler;
+	bool pass_pending; // a pass was started and hasn't been collected by cpu_raytracer_poll yet
+	FrameStats stats; // of the last pass collected by cpu_raytracer_poll
+};
+
+// Whole-image buffers a pass writes to. aovs and history are null when they aren't kept.
+struct PassTarget {
+	Vector4* pixels;
+	PixelAov* aovs;
+	float* history;
+};
+
+// The random helpers take a plain wang_hash state or a PathSampler, see sampler.h. Paths always use a PathSampler.
+template <typename Random>
+inline float random_float_between(Random& state, float min, float max) {
+	return min + (max - min) * random_float(state);
+}
+
+template <typename Random>
+inline Vector3 random_in_unit_disk(Random& state) {
+	float a = random_float_between(state, 0, 2 * PI);
+	float r = std::sqrt(random_float(state));
+	return Vector3(std::cos(a) * r, std::sin(a) * r, 0);
+}
+
+template <typename Random>
+inline Vector3 random_in_unit_sphere(Random& state) {
+	float z = random_float_between(state, -1.0f, 1.0f);
+	float t = random_float_between(state, 0.0f, 2.0f * PI);
+	float r = std::sqrt(std::fmax(0.0f, 1.0f - z * z));
+	float x = r * std::cos(t);
+	float y = r * std::sin(t);
+	return Vector3(x, y, z) * std::cbrt(random_float(state));
+}
+
+template <typename Random>
+inline Vector3 random_unit_vector(Random& state) {
+	float a = random_float_between(state, 0.0f, 2.0f * PI);
+	float z = random_float_between(state, -1.0f, 1.0f);
+	float r = std::sqrt(1.0f - z * z);
+	return Vector3(r * std::cos(a), r * std::sin(a), z);
+}
+
+template <int Features = KERNEL_ALL_FEATURES>
+inline Ray get_camera_ray(PathSampler& state, const Camera& cam, float u, float v) {
+	sampler_seek(state, SAMPLE_DIM_LENS);
+	if (!(Features & KERNEL_DEPTH_OF_FIELD)) {
+		// Skips the two random numbers of random_in_unit_disk, so every kernel traces the same paths.
+		sampler_skip(state, 2);
+		return Ray(cam.origin, cam.lower_left_corner + cam.horizontal * u + cam.vertical * v - cam.origin);
+	}
+	Vector3 rd = random_in_unit_disk(state) * cam.lens_radius;
+	Vector3 offset = cam.u * rd.x + cam.v * rd.y;
+
+	return Ray(cam.origin + offset, cam.lower_left_corner + cam.horizontal * u + cam.vertical * v - cam.origin - offset);
+}
+
+inline bool lambertian_scatter(PathSampler& state, const Material& material, const Ray& incoming_ray, const Hit& hit, Vector3& attenuation, Ray& outgoing_ray) {
+	outgoing_ray = Ray(hit.pos, hit.normal + random_unit_vector(state));
+	attenuation = material.albedo;
+
+	return true;
+}
+
+inline bool metal_scatter(PathSampler& state, const Material& material, const Ray& incoming_ray, const Hit& hit, Vector3& attenuation, Ray& outgoing_ray) {
+	Vector3 reflected_vec = reflect(unit_vector(incoming_ray.direction), hit.normal);
+
+	outgoing_ray = Ray(hit.pos, reflected_vec + random_in_unit_sphere(state) * material.fuzziness);
+	attenuation = material.albedo;
+
+	return dot(outgoing_ray.direction, hit.normal) > 0;
+}
+
+// Whether material is of type, one of 0, 1 or 2 like Material::type. Known at compile time when the scene has no
+// materials of that type, or only of that type.
+template <int Features, int Type>
+inline bool kernel_material_is(const Material& material) {
+	const int feature = Type == 0 ? KERNEL_EMISSIVE : Type == 1 ? KERNEL_LAMBERTIAN : KERNEL_METAL;
+	if (!(Features & feature)) {
+		return false;
+	}
+	if (!(Features & KERNEL_MATERIALS & ~feature)) {
+		return true;
+	}
+	return material.type == Type;
+}
+
+template <int Features = KERNEL_ALL_FEATURES>
+inline Vector3 emit(const Material& material) {
+	if (kernel_material_is<Features, 0>(material)) {
+		return material.albedo;
+	}
+
+	return Vector3(0, 0, 0);
+}
+
+// Fills hit for the ray meeting sphere at t. The SIMD kernels only find t, this completes their closest hit.
+inline void set_sphere_hit(const Sphere& sphere, const Ray& ray, float t, Hit& hit) {
+	hit.t = t;
+	hit.pos = ray_at(ray, t);
+	Vector3 outward_normal = (hit.pos - sphere.center) / sphere.radius;
+	hit.normal = dot(ray.direction, outward_normal) < 0 ? outward_normal : -outward_normal;
+}
+
+inline bool sphere_hit(const Sphere& sphere, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	Vector3 diff = ray.origin_point - sphere.center;
+
+	float a = dot(ray.direction, ray.direction);
+	float b = dot(diff, ray.direction);
+	float c = dot(diff, diff) - sphere.radius * sphere.radius;
+
+	float discriminant = b * b - a * c;
+
+	if (discriminant > 0) {
+		float discriminant_sqrt = std::sqrt(discriminant);
+		float first_root = (-b - discriminant_sqrt) / a;
+
+		if (first_root > t_min && first_root < t_max) {
+			set_sphere_hit(sphere, ray, first_root, hit);
+			return true;
+		}
+
+		float second_root = (-b + discriminant_sqrt) / a;
+		if (second_root > t_min && second_root < t_max) {
+			set_sphere_hit(sphere, ray, second_root, hit);
+			return true;
+		}
+	}
+	return false;
+}
+
+template <int Features = KERNEL_ALL_FEATURES>
+inline bool scatter(PathSampler& state, const Material& material, const Ray& incoming_ray, const Hit& hit, Vector3& attenuation, Ray& outgoing_ray) {
+	if (kernel_material_is<Features, 1>(material)) {
+		return lambertian_scatter(state, material, incoming_ray, hit, attenuation, outgoing_ray);
+	}
+	else if (kernel_material_is<Features, 2>(material)) {
+		return metal_scatter(state, material, incoming_ray, hit, attenuation, outgoing_ray);
+	}
+
+	return false;
+}
+
+inline int bvh_check_object_hit(const RaytracerData& data, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	int selected_index = -1;
+	float closest_hit_distance = t_max;
+	int tests = 0;
+
+	int visited = bvh_traverse(data.bvh_nodes, data.properties.bvh_node_count, data.properties.sphere_count, ray, t_min, closest_hit_distance, [&](int first, int count, float& closest) {
+		tests += count;
+		if (data.sphere_soa) {
+			int slot = soa_closest_hit(*data.sphere_soa, first, count, ray, t_min, closest);
+			if (slot != -1) {
+				selected_index = data.sphere_soa->sphere_index[slot];
+			}
+		}
+		else {
+			for (int i = 0; i < count; i++) {
+				int prim = data.bvh_primitive_indices[first + i];
+				if (prim >= 0 && prim < data.properties.sphere_count && sphere_hit(data.spheres[prim], ray, t_min, closest, hit)) {
+					selected_index = prim;
+					closest = hit.t;
+				}
+			}
+		}
+	});
+
+	if (data.sphere_soa && selected_index != -1) {
+		set_sphere_hit(data.spheres[selected_index], ray, closest_hit_distance, hit);
+	}
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+	return selected_index;
+}
+
+// CPU only, see compressed_bvh.h. The hit is completed with the decoded sphere, which the image then shows.
+inline int compressed_check_object_hit(const RaytracerData& data, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	const CompressedBVH& bvh = *data.compressed_bvh;
+	float closest_hit_distance = t_max;
+	Sphere sphere(Vector3(), 0.0f);
+	int visited, tests;
+	int slot = compressed_closest_hit(bvh, ray, t_min, closest_hit_distance, sphere, visited, tests);
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+	if (slot == -1) {
+		return -1;
+	}
+	set_sphere_hit(sphere, ray, closest_hit_distance, hit);
+	return bvh.sphere_index[slot];
+}
+
+inline int check_sphere_hit(const RaytracerData& data, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	if (data.compressed_bvh) {
+		return compressed_check_object_hit(data, ray, t_min, t_max, hit);
+	}
+	if (data.properties.bvh_node_count > 0) {
+		return bvh_check_object_hit(data, ray, t_min, t_max, hit);
+	}
+
+	thread_counters().intersection_tests += data.properties.sphere_count;
+
+	if (data.sphere_soa) {
+		float closest_hit_distance = t_max;
+		int slot = soa_closest_hit(*data.sphere_soa, 0, data.sphere_soa->count, ray, t_min, closest_hit_distance);
+		if (slot == -1) {
+			return -1;
+		}
+		int selected_index = data.sphere_soa->sphere_index[slot];
+		set_sphere_hit(data.spheres[selected_index], ray, closest_hit_distance, hit);
+		return selected_index;
+	}
+
+	Hit closest_hit;
+	int selected_index = -1;
+	float closest_hit_distance = t_max;
+
+	for (int i = 0; i < data.properties.sphere_count; i++) {
+		if (sphere_hit(data.spheres[i], ray, t_min, closest_hit_distance, closest_hit)) {
+			selected_index = i;
+			closest_hit_distance = closest_hit.t;
+		}
+	}
+
+	if (selected_index != -1) {
+		hit = closest_hit;
+	}
+
+	return selected_index;
+}
+
+// CPU only, the compute shader has no meshes yet. Rays are moved into each instance's mesh space instead of
+// transforming the triangles.
+inline int mesh_instance_hit(const RaytracerData& data, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	int selected_index = -1;
+	int selected_triangle = -1;
+	float closest_hit_distance = t_max;
+
+	for (int i = 0; i < data.mesh_instance_count; i++) {
+		const MeshInstance& instance = data.mesh_instances[i];
+		float inv_scale = 1.0f / instance.scale;
+		Ray local_ray((ray.origin_point - instance.offset) * inv_scale, ray.direction * inv_scale);
+		int triangle = mesh_closest_hit(data.meshes[instance.mesh], local_ray, t_min, closest_hit_distance);
+		if (triangle != -1) {
+			selected_index = i;
+			selected_triangle = triangle;
+		}
+	}
+
+	if (selected_index != -1) {
+		const Triangle& tri = data.meshes[data.mesh_instances[selected_index].mesh].triangles[selected_triangle];
+		Vector3 outward_normal = unit_vector(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+		hit.t = closest_hit_distance;
+		hit.pos = ray_at(ray, hit.t);
+		hit.normal = dot(ray.direction, outward_normal) < 0 ? outward_normal : -outward_normal;
+	}
+
+	return selected_index;
+}
+
+inline int check_object_hit(const RaytracerData& data, const Ray& ray, float t_min, float t_max, Hit& hit) {
+	int selected_index = check_sphere_hit(data, ray, t_min, t_max, hit);
+	if (data.mesh_instance_count > 0) {
+		int instance = mesh_instance_hit(data, ray, t_min, selected_index != -1 ? hit.t : t_max, hit);
+		if (instance != -1) {
+			selected_index = data.properties.sphere_count + instance;
+		}
+	}
+	return selected_index;
+}
+
+// check_object_hit for rays that all start at rays[0].origin_point: objects[i] and hits[i] are what it returns for
+// rays[i]. Spheres are found with one packet traversal of the BVH, meshes ray by ray. Needs a BVH.
+inline void packet_check_object_hit(const RaytracerData& data, const Ray* rays, int count, float t_min, float t_max, int* objects, Hit* hits) {
+	float closest[BVH_PACKET_MAX_RAYS];
+	for (int i = 0; i < count; i++) {
+		objects[i] = -1;
+		closest[i] = t_max;
+	}
+	int tests = 0;
+
+	int visited = bvh_traverse_packet(data.bvh_nodes, data.properties.bvh_node_count, data.properties.sphere_count, rays, count, t_min, closest, [&](int first, int prim_count, int ray, float& ray_closest) {
+		tests += prim_count;
+		if (data.sphere_soa) {
+			int slot = soa_closest_hit(*data.sphere_soa, first, prim_count, rays[ray], t_min, ray_closest);
+			if (slot != -1) {
+				objects[ray] = data.sphere_soa->sphere_index[slot];
+			}
+		}
+		else {
+			for (int i = 0; i < prim_count; i++) {
+				int prim = data.bvh_primitive_indices[first + i];
+				if (prim >= 0 && prim < data.properties.sphere_count && sphere_hit(data.spheres[prim], rays[ray], t_min, ray_closest, hits[ray])) {
+					objects[ray] = prim;
+					ray_closest = hits[ray].t;
+				}
+			}
+		}
+	});
+
+	for (int i = 0; i < count; i++) {
+		if (data.sphere_soa && objects[i] != -1) {
+			set_sphere_hit(data.spheres[objects[i]], rays[i], closest[i], hits[i]);
+		}
+		if (data.mesh_instance_count > 0) {
+			int instance = mesh_instance_hit(data, rays[i], t_min, objects[i] != -1 ? hits[i].t : t_max, hits[i]);
+			if (instance != -1) {
+				objects[i] = data.properties.sphere_count + instance;
+			}
+		}
+	}
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+}
+
+// check_object_hit for the rays rays[ray_indices[i]], which don't need to share anything: objects and hits are filled
+// at the same indices, closest is scratch indexed the same way. Spheres are found with one bvh_traverse_stream, whose
+// leaves test all the rays that reach them with soa_closest_hits, meshes ray by ray. Needs a BVH.
+inline void stream_check_object_hit(const RaytracerData& data, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float t_max, float* closest,
+	int* objects, Hit* hits, BVHStream& stream) {
+	for (int i = 0; i < ray_count; i++) {
+		objects[ray_indices[i]] = -1;
+		closest[ray_indices[i]] = t_max;
+	}
+	int tests = 0;
+
+	// With SoA leaves objects holds slots until the traversal is done.
+	int visited = bvh_traverse_stream(data.bvh_nodes, data.properties.bvh_node_count, data.properties.sphere_count, rays, ray_indices, ray_count, t_min, closest, stream, [&](int first, int count, const int* leaf_rays, int leaf_ray_count) {
+		tests += count * leaf_ray_count;
+		if (data.sphere_soa) {
+			soa_closest_hits(*data.sphere_soa, first, count, rays, leaf_rays, leaf_ray_count, t_min, closest, objects);
+			return;
+		}
+		for (int j = 0; j < leaf_ray_count; j++) {
+			int ray = leaf_rays[j];
+			for (int i = 0; i < count; i++) {
+				int prim = data.bvh_primitive_indices[first + i];
+				if (prim >= 0 && prim < data.properties.sphere_count && sphere_hit(data.spheres[prim], rays[ray], t_min, closest[ray], hits[ray])) {
+					objects[ray] = prim;
+					closest[ray] = hits[ray].t;
+				}
+			}
+		}
+	});
+
+	for (int i = 0; i < ray_count; i++) {
+		int ray = ray_indices[i];
+		if (data.sphere_soa && objects[ray] != -1) {
+			objects[ray] = data.sphere_soa->sphere_index[objects[ray]];
+			if (objects[ray] != -1) {
+				set_sphere_hit(data.spheres[objects[ray]], rays[ray], closest[ray], hits[ray]);
+			}
+		}
+		if (data.mesh_instance_count > 0) {
+			int instance = mesh_instance_hit(data, rays[ray], t_min, objects[ray] != -1 ? hits[ray].t : t_max, hits[ray]);
+			if (instance != -1) {
+				objects[ray] = data.properties.sphere_count + instance;
+			}
+		}
+	}
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+}
+
+// Camera rays only share an origin without depth of field.
+inline bool packets_usable(const RaytracerData& data) {
+	return data.properties.camera.lens_radius == 0.0f && data.properties.bvh_node_count > 0;
+}
+
+inline float power_heuristic(float pdf, float other_pdf) {
+	return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Solid angle density of sample_sphere_light for a direction that hits the sphere. 0 from inside the sphere.
+inline float sphere_light_pdf(const Sphere& sphere, const Vector3& from) {
+	Vector3 to_center = sphere.center - from;
+	float sin2_theta_max = sphere.radius * sphere.radius / dot(to_center, to_center);
+	if (sin2_theta_max >= 1.0f) {
+		return 0.0f;
+	}
+	float one_minus_cos_theta_max = sin2_theta_max / (1.0f + std::sqrt(1.0f - sin2_theta_max)); // stable for small, far lights
+	return 1.0f / (2.0f * PI * one_minus_cos_theta_max);
+}
+
+// Picks a direction uniformly inside the cone the sphere subtends from a point. Returns false from inside the sphere.
+inline bool sample_sphere_light(PathSampler& state, const Sphere& sphere, const Vector3& from, Vector3& direction, float& pdf) {
+	float u1 = random_float(state);
+	float u2 = random_float(state);
+	Vector3 to_center = sphere.center - from;
+	float distance2 = dot(to_center, to_center);
+	float sin2_theta_max = sphere.radius * sphere.radius / distance2;
+	if (sin2_theta_max >= 1.0f) {
+		return false;
+	}
+	float one_minus_cos_theta_max = sin2_theta_max / (1.0f + std::sqrt(1.0f - sin2_theta_max));
+
+	float one_minus_cos_theta = u1 * one_minus_cos_theta_max;
+	float cos_theta = 1.0f - one_minus_cos_theta;
+	float sin_theta = std::sqrt(std::fmax(0.0f, one_minus_cos_theta * (2.0f - one_minus_cos_theta)));
+	float phi = 2.0f * PI * u2;
+
+	// Orthonormal basis around the axis (Duff et al. 2017).
+	Vector3 w = to_center / std::sqrt(distance2);
+	float sign = std::copysign(1.0f, w.z);
+	float a = -1.0f / (sign + w.z);
+	float b = w.x * w.y * a;
+	Vector3 u(1.0f + sign * w.x * w.x * a, sign * b, -sign * w.x);
+	Vector3 v(b, sign + w.y * w.y * a, -w.y);
+
+	direction = u * (std::cos(phi) * sin_theta) + v * (std::sin(phi) * sin_theta) + w * cos_theta;
+	pdf = 1.0f / (2.0f * PI * one_minus_cos_theta_max);
+	return true;
+}
+
+// Density of lambertian_scatter's direction, cosine weighted around the normal.
+inline float lambertian_pdf(const Hit& hit, const Vector3& direction) {
+	float length_squared = dot(direction, direction);
+	return length_squared > 0.0f ? std::fmax(0.0f, dot(direction, hit.normal)) / (std::sqrt(length_squared) * PI) : 0.0f;
+}
+
+// A light sample before its shadow ray is traced: contribution is what it adds if ray reaches light before t_max.
+struct LightSample {
+	Ray ray;
+	float t_max;
+	int light;
+	Vector3 contribution;
+};
+
+// First half of sample_direct_light, so the wavefront tracer can trace the shadow rays as a batch.
+inline bool sample_light(PathSampler& state, const RaytracerData& data, const Hit& hit, const Material& material, LightSample& sample) {
+	int light_count = data.properties.light_count;
+	int light = data.lights[std::min((int)(random_float(state) * light_count), light_count - 1)];
+	const Sphere& sphere = data.spheres[light];
+
+	Vector3 direction;
+	float cone_pdf;
+	if (!sample_sphere_light(state, sphere, hit.pos, direction, cone_pdf)) {
+		return false;
+	}
+	float cosine = dot(direction, hit.normal);
+	if (cosine <= 0.0f) {
+		return false;
+	}
+
+	float light_pdf = cone_pdf / light_count;
+	float weight = power_heuristic(light_pdf, cosine / PI);
+	sample.ray = Ray(hit.pos, direction);
+	sample.t_max = length(sphere.center - hit.pos); // the visible side of the light is closer than its center
+	sample.light = light;
+	sample.contribution = material.albedo * emit(object_material(data, light)) * (cosine / PI / light_pdf * weight);
+	return true;
+}
+
+inline bool light_sample_visible(const RaytracerData& data, const LightSample& sample) {
+	thread_counters().rays++;
+	Hit shadow_hit;
+	return check_object_hit(data, sample.ray, 0.001f, sample.t_max, shadow_hit) == sample.light;
+}
+
+// Next event estimation at a lambertian hit: one light picked uniformly, one direction towards it and a shadow ray.
+// Weighted against lambertian_scatter with the power heuristic; trace_ray applies the other half of the weights
+// when a scattered ray hits a light.
+inline Vector3 sample_direct_light(PathSampler& state, const RaytracerData& data, const Hit& hit, const Material& material) {
+	LightSample sample;
+	if (!sample_light(state, data, hit, material, sample) || !light_sample_visible(data, sample)) {
+		return Vector3();
+	}
+	return sample.contribution;
+}
+
+// Russian roulette: continue with the probability of the path's throughput and make up for the paths ended here
+// by dividing by it, which keeps the estimate unbiased. Returns false if the path ends.
+inline bool russian_roulette(PathSampler& state, const RaytracerProperties& properties, int depth, Vector3& throughput) {
+	if (depth < properties.roulette_depth) {
+		return true;
+	}
+	float survival = std::fmin(1.0f, std::fmax(throughput.x, std::fmax(throughput.y, throughput.z)));
+	if (random_float(state) >= survival) {
+		return false;
+	}
+	throughput /= survival;
+	return true;
+}
+
+// The path of a ray whose first hit is already known (obj_index -1 for a miss), e.g. from a primary ray packet. The
+// caller counts that first ray. CPU only, trace_ray below is what mirrors the shader.
+template <int Features = KERNEL_ALL_FEATURES>
+inline Vector3 trace_ray_from_hit(PathSampler& state, const RaytracerData& data, Ray ray, int obj_index, Hit hit) {
+	Vector3 result;
+	Vector3 cumilative_attenuation(1.0f, 1.0f, 1.0f);
+	ThreadCounters& counters = thread_counters();
+	bool light_sampling = (Features & KERNEL_LIGHT_SAMPLING) && data.properties.light_sampling && data.properties.light_count > 0;
+	float bsdf_pdf = 0.0f; // of the last scattered direction if lights were sampled at its origin, 0 counts emission in full
+	Vector3 bounce_origin;
+	int depth = 0;
+
+	for (; depth < data.properties.max_depth; depth++) {
+		if (depth > 0) {
+			counters.rays++;
+			obj_index = check_object_hit(data, ray, 0.001f, 1.0e7f, hit);
+		}
+		if (obj_index != -1) {
+			const Material& material = object_material(data, obj_index);
+			Ray outgoing_ray;
+			Vector3 attenuation;
+			Vector3 emitted = emit<Features>(material);
+
+			sampler_seek_bounce(state, depth, SAMPLE_DIM_SCATTER);
+			if (scatter<Features>(state, material, ray, hit, attenuation, outgoing_ray)) {
+				bsdf_pdf = 0.0f;
+				if (light_sampling && kernel_material_is<Features, 1>(material)) {
+					sampler_seek_bounce(state, depth, SAMPLE_DIM_LIGHT);
+					result += cumilative_attenuation * sample_direct_light(state, data, hit, material);
+					bsdf_pdf = lambertian_pdf(hit, outgoing_ray.direction);
+					bounce_origin = hit.pos;
+				}
+				cumilative_attenuation *= attenuation;
+				ray = outgoing_ray;
+				sampler_seek_bounce(state, depth, SAMPLE_DIM_ROULETTE);
+				if ((Features & KERNEL_ROULETTE) && !russian_roulette(state, data.properties, depth, cumilative_attenuation)) {
+					break;
+				}
+			}
+			else {
+				float weight = 1.0f;
+				if ((Features & KERNEL_LIGHT_SAMPLING) && bsdf_pdf > 0.0f && obj_index < data.properties.sphere_count) {
+					float light_pdf = sphere_light_pdf(data.spheres[obj_index], bounce_origin) / data.properties.light_count;
+					weight = power_heuristic(bsdf_pdf, light_pdf);
+				}
+				result += cumilative_attenuation * emitted * weight;
+				break;
+			}
+		}
+		else {
+			float t = 0.5f * unit_vector(ray.direction).y + 0.5f;
+			result += cumilative_attenuation * lerp(Vector3(1, 1, 1), Vector3(0.5f, 0.7f, 1.0f), t);
+			break;
+		}
+	}
+
+	counters.paths++;
+	counters.bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)]++;
+	return result;
+}
+
+template <int Features = KERNEL_ALL_FEATURES>
+inline Vector3 trace_ray(PathSampler& state, const RaytracerData& data, Ray ray) {
+	thread_counters().rays++;
+	Hit hit;
+	int obj_index = check_object_hit(data, ray, 0.001f, 1.0e7f, hit);
+	return trace_ray_from_hit<Features>(state, data, ray, obj_index, hit);
+}
+
+// Adds what a camera ray's first hit contributes to its pixel's AOVs. Mirror-like metal is looked through along the
+// perfect reflection, with its albedo multiplied in: a reflection is as sharp as what it shows, and the denoiser
+// would blur it if the AOVs only held the mirror's smooth surface.
+inline void add_first_hit_aov(const RaytracerData& data, Ray ray, int obj_index, Hit hit, PixelAov& aov) {
+	Vector3 tint(1.0f, 1.0f, 1.0f);
+	float distance = 0.0f;
+	for (int bounce = 0;; bounce++) {
+		if (obj_index == -1) {
+			Vector3 direction = unit_vector(ray.direction);
+			aov.albedo += tint * lerp(Vector3(1, 1, 1), Vector3(0.5f, 0.7f, 1.0f), 0.5f * direction.y + 0.5f); // sky as in trace_ray_from_hit
+			aov.normal -= direction;
+			aov.depth += AOV_MISS_DEPTH;
+			return;
+		}
+
+		const Material& material = object_material(data, obj_index);
+		distance += hit.t * length(ray.direction);
+		if (material.type != 2 || material.fuzziness >= AOV_MIRROR_FUZZINESS || bounce == AOV_MAX_MIRROR_BOUNCES) {
+			aov.albedo += tint * material.albedo; // the emitted color for lights
+			aov.normal += hit.normal;
+			aov.depth += distance;
+			return;
+		}
+
+		tint *= material.albedo;
+		ray = Ray(hit.pos, reflect(unit_vector(ray.direction), hit.normal));
+		thread_counters().rays++;
+		obj_index = check_object_hit(data, ray, 0.001f, 1.0e7f, hit);
+	}
+}
+
+inline void average_aov(PixelAov& aov, int samples) {
+	aov.albedo /= float(samples);
+	aov.normal /= float(samples);
+	aov.depth /= float(samples);
+}
+
+// trace_ray for a camera ray that also adds its first hit to aov. CPU only.
+template <int Features = KERNEL_ALL_FEATURES>
+inline Vector3 trace_camera_ray_aov(PathSampler& state, const RaytracerData& data, Ray ray, PixelAov& aov) {
+	thread_counters().rays++;
+	Hit hit;
+	int obj_index = check_object_hit(data, ray, 0.001f, 1.0e7f, hit);
+	add_first_hit_aov(data, ray, obj_index, hit, aov);
+	return trace_ray_from_hit<Features>(state, data, ray, obj_index, hit);
+}
+
+// Sum of properties.samples samples of pixel (x, y). The luminance of every sample goes into variance if there is one,
+// and aov, if there is one, is set to the pixel's first hit features.
+template <int Features = KERNEL_ALL_FEATURES>
+inline Vector3 sample_pixel(const RaytracerData& data, uint32_t x, uint32_t y, PixelVariance* variance, PixelAov* aov) {
+	const RaytracerProperties& properties = data.properties;
+	Vector3 color;
+	if (aov) {
+		*aov = PixelAov();
+	}
+	PathSampler random_state = create_path_sampler(data.sampler, x, y, properties.frame_count);
+	const uint32_t first_sample = (uint32_t)properties.frame_count * properties.samples;
+
+	bool timed = frame_stats_timed_pixel(x, y);
+	uint64_t ray_generation_ticks = 0, trace_ticks = 0;
+
+	for (int i = 0; i < properties.samples; i++) {
+		uint64_t generation_start = timed ? stats_ticks() : 0;
+		sampler_begin_sample(random_state, first_sample + i);
+		float u = float(x + random_float(random_state)) / float(properties.width);
+		float v = (properties.height - float(y + random_float(random_state))) / float(properties.height);
+		Ray ray = get_camera_ray<Features>(random_state, properties.camera, u, v);
+		uint64_t trace_start = timed ? stats_ticks() : 0;
+		Vector3 sample = aov ? trace_camera_ray_aov<Features>(random_state, data, ray, *aov) : trace_ray<Features>(random_state, data, ray);
+		color += sample;
+		if (timed) {
+			uint64_t trace_end = stats_ticks();
+			ray_generation_ticks += trace_start - generation_start;
+			trace_ticks += trace_end - trace_start;
+		}
+
+		if (variance) {
+			float luminance = 0.2126f * sample.x + 0.7152f * sample.y + 0.0722f * sample.z;
+			variance->samples++;
+			float delta = luminance - variance->mean;
+			variance->mean += delta / variance->samples;
+			variance->m2 += delta * (luminance - variance->mean);
+		}
+	}
+
+	if (aov) {
+		average_aov(*aov, properties.samples);
+	}
+	if (timed) {
+		ThreadCounters& counters = thread_counters();
+		counters.ray_generation_ticks += ray_generation_ticks;
+		counters.trace_ticks += trace_ticks;
+	}
+	return color;
+}
+
+// Standard error of the pixel's mean luminance, relative to that luminance.
+inline bool pixel_converged(const PixelVariance& variance, float threshold, int min_samples) {
+	if (variance.samples < min_samples) {
+		return false;
+	}
+	float variance_of_mean = variance.m2 / ((float)(variance.samples - 1) * variance.samples);
+	float error = std::sqrt(variance_of_mean) / std::fmax(variance.mean, ADAPTIVE_LUMINANCE_FLOOR);
+	return error <= threshold;
+}
+
+// Blends one pass's average color into pixel index of target. Without history every pixel holds frame_count passes
+// like in CS; with it each pixel holds its own count, which cpu_reproject lowers for pixels it couldn't carry over.
+inline void accumulate_pixel(const RaytracerProperties& properties, const PassTarget& target, size_t index, Vector3 color) {
+	Vector4& pixel = target.pixels[index];
+	if (!target.history) {
+		pixel = lerp(Vector4(color, 1), pixel, float(properties.frame_count) / float(properties.frame_count + 1));
+		return;
+	}
+	float passes = properties.frame_count == 0 ? 0.0f : target.history[index];
+	pixel = lerp(Vector4(color, 1), pixel, passes / (passes + 1.0f));
+	target.history[index] = passes + 1.0f;
+}
+
+// Equivalent of one CS invocation for pixel (x, y). Also fills the pixel's aov if target has aovs.
+template <int Features = KERNEL_ALL_FEATURES>
+inline void trace_pixel(const RaytracerData& data, const PassTarget& target, uint32_t x, uint32_t y) {
+	const RaytracerProperties& properties = data.properties;
+	size_t index = (size_t)y * properties.width + x;
+	Vector3 color = sample_pixel<Features>(data, x, y, nullptr, target.aovs ? &target.aovs[index] : nullptr);
+
+	bool timed = frame_stats_timed_pixel(x, y);
+	uint64_t accumulation_start = timed ? stats_ticks() : 0;
+	color /= float(properties.samples);
+	accumulate_pixel(properties, target, index, color);
+
+	if (timed) {
+		thread_counters().accumulation_ticks += stats_ticks() - accumulation_start;
+	}
+}
+
+// trace_pixel for every pixel of a block of at most CPU_PACKET_SIZE x CPU_PACKET_SIZE, with the camera rays of each
+// sample traced as one packet and the rest of every path ray by ray. Needs packets_usable. Each pixel draws its
+// random numbers in the same order as in sample_pixel, so the result is identical to trace_pixel.
+template <int Features = KERNEL_ALL_FEATURES>
+inline void trace_pixel_block(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1) {
+	const RaytracerProperties& properties = data.properties;
+	const int width = x1 - x0;
+	const int count = width * (y1 - y0);
+	assert(count <= CPU_PACKET_SIZE * CPU_PACKET_SIZE);
+	PathSampler random_states[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	float jitter_x[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	float jitter_y[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	Vector3 colors[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	Ray rays[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	int objects[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	Hit hits[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	PixelAov first_hits[CPU_PACKET_SIZE * CPU_PACKET_SIZE];
+	for (int i = 0; i < count; i++) {
+		uint32_t x = x0 + i % width, y = y0 + i / width;
+		random_states[i] = create_path_sampler(data.sampler, x, y, properties.frame_count);
+	}
+	const uint32_t first_sample = (uint32_t)properties.frame_count * properties.samples;
+
+	ThreadCounters& counters = thread_counters();
+	uint64_t ray_generation_ticks = 0, trace_ticks = 0;
+	for (int sample = 0; sample < properties.samples; sample++) {
+		uint64_t generation_start = stats_ticks();
+		for (int i = 0; i < count; i++) {
+			sampler_begin_sample(random_states[i], first_sample + sample);
+		}
+		random_floats(random_states, count, jitter_x);
+		random_floats(random_states, count, jitter_y);
+		for (int i = 0; i < count; i++) {
+			int x = x0 + i % width, y = y0 + i / width;
+			float u = float(x + jitter_x[i]) / float(properties.width);
+			float v = (properties.height - float(y + jitter_y[i])) / float(properties.height);
+			rays[i] = get_camera_ray<Features>(random_states[i], properties.camera, u, v);
+		}
+		uint64_t trace_start = stats_ticks();
+		counters.rays += count;
+		packet_check_object_hit(data, rays, count, 0.001f, 1.0e7f, objects, hits);
+		if (target.aovs) {
+			for (int i = 0; i < count; i++) {
+				add_first_hit_aov(data, rays[i], objects[i], hits[i], first_hits[i]);
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			colors[i] += trace_ray_from_hit<Features>(random_states[i], data, rays[i], objects[i], hits[i]);
+		}
+		ray_generation_ticks += trace_start - generation_start;
+		trace_ticks += stats_ticks() - trace_start;
+	}
+
+	uint64_t accumulation_start = stats_ticks();
+	for (int i = 0; i < count; i++) {
+		Vector3 color = colors[i];
+		color /= float(properties.samples);
+		size_t index = (size_t)(y0 + i / width) * properties.width + x0 + i % width;
+		accumulate_pixel(properties, target, index, color);
+		if (target.aovs) {
+			average_aov(first_hits[i], properties.samples);
+			target.aovs[index] = first_hits[i];
+		}
+	}
+	counters.ray_generation_ticks += ray_generation_ticks;
+	counters.trace_ticks += trace_ticks;
+	counters.accumulation_ticks += stats_ticks() - accumulation_start;
+}
+
+// trace_pixel for adaptive sampling: pixels whose error estimate is below the threshold are skipped, so pixels
+// hold different sample counts and are averaged by those counts. CPU only.
+template <int Features = KERNEL_ALL_FEATURES>
+inline void trace_pixel_adaptive(const RaytracerData& data, CpuRenderer& renderer, uint32_t x, uint32_t y, PixelAov* aov) {
+	const RaytracerProperties& properties = data.properties;
+	size_t index = (size_t)y * properties.width + x;
+	PixelVariance& variance = renderer.variance[index];
+	int min_samples = ADAPTIVE_MIN_PASSES * properties.samples;
+	if (properties.frame_count == 0) {
+		variance = PixelVariance();
+	}
+	else if (pixel_converged(variance, renderer.adaptive_threshold, min_samples)) {
+		return;
+	}
+
+	int previous_samples = variance.samples;
+	Vector3 color = sample_pixel<Features>(data, x, y, &variance, aov);
+
+	bool timed = frame_stats_timed_pixel(x, y);
+	uint64_t accumulation_start = timed ? stats_ticks() : 0;
+	color /= float(properties.samples);
+
+	Vector4& pixel = renderer.pixels[index];
+	pixel = lerp(Vector4(color, 1), pixel, float(previous_samples) / float(variance.samples));
+
+	ThreadCounters& counters = thread_counters();
+	counters.pixels_sampled++;
+	counters.pixels_unconverged += pixel_converged(variance, renderer.adaptive_threshold, min_samples) ? 0 : 1;
+	if (timed) {
+		counters.accumulation_ticks += stats_ticks() - accumulation_start;
+	}
+}
+
+// KERNEL_MATERIALS bits of the material types the scene's spheres and mesh instances use. Unknown types keep every
+// check, so they go on scattering nothing like in the generic kernel.
+inline int scene_material_features(const RaytracerData& data) {
+	int features = 0;
+	int object_count = data.properties.sphere_count + data.mesh_instance_count;
+	for (int i = 0; i < object_count && features != KERNEL_MATERIALS; i++) {
+		int type = object_material(data, i).type;
+		features |= type == 0 ? KERNEL_EMISSIVE : type == 1 ? KERNEL_LAMBERTIAN : type == 2 ? KERNEL_METAL : KERNEL_MATERIALS;
+	}
+	return features;
+}
+
+// The kernel features a pass over data needs, given its material features.
+inline int scene_kernel_features(const RaytracerData& data, int material_features) {
+	const RaytracerProperties& properties = data.properties;
+	int features = material_features;
+	if (properties.camera.lens_radius > 0.0f) {
+		features |= KERNEL_DEPTH_OF_FIELD;
+	}
+	if (properties.light_sampling && properties.light_count > 0) {
+		features |= KERNEL_LIGHT_SAMPLING;
+	}
+	if (properties.roulette_depth < properties.max_depth) {
+		features |= KERNEL_ROULETTE;
+	}
+	return features;
+}
+
+// The per-pixel entry points compiled for one set of kernel features. Max depth and the sample count stay run time
+// values: they only bound loops around whole paths, so fixing them would multiply the variants without removing a
+// branch from a bounce.
+struct CpuKernel {
+	void (*trace_pixel)(const RaytracerData& data, const PassTarget& target, uint32_t x, uint32_t y);
+	void (*trace_pixel_block)(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1);
+	void (*trace_pixel_adaptive)(const RaytracerData& data, CpuRenderer& renderer, uint32_t x, uint32_t y, PixelAov* aov);
+};
+
+template <int... Features>
+inline const CpuKernel& cpu_kernel_table_entry(int features, std::integer_sequence<int, Features...>) {
+	static const CpuKernel kernels[] = { { trace_pixel<Features>, trace_pixel_block<Features>, trace_pixel_adaptive<Features> }... };
+	return kernels[features];
+}
+
+// The kernel compiled for exactly features, any combination of the KERNEL_ bits.
+inline const CpuKernel& select_cpu_kernel(int features) {
+	assert(features >= 0 && features <= KERNEL_ALL_FEATURES);
+	return cpu_kernel_table_entry(features, std::make_integer_sequence<int, KERNEL_VARIANT_COUNT>());
+}
+
+inline CpuRenderer create_cpu_renderer(int width, int height, int thread_count = 0) {
+	CpuRenderer renderer;
+	renderer.width = width;
+	renderer.height = height;
+	renderer.thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+	if (renderer.thread_count <= 0) {
+		renderer.thread_count = 1;
+	}
+	renderer.pixels.resize((size_t)width * height);
+	renderer.adaptive_threshold = 0.0f;
+	renderer.wavefront = false;
+	renderer.packets = true;
+	renderer.write_aovs = false;
+	renderer.specialize = true;
+	renderer.material_features = -1;
+	renderer.kernel_features = KERNEL_ALL_FEATURES;
+	renderer.reproject = false;
+	renderer.refresh_aovs = false;
+	renderer.scheduler.reset(new TileScheduler());
+	start_tile_scheduler(*renderer.scheduler, renderer.thread_count);
+	renderer.pass_pending = false;
+	renderer.stats = create_frame_stats();
+	return renderer;
+}
+
+// Defined in wavefront.h and treelets.h, which are included at the end of this file because they build on the functions above.
+inline void trace_tile_wavefront(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1);
+inline void trace_tile_treelets(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1);
+inline int treelet_scene_material_features(const TreeletScene& scene);
+
+// Starts one progressive frame of the pixels in [region_x0, region_x1) x [region_y0, region_y1) on the worker threads
+// and returns; the other pixels are left alone. raytracer_data and renderer.pixels must not be changed until the pass
+// is collected with cpu_raytracer_poll or stopped with cpu_raytracer_cancel. Partial tiles at the right and bottom
+// edges of the region are included.
+inline void cpu_raytracer_begin_region(CpuRenderer& renderer, const RaytracerData& raytracer_data, int region_x0, int region_y0, int region_x1, int region_y1) {
+	assert(renderer.width == raytracer_data.properties.width && renderer.height == raytracer_data.properties.height);
+	assert(0 <= region_x0 && region_x0 < region_x1 && region_x1 <= renderer.width);
+	assert(0 <= region_y0 && region_y0 < region_y1 && region_y1 <= renderer.height);
+
+	const int tiles_x = (region_x1 - region_x0 + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	const int tiles_y = (region_y1 - region_y0 + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	CpuRenderer* target = &renderer;
+	const RaytracerData* data = &raytracer_data;
+	bool treelets = raytracer_data.treelets != nullptr; // always traced in wavefront stages, see treelets.h
+	bool adaptive = renderer.adaptive_threshold > 0.0f && !treelets;
+	bool wavefront = renderer.wavefront && !adaptive;
+	bool packets = renderer.packets && !adaptive && packets_usable(raytracer_data);
+	if (adaptive) {
+		renderer.variance.resize(renderer.pixels.size());
+	}
+	PassTarget pass_target = { renderer.pixels.data(), nullptr, nullptr };
+	if (renderer.write_aovs || renderer.reproject) {
+		renderer.aovs.resize(renderer.pixels.size());
+		bool first_pass = raytracer_data.properties.frame_count == 0 || renderer.refresh_aovs;
+		pass_target.aovs = first_pass ? renderer.aovs.data() : nullptr;
+	}
+	if (renderer.reproject && !adaptive) {
+		renderer.history.resize(renderer.pixels.size());
+		pass_target.history = renderer.history.data();
+	}
+	// Materials are only looked at when a frame starts, edits reset frame_count.
+	if (raytracer_data.properties.frame_count == 0 || renderer.material_features < 0) {
+		renderer.material_features = treelets ? treelet_scene_material_features(*raytracer_data.treelets) : scene_material_features(raytracer_data);
+	}
+	renderer.kernel_features = renderer.specialize ? scene_kernel_features(raytracer_data, renderer.material_features) : KERNEL_ALL_FEATURES;
+	const CpuKernel& kernel = select_cpu_kernel(renderer.kernel_features);
+
+	begin_tile_pass(*renderer.scheduler, tiles_x * tiles_y, [=](int tile, int) {
+		int x0 = region_x0 + (tile % tiles_x) * CPU_TILE_SIZE;
+		int y0 = region_y0 + (tile / tiles_x) * CPU_TILE_SIZE;
+		int x1 = std::min(x0 + CPU_TILE_SIZE, region_x1);
+		int y1 = std::min(y0 + CPU_TILE_SIZE, region_y1);
+		if (treelets) {
+			trace_tile_treelets(*data, pass_target, x0, y0, x1, y1);
+			return;
+		}
+		if (wavefront) {
+			trace_tile_wavefront(*data, pass_target, x0, y0, x1, y1);
+			return;
+		}
+		if (packets) {
+			for (int by = y0; by < y1; by += CPU_PACKET_SIZE) {
+				for (int bx = x0; bx < x1; bx += CPU_PACKET_SIZE) {
+					kernel.trace_pixel_block(*data, pass_target, bx, by, std::min(bx + CPU_PACKET_SIZE, x1), std::min(by + CPU_PACKET_SIZE, y1));
+				}
+			}
+			return;
+		}
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				if (adaptive) {
+					PixelAov* aov = pass_target.aovs ? &pass_target.aovs[(size_t)y * target->width + x] : nullptr;
+					kernel.trace_pixel_adaptive(*data, *target, x, y, aov);
+				}
+				else {
+					kernel.trace_pixel(*data, pass_target, x, y);
+				}
+			}
+		}
+	});
+	renderer.pass_pending = true;
+}
+
+// cpu_raytracer_begin_region for the whole image.
+inline void cpu_raytracer_begin(CpuRenderer& renderer, const RaytracerData& raytracer_data) {
+	cpu_raytracer_begin_region(renderer, raytracer_data, 0, 0, renderer.width, renderer.height);
+}
+
+// Returns true once per finished pass, after advancing frame_count like raytracer_render does.
+// Returns false while the pass is still running, or if none was started.
+inline bool cpu_raytracer_poll(CpuRenderer& renderer, RaytracerData& raytracer_data) {
+	if (!renderer.pass_pending || tile_pass_running(*renderer.scheduler)) {
+		return false;
+	}
+	renderer.pass_pending = false;
+	if (!wait_tile_pass(*renderer.scheduler)) {
+		FrameStats discarded = create_frame_stats(); // what the cancelled pass counted
+		take_thread_counters(discarded, 0.0);
+		return false;
+	}
+
+	TileScheduler& scheduler = *renderer.scheduler;
+	FrameStats& stats = renderer.stats;
+	stats = create_frame_stats();
+	stats.frame = raytracer_data.properties.frame_count;
+	stats.passes = 1;
+	stats.frame_ms = scheduler.pass_seconds * 1000.0;
+	double total_busy_ms = 0;
+	for (int i = 0; i < scheduler.worker_count; i++) {
+		double busy_ms = scheduler.queues[i].busy_seconds * 1000.0;
+		stats.thread_busy_ms.push_back(busy_ms);
+		stats.thread_idle_ms.push_back(std::max(0.0, stats.frame_ms - busy_ms));
+		total_busy_ms += busy_ms;
+	}
+	take_thread_counters(stats, total_busy_ms);
+
+	raytracer_data.properties.frame_count++;
+	renderer.refresh_aovs = false;
+	return true;
+}
+
+inline bool cpu_raytracer_busy(CpuRenderer& renderer) {
+	return renderer.pass_pending;
+}
+
+// With adaptive sampling, true once the last collected pass left no pixel above the threshold, so further passes
+// would not trace anything. Resetting frame_count starts over.
+inline bool cpu_raytracer_converged(const CpuRenderer& renderer, const RaytracerData& raytracer_data) {
+	return renderer.adaptive_threshold > 0.0f && raytracer_data.properties.frame_count > 0 && renderer.stats.passes > 0
+		&& renderer.stats.pixels_unconverged == 0;
+}
+
+// Abandons the running pass, if any, and returns once no worker touches the scene or the pixels any more.
+// Tiles that were already written keep their new value; callers reset frame_count after an edit anyway,
+// which makes the next pass overwrite every pixel.
+inline void cpu_raytracer_cancel(CpuRenderer& renderer) {
+	if (renderer.pass_pending) {
+		cancel_tile_pass(*renderer.scheduler);
+		renderer.pass_pending = false;
+		FrameStats discarded = create_frame_stats();
+		take_thread_counters(discarded, 0.0);
+	}
+}
+
+// Renders one progressive frame into renderer.pixels and advances frame_count, blocking until it is done.
+inline void cpu_raytracer_render(CpuRenderer& renderer, RaytracerData& raytracer_data) {
+	cpu_raytracer_begin(renderer, raytracer_data);
+	wait_tile_pass(*renderer.scheduler);
+	cpu_raytracer_poll(renderer, raytracer_data);
+}
+
+// cpu_raytracer_render for the pixels of a region only, see cpu_raytracer_begin_region.
+inline void cpu_raytracer_render_region(CpuRenderer& renderer, RaytracerData& raytracer_data, int x0, int y0, int x1, int y1) {
+	cpu_raytracer_begin_region(renderer, raytracer_data, x0, y0, x1, y1);
+	wait_tile_pass(*renderer.scheduler);
+	cpu_raytracer_poll(renderer, raytracer_data);
+}
+
+#include "wavefront.h"
+#include "treelets.h"
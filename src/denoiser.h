@@ -0,0 +1,310 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "sphere_soa.h"
+#include "tile_scheduler.h"
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010) that turns the first few passes of the CPU tracer into
+// a usable preview. The accumulated color is divided by the first hit albedo, so only the lighting gets blurred and
+// material edges come back when it is multiplied in again at the end. Each iteration is a 5x5 B3 spline kernel whose
+// taps are 1, 2, 4, ... pixels apart, and every tap is weighted down by how far its color, normal and depth are from
+// the center pixel's, which stops the blur at edges. Color differences are measured against the variance of the
+// pixel's 3x3 neighbourhood, so the filter blurs noisy early passes hard and backs off as the image converges. The
+// AOVs come from CpuRenderer::aovs. Rows are split over the renderer's worker threads and filtered SIMD_WIDTH pixels
+// at a time.
+
+#define DENOISE_MAX_ITERATIONS 5
+#define DENOISE_PAD (2 << (DENOISE_MAX_ITERATIONS - 1)) // widest tap offset, planes repeat their edge pixels this far out
+#define DENOISE_ROWS_PER_TASK 4
+#define DENOISE_ALBEDO_FLOOR 0.01f // so black albedos don't blow up the demodulated color
+#define DENOISE_VARIANCE_FLOOR 1.0e-4f
+
+struct DenoiseSettings {
+	int iterations = DENOISE_MAX_ITERATIONS;
+	float color_sigma = 2.0f; // in standard deviations of the demodulated color around the pixel, halved every iteration
+	float normal_sigma = 0.15f;
+	float depth_sigma = 0.02f; // relative to the center pixel's depth, per pixel of tap distance
+};
+
+// Planar copies of the inputs with DENOISE_PAD columns of clamped border on either side. Reused between frames.
+struct Denoiser {
+	int width = 0;
+	int height = 0;
+	int stride = 0; // floats per plane row
+	aligned_float_vector color[2][3]; // ping-pong between iterations
+	aligned_float_vector normal[3];
+	aligned_float_vector depth;
+	aligned_float_vector inv_variance; // 1 / variance of the demodulated color around each pixel, only read at the center
+	std::vector<Vector4> output;
+	double seconds = 0; // of the last cpu_denoise
+};
+
+// Per iteration constants of the tap weights.
+struct DenoiseWeights {
+	int step;
+	float inv_color_sigma2;
+	float inv_normal_sigma2;
+	float inv_depth_sigma;
+};
+
+static const float denoise_kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// 1 / distance of tap (i, j) from the center in kernel steps, 0 for the center.
+inline float denoise_inv_tap_distance(int i, int j) {
+	int d2 = (i - 2) * (i - 2) + (j - 2) * (j - 2);
+	return d2 > 0 ? 1.0f / std::sqrt((float)d2) : 0.0f;
+}
+
+// (1 - x / 8)^8, a cheap stand-in for exp(-x) that reaches 0 at x = 8, where exp(-x) is already below 0.001.
+inline float denoise_falloff(float x) {
+	float e = std::fmax(0.0f, 1.0f - x * 0.125f);
+	e *= e;
+	e *= e;
+	return e * e;
+}
+
+inline float* denoise_row(aligned_float_vector& plane, const Denoiser& denoiser, int y) {
+	return plane.data() + (size_t)y * denoiser.stride + DENOISE_PAD;
+}
+
+// Repeats the first and last pixel of a row into its padding.
+inline void denoise_pad_row(float* row, const Denoiser& denoiser) {
+	std::fill(row - DENOISE_PAD, row, row[0]);
+	std::fill(row + denoiser.width, row + denoiser.stride - DENOISE_PAD, row[denoiser.width - 1]);
+}
+
+// One iteration for row y, from color[source] into color[source ^ 1].
+#if SIMD_WIDTH > 1
+inline void denoise_filter_row(Denoiser& denoiser, int source, int y, const DenoiseWeights& weights) {
+	const aligned_float_vector* in = denoiser.color[source];
+	aligned_float_vector* out = denoiser.color[source ^ 1];
+	const simd_float inv_color_sigma2 = simd_set(weights.inv_color_sigma2);
+	const simd_float inv_normal_sigma2 = simd_set(weights.inv_normal_sigma2);
+	const simd_float inv_depth_sigma = simd_set(weights.inv_depth_sigma / weights.step);
+	const simd_float zero = simd_set(0.0f);
+	const simd_float one = simd_set(1.0f);
+	const simd_float eighth = simd_set(0.125f);
+
+	size_t rows[5];
+	for (int j = 0; j < 5; j++) {
+		int tap_y = std::min(std::max(y + (j - 2) * weights.step, 0), denoiser.height - 1);
+		rows[j] = (size_t)tap_y * denoiser.stride + DENOISE_PAD;
+	}
+	const size_t center_row = rows[2];
+
+	for (int x = 0; x < denoiser.width; x += SIMD_WIDTH) {
+		size_t center = center_row + x;
+		simd_float r = simd_load(&in[0][center]);
+		simd_float g = simd_load(&in[1][center]);
+		simd_float b = simd_load(&in[2][center]);
+		simd_float nx = simd_load(&denoiser.normal[0][center]);
+		simd_float ny = simd_load(&denoiser.normal[1][center]);
+		simd_float nz = simd_load(&denoiser.normal[2][center]);
+		simd_float z = simd_load(&denoiser.depth[center]);
+		simd_float depth_scale = simd_div(inv_depth_sigma, z);
+		simd_float color_scale = simd_mul(inv_color_sigma2, simd_load(&denoiser.inv_variance[center]));
+
+		simd_float sum_weight = zero, sum_r = zero, sum_g = zero, sum_b = zero;
+		for (int j = 0; j < 5; j++) {
+			for (int i = 0; i < 5; i++) {
+				size_t tap = rows[j] + x + (i - 2) * weights.step;
+				simd_float tap_r = simd_load(&in[0][tap]);
+				simd_float tap_g = simd_load(&in[1][tap]);
+				simd_float tap_b = simd_load(&in[2][tap]);
+				simd_float dr = simd_sub(tap_r, r), dg = simd_sub(tap_g, g), db = simd_sub(tap_b, b);
+				simd_float dnx = simd_sub(simd_load(&denoiser.normal[0][tap]), nx);
+				simd_float dny = simd_sub(simd_load(&denoiser.normal[1][tap]), ny);
+				simd_float dnz = simd_sub(simd_load(&denoiser.normal[2][tap]), nz);
+				simd_float dz = simd_mul(simd_mul(simd_sub(simd_load(&denoiser.depth[tap]), z), depth_scale), simd_set(denoise_inv_tap_distance(i, j)));
+
+				simd_float color_distance = simd_add(simd_add(simd_mul(dr, dr), simd_mul(dg, dg)), simd_mul(db, db));
+				simd_float normal_distance = simd_add(simd_add(simd_mul(dnx, dnx), simd_mul(dny, dny)), simd_mul(dnz, dnz));
+				simd_float distance = simd_add(simd_add(simd_mul(color_distance, color_scale), simd_mul(normal_distance, inv_normal_sigma2)), simd_mul(dz, dz));
+
+				simd_float falloff = simd_max(zero, simd_sub(one, simd_mul(distance, eighth)));
+				falloff = simd_mul(falloff, falloff);
+				falloff = simd_mul(falloff, falloff);
+				simd_float weight = simd_mul(simd_mul(falloff, falloff), simd_set(denoise_kernel[i] * denoise_kernel[j]));
+
+				sum_weight = simd_add(sum_weight, weight);
+				sum_r = simd_add(sum_r, simd_mul(weight, tap_r));
+				sum_g = simd_add(sum_g, simd_mul(weight, tap_g));
+				sum_b = simd_add(sum_b, simd_mul(weight, tap_b));
+			}
+		}
+
+		simd_float inv_sum = simd_div(one, sum_weight); // the center tap always counts
+		simd_store(&out[0][center], simd_mul(sum_r, inv_sum));
+		simd_store(&out[1][center], simd_mul(sum_g, inv_sum));
+		simd_store(&out[2][center], simd_mul(sum_b, inv_sum));
+	}
+}
+#else
+inline void denoise_filter_row(Denoiser& denoiser, int source, int y, const DenoiseWeights& weights) {
+	const aligned_float_vector* in = denoiser.color[source];
+	aligned_float_vector* out = denoiser.color[source ^ 1];
+	const float inv_depth_sigma = weights.inv_depth_sigma / weights.step;
+
+	size_t rows[5];
+	for (int j = 0; j < 5; j++) {
+		int tap_y = std::min(std::max(y + (j - 2) * weights.step, 0), denoiser.height - 1);
+		rows[j] = (size_t)tap_y * denoiser.stride + DENOISE_PAD;
+	}
+
+	for (int x = 0; x < denoiser.width; x++) {
+		size_t center = rows[2] + x;
+		Vector3 color(in[0][center], in[1][center], in[2][center]);
+		Vector3 normal(denoiser.normal[0][center], denoiser.normal[1][center], denoiser.normal[2][center]);
+		float z = denoiser.depth[center];
+		float depth_scale = inv_depth_sigma / z;
+		float color_scale = weights.inv_color_sigma2 * denoiser.inv_variance[center];
+
+		float sum_weight = 0.0f;
+		Vector3 sum;
+		for (int j = 0; j < 5; j++) {
+			for (int i = 0; i < 5; i++) {
+				size_t tap = rows[j] + x + (i - 2) * weights.step;
+				Vector3 tap_color(in[0][tap], in[1][tap], in[2][tap]);
+				Vector3 dc = tap_color - color;
+				Vector3 dn = Vector3(denoiser.normal[0][tap], denoiser.normal[1][tap], denoiser.normal[2][tap]) - normal;
+				float dz = (denoiser.depth[tap] - z) * depth_scale * denoise_inv_tap_distance(i, j);
+				float distance = dot(dc, dc) * color_scale + dot(dn, dn) * weights.inv_normal_sigma2 + dz * dz;
+				float weight = denoise_falloff(distance) * denoise_kernel[i] * denoise_kernel[j];
+				sum_weight += weight;
+				sum += tap_color * weight;
+			}
+		}
+
+		out[0][center] = sum.x / sum_weight;
+		out[1][center] = sum.y / sum_weight;
+		out[2][center] = sum.z / sum_weight;
+	}
+}
+#endif
+
+// Variance of the demodulated color over the 3x3 pixels around each pixel of row y, summed over the channels.
+inline void denoise_variance_row(Denoiser& denoiser, int y) {
+	size_t rows[3];
+	for (int j = 0; j < 3; j++) {
+		rows[j] = (size_t)std::min(std::max(y + j - 1, 0), denoiser.height - 1) * denoiser.stride + DENOISE_PAD;
+	}
+	for (int x = 0; x < denoiser.width; x++) {
+		float variance = 0.0f;
+		for (int c = 0; c < 3; c++) {
+			const float* plane = denoiser.color[0][c].data();
+			float sum = 0.0f, sum2 = 0.0f;
+			for (int j = 0; j < 3; j++) {
+				for (int i = -1; i <= 1; i++) {
+					float v = plane[rows[j] + x + i];
+					sum += v;
+					sum2 += v * v;
+				}
+			}
+			float mean = sum / 9.0f;
+			variance += std::fmax(0.0f, sum2 / 9.0f - mean * mean);
+		}
+		denoiser.inv_variance[rows[1] + x] = 1.0f / (variance + DENOISE_VARIANCE_FLOOR);
+	}
+}
+
+inline Vector3 denoise_albedo(const PixelAov& aov) {
+	return Vector3(std::fmax(aov.albedo.x, DENOISE_ALBEDO_FLOOR), std::fmax(aov.albedo.y, DENOISE_ALBEDO_FLOOR), std::fmax(aov.albedo.z, DENOISE_ALBEDO_FLOOR));
+}
+
+// Calls rows(y0, y1) for bands of rows on the worker threads and waits for all of them.
+inline void denoise_rows(TileScheduler& scheduler, int height, const std::function<void(int y0, int y1)>& rows) {
+	begin_tile_pass(scheduler, (height + DENOISE_ROWS_PER_TASK - 1) / DENOISE_ROWS_PER_TASK, [&](int task, int) {
+		int y0 = task * DENOISE_ROWS_PER_TASK;
+		rows(y0, std::min(y0 + DENOISE_ROWS_PER_TASK, height));
+	});
+	wait_tile_pass(scheduler);
+}
+
+// Filters renderer.pixels into denoiser.output. Only call while the renderer is idle (e.g. right after
+// cpu_raytracer_poll returned true), with write_aovs on since the frame's first pass.
+inline void cpu_denoise(Denoiser& denoiser, CpuRenderer& renderer, const DenoiseSettings& settings) {
+	auto start = std::chrono::steady_clock::now();
+	assert(renderer.aovs.size() == renderer.pixels.size());
+	const int width = renderer.width;
+	const int height = renderer.height;
+	if (denoiser.width != width || denoiser.height != height) {
+		denoiser.width = width;
+		denoiser.height = height;
+		denoiser.stride = (width + 7) / 8 * 8 + 2 * DENOISE_PAD;
+		size_t plane_size = (size_t)denoiser.stride * height;
+		for (int c = 0; c < 3; c++) {
+			denoiser.color[0][c].assign(plane_size, 0.0f);
+			denoiser.color[1][c].assign(plane_size, 0.0f);
+			denoiser.normal[c].assign(plane_size, 0.0f);
+		}
+		denoiser.depth.assign(plane_size, 0.0f);
+		denoiser.inv_variance.assign(plane_size, 0.0f);
+	}
+	denoiser.output.resize((size_t)width * height); // may have been moved out
+
+	denoise_rows(*renderer.scheduler, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			float* planes[7] = {
+				denoise_row(denoiser.color[0][0], denoiser, y), denoise_row(denoiser.color[0][1], denoiser, y), denoise_row(denoiser.color[0][2], denoiser, y),
+				denoise_row(denoiser.normal[0], denoiser, y), denoise_row(denoiser.normal[1], denoiser, y), denoise_row(denoiser.normal[2], denoiser, y),
+				denoise_row(denoiser.depth, denoiser, y)
+			};
+			for (int x = 0; x < width; x++) {
+				size_t index = (size_t)y * width + x;
+				const Vector4& pixel = renderer.pixels[index];
+				const PixelAov& aov = renderer.aovs[index];
+				Vector3 albedo = denoise_albedo(aov);
+				planes[0][x] = pixel.x / albedo.x;
+				planes[1][x] = pixel.y / albedo.y;
+				planes[2][x] = pixel.z / albedo.z;
+				planes[3][x] = aov.normal.x;
+				planes[4][x] = aov.normal.y;
+				planes[5][x] = aov.normal.z;
+				planes[6][x] = aov.depth;
+			}
+			for (float* plane : planes) {
+				denoise_pad_row(plane, denoiser);
+			}
+		}
+	});
+
+	denoise_rows(*renderer.scheduler, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			denoise_variance_row(denoiser, y);
+		}
+	});
+
+	int source = 0;
+	int iterations = std::min(std::max(settings.iterations, 0), DENOISE_MAX_ITERATIONS);
+	for (int i = 0; i < iterations; i++) {
+		float color_sigma = settings.color_sigma / (float)(1 << i);
+		DenoiseWeights weights = { 1 << i, 1.0f / (color_sigma * color_sigma), 1.0f / (settings.normal_sigma * settings.normal_sigma), 1.0f / settings.depth_sigma };
+		denoise_rows(*renderer.scheduler, height, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				denoise_filter_row(denoiser, source, y, weights);
+				for (int c = 0; c < 3; c++) {
+					denoise_pad_row(denoise_row(denoiser.color[source ^ 1][c], denoiser, y), denoiser);
+				}
+			}
+		});
+		source ^= 1;
+	}
+
+	denoise_rows(*renderer.scheduler, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const float* r = denoise_row(denoiser.color[source][0], denoiser, y);
+			const float* g = denoise_row(denoiser.color[source][1], denoiser, y);
+			const float* b = denoise_row(denoiser.color[source][2], denoiser, y);
+			for (int x = 0; x < width; x++) {
+				size_t index = (size_t)y * width + x;
+				Vector3 albedo = denoise_albedo(renderer.aovs[index]);
+				denoiser.output[index] = Vector4(r[x] * albedo.x, g[x] * albedo.y, b[x] * albedo.z, renderer.pixels[index].w);
+			}
+		}
+	});
+	denoiser.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,301 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FRAME_STATS_RDTSC 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+// Hot path counters of the CPU tracer. Every thread increments its own ThreadCounters (a thread_local, so there
+// is no sharing or locking while tracing); when a pass has finished the renderer sums and clears all of them into
+// a FrameStats. Reading the time stamp counter around every sample would cost as much as tracing a short path, so
+// stages are only timed on one pixel in FRAME_STATS_TIMING_STRIDE^2 and their shares split the measured busy time.
+
+#define FRAME_STATS_BOUNCE_BUCKETS 64 // paths ending at a deeper bounce go to the last bucket
+#define FRAME_STATS_TIMING_STRIDE 4
+
+struct alignas(64) ThreadCounters {
+	uint64_t rays; // closest hit queries, shadow rays included
+	uint64_t paths;
+	uint64_t intersection_tests; // sphere and triangle tests, SIMD lanes included
+	uint64_t bvh_nodes_visited;
+	uint64_t pixels_sampled; // adaptive sampling only, see trace_pixel_adaptive
+	uint64_t pixels_unconverged;
+	uint64_t treelet_hits; // out-of-core scenes only, see acquire_treelet
+	uint64_t treelet_misses;
+	uint64_t treelet_evictions;
+	uint64_t treelet_bytes_paged;
+	uint64_t ray_generation_ticks; // timed pixels only
+	uint64_t trace_ticks;
+	uint64_t accumulation_ticks;
+	uint64_t bounce_histogram[FRAME_STATS_BOUNCE_BUCKETS]; // paths by the bounce they ended at
+};
+
+struct ThreadCountersRegistry {
+	std::mutex mutex;
+	std::vector<ThreadCounters*> counters;
+};
+
+inline ThreadCountersRegistry& thread_counters_registry() {
+	static ThreadCountersRegistry registry;
+	return registry;
+}
+
+// Registers the calling thread's counters on first use and removes them when the thread exits.
+struct RegisteredThreadCounters {
+	ThreadCounters counters;
+
+	RegisteredThreadCounters() : counters() {
+		ThreadCountersRegistry& registry = thread_counters_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.counters.push_back(&counters);
+	}
+
+	~RegisteredThreadCounters() {
+		ThreadCountersRegistry& registry = thread_counters_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.counters.erase(std::remove(registry.counters.begin(), registry.counters.end(), &counters), registry.counters.end());
+	}
+};
+
+inline ThreadCounters& thread_counters() {
+	static thread_local RegisteredThreadCounters registered;
+	return registered.counters;
+}
+
+inline uint64_t stats_ticks() {
+#if defined(FRAME_STATS_RDTSC)
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline bool frame_stats_timed_pixel(uint32_t x, uint32_t y) {
+	return (x % FRAME_STATS_TIMING_STRIDE) == 0 && (y % FRAME_STATS_TIMING_STRIDE) == 0;
+}
+
+struct FrameStats {
+	int frame;
+	int passes;
+	double frame_ms; // wall time of the passes
+	uint64_t rays;
+	uint64_t paths;
+	uint64_t intersection_tests;
+	uint64_t bvh_nodes_visited;
+	uint64_t pixels_sampled; // adaptive sampling: pixels that were traced, the others had converged
+	uint64_t pixels_unconverged; // adaptive sampling: traced pixels still above the error threshold, 0 once the image is done
+	uint64_t treelet_hits; // out-of-core scenes: ray batches whose treelet was in memory
+	uint64_t treelet_misses; // out-of-core scenes: ray batches that had to page their treelet in
+	uint64_t treelet_evictions;
+	uint64_t treelet_bytes_paged;
+	uint64_t bounce_histogram[FRAME_STATS_BOUNCE_BUCKETS];
+	double ray_generation_ms; // stage times are summed over the worker threads and add up to their busy time
+	double trace_ms;
+	double accumulation_ms;
+	double display_ms; // set by the caller: texture upload and draw in the app, handing the frame to the writer and the frame stream when headless
+	double denoise_ms; // set by the caller, 0 without denoising
+	std::vector<double> thread_busy_ms; // per worker, time spent rendering tiles
+	std::vector<double> thread_idle_ms; // per worker, rest of the pass
+};
+
+inline FrameStats create_frame_stats() {
+	FrameStats stats;
+	stats.frame = 0;
+	stats.passes = 0;
+	stats.frame_ms = 0;
+	stats.rays = stats.paths = stats.intersection_tests = stats.bvh_nodes_visited = 0;
+	stats.pixels_sampled = stats.pixels_unconverged = 0;
+	stats.treelet_hits = stats.treelet_misses = stats.treelet_evictions = stats.treelet_bytes_paged = 0;
+	memset(stats.bounce_histogram, 0, sizeof(stats.bounce_histogram));
+	stats.ray_generation_ms = stats.trace_ms = stats.accumulation_ms = stats.display_ms = stats.denoise_ms = 0;
+	return stats;
+}
+
+// Moves the counters of every thread into stats and clears them, splitting busy_ms over the stages. Only call
+// while no thread is tracing, e.g. after the tile pass was waited for.
+inline void take_thread_counters(FrameStats& stats, double busy_ms) {
+	ThreadCounters total = {};
+	ThreadCountersRegistry& registry = thread_counters_registry();
+	{
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (ThreadCounters* counters : registry.counters) {
+			total.rays += counters->rays;
+			total.paths += counters->paths;
+			total.intersection_tests += counters->intersection_tests;
+			total.bvh_nodes_visited += counters->bvh_nodes_visited;
+			total.pixels_sampled += counters->pixels_sampled;
+			total.pixels_unconverged += counters->pixels_unconverged;
+			total.treelet_hits += counters->treelet_hits;
+			total.treelet_misses += counters->treelet_misses;
+			total.treelet_evictions += counters->treelet_evictions;
+			total.treelet_bytes_paged += counters->treelet_bytes_paged;
+			total.ray_generation_ticks += counters->ray_generation_ticks;
+			total.trace_ticks += counters->trace_ticks;
+			total.accumulation_ticks += counters->accumulation_ticks;
+			for (int i = 0; i < FRAME_STATS_BOUNCE_BUCKETS; i++) {
+				total.bounce_histogram[i] += counters->bounce_histogram[i];
+			}
+			*counters = ThreadCounters();
+		}
+	}
+
+	double timed_ticks = (double)(total.ray_generation_ticks + total.trace_ticks + total.accumulation_ticks);
+	double ms_per_tick = timed_ticks > 0 ? busy_ms / timed_ticks : 0.0;
+	stats.rays = total.rays;
+	stats.paths = total.paths;
+	stats.intersection_tests = total.intersection_tests;
+	stats.bvh_nodes_visited = total.bvh_nodes_visited;
+	stats.pixels_sampled = total.pixels_sampled;
+	stats.pixels_unconverged = total.pixels_unconverged;
+	stats.treelet_hits = total.treelet_hits;
+	stats.treelet_misses = total.treelet_misses;
+	stats.treelet_evictions = total.treelet_evictions;
+	stats.treelet_bytes_paged = total.treelet_bytes_paged;
+	stats.ray_generation_ms = total.ray_generation_ticks * ms_per_tick;
+	stats.trace_ms = total.trace_ticks * ms_per_tick;
+	stats.accumulation_ms = total.accumulation_ticks * ms_per_tick;
+	memcpy(stats.bounce_histogram, total.bounce_histogram, sizeof(stats.bounce_histogram));
+}
+
+// Adds the counters and times of pass to total, e.g. to combine the passes of one headless frame.
+inline void add_frame_stats(FrameStats& total, const FrameStats& pass) {
+	total.passes += pass.passes;
+	total.frame_ms += pass.frame_ms;
+	total.rays += pass.rays;
+	total.paths += pass.paths;
+	total.intersection_tests += pass.intersection_tests;
+	total.bvh_nodes_visited += pass.bvh_nodes_visited;
+	total.pixels_sampled += pass.pixels_sampled;
+	total.pixels_unconverged = pass.pixels_unconverged; // what is left after the last pass
+	total.treelet_hits += pass.treelet_hits;
+	total.treelet_misses += pass.treelet_misses;
+	total.treelet_evictions += pass.treelet_evictions;
+	total.treelet_bytes_paged += pass.treelet_bytes_paged;
+	for (int i = 0; i < FRAME_STATS_BOUNCE_BUCKETS; i++) {
+		total.bounce_histogram[i] += pass.bounce_histogram[i];
+	}
+	total.ray_generation_ms += pass.ray_generation_ms;
+	total.trace_ms += pass.trace_ms;
+	total.accumulation_ms += pass.accumulation_ms;
+	total.display_ms += pass.display_ms;
+	total.denoise_ms += pass.denoise_ms;
+	total.thread_busy_ms.resize(std::max(total.thread_busy_ms.size(), pass.thread_busy_ms.size()));
+	total.thread_idle_ms.resize(total.thread_busy_ms.size());
+	for (size_t i = 0; i < pass.thread_busy_ms.size(); i++) {
+		total.thread_busy_ms[i] += pass.thread_busy_ms[i];
+		total.thread_idle_ms[i] += pass.thread_idle_ms[i];
+	}
+}
+
+inline double frame_stats_mrays_per_s(const FrameStats& stats) {
+	return stats.frame_ms > 0 ? stats.rays / (stats.frame_ms * 1000.0) : 0.0;
+}
+
+// Index of the last non-empty bounce bucket plus one, so exports and plots can leave out the empty tail.
+inline int frame_stats_bounce_count(const FrameStats& stats) {
+	int count = 0;
+	for (int i = 0; i < FRAME_STATS_BOUNCE_BUCKETS; i++) {
+		if (stats.bounce_histogram[i] > 0) {
+			count = i + 1;
+		}
+	}
+	return count;
+}
+
+// One row per frame. All frames should come from the same renderer, so the per-thread columns line up.
+inline bool write_frame_stats_csv(const char* path, const std::vector<FrameStats>& frames) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		return false;
+	}
+
+	size_t thread_count = 0;
+	int bounce_count = 0;
+	for (const FrameStats& stats : frames) {
+		thread_count = std::max(thread_count, stats.thread_busy_ms.size());
+		bounce_count = std::max(bounce_count, frame_stats_bounce_count(stats));
+	}
+
+	fprintf(file, "frame,passes,frame_ms,mrays_per_s,rays,paths,intersection_tests,bvh_nodes_visited,pixels_sampled,pixels_unconverged,ray_generation_ms,trace_ms,accumulation_ms,display_ms,denoise_ms,treelet_hits,treelet_misses,treelet_evictions,treelet_bytes_paged");
+	for (size_t i = 0; i < thread_count; i++) {
+		fprintf(file, ",thread%zu_busy_ms,thread%zu_idle_ms", i, i);
+	}
+	for (int i = 0; i < bounce_count; i++) {
+		fprintf(file, ",bounces_%d", i);
+	}
+	fprintf(file, "\n");
+
+	for (const FrameStats& stats : frames) {
+		fprintf(file, "%d,%d,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%llu,%llu", stats.frame, stats.passes, stats.frame_ms, frame_stats_mrays_per_s(stats),
+			(unsigned long long)stats.rays, (unsigned long long)stats.paths, (unsigned long long)stats.intersection_tests, (unsigned long long)stats.bvh_nodes_visited,
+			(unsigned long long)stats.pixels_sampled, (unsigned long long)stats.pixels_unconverged,
+			stats.ray_generation_ms, stats.trace_ms, stats.accumulation_ms, stats.display_ms, stats.denoise_ms,
+			(unsigned long long)stats.treelet_hits, (unsigned long long)stats.treelet_misses, (unsigned long long)stats.treelet_evictions,
+			(unsigned long long)stats.treelet_bytes_paged);
+		for (size_t i = 0; i < thread_count; i++) {
+			bool has = i < stats.thread_busy_ms.size();
+			fprintf(file, ",%.3f,%.3f", has ? stats.thread_busy_ms[i] : 0.0, has ? stats.thread_idle_ms[i] : 0.0);
+		}
+		for (int i = 0; i < bounce_count; i++) {
+			fprintf(file, ",%llu", (unsigned long long)stats.bounce_histogram[i]);
+		}
+		fprintf(file, "\n");
+	}
+
+	return fclose(file) == 0;
+}
+
+inline bool write_frame_stats_json(const char* path, const std::vector<FrameStats>& frames) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		return false;
+	}
+
+	fprintf(file, "{\n  \"frames\": [\n");
+	for (size_t f = 0; f < frames.size(); f++) {
+		const FrameStats& stats = frames[f];
+		fprintf(file, "    { \"frame\": %d, \"passes\": %d, \"frame_ms\": %.3f, \"mrays_per_s\": %.3f, \"rays\": %llu, \"paths\": %llu, \"intersection_tests\": %llu, \"bvh_nodes_visited\": %llu,\n",
+			stats.frame, stats.passes, stats.frame_ms, frame_stats_mrays_per_s(stats), (unsigned long long)stats.rays, (unsigned long long)stats.paths,
+			(unsigned long long)stats.intersection_tests, (unsigned long long)stats.bvh_nodes_visited);
+		fprintf(file, "      \"pixels_sampled\": %llu, \"pixels_unconverged\": %llu,\n", (unsigned long long)stats.pixels_sampled, (unsigned long long)stats.pixels_unconverged);
+		fprintf(file, "      \"stage_ms\": { \"ray_generation\": %.3f, \"trace\": %.3f, \"accumulation\": %.3f, \"display\": %.3f, \"denoise\": %.3f },\n",
+			stats.ray_generation_ms, stats.trace_ms, stats.accumulation_ms, stats.display_ms, stats.denoise_ms);
+		fprintf(file, "      \"treelet_cache\": { \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, \"bytes_paged\": %llu },\n",
+			(unsigned long long)stats.treelet_hits, (unsigned long long)stats.treelet_misses, (unsigned long long)stats.treelet_evictions,
+			(unsigned long long)stats.treelet_bytes_paged);
+
+		fprintf(file, "      \"threads\": [");
+		for (size_t i = 0; i < stats.thread_busy_ms.size(); i++) {
+			fprintf(file, "%s{ \"busy_ms\": %.3f, \"idle_ms\": %.3f }", i > 0 ? ", " : "", stats.thread_busy_ms[i], stats.thread_idle_ms[i]);
+		}
+		fprintf(file, "],\n      \"bounce_histogram\": [");
+		int bounce_count = frame_stats_bounce_count(stats);
+		for (int i = 0; i < bounce_count; i++) {
+			fprintf(file, "%s%llu", i > 0 ? ", " : "", (unsigned long long)stats.bounce_histogram[i]);
+		}
+		fprintf(file, "] }%s\n", f + 1 < frames.size() ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+
+	return fclose(file) == 0;
+}
+
+// Picks the format by extension: .json, anything else is CSV.
+inline bool write_frame_stats(const char* path, const std::vector<FrameStats>& frames) {
+	size_t length = strlen(path);
+	if (length >= 5 && strcmp(path + length - 5, ".json") == 0) {
+		return write_frame_stats_json(path, frames);
+	}
+	return write_frame_stats_csv(path, frames);
+}
@@ -0,0 +1,388 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "maths.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Progressive frames in shared memory, for viewers and tools outside the renderer. The writer publishes whole images
+// into a ring of slots; each slot stores its pixels tile by tile with the sequence number at which every tile last
+// changed. A reader maps the same memory, reads the tiles it hasn't seen yet in place, and checks afterwards that the
+// writer didn't reuse the slot meanwhile (a seqlock per slot). The writer never waits for readers.
+//
+// Layout: FrameStreamHeader, then slot_count slots of slot_stride bytes. A slot is a FrameStreamSlot, the uint64_t
+// versions of its tiles, then the tiles' float4 pixels, tile_size * tile_size per tile with rows of tile_size; edge
+// tiles are padded.
+
+#define FRAME_STREAM_MAGIC 0x53464750u // "PGFS"
+#define FRAME_STREAM_VERSION 1
+#define FRAME_STREAM_SLOTS 3 // a reader has two publishes' time to read a slot before it is reused
+#define FRAME_STREAM_TILE_SIZE 32
+
+struct FrameStreamHeader {
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t tile_size;
+	int32_t tiles_x;
+	int32_t tiles_y;
+	int32_t slot_count;
+	uint64_t slot_stride; // bytes, slot 0 starts at FRAME_STREAM_HEADER_SIZE
+	std::atomic<uint64_t> published; // sequence of the newest complete slot, 0 before the first publish
+	std::atomic<uint32_t> closed; // set when the writer is done, nothing is published after
+};
+
+struct FrameStreamSlot {
+	std::atomic<uint64_t> sequence; // of the image in the slot, 0 while the writer fills it
+	int32_t frame;
+	int32_t passes; // accumulated in the image
+};
+
+#define FRAME_STREAM_HEADER_SIZE 128
+#define FRAME_STREAM_SLOT_HEADER_SIZE 64
+static_assert(sizeof(FrameStreamHeader) <= FRAME_STREAM_HEADER_SIZE && sizeof(FrameStreamSlot) <= FRAME_STREAM_SLOT_HEADER_SIZE, "stream headers outgrew their space");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "stream counters must be plain 64 bit values in shared memory");
+
+// Named shared memory. The name is a plain identifier; it becomes "/name" for shm_open and "Local\name" on Windows.
+struct SharedMemory {
+	void* data;
+	size_t size;
+	std::string name;
+	bool owner; // created it, and removes the name when it is closed
+#if defined(_WIN32)
+	HANDLE mapping;
+#endif
+};
+
+inline bool create_shared_memory(const char* name, size_t size, SharedMemory& memory) {
+	memory = {};
+	memory.owner = true;
+#if defined(_WIN32)
+	memory.name = std::string("Local\\") + name;
+	memory.mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, memory.name.c_str());
+	if (!memory.mapping) {
+		return false;
+	}
+	memory.data = MapViewOfFile(memory.mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!memory.data) {
+		CloseHandle(memory.mapping);
+		return false;
+	}
+#else
+	memory.name = std::string("/") + name;
+	shm_unlink(memory.name.c_str()); // a stream left behind by a writer that crashed
+	int fd = shm_open(memory.name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	void* data = ftruncate(fd, (off_t)size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		shm_unlink(memory.name.c_str());
+		return false;
+	}
+	memory.data = data;
+#endif
+	memory.size = size;
+	return true;
+}
+
+// Maps an existing block read-only, whatever its size.
+inline bool open_shared_memory(const char* name, SharedMemory& memory) {
+	memory = {};
+#if defined(_WIN32)
+	memory.name = std::string("Local\\") + name;
+	memory.mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, memory.name.c_str());
+	if (!memory.mapping) {
+		return false;
+	}
+	memory.data = MapViewOfFile(memory.mapping, FILE_MAP_READ, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION info;
+	if (!memory.data || !VirtualQuery(memory.data, &info, sizeof(info))) {
+		if (memory.data) UnmapViewOfFile(memory.data);
+		CloseHandle(memory.mapping);
+		memory.data = nullptr;
+		return false;
+	}
+	memory.size = info.RegionSize;
+#else
+	memory.name = std::string("/") + name;
+	int fd = shm_open(memory.name.c_str(), O_RDONLY, 0);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	void* data = fstat(fd, &info) == 0 && info.st_size > 0 ? mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	memory.data = data;
+	memory.size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+inline void close_shared_memory(SharedMemory& memory) {
+#if defined(_WIN32)
+	if (memory.data) UnmapViewOfFile(memory.data);
+	if (memory.mapping) CloseHandle(memory.mapping);
+	memory.mapping = NULL;
+#else
+	if (memory.data) munmap(memory.data, memory.size);
+	if (memory.owner && memory.data) shm_unlink(memory.name.c_str());
+#endif
+	memory.data = nullptr;
+	memory.size = 0;
+}
+
+inline size_t frame_stream_versions_size(int tile_count) {
+	return ((size_t)tile_count * sizeof(uint64_t) + 63) & ~(size_t)63;
+}
+
+inline size_t frame_stream_tile_pixels(int tile_size) {
+	return (size_t)tile_size * tile_size;
+}
+
+inline FrameStreamSlot* frame_stream_slot(FrameStreamHeader* header, uint64_t sequence) {
+	return (FrameStreamSlot*)((uint8_t*)header + FRAME_STREAM_HEADER_SIZE + (sequence % header->slot_count) * header->slot_stride);
+}
+
+inline const FrameStreamSlot* frame_stream_slot(const FrameStreamHeader* header, uint64_t sequence) {
+	return frame_stream_slot(const_cast<FrameStreamHeader*>(header), sequence);
+}
+
+inline uint64_t* frame_stream_versions(FrameStreamSlot* slot) {
+	return (uint64_t*)((uint8_t*)slot + FRAME_STREAM_SLOT_HEADER_SIZE);
+}
+
+inline const uint64_t* frame_stream_versions(const FrameStreamSlot* slot) {
+	return frame_stream_versions(const_cast<FrameStreamSlot*>(slot));
+}
+
+inline Vector4* frame_stream_tile(const FrameStreamHeader* header, FrameStreamSlot* slot, int tile) {
+	uint8_t* tiles = (uint8_t*)frame_stream_versions(slot) + frame_stream_versions_size(header->tiles_x * header->tiles_y);
+	return (Vector4*)tiles + (size_t)tile * frame_stream_tile_pixels(header->tile_size);
+}
+
+inline const Vector4* frame_stream_tile(const FrameStreamHeader* header, const FrameStreamSlot* slot, int tile) {
+	return frame_stream_tile(header, const_cast<FrameStreamSlot*>(slot), tile);
+}
+
+inline void frame_stream_tile_rect(const FrameStreamHeader* header, int tile, int& x0, int& y0, int& x1, int& y1) {
+	x0 = (tile % header->tiles_x) * header->tile_size;
+	y0 = (tile / header->tiles_x) * header->tile_size;
+	x1 = std::min(x0 + header->tile_size, (int)header->width);
+	y1 = std::min(y0 + header->tile_size, (int)header->height);
+}
+
+// Writer
+
+struct FrameStreamWriter {
+	SharedMemory memory;
+	FrameStreamHeader* header;
+	uint64_t sequence; // of the last publish
+	std::vector<uint64_t> versions; // sequence each tile last changed at
+	int tiles_changed; // by the last publish
+	double publish_seconds; // of the last publish
+};
+
+inline bool create_frame_stream(const char* name, int width, int height, FrameStreamWriter& writer, int tile_size = FRAME_STREAM_TILE_SIZE,
+	int slot_count = FRAME_STREAM_SLOTS) {
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	int tile_count = tiles_x * tiles_y;
+	uint64_t slot_stride = FRAME_STREAM_SLOT_HEADER_SIZE + frame_stream_versions_size(tile_count)
+		+ (uint64_t)tile_count * frame_stream_tile_pixels(tile_size) * sizeof(Vector4);
+	if (!create_shared_memory(name, FRAME_STREAM_HEADER_SIZE + slot_stride * slot_count, writer.memory)) {
+		fprintf(stderr, "%s: can't create the frame stream\n", name);
+		return false;
+	}
+
+	// Fresh shared memory is zeroed, so every slot starts out empty.
+	FrameStreamHeader* header = new (writer.memory.data) FrameStreamHeader();
+	header->width = width;
+	header->height = height;
+	header->tile_size = tile_size;
+	header->tiles_x = tiles_x;
+	header->tiles_y = tiles_y;
+	header->slot_count = slot_count;
+	header->slot_stride = slot_stride;
+	header->published.store(0);
+	header->closed.store(0);
+	header->version = FRAME_STREAM_VERSION;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = FRAME_STREAM_MAGIC; // last, readers that open the stream early wait for it
+	writer.header = header;
+	writer.sequence = 0;
+	writer.versions.assign(tile_count, 0);
+	writer.tiles_changed = 0;
+	writer.publish_seconds = 0;
+	return true;
+}
+
+// Publishes a width * height image with rows from the top. A tile gets a new version when it differs from the last
+// publish; the slot being filled is brought up to date by copying the tiles it is behind on. Returns the number of
+// changed tiles.
+inline int publish_frame(FrameStreamWriter& writer, const Vector4* pixels, int frame, int passes) {
+	auto start = std::chrono::steady_clock::now();
+	FrameStreamHeader* header = writer.header;
+	const uint64_t sequence = writer.sequence + 1;
+	const FrameStreamSlot* previous = writer.sequence > 0 ? frame_stream_slot(header, writer.sequence) : nullptr;
+	FrameStreamSlot* slot = frame_stream_slot(header, sequence);
+	slot->sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	uint64_t* slot_versions = frame_stream_versions(slot);
+	const int tile_size = header->tile_size;
+
+	int changed = 0;
+	for (int tile = 0; tile < (int)writer.versions.size(); tile++) {
+		int x0, y0, x1, y1;
+		frame_stream_tile_rect(header, tile, x0, y0, x1, y1);
+		size_t row_bytes = (size_t)(x1 - x0) * sizeof(Vector4);
+		bool same = previous != nullptr;
+		const Vector4* old_tile = previous ? frame_stream_tile(header, previous, tile) : nullptr;
+		for (int y = y0; y < y1 && same; y++) {
+			same = memcmp(old_tile + (size_t)(y - y0) * tile_size, pixels + (size_t)y * header->width + x0, row_bytes) == 0;
+		}
+		if (!same) {
+			writer.versions[tile] = sequence;
+			changed++;
+		}
+		if (slot_versions[tile] != writer.versions[tile]) {
+			Vector4* slot_tile = frame_stream_tile(header, slot, tile);
+			for (int y = y0; y < y1; y++) {
+				memcpy(slot_tile + (size_t)(y - y0) * tile_size, pixels + (size_t)y * header->width + x0, row_bytes);
+			}
+			slot_versions[tile] = writer.versions[tile];
+		}
+	}
+	slot->frame = frame;
+	slot->passes = passes;
+	slot->sequence.store(sequence, std::memory_order_release);
+	header->published.store(sequence, std::memory_order_release);
+	writer.sequence = sequence;
+	writer.tiles_changed = changed;
+	writer.publish_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return changed;
+}
+
+// Tells readers the stream is over and removes its name; mapped readers keep the memory.
+inline void close_frame_stream(FrameStreamWriter& writer) {
+	if (writer.memory.data) {
+		writer.header->closed.store(1, std::memory_order_release);
+		close_shared_memory(writer.memory);
+	}
+	writer.header = nullptr;
+}
+
+// Reader
+
+struct FrameStreamReader {
+	SharedMemory memory;
+	const FrameStreamHeader* header;
+	uint64_t sequence; // of the last complete update
+	std::vector<uint64_t> versions; // of the tiles as of that update
+	int frame;
+	int passes;
+	int lapped; // updates given up because the writer reused the slot meanwhile
+};
+
+// False while the stream doesn't exist yet or its writer hasn't finished setting it up.
+inline bool open_frame_stream(const char* name, FrameStreamReader& reader) {
+	if (!open_shared_memory(name, reader.memory)) {
+		return false;
+	}
+	const FrameStreamHeader* header = (const FrameStreamHeader*)reader.memory.data;
+	bool valid = reader.memory.size >= FRAME_STREAM_HEADER_SIZE && header->magic == FRAME_STREAM_MAGIC;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	valid = valid && header->version == FRAME_STREAM_VERSION
+		&& reader.memory.size >= FRAME_STREAM_HEADER_SIZE + header->slot_stride * (uint64_t)header->slot_count;
+	if (!valid) {
+		close_shared_memory(reader.memory);
+		return false;
+	}
+	reader.header = header;
+	reader.sequence = 0;
+	reader.versions.assign(header->tiles_x * header->tiles_y, 0);
+	reader.frame = -1;
+	reader.passes = 0;
+	reader.lapped = 0;
+	return true;
+}
+
+// Calls pull(tile, pixels) for every tile that changed since the last update, with pixels pointing into the shared
+// slot (rows of header->tile_size, see frame_stream_tile_rect). Returns the number of tiles pulled, 0 when nothing was
+// published since, or -1 when the writer reused the slot while it was read: what pull saw may be torn, and the same
+// tiles come again on the next update.
+template <typename Pull>
+inline int frame_stream_update(FrameStreamReader& reader, Pull pull) {
+	const FrameStreamHeader* header = reader.header;
+	uint64_t sequence = header->published.load(std::memory_order_acquire);
+	if (sequence == reader.sequence) {
+		return 0;
+	}
+	const FrameStreamSlot* slot = frame_stream_slot(header, sequence);
+	if (slot->sequence.load(std::memory_order_acquire) != sequence) {
+		reader.lapped++;
+		return -1;
+	}
+	const uint64_t* slot_versions = frame_stream_versions(slot);
+	std::vector<std::pair<int, uint64_t>> pulled;
+	for (int tile = 0; tile < (int)reader.versions.size(); tile++) {
+		uint64_t version = slot_versions[tile];
+		if (version != reader.versions[tile]) {
+			pull(tile, frame_stream_tile(header, slot, tile));
+			pulled.push_back(std::make_pair(tile, version));
+		}
+	}
+	int frame = slot->frame;
+	int passes = slot->passes;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot->sequence.load(std::memory_order_relaxed) != sequence) {
+		reader.lapped++;
+		return -1;
+	}
+	for (const std::pair<int, uint64_t>& tile : pulled) {
+		reader.versions[tile.first] = tile.second;
+	}
+	reader.sequence = sequence;
+	reader.frame = frame;
+	reader.passes = passes;
+	return (int)pulled.size();
+}
+
+// Frame of the newest publish if the reader hasn't seen it yet, otherwise -1. Only a hint, the slot may be reused
+// right after.
+inline int frame_stream_next_frame(const FrameStreamReader& reader) {
+	uint64_t sequence = reader.header->published.load(std::memory_order_acquire);
+	return sequence == reader.sequence ? -1 : frame_stream_slot(reader.header, sequence)->frame;
+}
+
+inline bool frame_stream_closed(const FrameStreamReader& reader) {
+	return reader.header->closed.load(std::memory_order_acquire) != 0;
+}
+
+inline void close_frame_stream(FrameStreamReader& reader) {
+	close_shared_memory(reader.memory);
+	reader.header = nullptr;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "image_io.h"
+
+// Second pipeline stage for the headless renderer: finished frames are queued here and encoded/written on
+// a separate thread while the tracer works on the next frame. The queue is bounded so a slow disk applies
+// back pressure instead of piling up full resolution float buffers.
+
+struct FrameWriteJob {
+	std::string path;
+	int width;
+	int height;
+	std::vector<Vector4> pixels;
+};
+
+struct FrameWriter {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<FrameWriteJob> queue;
+	size_t max_queued;
+	bool closing;
+	int failed_count;
+	double busy_seconds; // time spent encoding and writing, to compare with render time
+};
+
+inline void frame_writer_loop(FrameWriter& writer) {
+	for (;;) {
+		FrameWriteJob job;
+		{
+			std::unique_lock<std::mutex> lock(writer.mutex);
+			writer.changed.wait(lock, [&]() { return writer.closing || !writer.queue.empty(); });
+			if (writer.queue.empty()) {
+				return;
+			}
+			job = std::move(writer.queue.front());
+			writer.queue.pop_front();
+		}
+		writer.changed.notify_all();
+
+		auto start = std::chrono::steady_clock::now();
+		bool ok = write_image(job.path.c_str(), job.pixels.data(), job.width, job.height);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!ok) {
+			fprintf(stderr, "failed to write %s\n", job.path.c_str());
+		}
+
+		std::lock_guard<std::mutex> lock(writer.mutex);
+		writer.failed_count += ok ? 0 : 1;
+		writer.busy_seconds += seconds;
+	}
+}
+
+inline void start_frame_writer(FrameWriter& writer, size_t max_queued = 2) {
+	writer.max_queued = max_queued;
+	writer.closing = false;
+	writer.failed_count = 0;
+	writer.busy_seconds = 0;
+	writer.thread = std::thread(frame_writer_loop, std::ref(writer));
+}
+
+// Blocks only while max_queued frames are already waiting.
+inline void frame_writer_push(FrameWriter& writer, FrameWriteJob job) {
+	{
+		std::unique_lock<std::mutex> lock(writer.mutex);
+		writer.changed.wait(lock, [&]() { return writer.queue.size() < writer.max_queued; });
+		writer.queue.push_back(std::move(job));
+	}
+	writer.changed.notify_all();
+}
+
+// Writes everything still queued, then stops the thread. Returns the number of frames that failed to write.
+inline int finish_frame_writer(FrameWriter& writer) {
+	{
+		std::lock_guard<std::mutex> lock(writer.mutex);
+		writer.closing = true;
+	}
+	writer.changed.notify_all();
+	writer.thread.join();
+	return writer.failed_count;
+}
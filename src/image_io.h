@@ -0,0 +1,241 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "maths.h"
+
+// Minimal PNG and OpenEXR writers for the accumulation buffer, so the headless renderer needs no extra libraries.
+// PNG is 8-bit RGB with the same clamp the playground window applies (no gamma). The zlib stream uses stored
+// blocks only, which trades file size for encode speed. EXR is uncompressed 32-bit float RGBA, linear.
+
+inline uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+	static uint32_t table[256];
+	static bool table_ready = false;
+	if (!table_ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		table_ready = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+inline void put_u32_be(std::vector<uint8_t>& out, uint32_t v) {
+	uint8_t bytes[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+	out.insert(out.end(), bytes, bytes + 4);
+}
+
+template <typename T>
+inline void put_le(std::vector<uint8_t>& out, T v) {
+	uint8_t bytes[sizeof(T)];
+	memcpy(bytes, &v, sizeof(T)); // all supported targets are little endian
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+inline void put_png_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+	put_u32_be(out, (uint32_t)size);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put_u32_be(out, crc32(0, out.data() + start, size + 4));
+}
+
+inline uint8_t to_unorm8(float v) {
+	return (uint8_t)(std::min(std::max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+inline std::vector<uint8_t> encode_png(const Vector4* pixels, int width, int height) {
+	// Filter type 0 for every row, then RGB.
+	size_t row_size = (size_t)width * 3 + 1;
+	std::vector<uint8_t> raw(row_size * height);
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = &raw[row_size * y];
+		row[0] = 0;
+		for (int x = 0; x < width; x++) {
+			const Vector4& p = pixels[(size_t)y * width + x];
+			row[1 + x * 3 + 0] = to_unorm8(p.x);
+			row[1 + x * 3 + 1] = to_unorm8(p.y);
+			row[1 + x * 3 + 2] = to_unorm8(p.z);
+		}
+	}
+
+	std::vector<uint8_t> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	uint32_t adler_a = 1, adler_b = 0;
+	for (size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535) {
+		size_t size = std::min<size_t>(65535, raw.size() - offset);
+		bool last = offset + size >= raw.size();
+		zlib.push_back(last ? 1 : 0);
+		put_le<uint16_t>(zlib, (uint16_t)size);
+		put_le<uint16_t>(zlib, (uint16_t)~size);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + size);
+		for (size_t i = offset; i < offset + size; i++) {
+			adler_a = (adler_a + raw[i]) % 65521;
+			adler_b = (adler_b + adler_a) % 65521;
+		}
+		if (last) {
+			break;
+		}
+	}
+	put_u32_be(zlib, (adler_b << 16) | adler_a);
+
+	std::vector<uint8_t> png;
+	const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	png.insert(png.end(), signature, signature + 8);
+
+	std::vector<uint8_t> header;
+	put_u32_be(header, width);
+	put_u32_be(header, height);
+	const uint8_t format[5] = { 8, 2, 0, 0, 0 }; // 8 bit, truecolor, deflate, adaptive filtering, no interlace
+	header.insert(header.end(), format, format + 5);
+
+	put_png_chunk(png, "IHDR", header.data(), header.size());
+	put_png_chunk(png, "IDAT", zlib.data(), zlib.size());
+	put_png_chunk(png, "IEND", nullptr, 0);
+	return png;
+}
+
+inline void put_exr_attribute(std::vector<uint8_t>& out, const char* name, const char* type, const std::vector<uint8_t>& value) {
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put_le<int32_t>(out, (int32_t)value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+inline std::vector<uint8_t> encode_exr(const Vector4* pixels, int width, int height) {
+	const char* channel_names[] = { "A", "B", "G", "R" }; // EXR wants channels sorted by name
+
+	std::vector<uint8_t> channels;
+	for (const char* name : channel_names) {
+		channels.insert(channels.end(), name, name + 2);
+		put_le<int32_t>(channels, 2); // FLOAT
+		put_le<int32_t>(channels, 0); // pLinear + reserved
+		put_le<int32_t>(channels, 1); // x sampling
+		put_le<int32_t>(channels, 1); // y sampling
+	}
+	channels.push_back(0);
+
+	std::vector<uint8_t> box;
+	put_le<int32_t>(box, 0);
+	put_le<int32_t>(box, 0);
+	put_le<int32_t>(box, width - 1);
+	put_le<int32_t>(box, height - 1);
+
+	std::vector<uint8_t> zero_byte(1, 0);
+	std::vector<uint8_t> one_float, center;
+	put_le<float>(one_float, 1.0f);
+	put_le<float>(center, 0.0f);
+	put_le<float>(center, 0.0f);
+
+	std::vector<uint8_t> exr;
+	put_le<uint32_t>(exr, 20000630); // magic
+	put_le<uint32_t>(exr, 2); // version 2, single part scanline
+	put_exr_attribute(exr, "channels", "chlist", channels);
+	put_exr_attribute(exr, "compression", "compression", zero_byte);
+	put_exr_attribute(exr, "dataWindow", "box2i", box);
+	put_exr_attribute(exr, "displayWindow", "box2i", box);
+	put_exr_attribute(exr, "lineOrder", "lineOrder", zero_byte);
+	put_exr_attribute(exr, "pixelAspectRatio", "float", one_float);
+	put_exr_attribute(exr, "screenWindowCenter", "v2f", center);
+	put_exr_attribute(exr, "screenWindowWidth", "float", one_float);
+	exr.push_back(0);
+
+	// One scanline per block without compression: y, byte count, then each channel's row.
+	uint32_t line_size = (uint32_t)width * 4 * sizeof(float);
+	uint64_t offset = exr.size() + (uint64_t)height * sizeof(uint64_t);
+	for (int y = 0; y < height; y++) {
+		put_le<uint64_t>(exr, offset + (uint64_t)y * (line_size + 8));
+	}
+
+	exr.reserve(exr.size() + (size_t)height * (line_size + 8));
+	for (int y = 0; y < height; y++) {
+		put_le<int32_t>(exr, y);
+		put_le<uint32_t>(exr, line_size);
+		const Vector4* row = pixels + (size_t)y * width;
+		for (int x = 0; x < width; x++) put_le<float>(exr, row[x].w);
+		for (int x = 0; x < width; x++) put_le<float>(exr, row[x].z);
+		for (int x = 0; x < width; x++) put_le<float>(exr, row[x].y);
+		for (int x = 0; x < width; x++) put_le<float>(exr, row[x].x);
+	}
+
+	return exr;
+}
+
+inline bool ends_with(const char* str, const char* suffix) {
+	size_t str_size = strlen(str), suffix_size = strlen(suffix);
+	return str_size >= suffix_size && strcmp(str + str_size - suffix_size, suffix) == 0;
+}
+
+// Writes pattern to path with its frame conversion, %d, %Nd or %0Nd, replaced by frame and %% by %. The pattern is
+// never passed to printf: it returns false for any other conversion, for a second frame conversion, or if the path
+// doesn't fit. frame_conversions, if given, gets whether the pattern has a frame conversion.
+inline bool format_frame_path(char* path, size_t path_size, const char* pattern, int frame, int* frame_conversions = nullptr) {
+	size_t length = 0;
+	int conversions = 0;
+	auto put = [&](const char* text, size_t size) {
+		if (length + size >= path_size) {
+			return false;
+		}
+		memcpy(path + length, text, size);
+		length += size;
+		return true;
+	};
+	for (const char* c = pattern; *c; c++) {
+		if (*c != '%' || *++c == '%') {
+			if (!put(c, 1)) {
+				return false;
+			}
+			continue;
+		}
+		bool zero_padded = *c == '0';
+		int width = 0;
+		for (c += zero_padded; *c >= '0' && *c <= '9'; c++) {
+			width = width * 10 + (*c - '0');
+			if (width > 64) {
+				return false;
+			}
+		}
+		if (*c != 'd' || conversions++ > 0) {
+			return false;
+		}
+		char number[80];
+		int size = snprintf(number, sizeof(number), zero_padded ? "%0*d" : "%*d", width, frame);
+		if (!put(number, (size_t)size)) {
+			return false;
+		}
+	}
+	if (path_size == 0) {
+		return false;
+	}
+	path[length] = '\0';
+	if (frame_conversions) {
+		*frame_conversions = conversions;
+	}
+	return true;
+}
+
+// Picks the format from the extension (.exr, anything else is PNG). Returns false if the file can't be written.
+inline bool write_image(const char* path, const Vector4* pixels, int width, int height) {
+	std::vector<uint8_t> data = ends_with(path, ".exr") ? encode_exr(pixels, width, height) : encode_png(pixels, width, height);
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+	bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
@@ -6,6 +6,7 @@
 #include <vector>
 #include "d3d_utils.h"
 #include "raytracer.h"
+#include "scene_file.h"
 
 static ID3D11Device*            g_pd3dDevice = NULL;
 static ID3D11DeviceContext*     g_pd3dDeviceContext = NULL;
@@ -17,7 +18,8 @@ void CleanupDeviceD3D();
 void CreateRenderTarget();
 void CleanupRenderTarget();
 
-void render_imgui(RaytracerData& raytracer_data);
+void render_imgui(RaytracerData& raytracer_data, SceneStore& scene_store, BVH& bvh, BVHUpdater& bvh_updater, std::vector<int>& lights, CameraPlacement& camera, CpuRenderer& cpu_renderer, DenoiseSettings& denoise_settings, bool& use_cpu_backend);
+void render_frame_stats(const FrameStats& stats, bool use_cpu_backend);
 
 LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 
@@ -29,7 +31,14 @@ struct WindowData {
 
 };
 
-int main(int, char**) {
+int main(int argc, char** argv) {
+    // Binary scenes are mapped, text scenes parsed (see scene_file.h).
+    const char* scene_path = argc > 1 ? argv[1] : "data/scenes/default.txt";
+    Scene scene;
+    if (!load_scene(scene_path, scene)) {
+        return 1;
+    }
+
     WindowData window_data;
     window_data.width = 1938;
     window_data.height = 1127;
@@ -76,105 +85,32 @@ int main(int, char**) {
 
     QuadRenderer quad_renderer = initialize_quad_renderer(g_pd3dDevice);
     ComputeShaderData compute_data = create_raytracer_shader(g_pd3dDevice, g_pSwapChain);
+    D3D11UploadDevice upload_device(g_pd3dDevice, g_pd3dDeviceContext);
+    SceneStore scene_store = create_scene_store(&upload_device);
 
     // RAYTRACER DATA
-    std::vector<Sphere> spheres;
-    std::vector<Material> materials;
-    {
-        Material mat_light = {};
-        mat_light.albedo = Vector3(10, 10, 10);
-        mat_light.type = 0;
-
-        Material mat_light_red = {};
-        mat_light_red.albedo = Vector3(10, 0, 0);
-        mat_light_red.type = 0;
-
-        Material mat_light_green = {};
-        mat_light_green.albedo = Vector3(0, 10, 0);
-        mat_light_green.type = 0;
-
-        Material mat_light_blue = {};
-        mat_light_blue.albedo = Vector3(0, 0, 10);
-        mat_light_blue.type = 0;
-
-        Material mat_lambert_yellowish = {};
-        mat_lambert_yellowish.albedo = Vector3(0.8f, 0.8f, 0.0f);
-        mat_lambert_yellowish.type = 1;
-
-        Material mat_lambert_reddish = {};
-        mat_lambert_reddish.albedo = Vector3(0.7f, 0.3f, 0.3f);
-        mat_lambert_reddish.type = 1;
-
-        Material mat_lambert_greenish = {};
-        mat_lambert_greenish.albedo = Vector3(0.3f, 0.7f, 0.3f);
-        mat_lambert_greenish.type = 1;
-
-        Material mat_lambert_bluish = {};
-        mat_lambert_bluish.albedo = Vector3(0.3f, 0.3f, 0.7f);
-        mat_lambert_bluish.type = 1;
-
-        Material mat_mirror = {};
-        mat_mirror.albedo = Vector3(0.8f, 0.8f, 0.8f);
-        mat_mirror.type = 2;
-        mat_mirror.fuzziness = 0.0f;
-
-        Material mat_less_fuzzy_metal = {};
-        mat_less_fuzzy_metal.albedo = Vector3(0.8f, 0.8f, 0.8f);
-        mat_less_fuzzy_metal.type = 2;
-        mat_less_fuzzy_metal.fuzziness = 0.3f;
-
-        Material mat_less_fuzzy_pink_metal = {};
-        mat_less_fuzzy_pink_metal.albedo = Vector3(0.6f, 0.0f, 0.3f);
-        mat_less_fuzzy_pink_metal.type = 2;
-        mat_less_fuzzy_pink_metal.fuzziness = 0.5f;
-
-        Material mat_fuzzy_metal = {};
-        mat_fuzzy_metal.albedo = Vector3(0.3f, 0.6f, 0.8f);
-        mat_fuzzy_metal.type = 2;
-        mat_fuzzy_metal.fuzziness = 0.7f;
-
-        spheres.push_back(Sphere(Vector3(0, 40, 0), 10));
-        materials.push_back(mat_light_red);
-        
-        spheres.push_back(Sphere(Vector3(0, 40, -40), 10));
-        materials.push_back(mat_light_green);
-        
-        spheres.push_back(Sphere(Vector3(0, 40, 40), 10));
-        materials.push_back(mat_light_blue);
-        
-        spheres.push_back(Sphere(Vector3(0, -100.5f, -1), 100));
-        materials.push_back(mat_fuzzy_metal);
-        
-        spheres.push_back(Sphere(Vector3(0, 0, -1), 0.5f));
-        materials.push_back(mat_mirror);
-        
-        spheres.push_back(Sphere(Vector3(0, 1, -1), 0.5f));
-        materials.push_back(mat_mirror);
-        
-        spheres.push_back(Sphere(Vector3(-1.2f, 0, -1.5f), 0.5f));
-        materials.push_back(mat_lambert_yellowish);
-        
-        spheres.push_back(Sphere(Vector3(1.2f, 0, -1), 0.5f));
-        materials.push_back(mat_lambert_reddish);
-        
-        spheres.push_back(Sphere(Vector3(0.5f, -0.2, 0), 0.3f));
-        materials.push_back(mat_lambert_greenish);
-        
-        spheres.push_back(Sphere(Vector3(1.4, -0.2, 0), 0.3));
-        materials.push_back(mat_fuzzy_metal);
-        
-        spheres.push_back(Sphere(Vector3(-0.8f, -0.2, -0.2), 0.3f));
-        materials.push_back(mat_lambert_bluish);
-        
-        spheres.push_back(Sphere(Vector3(-0.2f, -0.4, 0), 0.1f));
-        materials.push_back(mat_less_fuzzy_pink_metal);
-    }
-
-
     const auto aspect_ratio = (float)1920 / 1080;
-    Camera camera(Vector3(0, 1, 1), Vector3(0, 0, -1), Vector3(0, 1, 0), aspect_ratio, 90, 0.0f, 1.5f);
-    RaytracerProperties properties = { 1920, 1080, 0, spheres.size(), camera};
-    RaytracerData raytracer_data = { properties, spheres.data(), materials.data() };
+    RaytracerData raytracer_data = {};
+    raytracer_data.properties.width = 1920;
+    raytracer_data.properties.height = 1080;
+    raytracer_data.properties.camera = create_camera(scene.camera, aspect_ratio);
+    set_scene(raytracer_data, scene);
+    BVH bvh;
+    BVHUpdater bvh_updater = {};
+    if (!scene.bvh_nodes) {
+        bvh = build_bvh(scene.spheres, scene.sphere_count);
+        bvh_updater = create_bvh_updater(bvh, scene.spheres, scene.sphere_count);
+        set_bvh(raytracer_data, bvh);
+    }
+    SphereSoA sphere_soa;
+    set_sphere_soa(raytracer_data, sphere_soa);
+    std::vector<int> lights = build_light_list(scene.materials, scene.sphere_count);
+    set_lights(raytracer_data, lights);
+    raytracer_data.properties.light_sampling = 1;
+    CpuRenderer cpu_renderer = create_cpu_renderer(raytracer_data.properties.width, raytracer_data.properties.height);
+    Denoiser denoiser;
+    DenoiseSettings denoise_settings;
+    bool use_cpu_backend = false;
     
     bool done = false;
     while (!done)
@@ -204,9 +140,14 @@ int main(int, char**) {
 
         g_pd3dDeviceContext->OMSetRenderTargets(1, &g_mainRenderTargetView, NULL);
 
-        raytracer_render(g_pd3dDeviceContext, compute_data, raytracer_data, quad_renderer);
+        if (use_cpu_backend) {
+            raytracer_render_cpu(g_pd3dDeviceContext, compute_data, cpu_renderer, raytracer_data, quad_renderer, denoiser, denoise_settings);
+        }
+        else {
+            raytracer_render(g_pd3dDeviceContext, compute_data, scene_store, raytracer_data, quad_renderer);
+        }
 
-        render_imgui(raytracer_data);
+        render_imgui(raytracer_data, scene_store, bvh, bvh_updater, lights, scene.camera, cpu_renderer, denoise_settings, use_cpu_backend);
         ImGui_ImplDX11_RenderDrawData(ImGui::GetDrawData());
 
         g_pSwapChain->Present(0, 0); 
@@ -216,15 +157,18 @@ int main(int, char**) {
     ImGui_ImplWin32_Shutdown();
     ImGui::DestroyContext();
 
+    cpu_raytracer_cancel(cpu_renderer);
+    release_scene_store(scene_store);
     CleanupDeviceD3D();
     DestroyWindow(window_data.hwnd);
     UnregisterClass(window_data.wc.lpszClassName, window_data.wc.hInstance);
+    free_scene(scene);
 
     return 0;
 }
 
 
-void render_imgui(RaytracerData& raytracer_data)
+void render_imgui(RaytracerData& raytracer_data, SceneStore& scene_store, BVH& bvh, BVHUpdater& bvh_updater, std::vector<int>& lights, CameraPlacement& camera, CpuRenderer& cpu_renderer, DenoiseSettings& denoise_settings, bool& use_cpu_backend)
 {
     ImGui_ImplDX11_NewFrame();
     ImGui_ImplWin32_NewFrame();
@@ -234,26 +178,142 @@ void render_imgui(RaytracerData& raytracer_data)
         ImGui::Begin("Playground");
         char buffer[50];
         const char* elements[] = { "Light", "Lambertian", "Metal" };
+
+        if (ImGui::Checkbox("CPU backend", &use_cpu_backend)) {
+            cpu_raytracer_cancel(cpu_renderer);
+            raytracer_data.properties.frame_count = 0;
+        }
+        bool light_sampling = raytracer_data.properties.light_sampling != 0;
+        if (ImGui::Checkbox("Light sampling", &light_sampling)) {
+            cpu_raytracer_cancel(cpu_renderer);
+            raytracer_data.properties.light_sampling = light_sampling ? 1 : 0;
+            raytracer_data.properties.frame_count = 0;
+        }
+        // Sampling settings, shared by both backends.
+        RaytracerProperties sampling = raytracer_data.properties;
+        bool sampling_changed = ImGui::SliderInt("Samples per pass", &sampling.samples, 1, 200);
+        sampling_changed |= ImGui::SliderInt("Max depth", &sampling.max_depth, 1, 100);
+        sampling_changed |= ImGui::SliderInt("Roulette depth", &sampling.roulette_depth, 0, sampling.max_depth);
+        if (sampling_changed) {
+            cpu_raytracer_cancel(cpu_renderer);
+            raytracer_data.properties.samples = sampling.samples;
+            raytracer_data.properties.max_depth = sampling.max_depth;
+            raytracer_data.properties.roulette_depth = sampling.roulette_depth;
+            raytracer_data.properties.frame_count = 0;
+        }
+        if (use_cpu_backend) {
+            float adaptive_threshold = cpu_renderer.adaptive_threshold;
+            if (ImGui::SliderFloat("Adaptive error", &adaptive_threshold, 0.0f, 0.1f, "%.3f")) {
+                cpu_raytracer_cancel(cpu_renderer);
+                cpu_renderer.adaptive_threshold = adaptive_threshold;
+                raytracer_data.properties.frame_count = 0;
+            }
+            if (ImGui::Checkbox("Wavefront (slower)", &cpu_renderer.wavefront)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.properties.frame_count = 0;
+            }
+            if (ImGui::Checkbox("Primary ray packets", &cpu_renderer.packets)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.properties.frame_count = 0;
+            }
+            if (ImGui::Checkbox("Specialized kernels", &cpu_renderer.specialize)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.properties.frame_count = 0;
+            }
+            int sampler = raytracer_data.sampler;
+            if (ImGui::SliderInt("Sampler", &sampler, 0, SAMPLER_COUNT - 1, sampler_name(sampler))) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.sampler = sampler;
+                raytracer_data.properties.frame_count = 0;
+            }
+            // The AOVs are only written by a frame's first pass.
+            if (ImGui::Checkbox("Denoise", &cpu_renderer.write_aovs)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.properties.frame_count = 0;
+            }
+            if (cpu_renderer.write_aovs) {
+                // Only the filtering changes, the next pass picks the new settings up.
+                ImGui::SliderInt("Denoise iterations", &denoise_settings.iterations, 1, DENOISE_MAX_ITERATIONS);
+                ImGui::SliderFloat("Denoise color sigma", &denoise_settings.color_sigma, 0.25f, 8.0f, "%.2f");
+            }
+            if (ImGui::Checkbox("Reproject on camera motion", &cpu_renderer.reproject)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.properties.frame_count = 0;
+            }
+            if (cpu_raytracer_converged(cpu_renderer, raytracer_data)) {
+                ImGui::Text("Converged after %d passes", raytracer_data.properties.frame_count);
+            }
+        }
+        if (!use_cpu_backend && raytracer_data.mesh_instance_count > 0) {
+            ImGui::Text("Meshes are only traced by the CPU backend");
+        }
+
+        CameraPlacement placement = camera;
+        bool camera_changed = ImGui::DragFloat3("Camera position", &placement.position.x, 0.01f);
+        camera_changed |= ImGui::DragFloat3("Camera target", &placement.look_at.x, 0.01f);
+        if (camera_changed) {
+            camera = placement;
+            Camera moved = create_camera(placement, raytracer_data.properties.camera.aspect_ratio);
+            if (use_cpu_backend) {
+                cpu_reproject(cpu_renderer, raytracer_data, moved); // restarts the frame unless reprojection is on
+            }
+            else {
+                raytracer_data.properties.camera = moved;
+                raytracer_data.properties.frame_count = 0;
+            }
+        }
         
+        // Widgets edit copies, so a running CPU pass can be stopped before the scene changes under it.
         for (int i = 0; i < raytracer_data.properties.sphere_count; i++) {
+            Vector3 center = raytracer_data.spheres[i].center;
             sprintf_s(buffer, "Sphere #%d", i);
-            if (ImGui::DragFloat3(buffer, &raytracer_data.spheres[i].center.x, 0.01f)) {
+            if (ImGui::DragFloat3(buffer, &center.x, 0.01f)) {
+                cpu_raytracer_cancel(cpu_renderer);
+                raytracer_data.spheres[i].center = center;
                 raytracer_data.properties.frame_count = 0;
+                scene_store_mark_sphere_dirty(scene_store, i);
+                if (bvh.nodes.empty()) {
+                    // The BVH came with a binary scene; the first edit builds one that can be updated.
+                    bvh = build_bvh(raytracer_data.spheres, raytracer_data.properties.sphere_count);
+                    bvh_updater = create_bvh_updater(bvh, raytracer_data.spheres, raytracer_data.properties.sphere_count);
+                    set_bvh(raytracer_data, bvh);
+                    set_sphere_soa(raytracer_data, *raytracer_data.sphere_soa);
+                    scene_store_mark_bvh_dirty(scene_store);
+                }
+                else {
+                    // Refit from the sphere's leaf up, see bvh_refit.h, and copy only what changed.
+                    bvh_update_spheres(bvh, bvh_updater, raytracer_data.spheres, &i, 1);
+                    set_bvh(raytracer_data, bvh);
+                    int entry_count = bvh_updater.dirty_entry_end - bvh_updater.dirty_entry_first;
+                    int node_count = bvh_updater.dirty_node_end - bvh_updater.dirty_node_first;
+                    update_sphere_soa(*raytracer_data.sphere_soa, raytracer_data.spheres, raytracer_data.bvh_primitive_indices, bvh_updater.dirty_entry_first, entry_count);
+                    scene_store_mark_dirty(scene_store, SCENE_BUFFER_BVH_PRIMITIVE_INDICES, bvh_updater.dirty_entry_first, entry_count);
+                    scene_store_mark_dirty(scene_store, SCENE_BUFFER_BVH_NODES, bvh_updater.dirty_node_first, node_count);
+                }
             }
+
+            Material material = raytracer_data.materials[i];
+            bool material_changed = false;
             sprintf_s(buffer, "Material #%d", i);
-            if (ImGui::ColorEdit3(buffer, &raytracer_data.materials[i].albedo.x)) {
-                raytracer_data.properties.frame_count = 0;
-            }
-            if (raytracer_data.materials[i].type == 2) {
+            material_changed |= ImGui::ColorEdit3(buffer, &material.albedo.x);
+            if (material.type == 2) {
                 sprintf_s(buffer, "Fuzziness #%d", i);
-                if (ImGui::DragFloat(buffer, &raytracer_data.materials[i].fuzziness, 0.01f, 0, 1)) {
-                    raytracer_data.properties.frame_count = 0;
-                }
+                material_changed |= ImGui::DragFloat(buffer, &material.fuzziness, 0.01f, 0, 1);
             }
 
             sprintf_s(buffer, "Material type #%d", i);
-            if (ImGui::ListBox(buffer, &raytracer_data.materials[i].type, elements, 3)) {
+            material_changed |= ImGui::ListBox(buffer, &material.type, elements, 3);
+            if (material_changed) {
+                cpu_raytracer_cancel(cpu_renderer);
+                bool type_changed = raytracer_data.materials[i].type != material.type;
+                raytracer_data.materials[i] = material;
                 raytracer_data.properties.frame_count = 0;
+                scene_store_mark_material_dirty(scene_store, i);
+                if (type_changed) {
+                    lights = build_light_list(raytracer_data.materials, raytracer_data.properties.sphere_count);
+                    set_lights(raytracer_data, lights);
+                    scene_store_mark_lights_dirty(scene_store);
+                }
             }
             ImGui::NewLine();
         }
@@ -262,9 +322,56 @@ void render_imgui(RaytracerData& raytracer_data)
         ImGui::End();
     }
 
+    render_frame_stats(cpu_renderer.stats, use_cpu_backend);
+
     ImGui::Render();
 }
 
+// Counters of the last finished CPU pass, see frame_stats.h.
+void render_frame_stats(const FrameStats& stats, bool use_cpu_backend)
+{
+    ImGui::Begin("Frame stats");
+    if (!use_cpu_backend) {
+        ImGui::Text("Frame stats are recorded by the CPU backend");
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Text("Frame %d: %.2f ms, %.2f Mrays/s", stats.frame, stats.frame_ms, frame_stats_mrays_per_s(stats));
+    ImGui::Text("Rays %llu, paths %llu", (unsigned long long)stats.rays, (unsigned long long)stats.paths);
+    ImGui::Text("Intersection tests %llu (%.1f per ray)", (unsigned long long)stats.intersection_tests, stats.rays ? (double)stats.intersection_tests / stats.rays : 0.0);
+    ImGui::Text("BVH nodes visited %llu (%.1f per ray)", (unsigned long long)stats.bvh_nodes_visited, stats.rays ? (double)stats.bvh_nodes_visited / stats.rays : 0.0);
+    if (stats.pixels_sampled > 0) {
+        ImGui::Text("Adaptive: %llu pixels sampled, %llu above the error threshold", (unsigned long long)stats.pixels_sampled, (unsigned long long)stats.pixels_unconverged);
+    }
+
+    ImGui::Separator();
+    ImGui::Text("Ray generation %.2f ms", stats.ray_generation_ms);
+    ImGui::Text("Trace %.2f ms", stats.trace_ms);
+    ImGui::Text("Accumulation %.2f ms", stats.accumulation_ms);
+    ImGui::Text("Display %.2f ms", stats.display_ms);
+    if (stats.denoise_ms > 0) {
+        ImGui::Text("Denoise %.2f ms", stats.denoise_ms);
+    }
+
+    ImGui::Separator();
+    float bounces[FRAME_STATS_BOUNCE_BUCKETS];
+    int bounce_count = frame_stats_bounce_count(stats);
+    for (int i = 0; i < bounce_count; i++) {
+        bounces[i] = (float)stats.bounce_histogram[i];
+    }
+    ImGui::PlotHistogram("Bounces per path", bounces, bounce_count, 0, NULL, 0.0f, FLT_MAX, ImVec2(0, 80));
+
+    ImGui::Separator();
+    char label[64];
+    for (size_t i = 0; i < stats.thread_busy_ms.size(); i++) {
+        float busy = stats.frame_ms > 0 ? (float)(stats.thread_busy_ms[i] / stats.frame_ms) : 0.0f;
+        sprintf_s(label, "busy %.1f ms, idle %.1f ms", stats.thread_busy_ms[i], stats.thread_idle_ms[i]);
+        ImGui::ProgressBar(busy, ImVec2(-1, 0), label);
+    }
+    ImGui::End();
+}
+
 bool CreateDeviceD3D(HWND hWnd)
 {
     DXGI_SWAP_CHAIN_DESC sd;
@@ -0,0 +1,114 @@
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Whole-file, copy-on-write memory mapping. Pages are loaded lazily by the OS and writes stay private to the
+// process, so scene data can be edited in place (e.g. from ImGui) without touching the file on disk.
+
+struct MappedFile {
+	void* data;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+inline void unmap_file(MappedFile& mapped) {
+#if defined(_WIN32)
+	if (mapped.data) UnmapViewOfFile(mapped.data);
+	if (mapped.mapping) CloseHandle(mapped.mapping);
+	if (mapped.file && mapped.file != INVALID_HANDLE_VALUE) CloseHandle(mapped.file);
+	mapped.file = NULL;
+	mapped.mapping = NULL;
+#else
+	if (mapped.data) munmap(mapped.data, mapped.size);
+#endif
+	mapped.data = nullptr;
+	mapped.size = 0;
+}
+
+inline bool map_file(const char* path, MappedFile& mapped) {
+	mapped = {};
+#if defined(_WIN32)
+	mapped.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapped.file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mapped.file, &size) || size.QuadPart == 0) {
+		unmap_file(mapped);
+		return false;
+	}
+	mapped.size = (size_t)size.QuadPart;
+	mapped.mapping = CreateFileMappingA(mapped.file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapped.mapping) {
+		mapped.data = MapViewOfFile(mapped.mapping, FILE_MAP_COPY, 0, 0, 0);
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		mapped.size = (size_t)info.st_size;
+		void* data = mmap(nullptr, mapped.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		mapped.data = data == MAP_FAILED ? nullptr : data;
+	}
+	close(fd); // the mapping keeps its own reference
+#endif
+	if (!mapped.data) {
+		unmap_file(mapped);
+		return false;
+	}
+	return true;
+}
+
+// Lets the OS drop the pages of [offset, offset + size) from memory, e.g. after they were copied out. They are read
+// from the file again if touched later, and private writes to them are lost. Offset should be page aligned.
+inline void release_mapped_range(const MappedFile& mapped, size_t offset, size_t size) {
+	if (!mapped.data || offset >= mapped.size) {
+		return;
+	}
+	size = size < mapped.size - offset ? size : mapped.size - offset;
+#if defined(_WIN32)
+	VirtualUnlock((char*)mapped.data + offset, size); // unlocking pages that aren't locked takes them out of the working set
+#else
+	madvise((char*)mapped.data + offset, size, MADV_DONTNEED);
+#endif
+}
+
+// Name for a file that is written next to path and then moved over it with replace_file, unique per process so
+// processes writing the same path at once don't share it.
+inline std::string temporary_path(const char* path) {
+#if defined(_WIN32)
+	unsigned long process = GetCurrentProcessId();
+#else
+	unsigned long process = (unsigned long)getpid();
+#endif
+	return std::string(path) + ".tmp" + std::to_string(process);
+}
+
+// Moves from over to in one step. Processes that have the old file mapped keep reading its pages; on Windows,
+// where a mapped file can't be replaced, this fails instead.
+inline bool replace_file(const char* from, const char* to) {
+#if defined(_WIN32)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include "simd.h"
 
 #define PI 3.1415926535897932385f
 
@@ -26,6 +27,10 @@ struct Vector3 {
         return Vector3(this->x * s, this->y * s, this->z * s);
     }
 
+    Vector3 operator*(const Vector3& v) const {
+        return Vector3(this->x * v.x, this->y * v.y, this->z * v.z);
+    }
+
     Vector3 operator/(const float& s) const {
         return Vector3(this->x / s, this->y / s, this->z / s);
     }
@@ -51,6 +56,48 @@ struct Vector3 {
     Vector3 operator/=(const float& s) {
         return *this *= 1 / s;
     }
+
+    Vector3 operator*=(const Vector3& v) {
+        this->x *= v.x;
+        this->y *= v.y;
+        this->z *= v.z;
+        return *this;
+    }
+};
+
+// Vector3 stays three packed floats because its layout is shared with the HLSL structured buffers.
+// Vector4 is the same size as a float4 register, so its arithmetic goes through SSE.
+struct alignas(16) Vector4 {
+    float x, y, z, w;
+
+    Vector4() : x{ 0 }, y{ 0 }, z{ 0 }, w{ 0 } {}
+    Vector4(float xx, float yy, float zz, float ww) : x(xx), y(yy), z(zz), w(ww) {}
+    Vector4(const Vector3& v, float ww) : x(v.x), y(v.y), z(v.z), w(ww) {}
+
+#if SIMD_WIDTH > 1
+    Vector4(__m128 m) { _mm_store_ps(&this->x, m); }
+    __m128 m128() const { return _mm_load_ps(&this->x); }
+
+    Vector4 operator+(const Vector4& v) const { return _mm_add_ps(m128(), v.m128()); }
+    Vector4 operator-(const Vector4& v) const { return _mm_sub_ps(m128(), v.m128()); }
+    Vector4 operator*(const Vector4& v) const { return _mm_mul_ps(m128(), v.m128()); }
+    Vector4 operator*(const float& s) const { return _mm_mul_ps(m128(), _mm_set1_ps(s)); }
+#else
+    Vector4 operator+(const Vector4& v) const { return Vector4(this->x + v.x, this->y + v.y, this->z + v.z, this->w + v.w); }
+    Vector4 operator-(const Vector4& v) const { return Vector4(this->x - v.x, this->y - v.y, this->z - v.z, this->w - v.w); }
+    Vector4 operator*(const Vector4& v) const { return Vector4(this->x * v.x, this->y * v.y, this->z * v.z, this->w * v.w); }
+    Vector4 operator*(const float& s) const { return Vector4(this->x * s, this->y * s, this->z * s, this->w * s); }
+#endif
+};
+
+// 8 vectors in SoA form, the unit of work for the batched functions below.
+struct alignas(32) Vector3x8 {
+    float x[8];
+    float y[8];
+    float z[8];
+
+    void set(int lane, const Vector3& v) { x[lane] = v.x; y[lane] = v.y; z[lane] = v.z; }
+    Vector3 get(int lane) const { return Vector3(x[lane], y[lane], z[lane]); }
 };
 
 inline float dot(const Vector3& a, const Vector3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
@@ -60,8 +107,122 @@ inline Vector3 unit_vector(const Vector3& vec3) { return vec3 / length(vec3); }
 inline Vector3 reflect(const Vector3 vec3, const Vector3 normal) { return vec3 - normal * 2 * dot(vec3, normal); }
 inline Vector3 lerp(const Vector3& start, const Vector3& end, float t) { return start + (end - start) * t; }
 inline float lerp(float start, float end, float t) { return start + (end - start) * t; }
+inline Vector4 lerp(const Vector4& start, const Vector4& end, float t) { return start + (end - start) * t; }
 inline float deg2rad(float degrees) { return degrees * PI / 180.0f; }
 
+// Batched versions of the functions above over arrays of count Vector3x8. Each instruction set gets its own
+// copy of maths_batch.inl, and the best one the CPU supports is picked on first use.
+struct VectorBatchKernels {
+    SimdLevel level;
+    void (*dot)(const Vector3x8* a, const Vector3x8* b, float* out, size_t count);
+    void (*cross)(const Vector3x8* a, const Vector3x8* b, Vector3x8* out, size_t count);
+    void (*unit_vector)(const Vector3x8* v, Vector3x8* out, size_t count);
+    void (*reflect)(const Vector3x8* v, const Vector3x8* n, Vector3x8* out, size_t count);
+    void (*lerp)(const Vector3x8* start, const Vector3x8* end, const float* t, Vector3x8* out, size_t count);
+};
+
+namespace maths_scalar {
+    typedef float F;
+    const int GROUP = 1;
+    const int LANES = 1;
+    inline F load(const float* p, int) { return *p; }
+    inline void store(float* p, int, F v) { *p = v; }
+    inline F set(float f) { return f; }
+    inline F add(F a, F b) { return a + b; }
+    inline F sub(F a, F b) { return a - b; }
+    inline F mul(F a, F b) { return a * b; }
+    inline F div(F a, F b) { return a / b; }
+    inline F sqrt(F a) { return std::sqrt(a); }
+#include "maths_batch.inl"
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_BEGIN("sse4.1")
+namespace maths_sse4 {
+    typedef __m128 F;
+    const int GROUP = 1;
+    const int LANES = 4;
+    inline F load(const float* p, int) { return _mm_load_ps(p); }
+    inline void store(float* p, int, F v) { _mm_store_ps(p, v); }
+    inline F set(float f) { return _mm_set1_ps(f); }
+    inline F add(F a, F b) { return _mm_add_ps(a, b); }
+    inline F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    inline F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    inline F div(F a, F b) { return _mm_div_ps(a, b); }
+    inline F sqrt(F a) { return _mm_sqrt_ps(a); }
+#include "maths_batch.inl"
+}
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN("avx2")
+namespace maths_avx2 {
+    typedef __m256 F;
+    const int GROUP = 1;
+    const int LANES = 8;
+    inline F load(const float* p, int) { return _mm256_load_ps(p); }
+    inline void store(float* p, int, F v) { _mm256_store_ps(p, v); }
+    inline F set(float f) { return _mm256_set1_ps(f); }
+    inline F add(F a, F b) { return _mm256_add_ps(a, b); }
+    inline F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    inline F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    inline F div(F a, F b) { return _mm256_div_ps(a, b); }
+    inline F sqrt(F a) { return _mm256_sqrt_ps(a); }
+#include "maths_batch.inl"
+}
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN("avx512f")
+namespace maths_avx512 {
+    // One 16-lane register covers the same 8 lanes of two consecutive batches.
+    typedef __m512 F;
+    const int GROUP = 2;
+    const int LANES = 8;
+    inline F load(const float* p, int stride) {
+        __m512d low = _mm512_castpd256_pd512(_mm256_castps_pd(_mm256_load_ps(p)));
+        return _mm512_castpd_ps(_mm512_insertf64x4(low, _mm256_castps_pd(_mm256_load_ps(p + stride)), 1));
+    }
+    inline void store(float* p, int stride, F v) {
+        _mm256_store_ps(p, _mm512_castps512_ps256(v));
+        _mm256_store_ps(p + stride, _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+    }
+    inline F set(float f) { return _mm512_set1_ps(f); }
+    inline F add(F a, F b) { return _mm512_add_ps(a, b); }
+    inline F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+    inline F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+    inline F div(F a, F b) { return _mm512_div_ps(a, b); }
+    inline F sqrt(F a) { return _mm512_sqrt_ps(a); }
+#include "maths_batch.inl"
+}
+SIMD_TARGET_END
+#endif
+
+// Kernels for a specific level, which must be supported by the CPU. Mostly useful for benchmarks.
+inline VectorBatchKernels get_vector_batch_kernels(SimdLevel level) {
+#if defined(SIMD_X86)
+    if (level == SIMD_LEVEL_AVX512) {
+        return { level, maths_avx512::batch_dot, maths_avx512::batch_cross, maths_avx512::batch_unit_vector, maths_avx512::batch_reflect, maths_avx512::batch_lerp };
+    }
+    if (level == SIMD_LEVEL_AVX2) {
+        return { level, maths_avx2::batch_dot, maths_avx2::batch_cross, maths_avx2::batch_unit_vector, maths_avx2::batch_reflect, maths_avx2::batch_lerp };
+    }
+    if (level == SIMD_LEVEL_SSE4) {
+        return { level, maths_sse4::batch_dot, maths_sse4::batch_cross, maths_sse4::batch_unit_vector, maths_sse4::batch_reflect, maths_sse4::batch_lerp };
+    }
+#endif
+    return { SIMD_LEVEL_SCALAR, maths_scalar::batch_dot, maths_scalar::batch_cross, maths_scalar::batch_unit_vector, maths_scalar::batch_reflect, maths_scalar::batch_lerp };
+}
+
+inline const VectorBatchKernels& vector_batch_kernels() {
+    static const VectorBatchKernels kernels = get_vector_batch_kernels(detect_simd_level());
+    return kernels;
+}
+
+inline void dot(const Vector3x8* a, const Vector3x8* b, float* out, size_t count) { vector_batch_kernels().dot(a, b, out, count); }
+inline void cross(const Vector3x8* a, const Vector3x8* b, Vector3x8* out, size_t count) { vector_batch_kernels().cross(a, b, out, count); }
+inline void unit_vector(const Vector3x8* v, Vector3x8* out, size_t count) { vector_batch_kernels().unit_vector(v, out, count); }
+inline void reflect(const Vector3x8* v, const Vector3x8* n, Vector3x8* out, size_t count) { vector_batch_kernels().reflect(v, n, out, count); }
+inline void lerp(const Vector3x8* start, const Vector3x8* end, const float* t, Vector3x8* out, size_t count) { vector_batch_kernels().lerp(start, end, t, out, count); }
+
 struct Sphere {
     Vector3 center;
 	float radius;
@@ -85,6 +246,7 @@ struct Camera {
     Vector3 origin, lower_left_corner, horizontal, vertical;
     Vector3 u, v, w;
 
+    Camera() : aspect_ratio(0), lens_radius(0) {}
     Camera(Vector3 position, Vector3 look_at, Vector3 up, float aspect_r, float vertical_fov, float aperture, float focus_dist) : aspect_ratio(aspect_r) {
         auto theta = deg2rad(vertical_fov);
         auto h = tan(theta / 2);
@@ -0,0 +1,95 @@
+// Batched Vector3x8 kernels. maths.h includes this once per instruction set, inside a namespace that provides:
+//   F                          lane type
+//   GROUP                      Vector3x8 batches handled per step (2 for AVX-512, 1 otherwise)
+//   LANES                      lanes taken from each batch per step
+//   load(p, stride) / store(p, stride, v)
+//                              read/write LANES floats at p, plus the same lanes GROUP - 1 batches further
+//                              on, stride floats apart
+//   set(f), add, sub, mul, div, sqrt
+// Operation order matches the scalar Vector3 functions so the results are identical.
+
+#define BATCH_STRIDE (int)(sizeof(Vector3x8) / sizeof(float))
+
+static void batch_dot(const Vector3x8* a, const Vector3x8* b, float* out, size_t count) {
+	size_t i = 0;
+	for (; i + GROUP <= count; i += GROUP) {
+		for (int l = 0; l < 8; l += LANES) {
+			F ax = load(a[i].x + l, BATCH_STRIDE), ay = load(a[i].y + l, BATCH_STRIDE), az = load(a[i].z + l, BATCH_STRIDE);
+			F bx = load(b[i].x + l, BATCH_STRIDE), by = load(b[i].y + l, BATCH_STRIDE), bz = load(b[i].z + l, BATCH_STRIDE);
+			store(out + i * 8 + l, 8, add(add(mul(ax, bx), mul(ay, by)), mul(az, bz)));
+		}
+	}
+	if (i < count) {
+		maths_scalar::batch_dot(a + i, b + i, out + i * 8, count - i);
+	}
+}
+
+static void batch_cross(const Vector3x8* a, const Vector3x8* b, Vector3x8* out, size_t count) {
+	size_t i = 0;
+	for (; i + GROUP <= count; i += GROUP) {
+		for (int l = 0; l < 8; l += LANES) {
+			F ax = load(a[i].x + l, BATCH_STRIDE), ay = load(a[i].y + l, BATCH_STRIDE), az = load(a[i].z + l, BATCH_STRIDE);
+			F bx = load(b[i].x + l, BATCH_STRIDE), by = load(b[i].y + l, BATCH_STRIDE), bz = load(b[i].z + l, BATCH_STRIDE);
+			store(out[i].x + l, BATCH_STRIDE, sub(mul(ay, bz), mul(az, by)));
+			store(out[i].y + l, BATCH_STRIDE, sub(mul(az, bx), mul(ax, bz)));
+			store(out[i].z + l, BATCH_STRIDE, sub(mul(ax, by), mul(ay, bx)));
+		}
+	}
+	if (i < count) {
+		maths_scalar::batch_cross(a + i, b + i, out + i, count - i);
+	}
+}
+
+static void batch_unit_vector(const Vector3x8* v, Vector3x8* out, size_t count) {
+	size_t i = 0;
+	for (; i + GROUP <= count; i += GROUP) {
+		for (int l = 0; l < 8; l += LANES) {
+			F x = load(v[i].x + l, BATCH_STRIDE), y = load(v[i].y + l, BATCH_STRIDE), z = load(v[i].z + l, BATCH_STRIDE);
+			F length = sqrt(add(add(mul(x, x), mul(y, y)), mul(z, z)));
+			store(out[i].x + l, BATCH_STRIDE, div(x, length));
+			store(out[i].y + l, BATCH_STRIDE, div(y, length));
+			store(out[i].z + l, BATCH_STRIDE, div(z, length));
+		}
+	}
+	if (i < count) {
+		maths_scalar::batch_unit_vector(v + i, out + i, count - i);
+	}
+}
+
+static void batch_reflect(const Vector3x8* v, const Vector3x8* n, Vector3x8* out, size_t count) {
+	const F two = set(2.0f);
+	size_t i = 0;
+	for (; i + GROUP <= count; i += GROUP) {
+		for (int l = 0; l < 8; l += LANES) {
+			F vx = load(v[i].x + l, BATCH_STRIDE), vy = load(v[i].y + l, BATCH_STRIDE), vz = load(v[i].z + l, BATCH_STRIDE);
+			F nx = load(n[i].x + l, BATCH_STRIDE), ny = load(n[i].y + l, BATCH_STRIDE), nz = load(n[i].z + l, BATCH_STRIDE);
+			F d = add(add(mul(vx, nx), mul(vy, ny)), mul(vz, nz));
+			store(out[i].x + l, BATCH_STRIDE, sub(vx, mul(mul(nx, two), d)));
+			store(out[i].y + l, BATCH_STRIDE, sub(vy, mul(mul(ny, two), d)));
+			store(out[i].z + l, BATCH_STRIDE, sub(vz, mul(mul(nz, two), d)));
+		}
+	}
+	if (i < count) {
+		maths_scalar::batch_reflect(v + i, n + i, out + i, count - i);
+	}
+}
+
+// t holds one factor per vector, 8 per batch.
+static void batch_lerp(const Vector3x8* start, const Vector3x8* end, const float* t, Vector3x8* out, size_t count) {
+	size_t i = 0;
+	for (; i + GROUP <= count; i += GROUP) {
+		for (int l = 0; l < 8; l += LANES) {
+			F factor = load(t + i * 8 + l, 8);
+			F sx = load(start[i].x + l, BATCH_STRIDE), sy = load(start[i].y + l, BATCH_STRIDE), sz = load(start[i].z + l, BATCH_STRIDE);
+			F ex = load(end[i].x + l, BATCH_STRIDE), ey = load(end[i].y + l, BATCH_STRIDE), ez = load(end[i].z + l, BATCH_STRIDE);
+			store(out[i].x + l, BATCH_STRIDE, add(sx, mul(sub(ex, sx), factor)));
+			store(out[i].y + l, BATCH_STRIDE, add(sy, mul(sub(ey, sy), factor)));
+			store(out[i].z + l, BATCH_STRIDE, add(sz, mul(sub(ez, sz), factor)));
+		}
+	}
+	if (i < count) {
+		maths_scalar::batch_lerp(start + i, end + i, t + i * 8, out + i, count - i);
+	}
+}
+
+#undef BATCH_STRIDE
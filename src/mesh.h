@@ -0,0 +1,285 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "frame_stats.h"
+#include "mapped_file.h"
+#include "obj_loader.h"
+
+// Triangle meshes for the CPU tracer. A mesh is loaded from an OBJ file once and then cached next to it as
+// <file>.pgmesh: a header holding a hash of the OBJ bytes, the triangles in BVH leaf order and the BVH nodes,
+// 64-byte aligned like .pgscene sections. The next load hashes the OBJ, maps the cache and points straight into
+// it when the hash matches, so neither parsing nor the BVH build runs again. Leaves index the triangle array
+// directly, there is no primitive index array.
+
+#define MESH_CACHE_MAGIC "PGMESH"
+#define MESH_CACHE_VERSION 1 // bump when Triangle, BVHNode or the layout below changes
+#define MESH_CACHE_ALIGNMENT 64
+#define MESH_MAX_LEAF_SIZE 4
+
+struct MeshCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t triangle_size; // layout checks, so caches written by another build are rebuilt instead of misread
+	uint32_t node_size;
+	uint32_t triangle_count;
+	uint32_t bvh_node_count;
+	uint32_t reserved;
+	uint64_t source_hash; // of the OBJ bytes
+	uint64_t source_size;
+	uint64_t triangles_offset;
+	uint64_t bvh_nodes_offset;
+	uint64_t file_size;
+};
+
+struct TriangleMesh {
+	const Triangle* triangles;
+	int triangle_count;
+	const BVHNode* bvh_nodes;
+	int bvh_node_count;
+
+	std::string path;
+	MappedFile file; // backing memory when loaded from the cache
+	std::vector<Triangle> triangle_storage; // backing memory when the OBJ was parsed
+	std::vector<BVHNode> node_storage;
+};
+
+inline void free_mesh(TriangleMesh& mesh) {
+	unmap_file(mesh.file);
+	mesh = TriangleMesh();
+}
+
+// 64-bit hash of a byte range, a word at a time so hashing runs near memory bandwidth. Only used to tell whether
+// the OBJ changed since its cache was written, it is not cryptographic.
+inline uint64_t hash_bytes(const void* data, size_t size) {
+	const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t h = size * multiplier;
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ (word * 0xFF51AFD7ED558CCDull)) * multiplier;
+		h ^= h >> 29;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size - i);
+	h = (h ^ (tail * 0xFF51AFD7ED558CCDull)) * multiplier;
+
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+inline AABB triangle_bounds(const Triangle& tri) {
+	AABB b;
+	b.grow(tri.v0);
+	b.grow(tri.v1);
+	b.grow(tri.v2);
+	return b;
+}
+
+// Builds the BVH and reorders the triangles so that every leaf covers a contiguous range of them.
+inline std::vector<BVHNode> build_triangle_bvh(std::vector<Triangle>& triangles) {
+	std::vector<AABB> prim_bounds(triangles.size());
+	std::vector<Vector3> centroids(triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++) {
+		prim_bounds[i] = triangle_bounds(triangles[i]);
+		centroids[i] = (triangles[i].v0 + triangles[i].v1 + triangles[i].v2) / 3.0f;
+	}
+	BVH bvh = build_bvh_from_bounds(prim_bounds, centroids, MESH_MAX_LEAF_SIZE, 1.0f);
+
+	std::vector<Triangle> ordered(triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++) {
+		ordered[i] = triangles[bvh.primitive_indices[i]];
+	}
+	triangles.swap(ordered);
+	return bvh.nodes;
+}
+
+// Möller-Trumbore. Returns the ray parameter of the hit, which has to be inside (t_min, t_max).
+inline bool triangle_hit(const Triangle& tri, const Ray& ray, float t_min, float t_max, float& t) {
+	Vector3 edge1 = tri.v1 - tri.v0;
+	Vector3 edge2 = tri.v2 - tri.v0;
+	Vector3 p = cross(ray.direction, edge2);
+	float det = dot(edge1, p);
+	if (det == 0.0f) {
+		return false; // parallel to the plane or degenerate
+	}
+
+	float inv_det = 1.0f / det;
+	Vector3 s = ray.origin_point - tri.v0;
+	float u = dot(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+	Vector3 q = cross(s, edge1);
+	float v = dot(ray.direction, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+
+	float hit_t = dot(edge2, q) * inv_det;
+	if (hit_t <= t_min || hit_t >= t_max) {
+		return false;
+	}
+	t = hit_t;
+	return true;
+}
+
+// Returns the index of the closest triangle hit before closest and lowers closest to it, or -1.
+inline int mesh_closest_hit(const TriangleMesh& mesh, const Ray& ray, float t_min, float& closest) {
+	int selected = -1;
+	if (mesh.bvh_node_count == 0) {
+		return selected;
+	}
+	int tests = 0;
+	int visited = bvh_traverse(mesh.bvh_nodes, mesh.bvh_node_count, mesh.triangle_count, ray, t_min, closest, [&](int first, int count, float& closest_t) {
+		tests += count;
+		for (int i = first; i < first + count; i++) {
+			if (triangle_hit(mesh.triangles[i], ray, t_min, closest_t, closest_t)) {
+				selected = i;
+			}
+		}
+	});
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+	return selected;
+}
+
+inline bool mesh_error(const char* path, const char* message, size_t line = 0) {
+	if (line > 0) {
+		fprintf(stderr, "%s:%zu: %s\n", path, line, message);
+	}
+	else {
+		fprintf(stderr, "%s: %s\n", path, message);
+	}
+	return false;
+}
+
+inline std::string mesh_cache_path(const char* obj_path) {
+	return std::string(obj_path) + ".pgmesh";
+}
+
+// Maps the cache and points mesh into it. Fails quietly on a missing, stale or malformed cache.
+inline bool load_mesh_cache(const char* cache_path, uint64_t source_hash, uint64_t source_size, TriangleMesh& mesh) {
+	if (!map_file(cache_path, mesh.file)) {
+		return false;
+	}
+
+	const MeshCacheHeader* header = (const MeshCacheHeader*)mesh.file.data;
+	uint64_t file_size = mesh.file.size;
+	bool valid = file_size >= sizeof(MeshCacheHeader)
+		&& memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) == 0
+		&& header->version == MESH_CACHE_VERSION
+		&& header->triangle_size == sizeof(Triangle)
+		&& header->node_size == sizeof(BVHNode)
+		&& header->source_hash == source_hash
+		&& header->source_size == source_size
+		&& header->file_size == file_size
+		&& header->triangle_count > 0 && header->triangle_count <= INT32_MAX
+		&& header->bvh_node_count > 0 && header->bvh_node_count <= INT32_MAX
+		&& header->triangles_offset % MESH_CACHE_ALIGNMENT == 0 && header->bvh_nodes_offset % MESH_CACHE_ALIGNMENT == 0
+		&& header->triangles_offset <= file_size && (uint64_t)header->triangle_count * sizeof(Triangle) <= file_size - header->triangles_offset
+		&& header->bvh_nodes_offset <= file_size && (uint64_t)header->bvh_node_count * sizeof(BVHNode) <= file_size - header->bvh_nodes_offset;
+	valid = valid && bvh_valid((const BVHNode*)((const char*)mesh.file.data + header->bvh_nodes_offset), (int)header->bvh_node_count,
+		nullptr, (int)header->triangle_count, (int)header->triangle_count);
+	if (!valid) {
+		unmap_file(mesh.file);
+		return false;
+	}
+
+	mesh.triangles = (const Triangle*)((const char*)mesh.file.data + header->triangles_offset);
+	mesh.triangle_count = (int)header->triangle_count;
+	mesh.bvh_nodes = (const BVHNode*)((const char*)mesh.file.data + header->bvh_nodes_offset);
+	mesh.bvh_node_count = (int)header->bvh_node_count;
+	return true;
+}
+
+inline bool write_mesh_cache(const char* cache_path, uint64_t source_hash, uint64_t source_size, const TriangleMesh& mesh) {
+	MeshCacheHeader header = {};
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+	header.version = MESH_CACHE_VERSION;
+	header.triangle_size = sizeof(Triangle);
+	header.node_size = sizeof(BVHNode);
+	header.triangle_count = (uint32_t)mesh.triangle_count;
+	header.bvh_node_count = (uint32_t)mesh.bvh_node_count;
+	header.source_hash = source_hash;
+	header.source_size = source_size;
+	uint64_t triangles_size = (uint64_t)mesh.triangle_count * sizeof(Triangle);
+	uint64_t nodes_size = (uint64_t)mesh.bvh_node_count * sizeof(BVHNode);
+	header.triangles_offset = (sizeof(MeshCacheHeader) + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+	header.bvh_nodes_offset = (header.triangles_offset + triangles_size + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+	header.file_size = header.bvh_nodes_offset + nodes_size;
+
+	// Written beside the cache and moved over it, since other processes may have the old cache mapped.
+	std::string temporary = temporary_path(cache_path);
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	const char padding[MESH_CACHE_ALIGNMENT] = {};
+	size_t header_padding = (size_t)(header.triangles_offset - sizeof(header));
+	size_t triangle_padding = (size_t)(header.bvh_nodes_offset - header.triangles_offset - triangles_size);
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(padding, 1, header_padding, file) == header_padding;
+	ok = ok && fwrite(mesh.triangles, 1, (size_t)triangles_size, file) == triangles_size;
+	ok = ok && fwrite(padding, 1, triangle_padding, file) == triangle_padding;
+	ok = ok && fwrite(mesh.bvh_nodes, 1, (size_t)nodes_size, file) == nodes_size;
+	ok = fclose(file) == 0 && ok;
+	ok = ok && replace_file(temporary.c_str(), cache_path);
+	if (!ok) {
+		remove(temporary.c_str()); // don't leave a truncated file behind
+	}
+	return ok;
+}
+
+// Loads an OBJ through its cache, parsing it and rewriting the cache when the OBJ changed. A cache that can't
+// be written (e.g. a read-only directory) only costs the parse on the next load.
+inline bool load_mesh(const char* path, TriangleMesh& mesh) {
+	mesh = TriangleMesh();
+	mesh.path = path;
+
+	MappedFile source;
+	if (!map_file(path, source)) {
+		return mesh_error(path, "can't open file");
+	}
+	uint64_t source_hash = hash_bytes(source.data, source.size);
+	uint64_t source_size = source.size;
+
+	std::string cache_path = mesh_cache_path(path);
+	if (load_mesh_cache(cache_path.c_str(), source_hash, source_size, mesh)) {
+		unmap_file(source);
+		return true;
+	}
+
+	size_t error_line = 0;
+	bool parsed = parse_obj((const char*)source.data, source.size, mesh.triangle_storage, error_line);
+	unmap_file(source);
+	if (!parsed) {
+		mesh = TriangleMesh();
+		return mesh_error(path, "can't parse line", error_line);
+	}
+	if (mesh.triangle_storage.empty() || mesh.triangle_storage.size() > INT32_MAX) {
+		mesh = TriangleMesh();
+		return mesh_error(path, "a mesh needs at least one face");
+	}
+
+	mesh.node_storage = build_triangle_bvh(mesh.triangle_storage);
+	mesh.triangles = mesh.triangle_storage.data();
+	mesh.triangle_count = (int)mesh.triangle_storage.size();
+	mesh.bvh_nodes = mesh.node_storage.data();
+	mesh.bvh_node_count = (int)mesh.node_storage.size();
+
+	if (!write_mesh_cache(cache_path.c_str(), source_hash, source_size, mesh)) {
+		mesh_error(cache_path.c_str(), "can't write mesh cache");
+	}
+	return true;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "maths.h"
+
+// Streaming Wavefront OBJ reader. It walks the file bytes in place (normally a mapped file), so nothing is copied
+// into strings and memory use is just the output arrays. Only positions ("v") and faces ("f") are read; polygons
+// are fanned into triangles, and texture/normal references, groups and materials are skipped.
+
+struct Triangle {
+	Vector3 v0;
+	Vector3 v1;
+	Vector3 v2;
+};
+
+struct ObjCursor {
+	const char* at;
+	const char* end;
+};
+
+inline bool obj_is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline void obj_skip_spaces(ObjCursor& cursor) {
+	while (cursor.at < cursor.end && obj_is_space(*cursor.at)) cursor.at++;
+}
+
+inline void obj_skip_line(ObjCursor& cursor) {
+	while (cursor.at < cursor.end && *cursor.at != '\n') cursor.at++;
+	if (cursor.at < cursor.end) cursor.at++;
+}
+
+inline bool obj_parse_int(ObjCursor& cursor, long long& value) {
+	bool negative = cursor.at < cursor.end && *cursor.at == '-';
+	if (negative || (cursor.at < cursor.end && *cursor.at == '+')) cursor.at++;
+	const char* start = cursor.at;
+	value = 0;
+	while (cursor.at < cursor.end && *cursor.at >= '0' && *cursor.at <= '9') {
+		value = value * 10 + (*cursor.at++ - '0');
+	}
+	if (negative) value = -value;
+	return cursor.at != start;
+}
+
+// Decimal and exponent forms. Accurate to float precision, which is what the values are stored in.
+inline bool obj_parse_float(ObjCursor& cursor, float& value) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+	bool negative = cursor.at < cursor.end && *cursor.at == '-';
+	if (negative || (cursor.at < cursor.end && *cursor.at == '+')) cursor.at++;
+
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	for (; cursor.at < cursor.end && *cursor.at >= '0' && *cursor.at <= '9'; cursor.at++, digits++) {
+		if (mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*cursor.at - '0');
+		else exponent++;
+	}
+	if (cursor.at < cursor.end && *cursor.at == '.') {
+		cursor.at++;
+		for (; cursor.at < cursor.end && *cursor.at >= '0' && *cursor.at <= '9'; cursor.at++, digits++) {
+			if (mantissa < 100000000000000000ull) {
+				mantissa = mantissa * 10 + (*cursor.at - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0) {
+		return false;
+	}
+	if (cursor.at < cursor.end && (*cursor.at == 'e' || *cursor.at == 'E')) {
+		cursor.at++;
+		long long e;
+		if (!obj_parse_int(cursor, e)) {
+			return false;
+		}
+		exponent += (int)std::max(-1000ll, std::min(1000ll, e));
+	}
+
+	double result = (double)mantissa;
+	while (exponent > 0) { int step = std::min(exponent, 18); result *= powers[step]; exponent -= step; }
+	while (exponent < 0) { int step = std::min(-exponent, 18); result /= powers[step]; exponent += step; }
+	value = (float)(negative ? -result : result);
+	return true;
+}
+
+// Reads a face corner ("i", "i/t", "i//n" or "i/t/n") and returns the zero based position index, or -1.
+inline long long obj_parse_corner(ObjCursor& cursor, size_t vertex_count) {
+	long long index;
+	if (!obj_parse_int(cursor, index) || index == 0) {
+		return -1;
+	}
+	while (cursor.at < cursor.end && !obj_is_space(*cursor.at) && *cursor.at != '\n') cursor.at++;
+
+	index = index > 0 ? index - 1 : (long long)vertex_count + index; // negative indices count back from the last vertex
+	return index >= 0 && index < (long long)vertex_count ? index : -1;
+}
+
+// Appends the triangles of an OBJ file. Returns false on malformed input and sets error_line (1 based).
+inline bool parse_obj(const char* data, size_t size, std::vector<Triangle>& triangles, size_t& error_line) {
+	ObjCursor cursor = { data, data + size };
+	std::vector<Vector3> vertices;
+	size_t line = 0;
+
+	while (cursor.at < cursor.end) {
+		line++;
+		obj_skip_spaces(cursor);
+		const char* keyword = cursor.at;
+		bool is_vertex = cursor.end - keyword >= 2 && keyword[0] == 'v' && obj_is_space(keyword[1]);
+		bool is_face = cursor.end - keyword >= 2 && keyword[0] == 'f' && obj_is_space(keyword[1]);
+
+		if (is_vertex) {
+			cursor.at += 2;
+			Vector3 v;
+			obj_skip_spaces(cursor);
+			bool ok = obj_parse_float(cursor, v.x);
+			obj_skip_spaces(cursor);
+			ok = ok && obj_parse_float(cursor, v.y);
+			obj_skip_spaces(cursor);
+			ok = ok && obj_parse_float(cursor, v.z);
+			if (!ok) {
+				error_line = line;
+				return false;
+			}
+			vertices.push_back(v);
+		}
+		else if (is_face) {
+			cursor.at += 2;
+			long long first = -1, previous = -1;
+			int corner_count = 0;
+			for (;;) {
+				obj_skip_spaces(cursor);
+				if (cursor.at >= cursor.end || *cursor.at == '\n' || *cursor.at == '#') {
+					break;
+				}
+				long long corner = obj_parse_corner(cursor, vertices.size());
+				if (corner < 0) {
+					error_line = line;
+					return false;
+				}
+				if (corner_count == 0) first = corner;
+				else if (corner_count >= 2) triangles.push_back({ vertices[first], vertices[previous], vertices[corner] });
+				previous = corner;
+				corner_count++;
+			}
+			if (corner_count < 3) {
+				error_line = line;
+				return false;
+			}
+		}
+
+		obj_skip_line(cursor);
+	}
+
+	return true;
+}
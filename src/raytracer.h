@@ -1,26 +1,12 @@
 #pragma once
+#include <chrono>
 #include "d3d_utils.h"
-#include "maths.h"
-
-struct Material {
-	int type; // 0->emissive, 1->lambertian, 2->metal
-	Vector3 albedo;
-	float fuzziness;
-};
-
-struct RaytracerProperties {
-	int width;
-	int height;
-	int frame_count;
-	int sphere_count;
-	Camera camera;
-};
-
-struct RaytracerData {
-	RaytracerProperties properties;
-	Sphere* spheres;
-	Material* materials;
-};
+#include "scene.h"
+#include "bvh_refit.h"
+#include "scene_store.h"
+#include "cpu_raytracer.h"
+#include "denoiser.h"
+#include "reprojection.h"
 
 struct ComputeShaderData {
 	ID3DBlob* cs_blob;
@@ -28,10 +14,31 @@ struct ComputeShaderData {
 	ID3D11UnorderedAccessView* output_texture_view;
 	ID3D11ShaderResourceView* output_texture_shader_view;
 	ID3D11Texture2D* output_texture;
+};
+
+// Scene buffers are structured buffers with one SRV each, updated in place with UpdateSubresource.
+struct D3D11UploadDevice : UploadDevice {
+	ID3D11Device* device;
+	ID3D11DeviceContext* device_context;
+
+	D3D11UploadDevice(ID3D11Device* device, ID3D11DeviceContext* device_context) : device(device), device_context(device_context) {}
+
+	GpuBuffer create_buffer(int capacity, int element_size) override {
+		StructuredDataBuffer structured_data_buffer = create_structured_data_buffer(device, capacity, element_size);
+		GpuBuffer buffer = { structured_data_buffer.buffer, structured_data_buffer.shader_resource_view, capacity, element_size };
+		return buffer;
+	}
+
+	void release_buffer(GpuBuffer& buffer) override {
+		((ID3D11ShaderResourceView*)buffer.view)->Release();
+		((ID3D11Buffer*)buffer.resource)->Release();
+		buffer = GpuBuffer();
+	}
 
-	StructuredDataBuffer properties;
-	StructuredDataBuffer spheres;
-	StructuredDataBuffer materials;
+	void upload(GpuBuffer& buffer, size_t offset, size_t size, const void* data) override {
+		D3D11_BOX box = { (UINT)offset, 0, 0, (UINT)(offset + size), 1, 1 };
+		device_context->UpdateSubresource((ID3D11Buffer*)buffer.resource, 0, &box, data, 0, 0);
+	}
 };
 
 ComputeShaderData create_raytracer_shader(ID3D11Device* device, IDXGISwapChain* swapchain)
@@ -89,31 +96,53 @@ ComputeShaderData create_raytracer_shader(ID3D11Device* device, IDXGISwapChain*
 	hr = device->CreateUnorderedAccessView(data.output_texture, &uavDesc, &data.output_texture_view);
 	assert(SUCCEEDED(hr));
 
-	data.properties = create_structured_data_buffer(device, 1, sizeof(RaytracerProperties));
-	data.spheres = create_structured_data_buffer(device, 100, sizeof(Sphere));
-	data.materials = create_structured_data_buffer(device, 100, sizeof(Material));
-
 	return data;
 }
 
-void raytracer_render(ID3D11DeviceContext* device_context, ComputeShaderData compute_data, RaytracerData& raytracer_data, QuadRenderer quad_renderer) {
-
-	device_context->UpdateSubresource(compute_data.properties.buffer, 0, NULL, &raytracer_data.properties, 0, 0);
-	device_context->UpdateSubresource(compute_data.spheres.buffer, 0, NULL, raytracer_data.spheres, 0, 0);
-	device_context->UpdateSubresource(compute_data.materials.buffer, 0, NULL, raytracer_data.materials, 0, 0);
+void raytracer_render(ID3D11DeviceContext* device_context, ComputeShaderData compute_data, SceneStore& scene_store, RaytracerData& raytracer_data, QuadRenderer quad_renderer) {
+	scene_store_upload(scene_store, raytracer_data);
 
-	ID3D11ShaderResourceView* shader_resource_views[] = {
-		compute_data.properties.shader_resource_view,
-		compute_data.spheres.shader_resource_view,
-		compute_data.materials.shader_resource_view
-	};
+	ID3D11ShaderResourceView* shader_resource_views[SCENE_BUFFER_COUNT];
+	for (int i = 0; i < SCENE_BUFFER_COUNT; i++) {
+		shader_resource_views[i] = (ID3D11ShaderResourceView*)scene_store.buffers[i].gpu.view;
+	}
 	device_context->CSSetShaderResources(0, ARRAYSIZE(shader_resource_views), shader_resource_views);
 	device_context->CSSetShader(compute_data.compute_shader, nullptr, 0);
 	UINT uavInitialCount = 0;
 	device_context->CSSetUnorderedAccessViews(0, 1, &compute_data.output_texture_view, &uavInitialCount);
-	device_context->Dispatch(raytracer_data.properties.width / 8, raytracer_data.properties.height / 8, 1);
+	device_context->Dispatch((raytracer_data.properties.width + 7) / 8, (raytracer_data.properties.height + 7) / 8, 1);
 
 	draw_quad(quad_renderer, device_context, compute_data.output_texture_shader_view);
 
 	raytracer_data.properties.frame_count++;
+}
+
+// CPU backend counterpart of raytracer_render. Passes run on the renderer's worker threads while the UI keeps
+// drawing; output_texture is updated whenever a pass completes and the next pass is started right away, until
+// adaptive sampling reports the image as converged.
+// The texture upload and draw after a pass finished are recorded as that pass's display time.
+// With cpu_renderer.write_aovs on, the texture gets the denoised image instead. The denoiser runs on the worker threads
+// between two passes, so the UI thread waits for it.
+void raytracer_render_cpu(ID3D11DeviceContext* device_context, ComputeShaderData compute_data, CpuRenderer& cpu_renderer, RaytracerData& raytracer_data, QuadRenderer quad_renderer,
+	Denoiser& denoiser, const DenoiseSettings& denoise_settings) {
+	bool finished = cpu_raytracer_poll(cpu_renderer, raytracer_data);
+	const std::vector<Vector4>* image = &cpu_renderer.pixels;
+	if (finished && cpu_renderer.write_aovs) {
+		cpu_denoise(denoiser, cpu_renderer, denoise_settings);
+		cpu_renderer.stats.denoise_ms = denoiser.seconds * 1000.0;
+		image = &denoiser.output;
+	}
+	auto display_start = std::chrono::steady_clock::now();
+	if (finished) {
+		D3D11_BOX box = { 0, 0, 0, (UINT)cpu_renderer.width, (UINT)cpu_renderer.height, 1 };
+		device_context->UpdateSubresource(compute_data.output_texture, 0, &box, image->data(), cpu_renderer.width * sizeof(Vector4), 0);
+	}
+	if (!cpu_raytracer_busy(cpu_renderer) && !cpu_raytracer_converged(cpu_renderer, raytracer_data)) {
+		cpu_raytracer_begin(cpu_renderer, raytracer_data);
+	}
+
+	draw_quad(quad_renderer, device_context, compute_data.output_texture_shader_view);
+	if (finished) {
+		cpu_renderer.stats.display_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - display_start).count();
+	}
 }
\ No newline at end of file
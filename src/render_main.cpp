@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "denoiser.h"
+#include "frame_stream.h"
+#include "frame_writer.h"
+#include "reprojection.h"
+#include "scene_file.h"
+#include "tile_farm.h"
+#include "treelets.h"
+
+// playground-render: renders a frame range of a scene on the CPU tracer without a window and writes one image per frame.
+// While frame N is being traced, frame N - 1 is encoded and written on the FrameWriter thread. With --farm, the frames
+// are traced by worker processes, which are this program started with --worker, see tile_farm.h. .pgtreelets scenes
+// are traced out of core, with only --treelet-budget MB of their geometry in memory, see treelets.h.
+
+struct RenderOptions {
+	const char* scene; // path, see load_scene, or a treelet file
+	int width;
+	int height;
+	int samples;
+	int pass_samples; // samples per pixel and progressive pass
+	int max_depth;
+	int roulette_depth;
+	int first_frame;
+	int last_frame;
+	float orbit_degrees; // camera turn around its look_at point per frame
+	int thread_count;
+	const char* output; // printf pattern taking the frame number, extension picks .png or .exr
+	const char* stats; // optional path for per-frame counters, .csv or .json
+	const char* stream; // optional shared memory name to publish every pass to, see frame_stream.h
+	int light_sampling; // next event estimation, see sample_direct_light
+	float adaptive_threshold; // 0 -> every pixel gets every sample
+	int wavefront; // trace tiles in stages, see wavefront.h
+	int packets; // camera rays in packets, see trace_pixel_block
+	int specialize; // kernels compiled for the scene's features, see select_cpu_kernel
+	int compressed; // trace a quantized copy of the spheres and BVH, see compressed_bvh.h
+	int sampler; // a SamplerMode, see sampler.h
+	int denoise; // write the denoised image, see denoiser.h
+	int reproject; // start every frame from the previous one moved to its camera, see reprojection.h
+	int farm; // local worker processes to trace the frames with, -1 traces them in this process
+	const char* farm_listen; // host:port the coordinator accepts workers on
+	int farm_tile; // tile size of the farm's jobs
+	int farm_passes; // passes per job, 0 for all passes of a tile
+	float farm_timeout; // seconds a worker may take to answer
+	const char* worker; // host:port of a coordinator to trace tiles for, which also sends the render settings
+	int worker_exit_after; // tiles a worker traces before it exits without answering, -1 for no limit
+	int treelet_budget; // MB of treelets kept in memory for .pgtreelets scenes
+};
+
+// sampler_name with the spaces of the command line.
+static const char* sampler_option_names[SAMPLER_COUNT] = { "wang", "pcg", "sobol", "blue-noise" };
+
+static void print_usage() {
+	printf(
+		"usage: playground-render [options]\n"
+		"  --scene PATH            .pgscene, .txt or .pgtreelets scene (default: data/scenes/default.txt)\n"
+		"  --resolution WxH        image size (default: 1920x1080)\n"
+		"  --samples N             samples per pixel, rounded up to a multiple of --pass-samples (default: %d)\n"
+		"  --pass-samples N        samples per pixel and pass, at most --samples (default: %d)\n"
+		"  --max-depth N           bounces per path (default: %d)\n"
+		"  --roulette-depth N      bounces before Russian roulette may end a path, --max-depth or more turns it off (default: %d)\n"
+		"  --frames A[:B]          inclusive frame range (default: 0)\n"
+		"  --orbit DEGREES         camera orbit per frame around its target (default: 2)\n"
+		"  --threads N             render threads, 0 for one per core (default: 0)\n"
+		"  --output PATTERN        output path with a %%d for the frame, .png or .exr (default: frame_%%04d.png)\n"
+		"  --stats PATH            write per-frame counters and stage times, .csv or .json\n"
+		"  --stream NAME           publish every pass to shared memory NAME for playground-stream or other readers\n"
+		"  --light-sampling on|off sample emissive spheres directly at diffuse hits (default: on)\n"
+		"  --adaptive ERROR        stop sampling pixels once their relative standard error is below ERROR, e.g. 0.01;\n"
+		"                          --samples is then the most a pixel gets (default: 0, off)\n"
+		"  --wavefront on|off      trace tiles in batched stages instead of pixel by pixel; slower, for comparisons, not with\n"
+		"                          --adaptive (default: off)\n"
+		"  --packets on|off        trace camera rays in %dx%d packets when the camera has no depth of field, same image (default: on)\n"
+		"  --specialize on|off     trace with the kernel compiled for the scene's materials and settings, same image (default: on)\n"
+		"  --compressed on|off     trace quantized spheres and 8-wide BVH nodes, for scenes larger than the CPU caches;\n"
+		"                          spheres move by up to 1/65535 of their BVH leaf (default: off)\n"
+		"  --sampler NAME          random numbers of the paths: wang, pcg, sobol or blue-noise, the last two converge faster\n"
+		"                          (default: wang, like the shader)\n"
+		"  --denoise on|off        write frames through the AOV guided denoiser, for previews from a few passes (default: off)\n"
+		"  --reproject on|off      start each frame from the previous one reprojected to the new camera instead of from\n"
+		"                          nothing, not with --adaptive (default: off)\n"
+		"tile farm, not with --adaptive, --denoise or --reproject:\n"
+		"  --farm N                coordinate a tile farm and start N local workers, more can join with --worker\n"
+		"  --farm-listen HOST:PORT address workers connect to, port 0 picks a free one (default: 127.0.0.1:0)\n"
+		"  --farm-tile N           tile size of a job, a multiple of %d (default: %d)\n"
+		"  --farm-passes N         passes per job, 0 for all passes of a tile, which gives the image of a local render\n"
+		"                          (default: 0)\n"
+		"  --farm-timeout SECONDS  time a worker may take to answer before its job is given to another (default: 60)\n"
+		"  --worker HOST:PORT      trace tiles for the coordinator at HOST:PORT, which sends the scene and sampling\n"
+		"                          settings; --threads applies\n"
+		"  --worker-exit-after N   exit without answering the tile after the first N, to test retries\n"
+		"out-of-core scenes, .pgtreelets files written by playground-scene, always traced in wavefront stages and not with\n"
+		"--adaptive, --denoise, --reproject or the farm:\n"
+		"  --treelet-budget MB     memory for the treelets paged in, at least one treelet per thread (default: %d)\n",
+		DEFAULT_SAMPLES * 4, DEFAULT_SAMPLES, DEFAULT_MAX_DEPTH, DEFAULT_ROULETTE_DEPTH, CPU_PACKET_SIZE, CPU_PACKET_SIZE, CPU_TILE_SIZE,
+		FARM_DEFAULT_TILE_SIZE, TREELET_DEFAULT_BUDGET_MB);
+}
+
+static bool parse_options(int argc, char** argv, RenderOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		bool has_value = true;
+
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+			return false;
+		}
+		else if (!value) {
+			fprintf(stderr, "missing value for %s\n", arg);
+			return false;
+		}
+		else if (strcmp(arg, "--scene") == 0) {
+			options.scene = value;
+		}
+		else if (strcmp(arg, "--resolution") == 0) {
+			has_value = sscanf(value, "%dx%d", &options.width, &options.height) == 2 && options.width > 0 && options.height > 0;
+		}
+		else if (strcmp(arg, "--samples") == 0) {
+			options.samples = atoi(value);
+			has_value = options.samples > 0;
+		}
+		else if (strcmp(arg, "--pass-samples") == 0) {
+			options.pass_samples = atoi(value);
+			has_value = options.pass_samples > 0;
+		}
+		else if (strcmp(arg, "--max-depth") == 0) {
+			options.max_depth = atoi(value);
+			has_value = options.max_depth > 0;
+		}
+		else if (strcmp(arg, "--roulette-depth") == 0) {
+			options.roulette_depth = atoi(value);
+			has_value = options.roulette_depth >= 0;
+		}
+		else if (strcmp(arg, "--frames") == 0) {
+			int matched = sscanf(value, "%d:%d", &options.first_frame, &options.last_frame);
+			if (matched == 1) {
+				options.last_frame = options.first_frame;
+			}
+			has_value = matched >= 1 && options.first_frame <= options.last_frame;
+		}
+		else if (strcmp(arg, "--orbit") == 0) {
+			options.orbit_degrees = (float)atof(value);
+		}
+		else if (strcmp(arg, "--threads") == 0) {
+			options.thread_count = atoi(value);
+			has_value = options.thread_count >= 0;
+		}
+		else if (strcmp(arg, "--output") == 0) {
+			options.output = value;
+		}
+		else if (strcmp(arg, "--stats") == 0) {
+			options.stats = value;
+		}
+		else if (strcmp(arg, "--stream") == 0) {
+			options.stream = value;
+		}
+		else if (strcmp(arg, "--light-sampling") == 0) {
+			options.light_sampling = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.light_sampling >= 0;
+		}
+		else if (strcmp(arg, "--adaptive") == 0) {
+			options.adaptive_threshold = (float)atof(value);
+			has_value = options.adaptive_threshold >= 0.0f;
+		}
+		else if (strcmp(arg, "--wavefront") == 0) {
+			options.wavefront = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.wavefront >= 0;
+		}
+		else if (strcmp(arg, "--packets") == 0) {
+			options.packets = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.packets >= 0;
+		}
+		else if (strcmp(arg, "--specialize") == 0) {
+			options.specialize = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.specialize >= 0;
+		}
+		else if (strcmp(arg, "--compressed") == 0) {
+			options.compressed = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.compressed >= 0;
+		}
+		else if (strcmp(arg, "--sampler") == 0) {
+			options.sampler = -1;
+			for (int mode = 0; mode < SAMPLER_COUNT; mode++) {
+				if (strcmp(value, sampler_option_names[mode]) == 0) {
+					options.sampler = mode;
+				}
+			}
+			has_value = options.sampler >= 0;
+		}
+		else if (strcmp(arg, "--denoise") == 0) {
+			options.denoise = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.denoise >= 0;
+		}
+		else if (strcmp(arg, "--reproject") == 0) {
+			options.reproject = strcmp(value, "on") == 0 ? 1 : strcmp(value, "off") == 0 ? 0 : -1;
+			has_value = options.reproject >= 0;
+		}
+		else if (strcmp(arg, "--farm") == 0) {
+			options.farm = atoi(value);
+			has_value = options.farm >= 0;
+		}
+		else if (strcmp(arg, "--farm-listen") == 0) {
+			options.farm_listen = value;
+			has_value = strchr(value, ':') != nullptr;
+		}
+		else if (strcmp(arg, "--farm-tile") == 0) {
+			options.farm_tile = atoi(value);
+			has_value = options.farm_tile > 0 && options.farm_tile % CPU_TILE_SIZE == 0;
+		}
+		else if (strcmp(arg, "--farm-passes") == 0) {
+			options.farm_passes = atoi(value);
+			has_value = options.farm_passes >= 0;
+		}
+		else if (strcmp(arg, "--farm-timeout") == 0) {
+			options.farm_timeout = (float)atof(value);
+			has_value = options.farm_timeout > 0.0f;
+		}
+		else if (strcmp(arg, "--worker") == 0) {
+			options.worker = value;
+			has_value = strchr(value, ':') != nullptr;
+		}
+		else if (strcmp(arg, "--worker-exit-after") == 0) {
+			options.worker_exit_after = atoi(value);
+			has_value = options.worker_exit_after >= 0;
+		}
+		else if (strcmp(arg, "--treelet-budget") == 0) {
+			options.treelet_budget = atoi(value);
+			has_value = options.treelet_budget > 0;
+		}
+		else {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return false;
+		}
+
+		if (!has_value) {
+			fprintf(stderr, "invalid value for %s: %s\n", arg, value);
+			return false;
+		}
+		i++;
+	}
+
+	// Otherwise a single pass would render more samples than asked for.
+	options.pass_samples = std::min(options.pass_samples, options.samples);
+	if (options.farm >= 0 && (options.adaptive_threshold > 0.0f || options.denoise || options.reproject)) {
+		fprintf(stderr, "--farm doesn't combine with --adaptive, --denoise or --reproject\n");
+		return false;
+	}
+	if (is_treelet_file(options.scene) && (options.adaptive_threshold > 0.0f || options.denoise || options.reproject || options.farm >= 0 || options.worker || options.compressed)) {
+		fprintf(stderr, "treelet scenes don't combine with --adaptive, --denoise, --reproject, --compressed or the farm\n");
+		return false;
+	}
+	// No frame number between the first and the last is longer than both, so the path of every frame fits.
+	char path[1024];
+	int frame_conversions = 0;
+	if (!format_frame_path(path, sizeof(path), options.output, options.first_frame, &frame_conversions)
+		|| !format_frame_path(path, sizeof(path), options.output, options.last_frame)) {
+		fprintf(stderr, "--output takes a path with at most one %%d, %%Nd or %%0Nd for the frame and %%%% for a %%\n");
+		return false;
+	}
+	if (options.first_frame != options.last_frame && frame_conversions == 0) {
+		fprintf(stderr, "--output needs a %%d for the frame number when rendering more than one frame\n");
+		return false;
+	}
+	return true;
+}
+
+// Turns the camera around the vertical axis through its look_at point.
+static CameraPlacement orbit_camera(CameraPlacement camera, float degrees) {
+	float angle = deg2rad(degrees);
+	Vector3 offset = camera.position - camera.look_at;
+	float c = std::cos(angle), s = std::sin(angle);
+	camera.position = camera.look_at + Vector3(offset.x * c + offset.z * s, offset.y, -offset.x * s + offset.z * c);
+	return camera;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Scene data of a render, which raytracer_data points into.
+struct RenderScene {
+	Scene scene; // only the camera for treelet scenes
+	TreeletScene treelets;
+	BVH bvh;
+	SphereSoA sphere_soa;
+	CompressedScene compressed;
+	std::vector<int> lights;
+	RaytracerData raytracer_data = {};
+};
+
+static bool load_render_scene(const RenderOptions& options, RenderScene& render) {
+	bool treelets = is_treelet_file(options.scene);
+	if (treelets ? !load_treelet_scene(options.scene, render.treelets, (size_t)options.treelet_budget << 20) : !load_scene(options.scene, render.scene)) {
+		return false;
+	}
+
+	RaytracerData& raytracer_data = render.raytracer_data;
+	raytracer_data = {};
+	raytracer_data.properties.width = options.width;
+	raytracer_data.properties.height = options.height;
+	raytracer_data.properties.samples = options.pass_samples;
+	raytracer_data.properties.max_depth = options.max_depth;
+	raytracer_data.properties.roulette_depth = options.roulette_depth;
+	raytracer_data.properties.light_sampling = options.light_sampling;
+	raytracer_data.sampler = options.sampler;
+	if (treelets) {
+		render.scene.camera = render.treelets.header->camera;
+		set_treelet_scene(raytracer_data, render.treelets);
+		return true;
+	}
+	set_scene(raytracer_data, render.scene);
+	if (!render.scene.bvh_nodes) {
+		render.bvh = build_bvh(render.scene.spheres, render.scene.sphere_count);
+		set_bvh(raytracer_data, render.bvh);
+	}
+	render.lights = build_light_list(render.scene.materials, render.scene.sphere_count);
+	set_lights(raytracer_data, render.lights);
+	if (!options.compressed) {
+		set_sphere_soa(raytracer_data, render.sphere_soa);
+		return true;
+	}
+
+	if (!scene_bvh_valid(options.scene, render.scene)) {
+		return false;
+	}
+	int node_count = raytracer_data.properties.bvh_node_count;
+	build_compressed_scene(render.compressed, raytracer_data);
+	set_compressed_scene(raytracer_data, render.compressed);
+	const CompressedBVH& bvh = render.compressed.bvh;
+	printf("compressed: %d nodes, %.1f bytes per sphere for BVH and spheres (%.1f uncompressed), %d distinct materials, "
+		"centers within %.2g and radii within %.2g of a radius\n", (int)bvh.nodes.size(), compressed_bvh_bytes_per_sphere(bvh),
+		uncompressed_bvh_bytes_per_sphere(node_count, bvh.count), (int)render.compressed.materials.size(), bvh.max_center_error, bvh.max_radius_error);
+	return true;
+}
+
+static CpuRenderer create_renderer(const RenderOptions& options) {
+	CpuRenderer renderer = create_cpu_renderer(options.width, options.height, options.thread_count);
+	renderer.adaptive_threshold = options.adaptive_threshold;
+	renderer.wavefront = options.wavefront != 0;
+	renderer.packets = options.packets != 0;
+	renderer.specialize = options.specialize != 0;
+	renderer.write_aovs = options.denoise != 0;
+	renderer.reproject = options.reproject != 0;
+	return renderer;
+}
+
+// Traces tiles for the coordinator at options.worker until it is done. The scene and sampling options come from
+// the coordinator, so the tiles match what it would trace itself.
+static int worker_main(RenderOptions options) {
+	FarmWorker worker;
+	if (!connect_farm_worker(options.worker, worker)) {
+		return 1;
+	}
+	const FarmSettings& settings = worker.settings;
+	options.scene = settings.scene;
+	options.width = settings.width;
+	options.height = settings.height;
+	options.pass_samples = settings.samples;
+	options.max_depth = settings.max_depth;
+	options.roulette_depth = settings.roulette_depth;
+	options.light_sampling = settings.light_sampling;
+	options.sampler = settings.sampler;
+	options.wavefront = settings.wavefront;
+	options.packets = settings.packets;
+	options.specialize = settings.specialize;
+	options.compressed = settings.compressed;
+
+	RenderScene render;
+	if (!load_render_scene(options, render) || !farm_worker_ready(worker)) {
+		close_farm_worker(worker);
+		return 1;
+	}
+	RaytracerData& raytracer_data = render.raytracer_data;
+	CpuRenderer renderer = create_renderer(options);
+
+	FarmTile tile;
+	std::vector<Vector4> pixels;
+	int tiles = 0;
+	while (farm_worker_next_tile(worker, tile)) {
+		if (tiles == options.worker_exit_after) {
+			fprintf(stderr, "worker: exiting after %d tiles\n", tiles);
+			break;
+		}
+		auto tile_start = std::chrono::steady_clock::now();
+		const int tile_width = tile.x1 - tile.x0;
+		for (int y = tile.y0; y < tile.y1; y++) {
+			std::fill_n(&renderer.pixels[(size_t)y * options.width + tile.x0], tile_width, Vector4());
+		}
+		raytracer_data.properties.camera = tile.camera;
+		raytracer_data.properties.frame_count = tile.first_pass;
+		FrameStats stats = create_frame_stats();
+		for (int pass = 0; pass < tile.pass_count; pass++) {
+			cpu_raytracer_render_region(renderer, raytracer_data, tile.x0, tile.y0, tile.x1, tile.y1);
+			add_frame_stats(stats, renderer.stats);
+		}
+
+		// Passes after the first are blended in as if the earlier ones had left zeros, so the tile holds
+		// pass_count / (first_pass + pass_count) of its own average.
+		float scale = float(tile.first_pass + tile.pass_count) / float(tile.pass_count);
+		pixels.resize((size_t)tile_width * (tile.y1 - tile.y0));
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++) {
+				const Vector4& pixel = renderer.pixels[(size_t)y * options.width + x];
+				pixels[(size_t)(y - tile.y0) * tile_width + (x - tile.x0)] = tile.first_pass == 0 ? pixel : pixel * scale;
+			}
+		}
+		FarmTileResult result = { tile.frame, tile.job, tile.pass_count * settings.samples, seconds_since(tile_start) * 1000.0,
+			stats.rays, stats.paths, stats.intersection_tests, stats.bvh_nodes_visited };
+		if (!farm_worker_send_tile(worker, result, pixels)) {
+			break;
+		}
+		tiles++;
+	}
+	close_farm_worker(worker);
+	free_scene(render.scene);
+	return 0;
+}
+
+// Listens for workers and starts options.farm of them on this machine, which split the cores between them unless
+// --threads is given.
+static bool start_farm(const RenderOptions& options, const char* executable, FarmCoordinator& farm) {
+	FarmSettings settings = {};
+	if (strlen(options.scene) >= sizeof(settings.scene)) {
+		fprintf(stderr, "%s: path too long for the farm\n", options.scene);
+		return false;
+	}
+	strcpy(settings.scene, options.scene);
+	settings.width = options.width;
+	settings.height = options.height;
+	settings.samples = options.pass_samples;
+	settings.max_depth = options.max_depth;
+	settings.roulette_depth = options.roulette_depth;
+	settings.light_sampling = options.light_sampling;
+	settings.sampler = options.sampler;
+	settings.wavefront = options.wavefront;
+	settings.packets = options.packets;
+	settings.specialize = options.specialize;
+	settings.compressed = options.compressed;
+	if (!start_farm_coordinator(farm, options.farm_listen, settings, options.farm_tile, options.farm_timeout)) {
+		return false;
+	}
+	printf("farm: workers connect with --worker %s\n", farm.address.c_str());
+
+	int threads = options.thread_count;
+	if (threads == 0) {
+		threads = std::max(1, (int)std::thread::hardware_concurrency() / std::max(1, options.farm));
+	}
+	std::vector<std::string> arguments = { "--worker", farm.address, "--threads", std::to_string(threads) };
+	return spawn_farm_workers(farm, executable, arguments, options.farm);
+}
+
+int main(int argc, char** argv) {
+	RenderOptions options = { "data/scenes/default.txt", 1920, 1080, DEFAULT_SAMPLES * 4, DEFAULT_SAMPLES, DEFAULT_MAX_DEPTH, DEFAULT_ROULETTE_DEPTH, 0, 0, 2.0f, 0, "frame_%04d.png", nullptr, nullptr, 1, 0.0f, 0, 1, 1, 0, SAMPLER_WANG, 0, 0,
+		-1, "127.0.0.1:0", FARM_DEFAULT_TILE_SIZE, 0, 60.0f, nullptr, -1, TREELET_DEFAULT_BUDGET_MB };
+	if (!parse_options(argc, argv, options)) {
+		print_usage();
+		return 1;
+	}
+	if (options.worker) {
+		return worker_main(options);
+	}
+
+	// A farm's coordinator only needs the camera of the scene, and the renderer's buffer to merge tiles into.
+	const bool farmed = options.farm >= 0;
+	RenderScene render;
+	if (farmed ? !load_scene(options.scene, render.scene) : !load_render_scene(options, render)) {
+		return 1;
+	}
+	Scene& scene = render.scene;
+	RaytracerData& raytracer_data = render.raytracer_data;
+	FarmCoordinator farm;
+	if (farmed && !start_farm(options, argv[0], farm)) {
+		stop_farm_coordinator(farm);
+		free_scene(scene);
+		return 1;
+	}
+
+	CpuRenderer renderer = create_renderer(options);
+	Denoiser denoiser;
+	DenoiseSettings denoise_settings;
+	const int passes = (options.samples + options.pass_samples - 1) / options.pass_samples;
+	const float aspect_ratio = (float)options.width / options.height;
+
+	if (farmed) {
+		printf("rendering frames %d-%d of '%s' at %dx%d, %d spp, on %d local workers and any that join\n", options.first_frame, options.last_frame,
+			options.scene, options.width, options.height, passes * options.pass_samples, options.farm);
+	}
+	else {
+		printf("rendering frames %d-%d of '%s' at %dx%d, %d spp, %d threads\n", options.first_frame, options.last_frame, options.scene,
+			options.width, options.height, passes * options.pass_samples, renderer.thread_count);
+	}
+
+	FrameWriter writer;
+	start_frame_writer(writer);
+	auto total_start = std::chrono::steady_clock::now();
+	double render_seconds = 0;
+	std::vector<FrameStats> frame_stats;
+	bool farm_failed = false;
+	FrameStreamWriter stream = {};
+	if (options.stream && !create_frame_stream(options.stream, options.width, options.height, stream)) {
+		options.stream = nullptr;
+	}
+
+	for (int frame = options.first_frame; frame <= options.last_frame; frame++) {
+		Camera camera = create_camera(orbit_camera(scene.camera, frame * options.orbit_degrees), aspect_ratio);
+		auto frame_start = std::chrono::steady_clock::now();
+		float reprojected = 0.0f;
+		if (options.reproject && frame > options.first_frame) {
+			reprojected = cpu_reproject(renderer, raytracer_data, camera);
+		}
+		else {
+			raytracer_data.properties.camera = camera;
+			raytracer_data.properties.frame_count = 0;
+		}
+
+		FrameStats stats = create_frame_stats();
+		stats.frame = frame;
+		double stream_ms = 0;
+		auto publish = [&](const std::vector<Vector4>& image, int image_passes) {
+			if (options.stream) {
+				publish_frame(stream, image.data(), frame, image_passes);
+				stream_ms += stream.publish_seconds * 1000.0;
+			}
+		};
+		if (farmed) {
+			// Tiles show up in the stream as they are merged.
+			std::function<void()> progress = [&]() { publish(renderer.pixels, passes); };
+			if (!farm_render_frame(farm, frame, camera, passes, options.farm_passes, renderer.pixels, options.stream ? progress : nullptr)) {
+				fprintf(stderr, "frame %d: the farm failed\n", frame);
+				farm_failed = true;
+				break;
+			}
+			stats = farm.stats;
+			publish(renderer.pixels, passes);
+		}
+		for (int pass = 0; pass < passes && !farmed && !cpu_raytracer_converged(renderer, raytracer_data); pass++) {
+			cpu_raytracer_render(renderer, raytracer_data);
+			add_frame_stats(stats, renderer.stats);
+			publish(renderer.pixels, stats.passes);
+		}
+		if (options.denoise) {
+			cpu_denoise(denoiser, renderer, denoise_settings);
+			stats.denoise_ms = denoiser.seconds * 1000.0;
+			publish(denoiser.output, stats.passes);
+		}
+		double frame_seconds = seconds_since(frame_start);
+		render_seconds += frame_seconds;
+
+		char path[1024];
+		format_frame_path(path, sizeof(path), options.output, frame); // checked by parse_options
+		if (options.adaptive_threshold > 0.0f) {
+			printf("frame %d: %.2f s, %d passes, %.1f spp on average, %llu pixels above the threshold -> %s\n", frame, frame_seconds, stats.passes,
+				(double)stats.pixels_sampled * options.pass_samples / ((double)options.width * options.height), (unsigned long long)stats.pixels_unconverged, path);
+		}
+		else if (farmed) {
+			int workers = 0;
+			for (const FarmWorkerStats& worker : farm.workers) {
+				workers += worker.busy_ms > 0.0 ? 1 : 0;
+			}
+			printf("frame %d: %.2f s, %d jobs on %d workers, %d retried -> %s\n", frame, frame_seconds, (int)farm.jobs.size(), workers,
+				farm.retries, path);
+		}
+		else if (options.reproject) {
+			printf("frame %d: %.2f s, %.1f%% of the pixels reprojected -> %s\n", frame, frame_seconds, reprojected * 100.0f, path);
+		}
+		else {
+			printf("frame %d: %.2f s -> %s\n", frame, frame_seconds, path);
+		}
+
+		// Hand the accumulation buffer, or the denoised copy of it, over to the writer and start the next frame in a
+		// fresh one. Reprojection needs the accumulation buffer for the next frame, so the writer gets a copy of it.
+		// Its display time is the hand-over, including any wait for the writer to make room.
+		auto display_start = std::chrono::steady_clock::now();
+		std::vector<Vector4>& image = options.denoise ? denoiser.output : renderer.pixels;
+		FrameWriteJob job = { path, options.width, options.height, std::vector<Vector4>() };
+		if (options.reproject && !options.denoise) {
+			job.pixels = image;
+		}
+		else {
+			job.pixels = std::move(image);
+			image.assign((size_t)options.width * options.height, Vector4());
+		}
+		frame_writer_push(writer, std::move(job));
+		stats.display_ms = seconds_since(display_start) * 1000.0 + stream_ms;
+		frame_stats.push_back(stats);
+	}
+
+	int failed = finish_frame_writer(writer);
+	close_frame_stream(stream);
+	if (farmed) {
+		stop_farm_coordinator(farm);
+	}
+	int frame_count = (int)frame_stats.size();
+	printf("%d frames in %.2f s (render %.2f s, encode + write %.2f s overlapped)\n", frame_count, seconds_since(total_start),
+		render_seconds, writer.busy_seconds);
+	if (render.treelets.header) {
+		FrameStats total = create_frame_stats();
+		for (const FrameStats& stats : frame_stats) {
+			add_frame_stats(total, stats);
+		}
+		uint64_t batches = total.treelet_hits + total.treelet_misses;
+		printf("treelet cache: %llu ray batches, %.1f%% hits, %llu misses, %llu evictions, %.1f MB paged in, peak %.1f of %d MB\n",
+			(unsigned long long)batches, batches > 0 ? 100.0 * total.treelet_hits / batches : 0.0, (unsigned long long)total.treelet_misses,
+			(unsigned long long)total.treelet_evictions, total.treelet_bytes_paged / (1024.0 * 1024.0), render.treelets.cache.peak_bytes / (1024.0 * 1024.0),
+			options.treelet_budget);
+		if (render.treelets.cache.malformed_count > 0) {
+			fprintf(stderr, "%s: %d malformed treelets were left out of the frames\n", options.scene, render.treelets.cache.malformed_count);
+		}
+	}
+
+	bool stats_written = true;
+	if (options.stats) {
+		stats_written = write_frame_stats(options.stats, frame_stats);
+		if (!stats_written) {
+			fprintf(stderr, "%s: can't write stats\n", options.stats);
+		}
+	}
+
+	bool treelets_valid = render.treelets.cache.malformed_count == 0;
+	free_scene(scene);
+	free_treelet_scene(render.treelets);
+	return failed == 0 && stats_written && !farm_failed && treelets_valid ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "tile_scheduler.h"
+
+// Temporal reprojection for the CPU tracer: when only the camera moves, the accumulated image is carried over to the
+// new view instead of starting again from noise. A ray through the center of every new pixel finds its first hit
+// (through near mirrors, like the AOVs), the hit is projected into the old camera and the four old pixels around it are
+// blended bilinearly. Old pixels whose depth or normal AOV doesn't match the new hit saw another surface (a
+// disocclusion or a silhouette) and are left out; a pixel with no matching neighbour starts over from zero passes.
+// The pass counts in CpuRenderer::history move along with the colors, so every pixel keeps averaging its own samples.
+// History is capped, so view dependent shading (metal) and the slight blur of the bilinear taps wash out.
+
+#define REPROJECTION_ROWS_PER_TASK 4
+#define REPROJECTION_DEPTH_TOLERANCE 0.02f // relative difference between an old pixel's depth and the new hit's distance
+#define REPROJECTION_MIN_NORMAL_DOT 0.95f
+#define REPROJECTION_MIN_WEIGHT 0.05f // bilinear weight of matching old pixels a pixel needs to keep its history
+#define REPROJECTION_MAX_HISTORY 32.0f // passes
+
+// Position of world point p on camera's image in pixels, (0, 0) being the top left corner of the top left pixel.
+// Returns false for points behind the camera. Ignores the lens, like the center rays cpu_reproject traces.
+inline bool camera_project(const Camera& camera, Vector3 p, int width, int height, float& x, float& y) {
+	Vector3 d = p - camera.origin;
+	float z = dot(d, camera.w); // w points backwards
+	if (z >= 0.0f) {
+		return false;
+	}
+	Vector3 corner = camera.lower_left_corner - camera.origin;
+	Vector3 q = d * (dot(corner, camera.w) / z) - corner; // on the image plane, relative to its lower left corner
+	x = dot(q, camera.horizontal) / dot(camera.horizontal, camera.horizontal) * width;
+	y = (1.0f - dot(q, camera.vertical) / dot(camera.vertical, camera.vertical)) * height;
+	return true;
+}
+
+// Moves the camera to camera. With renderer.reproject on and a frame in progress, the accumulated pixels and
+// their pass counts are reprojected into the new view and the frame goes on from there; otherwise (and with adaptive
+// sampling, whose statistics can't be moved) frame_count is reset. Stops a running pass first.
+// Returns the fraction of pixels that kept some history, 0 when the frame started over.
+inline float cpu_reproject(CpuRenderer& renderer, RaytracerData& raytracer_data, const Camera& camera) {
+	cpu_raytracer_cancel(renderer);
+	RaytracerProperties& properties = raytracer_data.properties;
+	const size_t pixel_count = renderer.pixels.size();
+	bool reusable = renderer.reproject && renderer.adaptive_threshold <= 0.0f && properties.frame_count > 0
+		&& renderer.history.size() == pixel_count && renderer.aovs.size() == pixel_count;
+	if (!reusable) {
+		properties.camera = camera;
+		properties.frame_count = 0;
+		return 0.0f;
+	}
+
+	renderer.previous_pixels.swap(renderer.pixels);
+	renderer.previous_history.swap(renderer.history);
+	renderer.previous_aovs.swap(renderer.aovs);
+	renderer.pixels.resize(pixel_count);
+	renderer.history.resize(pixel_count);
+	renderer.aovs.resize(pixel_count);
+
+	const Camera previous = properties.camera;
+	const int width = renderer.width;
+	const int height = renderer.height;
+	std::atomic<long long> kept(0);
+	begin_tile_pass(*renderer.scheduler, (height + REPROJECTION_ROWS_PER_TASK - 1) / REPROJECTION_ROWS_PER_TASK, [&](int task, int) {
+		long long task_kept = 0;
+		int y_end = std::min((task + 1) * REPROJECTION_ROWS_PER_TASK, height);
+		for (int y = task * REPROJECTION_ROWS_PER_TASK; y < y_end; y++) {
+			for (int x = 0; x < width; x++) {
+				size_t index = (size_t)y * width + x;
+				float u = (x + 0.5f) / float(width);
+				float v = (height - (y + 0.5f)) / float(height);
+				Ray ray(camera.origin, camera.lower_left_corner + camera.horizontal * u + camera.vertical * v - camera.origin);
+				Hit hit;
+				int obj_index = check_object_hit(raytracer_data, ray, 0.001f, 1.0e7f, hit);
+				PixelAov aov;
+				add_first_hit_aov(raytracer_data, ray, obj_index, hit, aov);
+				renderer.aovs[index] = aov; // until the next pass writes the averaged ones
+
+				// Seen through mirrors this is the mirror image of the hit, which is what the old camera saw there too.
+				Vector3 point = camera.origin + unit_vector(ray.direction) * aov.depth;
+				float distance = length(point - previous.origin);
+				Vector4 color;
+				float passes = 0.0f, weight = 0.0f;
+				float px, py;
+				if (camera_project(previous, point, width, height, px, py)) {
+					px -= 0.5f; // to pixel centers
+					py -= 0.5f;
+					int x0 = (int)std::floor(px), y0 = (int)std::floor(py);
+					float tx = px - x0, ty = py - y0;
+					for (int j = 0; j < 2; j++) {
+						for (int i = 0; i < 2; i++) {
+							int sx = x0 + i, sy = y0 + j;
+							if (sx < 0 || sy < 0 || sx >= width || sy >= height) {
+								continue;
+							}
+							size_t source = (size_t)sy * width + sx;
+							float w = (i ? tx : 1.0f - tx) * (j ? ty : 1.0f - ty);
+							const PixelAov& old_aov = renderer.previous_aovs[source];
+							if (w == 0.0f || renderer.previous_history[source] == 0.0f
+								|| std::fabs(old_aov.depth - distance) > REPROJECTION_DEPTH_TOLERANCE * distance
+								|| dot(old_aov.normal, aov.normal) < REPROJECTION_MIN_NORMAL_DOT) {
+								continue;
+							}
+							color = color + renderer.previous_pixels[source] * w;
+							passes += renderer.previous_history[source] * w;
+							weight += w;
+						}
+					}
+				}
+
+				if (weight >= REPROJECTION_MIN_WEIGHT) {
+					renderer.pixels[index] = color * (1.0f / weight);
+					renderer.history[index] = std::min(passes / weight, REPROJECTION_MAX_HISTORY);
+					task_kept++;
+				}
+				else {
+					renderer.pixels[index] = Vector4();
+					renderer.history[index] = 0.0f;
+				}
+			}
+		}
+		kept += task_kept;
+	});
+	wait_tile_pass(*renderer.scheduler);
+	FrameStats discarded = create_frame_stats(); // the center rays aren't part of any pass
+	take_thread_counters(discarded, 0.0);
+
+	properties.camera = camera;
+	properties.frame_count++; // new random numbers, the ones of a cancelled pass may already be in the pixels
+	renderer.refresh_aovs = true;
+	return (float)((double)kept / pixel_count);
+}
@@ -0,0 +1,390 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+// Random numbers of the CPU tracer's paths. SAMPLER_WANG is the shader's generator: one wang_hash state per pixel,
+// chained through all its samples and bounces, so a draw depends on every draw before it. The other modes are
+// counter based: a draw is a function of the pixel, the sample's index over all passes and the dimension, a fixed
+// slot per bounce and purpose (SAMPLE_DIM_*). Paths don't depend on each other's draws, and the Sobol based modes
+// stratify each dimension over a pixel's samples instead of drawing them independently.
+
+enum SamplerMode {
+	SAMPLER_WANG, // as in raytracer_compute.hlsl
+	SAMPLER_PCG, // pcg4d of (pixel x, pixel y, sample, dimension), Jarzynski & Olano 2020
+	SAMPLER_SOBOL, // Owen scrambled Sobol, padded from 4D with shuffled indices per 4 dimensions (Burley 2020)
+	SAMPLER_BLUE_NOISE, // one scrambled Sobol sequence for all pixels, shifted per pixel by a blue noise tile
+	SAMPLER_COUNT
+};
+
+inline const char* sampler_name(int mode) {
+	const char* names[] = { "wang", "pcg", "sobol", "blue noise" };
+	return names[mode];
+}
+
+// Dimensions of a path. A bounce's slots are relative to SAMPLE_DIM_BOUNCE + depth * SAMPLE_DIMS_PER_BOUNCE.
+#define SAMPLE_DIM_PIXEL 0 // 2, position in the pixel
+#define SAMPLE_DIM_LENS 2 // 2
+#define SAMPLE_DIM_BOUNCE 4
+#define SAMPLE_DIM_SCATTER 0 // 3, the most a material's scatter draws
+#define SAMPLE_DIM_LIGHT 3 // 3, light pick and direction to it
+#define SAMPLE_DIM_ROULETTE 6
+#define SAMPLE_DIMS_PER_BOUNCE 8
+
+#define BLUE_NOISE_SIZE 64 // tile width and height, a power of two
+#define BLUE_NOISE_SIGMA 1.9f // of the void-and-cluster filter, in pixels
+#define BLUE_NOISE_SEQUENCE_SEED 0x5bd1e995u // scrambles the sequence all pixels share
+
+struct PathSampler {
+	int mode;
+	uint32_t state; // SAMPLER_WANG
+	uint32_t x; // pixel
+	uint32_t y;
+	uint32_t seed; // hash of the pixel, scrambles its Sobol sequence
+	uint32_t sample; // index of the sample in its pixel over all passes
+	uint32_t dimension; // of the next draw
+	uint32_t group; // 1 + the 4D Sobol group shuffled_index belongs to, 0 for none yet
+	uint32_t group_seed;
+	uint32_t shuffled_index; // bit reversed, see owen_sobol_shuffle
+};
+
+inline uint32_t wang_hash(uint32_t& seed) {
+	seed = (seed ^ 61) ^ (seed >> 16);
+	seed *= 9;
+	seed = seed ^ (seed >> 4);
+	seed *= 0x27d4eb2d;
+	seed = seed ^ (seed >> 15);
+	return seed;
+}
+
+inline float random_float(uint32_t& state) {
+	return (wang_hash(state) & 0xFFFFFF) / 16777216.0f;
+}
+
+inline uint32_t pcg_hash(uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+	return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+// First component of pcg4d. Only multiplies, adds, xors and shifts, so loops over lanes vectorize.
+inline uint32_t pcg4d_x(uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
+	x = x * 1664525u + 1013904223u;
+	y = y * 1664525u + 1013904223u;
+	z = z * 1664525u + 1013904223u;
+	w = w * 1664525u + 1013904223u;
+	x += y * w; y += z * x; z += x * y; w += y * z;
+	x ^= x >> 16; y ^= y >> 16; z ^= z >> 16; w ^= w >> 16;
+	x += y * w; y += z * x; z += x * y; w += y * z;
+	return x;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Burley's hash based Laine-Karras permutation: each bit is flipped or not depending on the seed and the bits below
+// it. On bit reversed numbers that is Owen scrambling, see nested_uniform_scramble.
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Owen scrambling of the bits of x, most significant first: every bit is flipped or not depending on the seed and
+// the bits above it.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first four Sobol dimensions, from the Joe-Kuo primitive polynomials and initial numbers, for indices and
+// results in bit reversed order, which is the order the scrambles work in. Scrambled indices use all 32 bits, so
+// the direction numbers are combined a byte at a time: reversed_bytes[dimension][k][b] is the reversed xor of the
+// direction numbers of the set bits of b, taken as byte k of a reversed index.
+struct SobolDirections {
+	uint32_t reversed_bytes[4][4][256];
+};
+
+inline const SobolDirections& sobol_directions() {
+	static const SobolDirections directions = []() {
+		uint32_t v[4][32];
+		const uint32_t degrees[4] = { 0, 1, 2, 3 };
+		const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+		const uint32_t initial[4][3] = { {}, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+		for (int i = 0; i < 32; i++) {
+			v[0][i] = 1u << (31 - i);
+		}
+		for (int dim = 1; dim < 4; dim++) {
+			uint32_t s = degrees[dim];
+			for (uint32_t i = 0; i < 32; i++) {
+				if (i < s) {
+					v[dim][i] = initial[dim][i] << (31 - i);
+					continue;
+				}
+				uint32_t direction = v[dim][i - s] ^ (v[dim][i - s] >> s);
+				for (uint32_t k = 1; k < s; k++) {
+					direction ^= ((coefficients[dim] >> (s - 1 - k)) & 1u) * v[dim][i - k];
+				}
+				v[dim][i] = direction;
+			}
+		}
+
+		SobolDirections d;
+		for (int dim = 0; dim < 4; dim++) {
+			for (int k = 0; k < 4; k++) {
+				for (int b = 0; b < 256; b++) {
+					uint32_t result = 0;
+					for (int i = 0; i < 8; i++) {
+						if (b & (1 << i)) {
+							result ^= v[dim][31 - 8 * k - i];
+						}
+					}
+					d.reversed_bytes[dim][k][b] = reverse_bits(result);
+				}
+			}
+		}
+		return d;
+	}();
+	return directions;
+}
+
+// reverse_bits(sobol_sample(reverse_bits(reversed_index), dimension)).
+inline uint32_t reversed_sobol_sample(uint32_t reversed_index, int dimension) {
+	const uint32_t (*bytes)[256] = sobol_directions().reversed_bytes[dimension];
+	return bytes[0][reversed_index & 0xFF] ^ bytes[1][(reversed_index >> 8) & 0xFF] ^ bytes[2][(reversed_index >> 16) & 0xFF]
+		^ bytes[3][reversed_index >> 24];
+}
+
+inline uint32_t sobol_sample(uint32_t index, int dimension) {
+	return reverse_bits(reversed_sobol_sample(reverse_bits(index), dimension));
+}
+
+// Dimension of sample index of the sequence seed picks. Each group of four dimensions is a 4D Sobol sequence whose
+// sample order is shuffled by its own seed, so groups stay uncorrelated; every dimension is scrambled on its own.
+// The shuffled index stays bit reversed in between, and the draws of a path mostly come in pairs of one group, so
+// PathSampler keeps the shuffled index of the last one.
+inline uint32_t owen_sobol_group_seed(uint32_t seed, uint32_t group) {
+	return hash_combine(seed, pcg_hash(group));
+}
+
+inline uint32_t owen_sobol_shuffle(uint32_t index, uint32_t group_seed) {
+	return laine_karras_permutation(reverse_bits(index), group_seed);
+}
+
+inline uint32_t owen_sobol_value(uint32_t shuffled_index, uint32_t dimension, uint32_t group_seed) {
+	uint32_t reversed = reversed_sobol_sample(shuffled_index, dimension % 4);
+	return reverse_bits(laine_karras_permutation(reversed, hash_combine(group_seed, dimension % 4)));
+}
+
+inline uint32_t owen_sobol_sample(uint32_t index, uint32_t dimension, uint32_t seed) {
+	uint32_t group_seed = owen_sobol_group_seed(seed, dimension / 4);
+	return owen_sobol_value(owen_sobol_shuffle(index, group_seed), dimension, group_seed);
+}
+
+// BLUE_NOISE_SIZE^2 ranks spread by void-and-cluster (Ulichney 1993): each rank goes where the Gaussian weighted
+// density of the lower ranks is lowest, so any threshold of the tile is an evenly spread point set. Stored as
+// fixed point fractions (rank + 0.5) / pixels for adding to a 32 bit sample. Built on first use.
+inline const std::vector<uint32_t>& blue_noise_tile() {
+	static const std::vector<uint32_t> tile = []() {
+		const int size = BLUE_NOISE_SIZE;
+		const int pixels = size * size;
+		std::vector<float> filter(pixels);
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				int dx = std::min(x, size - x), dy = std::min(y, size - y); // toroidal distance
+				filter[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+			}
+		}
+		std::vector<float> energy(pixels, 0.0f);
+		std::vector<uint8_t> set(pixels, 0);
+		auto toggle = [&](int p, bool on) {
+			set[p] = on;
+			float sign = on ? 1.0f : -1.0f;
+			int px = p % size, py = p / size;
+			for (int y = 0; y < size; y++) {
+				for (int x = 0; x < size; x++) {
+					energy[y * size + x] += sign * filter[((y - py) & (size - 1)) * size + ((x - px) & (size - 1))];
+				}
+			}
+		};
+		auto tightest_cluster = [&]() {
+			int best = -1;
+			for (int p = 0; p < pixels; p++) {
+				if (set[p] && (best == -1 || energy[p] > energy[best])) {
+					best = p;
+				}
+			}
+			return best;
+		};
+		auto largest_void = [&]() {
+			int best = -1;
+			for (int p = 0; p < pixels; p++) {
+				if (!set[p] && (best == -1 || energy[p] < energy[best])) {
+					best = p;
+				}
+			}
+			return best;
+		};
+
+		// A random tenth of the pixels, then moved from clusters into voids until that settles.
+		const int initial_count = pixels / 10;
+		for (uint32_t i = 0, placed = 0; placed < (uint32_t)initial_count; i++) {
+			int p = (int)(pcg_hash(i) % (uint32_t)pixels);
+			if (!set[p]) {
+				toggle(p, true);
+				placed++;
+			}
+		}
+		for (int iteration = 0; iteration < pixels; iteration++) {
+			int cluster = tightest_cluster();
+			toggle(cluster, false);
+			int hole = largest_void();
+			if (hole == cluster) {
+				toggle(cluster, true);
+				break;
+			}
+			toggle(hole, true);
+		}
+
+		std::vector<int> ranks(pixels);
+		std::vector<uint8_t> initial = set;
+		std::vector<float> initial_energy = energy;
+		for (int rank = initial_count - 1; rank >= 0; rank--) {
+			int cluster = tightest_cluster();
+			toggle(cluster, false);
+			ranks[cluster] = rank;
+		}
+		set = initial;
+		energy = initial_energy;
+		// With a toroidal filter the tightest cluster of the unset pixels is also the largest void of the set ones,
+		// so the upper half of the ranks comes out of the same search.
+		for (int rank = initial_count; rank < pixels; rank++) {
+			int hole = largest_void();
+			toggle(hole, true);
+			ranks[hole] = rank;
+		}
+
+		std::vector<uint32_t> result(pixels);
+		for (int p = 0; p < pixels; p++) {
+			result[p] = (uint32_t)(((uint64_t)ranks[p] << 32) / pixels) + (uint32_t)((1ull << 31) / pixels);
+		}
+		return result;
+	}();
+	return tile;
+}
+
+// Sampler of pixel (x, y) for a pass of frame_count. The wang state is the one the shader seeds its pixels with.
+inline PathSampler create_path_sampler(int mode, uint32_t x, uint32_t y, int frame_count) {
+	PathSampler sampler;
+	sampler.mode = mode;
+	sampler.state = (x * 1973 + y * 9277 + (uint32_t)frame_count * 26699) | 1;
+	sampler.x = x;
+	sampler.y = y;
+	sampler.seed = pcg_hash(x ^ pcg_hash(y));
+	sampler.sample = 0;
+	sampler.dimension = 0;
+	sampler.group = 0;
+	return sampler;
+}
+
+// Starts sample index of the pixel, counted over all passes of the frame. The wang state carries on.
+inline void sampler_begin_sample(PathSampler& sampler, uint32_t index) {
+	sampler.sample = index;
+	sampler.dimension = SAMPLE_DIM_PIXEL;
+	sampler.group = 0;
+}
+
+// Moves the next draw to a slot of a bounce. No effect on SAMPLER_WANG, whose draws are just the next in line.
+inline void sampler_seek_bounce(PathSampler& sampler, int depth, int slot) {
+	sampler.dimension = SAMPLE_DIM_BOUNCE + (uint32_t)depth * SAMPLE_DIMS_PER_BOUNCE + slot;
+}
+
+inline void sampler_seek(PathSampler& sampler, uint32_t dimension) {
+	sampler.dimension = dimension;
+}
+
+// owen_sobol_sample of the sampler's sample, reusing the shuffled index while the dimension stays in one group.
+inline uint32_t sampler_owen_sobol(PathSampler& sampler, uint32_t dimension, uint32_t seed) {
+	uint32_t group = dimension / 4 + 1;
+	if (sampler.group != group) {
+		sampler.group = group;
+		sampler.group_seed = owen_sobol_group_seed(seed, group - 1);
+		sampler.shuffled_index = owen_sobol_shuffle(sampler.sample, sampler.group_seed);
+	}
+	return owen_sobol_value(sampler.shuffled_index, dimension, sampler.group_seed);
+}
+
+inline uint32_t sampler_bits(PathSampler& sampler) {
+	uint32_t dimension = sampler.dimension++;
+	switch (sampler.mode) {
+	case SAMPLER_PCG:
+		return pcg4d_x(sampler.x, sampler.y, sampler.sample, dimension);
+	case SAMPLER_SOBOL:
+		return sampler_owen_sobol(sampler, dimension, sampler.seed);
+	case SAMPLER_BLUE_NOISE: {
+		// Cranley-Patterson rotation by the tile, at an offset per dimension so dimensions see different noise.
+		uint32_t offset = pcg_hash(dimension);
+		uint32_t tx = (sampler.x + offset) & (BLUE_NOISE_SIZE - 1);
+		uint32_t ty = (sampler.y + (offset >> 16)) & (BLUE_NOISE_SIZE - 1);
+		return sampler_owen_sobol(sampler, dimension, BLUE_NOISE_SEQUENCE_SEED) + blue_noise_tile()[ty * BLUE_NOISE_SIZE + tx];
+	}
+	default:
+		return wang_hash(sampler.state);
+	}
+}
+
+inline float random_float(PathSampler& sampler) {
+	if (sampler.mode == SAMPLER_WANG) {
+		return random_float(sampler.state);
+	}
+	return (sampler_bits(sampler) >> 8) / 16777216.0f;
+}
+
+// Skips count draws, keeping the wang chain where it would be had they been made.
+inline void sampler_skip(PathSampler& sampler, int count) {
+	if (sampler.mode == SAMPLER_WANG) {
+		for (int i = 0; i < count; i++) {
+			wang_hash(sampler.state);
+		}
+	}
+	sampler.dimension += count;
+}
+
+// One draw from each of count samplers that move in lockstep (same mode, sample and dimension), like the pixels of a
+// camera ray packet. The pcg lanes are computed in one loop the compiler vectorizes.
+inline void random_floats(PathSampler* samplers, int count, float* result) {
+	if (count == 0) {
+		return;
+	}
+	if (samplers[0].mode != SAMPLER_PCG) {
+		for (int i = 0; i < count; i++) {
+			result[i] = random_float(samplers[i]);
+		}
+		return;
+	}
+	const uint32_t sample = samplers[0].sample, dimension = samplers[0].dimension;
+	uint32_t xs[64], ys[64];
+	for (int first = 0; first < count; first += 64) {
+		int lanes = std::min(count - first, 64);
+		for (int i = 0; i < lanes; i++) {
+			xs[i] = samplers[first + i].x;
+			ys[i] = samplers[first + i].y;
+			samplers[first + i].dimension++;
+		}
+		for (int i = 0; i < lanes; i++) {
+			result[first + i] = (pcg4d_x(xs[i], ys[i], sample, dimension) >> 8) * (1.0f / 16777216.0f);
+		}
+	}
+}
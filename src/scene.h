@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "maths.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+
+// Shared between the D3D11 compute backend and the CPU backend. Layouts match the
+// structured buffers in raytracer_compute.hlsl, so keep them in sync.
+struct Material {
+	int type; // 0->emissive, 1->lambertian, 2->metal
+	Vector3 albedo;
+	float fuzziness;
+};
+
+inline bool material_valid(const Material& material) {
+	return material.type >= 0 && material.type <= 2;
+}
+
+// Camera parameters before they are baked into Camera, so the camera can be moved and re-created at any aspect ratio.
+struct CameraPlacement {
+	Vector3 position;
+	Vector3 look_at;
+	Vector3 up;
+	float vertical_fov;
+	float aperture;
+	float focus_dist;
+};
+
+inline Camera create_camera(const CameraPlacement& placement, float aspect_ratio) {
+	return Camera(placement.position, placement.look_at, placement.up, aspect_ratio, placement.vertical_fov, placement.aperture, placement.focus_dist);
+}
+
+struct TriangleMesh; // mesh.h
+struct TreeletScene; // treelets.h
+struct CompressedBVH; // compressed_bvh.h
+
+// A placed copy of a mesh. Only uniform scale and translation, so hit distances are the same in mesh and world space.
+struct MeshInstance {
+	int mesh; // index into RaytracerData::meshes
+	float scale;
+	Vector3 offset;
+	Material material;
+};
+
+#define DEFAULT_SAMPLES 50
+#define DEFAULT_MAX_DEPTH 50
+#define DEFAULT_ROULETTE_DEPTH 3
+
+struct RaytracerProperties {
+	int width;
+	int height;
+	int frame_count;
+	int sphere_count;
+	Camera camera;
+	int bvh_node_count; // 0 -> brute force over all spheres
+	int light_count;
+	int light_sampling; // 0 -> emitters are only found by the scattered rays
+	int samples = DEFAULT_SAMPLES; // per pixel and pass
+	int max_depth = DEFAULT_MAX_DEPTH; // bounces per path
+	int roulette_depth = DEFAULT_ROULETTE_DEPTH; // bounces before Russian roulette may end a path, >= max_depth turns it off
+};
+
+struct RaytracerData {
+	RaytracerProperties properties;
+	Sphere* spheres;
+	Material* materials;
+	BVHNode* bvh_nodes;
+	int* bvh_primitive_indices;
+	int* lights; // indices of the emissive spheres
+	SphereSoA* sphere_soa; // optional, CPU only
+	const TriangleMesh* meshes; // CPU only
+	const MeshInstance* mesh_instances;
+	int mesh_instance_count;
+	int sampler = 0; // CPU only, a SamplerMode of sampler.h, 0 draws like the shader
+	TreeletScene* treelets = nullptr; // CPU only, an out-of-core scene traced in place of spheres, materials and the BVH
+	const CompressedBVH* compressed_bvh = nullptr; // CPU only, traced in place of the BVH and the SoA copy
+	const uint16_t* material_indices = nullptr; // CPU only, when set materials holds the distinct materials and spheres index them
+};
+
+// Object ids returned by hit tests: spheres first, then mesh instances.
+inline const Material& object_material(const RaytracerData& raytracer_data, int object) {
+	int sphere_count = raytracer_data.properties.sphere_count;
+	if (object >= sphere_count) {
+		return raytracer_data.mesh_instances[object - sphere_count].material;
+	}
+	return raytracer_data.materials[raytracer_data.material_indices ? raytracer_data.material_indices[object] : object];
+}
+
+// Points raytracer_data at bvh. The BVH must outlive the data and be rebuilt when spheres move.
+inline void set_bvh(RaytracerData& raytracer_data, BVH& bvh) {
+	raytracer_data.properties.bvh_node_count = (int)bvh.nodes.size();
+	raytracer_data.bvh_nodes = bvh.nodes.data();
+	raytracer_data.bvh_primitive_indices = bvh.primitive_indices.data();
+}
+
+// The SoA copy follows BVH leaf order, so call this after set_bvh and again whenever the BVH or spheres change.
+inline void set_sphere_soa(RaytracerData& raytracer_data, SphereSoA& soa) {
+	const int* order = raytracer_data.properties.bvh_node_count > 0 ? raytracer_data.bvh_primitive_indices : nullptr;
+	soa = build_sphere_soa(raytracer_data.spheres, raytracer_data.properties.sphere_count, order);
+	raytracer_data.sphere_soa = &soa;
+}
+
+// Emissive spheres, the lights sampled by next event estimation. Meshes are never sampled, scattered rays still
+// pick up their emission.
+inline std::vector<int> build_light_list(const Material* materials, int sphere_count) {
+	std::vector<int> lights;
+	for (int i = 0; i < sphere_count; i++) {
+		if (materials[i].type == 0) {
+			lights.push_back(i);
+		}
+	}
+	return lights;
+}
+
+// Points raytracer_data at lights. Rebuild the list when a material changes type.
+inline void set_lights(RaytracerData& raytracer_data, std::vector<int>& lights) {
+	raytracer_data.properties.light_count = (int)lights.size();
+	raytracer_data.lights = lights.data();
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "scene_file.h"
+#include "treelets.h"
+
+// playground-scene: converts text scenes to the mapped binary format or to out-of-core treelets, generates large
+// random scenes for scaling tests and reports how long a scene takes to load.
+
+static void print_usage() {
+	printf(
+		"usage: playground-scene convert INPUT.txt OUTPUT.pgscene [--no-bvh]\n"
+		"       playground-scene random COUNT OUTPUT.pgscene [--no-bvh]\n"
+		"       playground-scene info SCENE\n"
+		"Binary scenes store a prebuilt BVH unless --no-bvh is given, in which case it is built on load.\n"
+		"An OUTPUT ending in .pgtreelets writes the scene as treelets for out-of-core rendering, see playground-render;\n"
+		"they always store their BVH and have no meshes.\n");
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int write_binary(const char* path, const Sphere* spheres, const Material* materials, int count, const CameraPlacement& camera, bool with_bvh,
+	const std::vector<SceneMeshRecord>& mesh_records = std::vector<SceneMeshRecord>()) {
+	bool treelets = is_treelet_file(path);
+	if (treelets && !mesh_records.empty()) {
+		fprintf(stderr, "%s: treelet files have no meshes, %zu mesh instances left out\n", path, mesh_records.size());
+	}
+	BVH bvh;
+	if (with_bvh || treelets) {
+		auto start = std::chrono::steady_clock::now();
+		bvh = build_bvh(spheres, count);
+		printf("built bvh: %zu nodes in %.2f s\n", bvh.nodes.size(), seconds_since(start));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	if (treelets) {
+		if (!write_treelet_file(path, spheres, materials, count, camera, bvh)) {
+			return 1;
+		}
+		printf("wrote %d spheres as treelets to %s in %.2f s\n", count, path, seconds_since(start));
+		return 0;
+	}
+	if (!write_scene_file(path, spheres, materials, count, camera, with_bvh ? &bvh : nullptr, mesh_records.data(), (int)mesh_records.size())) {
+		return 1;
+	}
+	printf("wrote %d spheres to %s in %.2f s\n", count, path, seconds_since(start));
+	return 0;
+}
+
+static int convert(const char* input, const char* output, bool with_bvh) {
+	Scene scene;
+	if (!load_scene_text(input, scene)) {
+		return 1;
+	}
+	return write_binary(output, scene.spheres, scene.materials, scene.sphere_count, scene.camera, with_bvh, scene.mesh_records);
+}
+
+// Spheres in a cube that grows with the count (like the benchmarks), a mix of diffuse and metal materials
+// and a few lights, viewed from outside the cube.
+static int random_scene(int count, const char* output, bool with_bvh) {
+	std::vector<Sphere> spheres;
+	std::vector<Material> materials;
+	spheres.reserve(count);
+	materials.reserve(count);
+
+	uint32_t seed = 0x5eed1234u;
+	float extent = std::cbrt((float)count);
+	for (int i = 0; i < count; i++) {
+		Vector3 center(random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent), random_float_between(seed, -extent, extent));
+		spheres.push_back(Sphere(center, random_float_between(seed, 0.2f, 0.5f)));
+
+		Material material = {};
+		float kind = random_float(seed);
+		material.type = kind < 0.01f ? 0 : kind < 0.7f ? 1 : 2;
+		material.albedo = Vector3(random_float(seed), random_float(seed), random_float(seed));
+		if (material.type == 0) {
+			material.albedo *= 10.0f;
+		}
+		material.fuzziness = random_float(seed) * 0.5f;
+		materials.push_back(material);
+	}
+
+	CameraPlacement camera = { Vector3(0, extent, extent * 3), Vector3(0, 0, 0), Vector3(0, 1, 0), 60, 0.0f, extent * 3 };
+	return write_binary(output, spheres.data(), materials.data(), count, camera, with_bvh);
+}
+
+static int treelet_info(const char* path) {
+	auto start = std::chrono::steady_clock::now();
+	TreeletScene scene;
+	if (!load_treelet_scene(path, scene, 0)) {
+		return 1;
+	}
+	double load_seconds = seconds_since(start);
+
+	const TreeletFileHeader* header = scene.header;
+	uint64_t treelet_bytes = 0, largest = 0;
+	for (uint32_t i = 0; i < header->treelet_count; i++) {
+		treelet_bytes += scene.records[i].size;
+		largest = std::max(largest, scene.records[i].size);
+	}
+	printf("%s\n", path);
+	printf("  spheres    %llu\n", (unsigned long long)header->sphere_count);
+	printf("  treelets   %u, %.1f KB on average, %.1f KB the largest\n", header->treelet_count, treelet_bytes / 1024.0 / header->treelet_count, largest / 1024.0);
+	printf("  top nodes  %u\n", header->top_node_count);
+	printf("  lights     %u\n", header->light_count);
+	printf("  resident   %.2f MB without treelets\n", (header->top_node_count * sizeof(BVHNode) + header->treelet_count * sizeof(TreeletRecord)
+		+ header->light_count * sizeof(TreeletLight)) / (1024.0 * 1024.0));
+	printf("  mapped     %zu bytes\n", scene.file.size);
+	printf("  load time  %.3f ms\n", load_seconds * 1000.0);
+	free_treelet_scene(scene);
+	return 0;
+}
+
+static int info(const char* path) {
+	if (is_treelet_file(path)) {
+		return treelet_info(path);
+	}
+	auto start = std::chrono::steady_clock::now();
+	Scene scene;
+	if (!load_scene(path, scene)) {
+		return 1;
+	}
+	double load_seconds = seconds_since(start);
+
+	printf("%s\n", path);
+	printf("  spheres    %d\n", scene.sphere_count);
+	printf("  bvh nodes  %d%s\n", scene.bvh_node_count, scene.bvh_nodes ? "" : " (built on load)");
+	printf("  mapped     %s, %zu bytes\n", scene.file.data ? "yes" : "no", scene.file.size);
+	for (const TriangleMesh& mesh : scene.meshes) {
+		printf("  mesh       %s, %d triangles, %d bvh nodes%s\n", mesh.path.c_str(), mesh.triangle_count, mesh.bvh_node_count, mesh.file.data ? " (cached)" : "");
+	}
+	printf("  instances  %zu\n", scene.mesh_instances.size());
+	printf("  load time  %.3f ms\n", load_seconds * 1000.0);
+	free_scene(scene);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	bool with_bvh = !(argc > 1 && strcmp(argv[argc - 1], "--no-bvh") == 0);
+	int arg_count = with_bvh ? argc : argc - 1;
+
+	if (arg_count == 4 && strcmp(argv[1], "convert") == 0) {
+		return convert(argv[2], argv[3], with_bvh);
+	}
+	if (arg_count == 4 && strcmp(argv[1], "random") == 0 && atoi(argv[2]) > 0) {
+		return random_scene(atoi(argv[2]), argv[3], with_bvh);
+	}
+	if (arg_count == 3 && strcmp(argv[1], "info") == 0) {
+		return info(argv[2]);
+	}
+
+	print_usage();
+	return 1;
+}
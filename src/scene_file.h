@@ -0,0 +1,385 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "mapped_file.h"
+#include "mesh.h"
+
+// Scenes on disk. The binary format (.pgscene) is a header, a section table and 64-byte aligned sections whose
+// elements are the in-memory Sphere, Material, CameraPlacement and BVHNode layouts, so a loaded Scene points
+// straight into the mapped file. Loading only validates the header and the section table; no element is read
+// until the tracer touches it. Traversal bounds every node and index it reads, see bvh_traverse, and unknown
+// material types scatter nothing, so a malformed file renders wrong instead of crashing. Code that walks the whole
+// BVH up front checks it with scene_bvh_valid first. The text format (.txt) is for writing scenes by hand and is converted with
+// playground-scene; it can also be loaded directly, which parses it and builds the BVH.
+//
+// Text format, one statement per line, '#' starts a comment:
+//   camera <position xyz> <look_at xyz> <up xyz> <vertical fov> <aperture> <focus distance>
+//   material <name> emissive|lambertian|metal <r g b> [fuzziness]
+//   sphere <center xyz> <radius> <material name>
+//   mesh <obj path> <material name> [scale] [offset xyz]
+//
+// Meshes are referenced by path (relative to the working directory, like the scene itself) and loaded through
+// their .pgmesh cache, see mesh.h. They are only traced by the CPU backend.
+
+#define SCENE_FILE_MAGIC "PGSCENE"
+#define SCENE_FILE_VERSION 1 // bump when a section layout changes, old files are rejected instead of misread
+#define SCENE_FILE_ALIGNMENT 64
+
+enum SceneSectionType {
+	SCENE_SECTION_SPHERES = 1,
+	SCENE_SECTION_MATERIALS = 2, // one per sphere
+	SCENE_SECTION_CAMERA = 3,
+	SCENE_SECTION_BVH_NODES = 4, // optional, both BVH sections or neither
+	SCENE_SECTION_BVH_PRIMITIVE_INDICES = 5,
+	SCENE_SECTION_MESH_INSTANCES = 6 // optional
+};
+
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t section_count; // SceneFileSection entries follow the header
+	uint64_t file_size;
+};
+
+struct SceneFileSection {
+	uint32_t type;
+	uint32_t element_size; // sizeof the element when written, checked against the reader's layout
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct SceneMeshRecord {
+	char path[256]; // zero terminated
+	float scale;
+	Vector3 offset;
+	Material material;
+};
+
+struct Scene {
+	Sphere* spheres;
+	Material* materials;
+	int sphere_count;
+	CameraPlacement camera;
+	BVHNode* bvh_nodes; // null if the file has no BVH
+	int bvh_node_count;
+	int* bvh_primitive_indices;
+
+	MappedFile file; // backing memory of binary scenes
+	std::vector<Sphere> sphere_storage; // backing memory of text scenes
+	std::vector<Material> material_storage;
+	BVH bvh;
+
+	std::vector<SceneMeshRecord> mesh_records; // as written in the file
+	std::vector<TriangleMesh> meshes; // one per distinct path
+	std::vector<MeshInstance> mesh_instances; // one per record
+};
+
+inline void free_scene(Scene& scene) {
+	for (TriangleMesh& mesh : scene.meshes) {
+		free_mesh(mesh);
+	}
+	unmap_file(scene.file);
+	scene = Scene();
+}
+
+// Points raytracer_data at the scene, including its BVH if it has one. The camera is left to the caller,
+// since it depends on the output aspect ratio (see create_camera).
+inline void set_scene(RaytracerData& raytracer_data, Scene& scene) {
+	raytracer_data.properties.sphere_count = scene.sphere_count;
+	raytracer_data.properties.bvh_node_count = scene.bvh_nodes ? scene.bvh_node_count : 0;
+	raytracer_data.spheres = scene.spheres;
+	raytracer_data.materials = scene.materials;
+	raytracer_data.bvh_nodes = scene.bvh_nodes;
+	raytracer_data.bvh_primitive_indices = scene.bvh_primitive_indices;
+	raytracer_data.meshes = scene.meshes.data();
+	raytracer_data.mesh_instances = scene.mesh_instances.data();
+	raytracer_data.mesh_instance_count = (int)scene.mesh_instances.size();
+}
+
+inline bool scene_error(const char* path, const char* message, int line = 0) {
+	if (line > 0) {
+		fprintf(stderr, "%s:%d: %s\n", path, line, message);
+	}
+	else {
+		fprintf(stderr, "%s: %s\n", path, message);
+	}
+	return false;
+}
+
+// Loads the meshes of scene.mesh_records, each distinct path once, and creates their instances.
+inline bool load_scene_meshes(const char* path, Scene& scene) {
+	std::map<std::string, int> mesh_indices;
+	for (const SceneMeshRecord& record : scene.mesh_records) {
+		if (!memchr(record.path, 0, sizeof(record.path)) || !(record.scale > 0.0f) || !material_valid(record.material)) {
+			return scene_error(path, "malformed mesh instance");
+		}
+		auto found = mesh_indices.find(record.path);
+		if (found == mesh_indices.end()) {
+			TriangleMesh mesh;
+			if (!load_mesh(record.path, mesh)) {
+				return scene_error(path, "can't load mesh");
+			}
+			found = mesh_indices.insert(std::make_pair(std::string(record.path), (int)scene.meshes.size())).first;
+			scene.meshes.push_back(std::move(mesh));
+		}
+
+		MeshInstance instance = { found->second, record.scale, record.offset, record.material };
+		scene.mesh_instances.push_back(instance);
+	}
+	return true;
+}
+
+inline const SceneFileSection* find_scene_section(const SceneFileHeader* header, uint32_t type) {
+	const SceneFileSection* sections = (const SceneFileSection*)(header + 1);
+	for (uint32_t i = 0; i < header->section_count; i++) {
+		if (sections[i].type == type) {
+			return &sections[i];
+		}
+	}
+	return nullptr;
+}
+
+// Returns a pointer to the section's elements, or null if the section is missing or doesn't fit the file.
+inline void* scene_section_data(const MappedFile& file, const SceneFileSection* section, size_t element_size, uint64_t max_count) {
+	if (!section || section->element_size != element_size || section->count > max_count) {
+		return nullptr;
+	}
+	if (section->offset % SCENE_FILE_ALIGNMENT != 0 || section->offset > file.size || section->count * element_size > file.size - section->offset) {
+		return nullptr;
+	}
+	return (char*)file.data + section->offset;
+}
+
+inline bool load_scene_binary(const char* path, Scene& scene) {
+	scene = Scene();
+	if (!map_file(path, scene.file)) {
+		return scene_error(path, "can't open file");
+	}
+
+	const MappedFile& file = scene.file;
+	const SceneFileHeader* header = (const SceneFileHeader*)file.data;
+	if (file.size < sizeof(SceneFileHeader) || memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+		free_scene(scene);
+		return scene_error(path, "not a scene file");
+	}
+	if (header->version != SCENE_FILE_VERSION) {
+		free_scene(scene);
+		return scene_error(path, "unsupported scene file version, convert it again");
+	}
+	if (header->file_size != file.size || header->section_count > (file.size - sizeof(SceneFileHeader)) / sizeof(SceneFileSection)) {
+		free_scene(scene);
+		return scene_error(path, "truncated scene file");
+	}
+
+	const SceneFileSection* sphere_section = find_scene_section(header, SCENE_SECTION_SPHERES);
+	const SceneFileSection* material_section = find_scene_section(header, SCENE_SECTION_MATERIALS);
+	const SceneFileSection* camera_section = find_scene_section(header, SCENE_SECTION_CAMERA);
+	const SceneFileSection* node_section = find_scene_section(header, SCENE_SECTION_BVH_NODES);
+	const SceneFileSection* index_section = find_scene_section(header, SCENE_SECTION_BVH_PRIMITIVE_INDICES);
+
+	scene.spheres = (Sphere*)scene_section_data(file, sphere_section, sizeof(Sphere), INT32_MAX);
+	scene.materials = (Material*)scene_section_data(file, material_section, sizeof(Material), INT32_MAX);
+	CameraPlacement* camera = (CameraPlacement*)scene_section_data(file, camera_section, sizeof(CameraPlacement), 1);
+	if (!scene.spheres || !scene.materials || !camera || camera_section->count != 1 || material_section->count != sphere_section->count) {
+		free_scene(scene);
+		return scene_error(path, "missing or malformed sphere, material or camera section");
+	}
+	scene.sphere_count = (int)sphere_section->count;
+	scene.camera = *camera;
+
+	if (node_section || index_section) {
+		scene.bvh_nodes = (BVHNode*)scene_section_data(file, node_section, sizeof(BVHNode), INT32_MAX);
+		scene.bvh_primitive_indices = (int*)scene_section_data(file, index_section, sizeof(int), INT32_MAX);
+		if (!scene.bvh_nodes || !scene.bvh_primitive_indices || index_section->count != sphere_section->count || node_section->count == 0) {
+			free_scene(scene);
+			return scene_error(path, "malformed bvh sections");
+		}
+		scene.bvh_node_count = (int)node_section->count;
+	}
+
+	if (const SceneFileSection* mesh_section = find_scene_section(header, SCENE_SECTION_MESH_INSTANCES)) {
+		const SceneMeshRecord* records = (const SceneMeshRecord*)scene_section_data(file, mesh_section, sizeof(SceneMeshRecord), INT32_MAX);
+		if (!records) {
+			free_scene(scene);
+			return scene_error(path, "malformed mesh section");
+		}
+		scene.mesh_records.assign(records, records + mesh_section->count);
+	}
+	if (!load_scene_meshes(path, scene)) {
+		free_scene(scene);
+		return false;
+	}
+
+	return true;
+}
+
+// Full check of a BVH that came with a binary scene, for code that walks every node rather than only the ones rays
+// reach. Reads the whole BVH, so it costs about what that walk does.
+inline bool scene_bvh_valid(const char* path, const Scene& scene) {
+	if (scene.file.data && scene.bvh_nodes && !bvh_valid(scene.bvh_nodes, scene.bvh_node_count, scene.bvh_primitive_indices, scene.sphere_count, scene.sphere_count)) {
+		return scene_error(path, "malformed bvh sections");
+	}
+	return true;
+}
+
+inline bool load_scene_text(const char* path, Scene& scene) {
+	scene = Scene();
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		return scene_error(path, "can't open file");
+	}
+
+	std::map<std::string, Material> materials;
+	bool has_camera = false;
+	char line[1024];
+	for (int line_number = 1; fgets(line, sizeof(line), file); line_number++) {
+		if (char* comment = strchr(line, '#')) {
+			*comment = 0;
+		}
+
+		char keyword[64] = {}, name[64] = {}, type[64] = {};
+		if (sscanf(line, "%63s", keyword) != 1) {
+			continue;
+		}
+
+		bool valid = false;
+		if (strcmp(keyword, "camera") == 0) {
+			CameraPlacement& c = scene.camera;
+			valid = sscanf(line, "%*s %f %f %f %f %f %f %f %f %f %f %f %f", &c.position.x, &c.position.y, &c.position.z,
+				&c.look_at.x, &c.look_at.y, &c.look_at.z, &c.up.x, &c.up.y, &c.up.z, &c.vertical_fov, &c.aperture, &c.focus_dist) == 12;
+			has_camera = true;
+		}
+		else if (strcmp(keyword, "material") == 0) {
+			Material material = {};
+			int matched = sscanf(line, "%*s %63s %63s %f %f %f %f", name, type, &material.albedo.x, &material.albedo.y, &material.albedo.z, &material.fuzziness);
+			material.type = strcmp(type, "emissive") == 0 ? 0 : strcmp(type, "lambertian") == 0 ? 1 : strcmp(type, "metal") == 0 ? 2 : -1;
+			valid = matched >= 5 && material.type >= 0;
+			materials[name] = material;
+		}
+		else if (strcmp(keyword, "sphere") == 0) {
+			Vector3 center;
+			float radius;
+			valid = sscanf(line, "%*s %f %f %f %f %63s", &center.x, &center.y, &center.z, &radius, name) == 5;
+			auto material = materials.find(name);
+			if (valid && material == materials.end()) {
+				fclose(file);
+				return scene_error(path, "unknown material", line_number);
+			}
+			if (valid && !(radius > 0.0f)) {
+				fclose(file);
+				return scene_error(path, "sphere radius must be positive", line_number);
+			}
+			if (valid) {
+				scene.sphere_storage.push_back(Sphere(center, radius));
+				scene.material_storage.push_back(material->second);
+			}
+		}
+
+		else if (strcmp(keyword, "mesh") == 0) {
+			SceneMeshRecord record = {};
+			record.scale = 1.0f;
+			char mesh_path[sizeof(record.path)] = {};
+			int matched = sscanf(line, "%*s %255s %63s %f %f %f %f", mesh_path, name, &record.scale, &record.offset.x, &record.offset.y, &record.offset.z);
+			valid = matched == 2 || matched == 3 || matched == 6;
+			auto material = materials.find(name);
+			if (valid && material == materials.end()) {
+				fclose(file);
+				return scene_error(path, "unknown material", line_number);
+			}
+			if (valid) {
+				memcpy(record.path, mesh_path, sizeof(record.path));
+				record.material = material->second;
+				scene.mesh_records.push_back(record);
+			}
+		}
+
+		if (!valid) {
+			fclose(file);
+			return scene_error(path, "can't parse line", line_number);
+		}
+	}
+	fclose(file);
+
+	if (!has_camera || scene.sphere_storage.empty()) {
+		return scene_error(path, "a scene needs a camera and at least one sphere");
+	}
+
+	scene.spheres = scene.sphere_storage.data();
+	scene.materials = scene.material_storage.data();
+	scene.sphere_count = (int)scene.sphere_storage.size();
+	scene.bvh = build_bvh(scene.spheres, scene.sphere_count);
+	scene.bvh_nodes = scene.bvh.nodes.data();
+	scene.bvh_node_count = (int)scene.bvh.nodes.size();
+	scene.bvh_primitive_indices = scene.bvh.primitive_indices.data();
+	if (!load_scene_meshes(path, scene)) {
+		free_scene(scene);
+		return false;
+	}
+	return true;
+}
+
+// .txt files are parsed, anything else is mapped as a binary scene.
+inline bool load_scene(const char* path, Scene& scene) {
+	size_t length = strlen(path);
+	if (length >= 4 && strcmp(path + length - 4, ".txt") == 0) {
+		return load_scene_text(path, scene);
+	}
+	return load_scene_binary(path, scene);
+}
+
+// bvh may be null. Sections are written in the order they are listed in the table.
+inline bool write_scene_file(const char* path, const Sphere* spheres, const Material* materials, int sphere_count, const CameraPlacement& camera, const BVH* bvh,
+	const SceneMeshRecord* mesh_records = nullptr, int mesh_record_count = 0) {
+	struct SectionSource { const void* data; SceneFileSection section; };
+	std::vector<SectionSource> sources;
+	sources.push_back({ spheres, { SCENE_SECTION_SPHERES, sizeof(Sphere), 0, (uint64_t)sphere_count } });
+	sources.push_back({ materials, { SCENE_SECTION_MATERIALS, sizeof(Material), 0, (uint64_t)sphere_count } });
+	sources.push_back({ &camera, { SCENE_SECTION_CAMERA, sizeof(CameraPlacement), 0, 1 } });
+	if (bvh) {
+		sources.push_back({ bvh->nodes.data(), { SCENE_SECTION_BVH_NODES, sizeof(BVHNode), 0, bvh->nodes.size() } });
+		sources.push_back({ bvh->primitive_indices.data(), { SCENE_SECTION_BVH_PRIMITIVE_INDICES, sizeof(int), 0, bvh->primitive_indices.size() } });
+	}
+	if (mesh_record_count > 0) {
+		sources.push_back({ mesh_records, { SCENE_SECTION_MESH_INSTANCES, sizeof(SceneMeshRecord), 0, (uint64_t)mesh_record_count } });
+	}
+
+	SceneFileHeader header = {};
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.section_count = (uint32_t)sources.size();
+
+	uint64_t offset = sizeof(SceneFileHeader) + sources.size() * sizeof(SceneFileSection);
+	std::vector<SceneFileSection> sections;
+	for (SectionSource& source : sources) {
+		offset = (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+		source.section.offset = offset;
+		offset += source.section.count * source.section.element_size;
+		sections.push_back(source.section);
+	}
+	header.file_size = offset;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		return scene_error(path, "can't create file");
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(sections.data(), sizeof(SceneFileSection), sections.size(), file) == sections.size();
+	uint64_t position = sizeof(SceneFileHeader) + sections.size() * sizeof(SceneFileSection);
+	const char padding[SCENE_FILE_ALIGNMENT] = {};
+	for (const SectionSource& source : sources) {
+		size_t padding_size = (size_t)(source.section.offset - position);
+		size_t size = (size_t)(source.section.count * source.section.element_size);
+		ok = ok && fwrite(padding, 1, padding_size, file) == padding_size;
+		ok = ok && fwrite(source.data, 1, size, file) == size;
+		position = source.section.offset + size;
+	}
+	ok = fclose(file) == 0 && ok;
+
+	return ok || scene_error(path, "write failed");
+}
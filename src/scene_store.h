@@ -0,0 +1,188 @@
+#pragma once
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "scene.h"
+
+// GPU copies of the scene arrays. Edits mark element ranges dirty and only those ranges are uploaded on the next
+// frame; buffers grow geometrically when the scene outgrows them. Uploads go through UploadDevice, so the same
+// code runs against D3D11 (raytracer.h) or RecordingUploadDevice, which runs anywhere and counts the traffic.
+
+#define SCENE_STORE_MIN_CAPACITY 64
+
+struct GpuBuffer {
+	void* resource; // device specific, e.g. ID3D11Buffer
+	void* view; // device specific, e.g. ID3D11ShaderResourceView
+	int capacity; // in elements
+	int element_size;
+};
+
+struct UploadDevice {
+	virtual ~UploadDevice() {}
+	virtual GpuBuffer create_buffer(int capacity, int element_size) = 0;
+	virtual void release_buffer(GpuBuffer& buffer) = 0;
+	virtual void upload(GpuBuffer& buffer, size_t offset, size_t size, const void* data) = 0;
+};
+
+// Keeps the buffer contents in memory and counts calls and bytes, for checking upload traffic without a GPU.
+struct RecordingUploadDevice : UploadDevice {
+	size_t uploaded_bytes = 0;
+	int upload_count = 0;
+	int created_count = 0;
+	size_t allocated_bytes = 0;
+
+	GpuBuffer create_buffer(int capacity, int element_size) override {
+		std::vector<uint8_t>* contents = new std::vector<uint8_t>((size_t)capacity * element_size);
+		created_count++;
+		allocated_bytes += contents->size();
+		GpuBuffer buffer = { contents, nullptr, capacity, element_size };
+		return buffer;
+	}
+
+	void release_buffer(GpuBuffer& buffer) override {
+		std::vector<uint8_t>* contents = (std::vector<uint8_t>*)buffer.resource;
+		allocated_bytes -= contents->size();
+		delete contents;
+		buffer = GpuBuffer();
+	}
+
+	void upload(GpuBuffer& buffer, size_t offset, size_t size, const void* data) override {
+		std::vector<uint8_t>& contents = *(std::vector<uint8_t>*)buffer.resource;
+		assert(offset + size <= contents.size());
+		memcpy(contents.data() + offset, data, size);
+		uploaded_bytes += size;
+		upload_count++;
+	}
+};
+
+inline const uint8_t* recorded_contents(const GpuBuffer& buffer) {
+	return ((std::vector<uint8_t>*)buffer.resource)->data();
+}
+
+// Same order as the t registers in raytracer_compute.hlsl.
+enum SceneBufferType {
+	SCENE_BUFFER_PROPERTIES,
+	SCENE_BUFFER_SPHERES,
+	SCENE_BUFFER_MATERIALS,
+	SCENE_BUFFER_BVH_NODES,
+	SCENE_BUFFER_BVH_PRIMITIVE_INDICES,
+	SCENE_BUFFER_LIGHTS,
+	SCENE_BUFFER_COUNT
+};
+
+// Elements [dirty_first, dirty_end) need uploading. Several edits in one frame merge into one range.
+struct SceneBuffer {
+	GpuBuffer gpu;
+	int count; // elements uploaded so far
+	int dirty_first;
+	int dirty_end;
+};
+
+struct SceneStore {
+	UploadDevice* device;
+	SceneBuffer buffers[SCENE_BUFFER_COUNT];
+	size_t frame_uploaded_bytes; // by the last scene_store_upload
+};
+
+inline SceneStore create_scene_store(UploadDevice* device) {
+	SceneStore store = {};
+	store.device = device;
+	return store;
+}
+
+inline void release_scene_store(SceneStore& store) {
+	for (SceneBuffer& buffer : store.buffers) {
+		if (buffer.gpu.resource) {
+			store.device->release_buffer(buffer.gpu);
+		}
+	}
+}
+
+inline void scene_buffer_mark_dirty(SceneBuffer& buffer, int first, int count) {
+	if (buffer.dirty_first >= buffer.dirty_end) {
+		buffer.dirty_first = first;
+		buffer.dirty_end = first + count;
+	}
+	else {
+		buffer.dirty_first = std::min(buffer.dirty_first, first);
+		buffer.dirty_end = std::max(buffer.dirty_end, first + count);
+	}
+}
+
+inline void scene_store_mark_dirty(SceneStore& store, SceneBufferType type, int first, int count) {
+	scene_buffer_mark_dirty(store.buffers[type], first, count);
+}
+
+// Marks the whole buffer, e.g. after the BVH was rebuilt.
+inline void scene_store_mark_all_dirty(SceneStore& store, SceneBufferType type) {
+	scene_store_mark_dirty(store, type, 0, INT32_MAX / 2);
+}
+
+inline void scene_store_mark_sphere_dirty(SceneStore& store, int sphere) {
+	scene_store_mark_dirty(store, SCENE_BUFFER_SPHERES, sphere, 1);
+}
+
+inline void scene_store_mark_material_dirty(SceneStore& store, int material) {
+	scene_store_mark_dirty(store, SCENE_BUFFER_MATERIALS, material, 1);
+}
+
+inline void scene_store_mark_lights_dirty(SceneStore& store) {
+	scene_store_mark_all_dirty(store, SCENE_BUFFER_LIGHTS);
+}
+
+inline void scene_store_mark_bvh_dirty(SceneStore& store) {
+	scene_store_mark_all_dirty(store, SCENE_BUFFER_BVH_NODES);
+	scene_store_mark_all_dirty(store, SCENE_BUFFER_BVH_PRIMITIVE_INDICES);
+}
+
+inline void scene_buffer_upload(SceneStore& store, SceneBuffer& buffer, const void* data, int count, int element_size) {
+	if (!buffer.gpu.resource || count > buffer.gpu.capacity) {
+		// Contents don't survive a resize, so everything is uploaded again.
+		int capacity = std::max(SCENE_STORE_MIN_CAPACITY, buffer.gpu.capacity);
+		while (capacity < count) {
+			capacity *= 2;
+		}
+		if (buffer.gpu.resource) {
+			store.device->release_buffer(buffer.gpu);
+		}
+		buffer.gpu = store.device->create_buffer(capacity, element_size);
+		buffer.count = 0;
+		buffer.dirty_first = 0;
+		buffer.dirty_end = count;
+	}
+	else if (count > buffer.count) {
+		scene_buffer_mark_dirty(buffer, buffer.count, count - buffer.count);
+	}
+
+	int first = std::max(buffer.dirty_first, 0);
+	int end = std::min(buffer.dirty_end, count);
+	if (first < end && data) {
+		size_t offset = (size_t)first * element_size;
+		size_t size = (size_t)(end - first) * element_size;
+		store.device->upload(buffer.gpu, offset, size, (const uint8_t*)data + offset);
+		store.frame_uploaded_bytes += size;
+	}
+
+	buffer.count = count;
+	buffer.dirty_first = buffer.dirty_end = 0;
+}
+
+// Call once per frame before dispatching. The properties hold frame_count, so they go up every frame;
+// everything else only when marked dirty or grown.
+inline void scene_store_upload(SceneStore& store, const RaytracerData& raytracer_data) {
+	const RaytracerProperties& properties = raytracer_data.properties;
+	int bvh_node_count = properties.bvh_node_count;
+	int bvh_index_count = bvh_node_count > 0 ? properties.sphere_count : 0;
+
+	store.frame_uploaded_bytes = 0;
+	scene_store_mark_dirty(store, SCENE_BUFFER_PROPERTIES, 0, 1);
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_PROPERTIES], &properties, 1, sizeof(RaytracerProperties));
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_SPHERES], raytracer_data.spheres, properties.sphere_count, sizeof(Sphere));
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_MATERIALS], raytracer_data.materials, properties.sphere_count, sizeof(Material));
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_BVH_NODES], raytracer_data.bvh_nodes, bvh_node_count, sizeof(BVHNode));
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_BVH_PRIMITIVE_INDICES], raytracer_data.bvh_primitive_indices, bvh_index_count, sizeof(int));
+	scene_buffer_upload(store, store.buffers[SCENE_BUFFER_LIGHTS], raytracer_data.lights, properties.light_count, sizeof(int));
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+// Thin wrapper over SSE/AVX2 so the CPU kernels can be written once for either width. Both widths live in their own
+// namespace, simd_sse and simd_avx2, so a kernel can be compiled for each and picked at runtime (see sphere_soa.h).
+// The simd_* names at global scope are the widest instruction set enabled for the translation unit (/arch:AVX2 or
+// -mavx2 for 8 lanes), for kernels that aren't dispatched.
+
+#if defined(__AVX2__)
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1 // no vector kernels, callers fall back to the scalar path
+#endif
+
+#define SIMD_ALIGNMENT 32
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(SIMD_X86)
+// GCC and Clang only emit AVX/AVX-512 instructions inside functions marked for them, MSVC doesn't need this.
+// AVX-512 implies FMA, so contraction is turned off to keep results identical to the scalar functions.
+// GCC 12 also reports false maybe-uninitialized warnings from inside its own AVX-512 intrinsics.
+#define SIMD_STRINGIFY(x) #x
+#if defined(__clang__)
+#define SIMD_TARGET_BEGIN(isa) _Pragma(SIMD_STRINGIFY(clang attribute push (__attribute__((target(isa))), apply_to = function)))
+#define SIMD_TARGET_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define SIMD_TARGET_BEGIN(isa) _Pragma("GCC push_options") _Pragma(SIMD_STRINGIFY(GCC target(isa))) _Pragma("GCC optimize(\"fp-contract=off\")") \
+	_Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define SIMD_TARGET_END _Pragma("GCC diagnostic pop") _Pragma("GCC pop_options")
+#else
+#define SIMD_TARGET_BEGIN(isa)
+#define SIMD_TARGET_END
+#endif
+#endif
+
+// Instruction sets that can be picked at runtime, independent of SIMD_WIDTH above (see maths.h).
+enum SimdLevel {
+	SIMD_LEVEL_SCALAR,
+	SIMD_LEVEL_SSE4,
+	SIMD_LEVEL_AVX2,
+	SIMD_LEVEL_AVX512,
+	SIMD_LEVEL_COUNT
+};
+
+inline const char* simd_level_name(SimdLevel level) {
+	const char* names[] = { "scalar", "sse4", "avx2", "avx512" };
+	return names[level];
+}
+
+// Checks both the CPU feature bits and that the OS saves the wider registers on context switches.
+inline SimdLevel detect_simd_level() {
+#if defined(SIMD_X86)
+	unsigned int info[4] = {};
+	unsigned int extended[4] = {};
+#if defined(_MSC_VER)
+	__cpuid((int*)info, 1);
+	__cpuidex((int*)extended, 7, 0);
+#else
+	__cpuid(1, info[0], info[1], info[2], info[3]);
+	__cpuid_count(7, 0, extended[0], extended[1], extended[2], extended[3]);
+#endif
+
+	bool sse4 = (info[2] & (1u << 19)) != 0;
+	bool osxsave = (info[2] & (1u << 27)) != 0;
+	bool avx = (info[2] & (1u << 28)) != 0;
+	bool avx2 = (extended[1] & (1u << 5)) != 0;
+	bool avx512 = (extended[1] & (1u << 16)) != 0;
+
+	unsigned long long xcr0 = 0;
+	if (osxsave) {
+#if defined(_MSC_VER)
+		xcr0 = _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		xcr0 = ((unsigned long long)edx << 32) | eax;
+#endif
+	}
+	bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+	bool zmm_enabled = (xcr0 & 0xE6) == 0xE6;
+
+	if (avx512 && avx2 && zmm_enabled) {
+		return SIMD_LEVEL_AVX512;
+	}
+	if (avx2 && avx && ymm_enabled) {
+		return SIMD_LEVEL_AVX2;
+	}
+	if (sse4) {
+		return SIMD_LEVEL_SSE4;
+	}
+#endif
+	return SIMD_LEVEL_SCALAR;
+}
+
+#if defined(_MSC_VER)
+inline int lowest_set_bit(unsigned int bits) { unsigned long index; _BitScanForward(&index, bits); return (int)index; }
+inline void* aligned_malloc(size_t size, size_t alignment) { return _aligned_malloc(size, alignment); }
+inline void aligned_free(void* ptr) { _aligned_free(ptr); }
+#else
+inline int lowest_set_bit(unsigned int bits) { return __builtin_ctz(bits); }
+inline void* aligned_malloc(size_t size, size_t alignment) { return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment); }
+inline void aligned_free(void* ptr) { free(ptr); }
+#endif
+
+// std::vector allocator that keeps the data aligned for vector loads.
+template <typename T>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		void* ptr = aligned_malloc(n * sizeof(T), SIMD_ALIGNMENT);
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return (T*)ptr;
+	}
+
+	void deallocate(T* ptr, size_t) { aligned_free(ptr); }
+
+	template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+#if defined(SIMD_X86)
+namespace simd_sse {
+const int SIMD_LANES = 4;
+typedef __m128 simd_float;
+
+inline simd_float simd_set(float v) { return _mm_set1_ps(v); }
+inline simd_float simd_load(const float* p) { return _mm_loadu_ps(p); }
+inline simd_float simd_load_u8(const uint8_t* p) {
+	int bytes;
+	memcpy(&bytes, p, sizeof(bytes));
+	__m128i zero = _mm_setzero_si128();
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+}
+inline simd_float simd_load_u16(const uint16_t* p) { return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128())); }
+inline void simd_store(float* p, simd_float a) { _mm_storeu_ps(p, a); }
+inline simd_float simd_lane_index() { return _mm_setr_ps(0, 1, 2, 3); }
+inline simd_float simd_add(simd_float a, simd_float b) { return _mm_add_ps(a, b); }
+inline simd_float simd_sub(simd_float a, simd_float b) { return _mm_sub_ps(a, b); }
+inline simd_float simd_mul(simd_float a, simd_float b) { return _mm_mul_ps(a, b); }
+inline simd_float simd_div(simd_float a, simd_float b) { return _mm_div_ps(a, b); }
+inline simd_float simd_min(simd_float a, simd_float b) { return _mm_min_ps(a, b); }
+inline simd_float simd_max(simd_float a, simd_float b) { return _mm_max_ps(a, b); }
+inline simd_float simd_sqrt(simd_float a) { return _mm_sqrt_ps(a); }
+inline simd_float simd_and(simd_float a, simd_float b) { return _mm_and_ps(a, b); }
+inline simd_float simd_or(simd_float a, simd_float b) { return _mm_or_ps(a, b); }
+inline simd_float simd_less(simd_float a, simd_float b) { return _mm_cmplt_ps(a, b); }
+inline simd_float simd_greater(simd_float a, simd_float b) { return _mm_cmpgt_ps(a, b); }
+inline simd_float simd_equal(simd_float a, simd_float b) { return _mm_cmpeq_ps(a, b); }
+inline simd_float simd_select(simd_float mask, simd_float a, simd_float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline int simd_mask_bits(simd_float mask) { return _mm_movemask_ps(mask); }
+inline float simd_horizontal_min(simd_float a) {
+	__m128 m = _mm_min_ps(a, _mm_movehl_ps(a, a));
+	m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+	return _mm_cvtss_f32(m);
+}
+}
+
+SIMD_TARGET_BEGIN("avx2")
+namespace simd_avx2 {
+const int SIMD_LANES = 8;
+typedef __m256 simd_float;
+
+inline simd_float simd_set(float v) { return _mm256_set1_ps(v); }
+inline simd_float simd_load(const float* p) { return _mm256_loadu_ps(p); }
+inline simd_float simd_load_u8(const uint8_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+inline simd_float simd_load_u16(const uint16_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+inline void simd_store(float* p, simd_float a) { _mm256_storeu_ps(p, a); }
+inline simd_float simd_lane_index() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+inline simd_float simd_add(simd_float a, simd_float b) { return _mm256_add_ps(a, b); }
+inline simd_float simd_sub(simd_float a, simd_float b) { return _mm256_sub_ps(a, b); }
+inline simd_float simd_mul(simd_float a, simd_float b) { return _mm256_mul_ps(a, b); }
+inline simd_float simd_div(simd_float a, simd_float b) { return _mm256_div_ps(a, b); }
+inline simd_float simd_min(simd_float a, simd_float b) { return _mm256_min_ps(a, b); }
+inline simd_float simd_max(simd_float a, simd_float b) { return _mm256_max_ps(a, b); }
+inline simd_float simd_sqrt(simd_float a) { return _mm256_sqrt_ps(a); }
+inline simd_float simd_and(simd_float a, simd_float b) { return _mm256_and_ps(a, b); }
+inline simd_float simd_or(simd_float a, simd_float b) { return _mm256_or_ps(a, b); }
+inline simd_float simd_less(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline simd_float simd_greater(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline simd_float simd_equal(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline simd_float simd_select(simd_float mask, simd_float a, simd_float b) { return _mm256_blendv_ps(b, a, mask); }
+inline int simd_mask_bits(simd_float mask) { return _mm256_movemask_ps(mask); }
+inline float simd_horizontal_min(simd_float a) {
+	__m128 m = _mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+	return _mm_cvtss_f32(m);
+}
+}
+SIMD_TARGET_END
+
+// Declares the wrappers of one namespace in the current scope, where they hide the global ones.
+#define SIMD_USING(ns) \
+	using ns::SIMD_LANES; using ns::simd_float; using ns::simd_set; using ns::simd_load; \
+	using ns::simd_load_u8; using ns::simd_load_u16; using ns::simd_store; using ns::simd_lane_index; \
+	using ns::simd_add; using ns::simd_sub; using ns::simd_mul; using ns::simd_div; using ns::simd_min; \
+	using ns::simd_max; using ns::simd_sqrt; using ns::simd_and; using ns::simd_or; \
+	using ns::simd_less; using ns::simd_greater; using ns::simd_equal; using ns::simd_select; \
+	using ns::simd_mask_bits; using ns::simd_horizontal_min;
+#endif
+
+#if SIMD_WIDTH == 8
+SIMD_USING(simd_avx2)
+#elif SIMD_WIDTH == 4
+SIMD_USING(simd_sse)
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+#include <float.h>
+#include <vector>
+#include "simd.h"
+#include "maths.h"
+
+// Structure-of-arrays copy of the sphere array for the vector intersection kernel.
+// When a BVH is present the slots follow bvh primitive order, so every leaf is one contiguous range.
+
+#define SPHERE_SOA_PADDING 8 // lanes of the widest kernel
+
+typedef std::vector<float, AlignedAllocator<float>> aligned_float_vector;
+
+struct SphereSoA {
+	int count;
+	aligned_float_vector center_x; // all four are padded by SPHERE_SOA_PADDING zeros so a load at any slot stays in bounds
+	aligned_float_vector center_y;
+	aligned_float_vector center_z;
+	aligned_float_vector radius;
+	std::vector<int> sphere_index; // slot -> index into the sphere array
+};
+
+// order may be null for identity order, otherwise it holds count sphere indices (e.g. BVH::primitive_indices).
+// Slots of indices outside [0, count) get sphere_index -1.
+inline SphereSoA build_sphere_soa(const Sphere* spheres, int count, const int* order) {
+	SphereSoA soa;
+	soa.count = count;
+	size_t padded = (size_t)count + SPHERE_SOA_PADDING;
+	soa.center_x.assign(padded, 0.0f);
+	soa.center_y.assign(padded, 0.0f);
+	soa.center_z.assign(padded, 0.0f);
+	soa.radius.assign(padded, 0.0f);
+	soa.sphere_index.resize(count);
+
+	for (int i = 0; i < count; i++) {
+		int index = order ? order[i] : i;
+		if (index < 0 || index >= count) {
+			soa.sphere_index[i] = -1; // from a malformed BVH in a file, left as a sphere of radius 0
+			continue;
+		}
+		const Sphere& sphere = spheres[index];
+		soa.center_x[i] = sphere.center.x;
+		soa.center_y[i] = sphere.center.y;
+		soa.center_z[i] = sphere.center.z;
+		soa.radius[i] = sphere.radius;
+		soa.sphere_index[i] = index;
+	}
+
+	return soa;
+}
+
+// Copies the spheres of slots [first, first + count) again, after they moved or order changed there.
+inline void update_sphere_soa(SphereSoA& soa, const Sphere* spheres, const int* order, int first, int count) {
+	for (int i = first; i < first + count; i++) {
+		int index = order ? order[i] : i;
+		const Sphere& sphere = spheres[index];
+		soa.center_x[i] = sphere.center.x;
+		soa.center_y[i] = sphere.center.y;
+		soa.center_z[i] = sphere.center.z;
+		soa.radius[i] = sphere.radius;
+		soa.sphere_index[i] = index;
+	}
+}
+
+// Tests the ray against slots [first, first + count), several spheres at a time, using the same root selection as
+// sphere_hit. Returns the closest slot hit in (t_min, t_max) and lowers t_max to its distance, or returns -1 and
+// leaves t_max alone. Ties go to the lowest slot, like the sequential loop. Each instruction set gets its own copy of
+// sphere_soa_kernel.inl and the widest one the CPU supports is picked on first use, like the batched kernels in
+// maths.h, so builds without /arch:AVX2 still get 8 lanes on CPUs that have them.
+namespace sphere_soa_scalar {
+static int closest_hit(const SphereSoA& soa, int first, int count, const Ray& ray, float t_min, float& t_max) {
+	float a = dot(ray.direction, ray.direction);
+	int selected_slot = -1;
+	for (int slot = first; slot < first + count; slot++) {
+		Vector3 diff = ray.origin_point - Vector3(soa.center_x[slot], soa.center_y[slot], soa.center_z[slot]);
+		float b = dot(diff, ray.direction);
+		float c = dot(diff, diff) - soa.radius[slot] * soa.radius[slot];
+		float discriminant = b * b - a * c;
+		if (discriminant > 0) {
+			float discriminant_sqrt = std::sqrt(discriminant);
+			float first_root = (-b - discriminant_sqrt) / a;
+			float second_root = (-b + discriminant_sqrt) / a;
+			float t = (first_root > t_min && first_root < t_max) ? first_root : second_root;
+			if (t > t_min && t < t_max) {
+				selected_slot = slot;
+				t_max = t;
+			}
+		}
+	}
+	return selected_slot;
+}
+
+static void closest_hits(const SphereSoA& soa, int first, int count, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float* t_max, int* slots) {
+	for (int i = 0; i < ray_count; i++) {
+		int index = ray_indices[i];
+		int slot = closest_hit(soa, first, count, rays[index], t_min, t_max[index]);
+		if (slot != -1) {
+			slots[index] = slot;
+		}
+	}
+}
+}
+
+#if defined(SIMD_X86)
+namespace sphere_soa_sse {
+SIMD_USING(simd_sse)
+#include "sphere_soa_kernel.inl"
+}
+
+SIMD_TARGET_BEGIN("avx2")
+namespace sphere_soa_avx2 {
+SIMD_USING(simd_avx2)
+#include "sphere_soa_kernel.inl"
+}
+SIMD_TARGET_END
+#endif
+
+typedef int (*SoaClosestHit)(const SphereSoA& soa, int first, int count, const Ray& ray, float t_min, float& t_max);
+typedef void (*SoaClosestHits)(const SphereSoA& soa, int first, int count, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float* t_max, int* slots);
+
+struct SphereSoAKernel {
+	SimdLevel level;
+	int lanes; // spheres per step, the leaf size to build BVHs with for this kernel
+	SoaClosestHit closest_hit;
+	SoaClosestHits closest_hits;
+};
+
+// Kernel for a specific level, which must be supported by the CPU. AVX-512 uses the AVX2 kernel, leaves are too
+// small to fill 16 lanes.
+inline SphereSoAKernel get_sphere_soa_kernel(SimdLevel level) {
+#if defined(SIMD_X86)
+	if (level >= SIMD_LEVEL_AVX2) {
+		return { SIMD_LEVEL_AVX2, 8, sphere_soa_avx2::closest_hit, sphere_soa_avx2::closest_hits };
+	}
+	if (level == SIMD_LEVEL_SSE4) {
+		return { SIMD_LEVEL_SSE4, 4, sphere_soa_sse::closest_hit, sphere_soa_sse::closest_hits };
+	}
+#endif
+	return { SIMD_LEVEL_SCALAR, 1, sphere_soa_scalar::closest_hit, sphere_soa_scalar::closest_hits };
+}
+
+// The kernel soa_closest_hit uses. Benchmarks may assign another supported level before tracing.
+inline SphereSoAKernel& sphere_soa_kernel() {
+	static SphereSoAKernel kernel = get_sphere_soa_kernel(detect_simd_level());
+	return kernel;
+}
+
+inline int soa_closest_hit(const SphereSoA& soa, int first, int count, const Ray& ray, float t_min, float& t_max) {
+	return sphere_soa_kernel().closest_hit(soa, first, count, ray, t_min, t_max);
+}
+
+// soa_closest_hit for each ray rays[ray_indices[i]] against one range of slots, such as the rays that reach a leaf in
+// bvh_traverse_stream. t_max and slots are indexed like rays; slots is only written for rays that hit.
+inline void soa_closest_hits(const SphereSoA& soa, int first, int count, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float* t_max, int* slots) {
+	sphere_soa_kernel().closest_hits(soa, first, count, rays, ray_indices, ray_count, t_min, t_max, slots);
+}
@@ -0,0 +1,116 @@
+// Closest hits of rays among SphereSoA slots, SIMD_LANES spheres at a time. sphere_soa.h includes this once per
+// instruction set, inside a namespace that declares the simd_* wrappers of that set with SIMD_USING. The roots are
+// selected like in sphere_hit and ties go to the lowest slot, so every set finds the same slot as the scalar loop.
+
+static int closest_hit(const SphereSoA& soa, int first, int count, const Ray& ray, float t_min, float& t_max) {
+	const simd_float origin_x = simd_set(ray.origin_point.x);
+	const simd_float origin_y = simd_set(ray.origin_point.y);
+	const simd_float origin_z = simd_set(ray.origin_point.z);
+	const simd_float dir_x = simd_set(ray.direction.x);
+	const simd_float dir_y = simd_set(ray.direction.y);
+	const simd_float dir_z = simd_set(ray.direction.z);
+	const float a_scalar = dot(ray.direction, ray.direction);
+	const simd_float a = simd_set(a_scalar);
+	const simd_float inv_a = simd_set(1.0f / a_scalar);
+	const simd_float t_min_v = simd_set(t_min);
+	const simd_float zero = simd_set(0.0f);
+	const simd_float no_hit = simd_set(FLT_MAX);
+	const simd_float lane_index = simd_lane_index();
+
+	int selected_slot = -1;
+	int end = first + count;
+	for (int base = first; base < end; base += SIMD_LANES) {
+		simd_float diff_x = simd_sub(origin_x, simd_load(&soa.center_x[base]));
+		simd_float diff_y = simd_sub(origin_y, simd_load(&soa.center_y[base]));
+		simd_float diff_z = simd_sub(origin_z, simd_load(&soa.center_z[base]));
+		simd_float radius = simd_load(&soa.radius[base]);
+
+		simd_float b = simd_add(simd_add(simd_mul(diff_x, dir_x), simd_mul(diff_y, dir_y)), simd_mul(diff_z, dir_z));
+		simd_float c = simd_sub(simd_add(simd_add(simd_mul(diff_x, diff_x), simd_mul(diff_y, diff_y)), simd_mul(diff_z, diff_z)), simd_mul(radius, radius));
+		simd_float discriminant = simd_sub(simd_mul(b, b), simd_mul(a, c));
+		simd_float discriminant_sqrt = simd_sqrt(simd_max(discriminant, zero));
+
+		simd_float neg_b = simd_sub(zero, b);
+		simd_float first_root = simd_mul(simd_sub(neg_b, discriminant_sqrt), inv_a);
+		simd_float second_root = simd_mul(simd_add(neg_b, discriminant_sqrt), inv_a);
+
+		simd_float t_max_v = simd_set(t_max);
+		simd_float first_valid = simd_and(simd_greater(first_root, t_min_v), simd_less(first_root, t_max_v));
+		simd_float second_valid = simd_and(simd_greater(second_root, t_min_v), simd_less(second_root, t_max_v));
+		simd_float valid = simd_and(simd_greater(discriminant, zero), simd_or(first_valid, second_valid));
+		valid = simd_and(valid, simd_less(lane_index, simd_set((float)(end - base))));
+
+		int valid_bits = simd_mask_bits(valid);
+		if (valid_bits == 0) {
+			continue;
+		}
+
+		simd_float t = simd_select(valid, simd_select(first_valid, first_root, second_root), no_hit);
+		float closest = simd_horizontal_min(t);
+		int closest_bits = simd_mask_bits(simd_equal(t, simd_set(closest))) & valid_bits;
+		selected_slot = base + lowest_set_bit(closest_bits);
+		t_max = closest;
+	}
+
+	return selected_slot;
+}
+
+// closest_hit for each ray rays[ray_indices[i]] against the same slots, with every block of spheres loaded once for
+// all of them. t_max and slots are indexed like rays, and slots is only written for rays that hit. Every ray gets the
+// slot and distance closest_hit returns for it.
+static void closest_hits(const SphereSoA& soa, int first, int count, const Ray* rays, const int* ray_indices, int ray_count, float t_min, float* t_max, int* slots) {
+	const simd_float t_min_v = simd_set(t_min);
+	const simd_float zero = simd_set(0.0f);
+	const simd_float no_hit = simd_set(FLT_MAX);
+	const simd_float lane_index = simd_lane_index();
+
+	int end = first + count;
+	for (int base = first; base < end; base += SIMD_LANES) {
+		const simd_float center_x = simd_load(&soa.center_x[base]);
+		const simd_float center_y = simd_load(&soa.center_y[base]);
+		const simd_float center_z = simd_load(&soa.center_z[base]);
+		const simd_float radius = simd_load(&soa.radius[base]);
+		const simd_float radius_squared = simd_mul(radius, radius);
+		const simd_float in_range = simd_less(lane_index, simd_set((float)(end - base)));
+
+		for (int i = 0; i < ray_count; i++) {
+			int index = ray_indices[i];
+			const Ray& ray = rays[index];
+			simd_float dir_x = simd_set(ray.direction.x);
+			simd_float dir_y = simd_set(ray.direction.y);
+			simd_float dir_z = simd_set(ray.direction.z);
+			float a_scalar = dot(ray.direction, ray.direction);
+			simd_float a = simd_set(a_scalar);
+			simd_float inv_a = simd_set(1.0f / a_scalar);
+
+			simd_float diff_x = simd_sub(simd_set(ray.origin_point.x), center_x);
+			simd_float diff_y = simd_sub(simd_set(ray.origin_point.y), center_y);
+			simd_float diff_z = simd_sub(simd_set(ray.origin_point.z), center_z);
+
+			simd_float b = simd_add(simd_add(simd_mul(diff_x, dir_x), simd_mul(diff_y, dir_y)), simd_mul(diff_z, dir_z));
+			simd_float c = simd_sub(simd_add(simd_add(simd_mul(diff_x, diff_x), simd_mul(diff_y, diff_y)), simd_mul(diff_z, diff_z)), radius_squared);
+			simd_float discriminant = simd_sub(simd_mul(b, b), simd_mul(a, c));
+			simd_float discriminant_sqrt = simd_sqrt(simd_max(discriminant, zero));
+
+			simd_float neg_b = simd_sub(zero, b);
+			simd_float first_root = simd_mul(simd_sub(neg_b, discriminant_sqrt), inv_a);
+			simd_float second_root = simd_mul(simd_add(neg_b, discriminant_sqrt), inv_a);
+
+			simd_float t_max_v = simd_set(t_max[index]);
+			simd_float first_valid = simd_and(simd_greater(first_root, t_min_v), simd_less(first_root, t_max_v));
+			simd_float second_valid = simd_and(simd_greater(second_root, t_min_v), simd_less(second_root, t_max_v));
+			simd_float valid = simd_and(simd_and(simd_greater(discriminant, zero), simd_or(first_valid, second_valid)), in_range);
+
+			int valid_bits = simd_mask_bits(valid);
+			if (valid_bits == 0) {
+				continue;
+			}
+
+			simd_float t = simd_select(valid, simd_select(first_valid, first_root, second_root), no_hit);
+			float closest = simd_horizontal_min(t);
+			int closest_bits = simd_mask_bits(simd_equal(t, simd_set(closest))) & valid_bits;
+			slots[index] = base + lowest_set_bit(closest_bits);
+			t_max[index] = closest;
+		}
+	}
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_stream.h"
+#include "image_io.h"
+
+// playground-stream: reference reader of the frame stream playground-render publishes with --stream. It follows the
+// stream from shared memory, copies only the tiles that changed into its own image, and reports what each update
+// pulled. Optionally writes the last image of every frame.
+
+static void print_usage() {
+	printf(
+		"usage: playground-stream NAME [options]\n"
+		"  --output PATTERN  write the last image of every frame, with a %%d for the frame, .png or .exr\n"
+		"  --poll MS         time between looks at the stream (default: 10)\n"
+		"  --wait SECONDS    time to wait for the stream to appear (default: 30)\n"
+		"Exits when the renderer closes the stream.\n");
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool write_frame(const char* pattern, int frame, const std::vector<Vector4>& image, int width, int height) {
+	char path[1024];
+	if (!format_frame_path(path, sizeof(path), pattern, frame)) {
+		fprintf(stderr, "frame %d: path too long\n", frame);
+		return false;
+	}
+	if (!write_image(path, image.data(), width, height)) {
+		fprintf(stderr, "%s: can't write\n", path);
+		return false;
+	}
+	printf("frame %d -> %s\n", frame, path);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argv[1][0] == '-') {
+		print_usage();
+		return 1;
+	}
+	const char* name = argv[1];
+	const char* output = nullptr;
+	int poll_ms = 10;
+	double wait_seconds = 30;
+	for (int i = 2; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--output") == 0) {
+			output = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--poll") == 0) {
+			poll_ms = atoi(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--wait") == 0) {
+			wait_seconds = atof(argv[i + 1]);
+		}
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+	char checked_path[1024];
+	if (output && !format_frame_path(checked_path, sizeof(checked_path), output, 0)) {
+		fprintf(stderr, "--output takes a path with at most one %%d, %%Nd or %%0Nd for the frame and %%%% for a %%\n");
+		return 1;
+	}
+
+	FrameStreamReader reader;
+	auto wait_start = std::chrono::steady_clock::now();
+	while (!open_frame_stream(name, reader)) {
+		if (seconds_since(wait_start) > wait_seconds) {
+			fprintf(stderr, "%s: no stream\n", name);
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+	}
+	const FrameStreamHeader* header = reader.header;
+	const int width = header->width, height = header->height, tile_size = header->tile_size;
+	const int tile_count = header->tiles_x * header->tiles_y;
+	printf("%s: %dx%d in %d tiles of %dx%d, %d slots\n", name, width, height, tile_count, tile_size, tile_size, header->slot_count);
+
+	std::vector<Vector4> image((size_t)width * height);
+	auto pull = [&](int tile, const Vector4* pixels) {
+		int x0, y0, x1, y1;
+		frame_stream_tile_rect(header, tile, x0, y0, x1, y1);
+		for (int y = y0; y < y1; y++) {
+			memcpy(&image[(size_t)y * width + x0], pixels + (size_t)(y - y0) * tile_size, (size_t)(x1 - x0) * sizeof(Vector4));
+		}
+	};
+
+	int updates = 0, written_frame = -1;
+	uint64_t tiles_pulled = 0;
+	bool ok = true;
+	for (;;) {
+		// Read closed first: a publish made before closing is still picked up below.
+		bool closed = frame_stream_closed(reader);
+		int next_frame = frame_stream_next_frame(reader);
+		if (output && reader.frame >= 0 && next_frame >= 0 && next_frame != reader.frame && reader.frame != written_frame) {
+			ok = write_frame(output, reader.frame, image, width, height) && ok;
+			written_frame = reader.frame;
+		}
+		auto update_start = std::chrono::steady_clock::now();
+		int pulled = frame_stream_update(reader, pull);
+		if (pulled > 0) {
+			updates++;
+			tiles_pulled += pulled;
+			printf("frame %d, %d passes: %d of %d tiles, %.2f MB, %.2f ms\n", reader.frame, reader.passes, pulled, tile_count,
+				pulled * (double)tile_size * tile_size * sizeof(Vector4) / (1024.0 * 1024.0), seconds_since(update_start) * 1000.0);
+		}
+		if (closed && pulled <= 0) {
+			break;
+		}
+		if (pulled <= 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+		}
+	}
+	if (output && reader.frame >= 0 && reader.frame != written_frame) {
+		ok = write_frame(output, reader.frame, image, width, height) && ok;
+	}
+	printf("%d updates, %llu tiles pulled, %.1f%% of copying whole images, %d updates retried after the writer lapped\n", updates,
+		(unsigned long long)tiles_pulled, updates > 0 ? 100.0 * tiles_pulled / ((double)updates * tile_count) : 0.0, reader.lapped);
+	close_frame_stream(reader);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,728 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_stats.h"
+#include "maths.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Tile farm for the headless renderer: a coordinator splits each frame into tiles and hands them to worker processes
+// over TCP, on this machine or others. A worker traces all passes of a tile with its own CpuRenderer and sends back
+// the tile's accumulated float4 pixels and sample count, which the coordinator merges into the same accumulation
+// buffer CS and cpu_raytracer_render produce. Jobs of a worker that disconnects or stops answering go back to the
+// queue, and locally spawned workers that die are started again, both a bounded number of times.
+//
+// Messages are a FarmMessageHeader followed by raw structs, so the coordinator and its workers have to be the same
+// build. Workers load the scene from the coordinator's path themselves.
+
+#define FARM_MAGIC 0x46544750u // "PGTF"
+#define FARM_VERSION 4
+#define FARM_PATH_MAX 1024
+#define FARM_DEFAULT_TILE_SIZE 64
+#define FARM_MAX_ATTEMPTS 3 // a job is given out this many times before the frame fails
+#define FARM_PROGRESS_SECONDS 0.25
+
+#if defined(_WIN32)
+typedef SOCKET FarmSocket;
+#define FARM_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int FarmSocket;
+#define FARM_INVALID_SOCKET -1
+#endif
+
+enum FarmMessageType {
+	FARM_HELLO = 1, // worker -> coordinator, FarmHello
+	FARM_SETTINGS, // coordinator -> worker, FarmSettings
+	FARM_READY, // worker -> coordinator once the scene is loaded, no payload
+	FARM_TILE, // coordinator -> worker, FarmTile
+	FARM_TILE_DONE, // worker -> coordinator, FarmTileResult and its pixels
+	FARM_DONE, // coordinator -> worker, no payload, the worker exits
+};
+
+struct FarmMessageHeader {
+	uint32_t type;
+	uint32_t size; // of the payload
+};
+
+struct FarmHello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t settings_size; // sizeof the structs, to catch workers of another build
+	uint32_t tile_size;
+};
+
+// What a worker needs to set up the same RaytracerData and CpuRenderer as a local render.
+struct FarmSettings {
+	int width;
+	int height;
+	int samples; // per pixel and pass
+	int max_depth;
+	int roulette_depth;
+	int light_sampling;
+	int sampler;
+	int wavefront;
+	int packets;
+	int specialize;
+	int compressed;
+	char scene[FARM_PATH_MAX];
+};
+
+// Passes [first_pass, first_pass + pass_count) of the pixels [x0, x1) x [y0, y1) of a frame.
+struct FarmTile {
+	int frame;
+	int job;
+	int x0, y0, x1, y1;
+	int first_pass;
+	int pass_count;
+	Camera camera;
+};
+
+struct FarmTileResult {
+	int frame;
+	int job;
+	int samples; // per pixel
+	double busy_ms; // the worker's render time
+	uint64_t rays;
+	uint64_t paths;
+	uint64_t intersection_tests;
+	uint64_t bvh_nodes_visited;
+};
+
+// Sockets
+
+inline bool farm_sockets_init() {
+#if defined(_WIN32)
+	static bool started = false;
+	if (!started) {
+		WSADATA wsa;
+		started = WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+	}
+	return started;
+#else
+	signal(SIGPIPE, SIG_IGN); // a worker dying mid send must fail the send, not end the process
+	return true;
+#endif
+}
+
+inline void farm_close_socket(FarmSocket socket) {
+	if (socket == FARM_INVALID_SOCKET) {
+		return;
+	}
+#if defined(_WIN32)
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+// Blocking sends and receives give up after seconds, 0 waits forever.
+inline void farm_set_timeout(FarmSocket socket, double seconds) {
+#if defined(_WIN32)
+	DWORD milliseconds = (DWORD)(seconds * 1000.0);
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&milliseconds, sizeof(milliseconds));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&milliseconds, sizeof(milliseconds));
+#else
+	timeval time;
+	time.tv_sec = (time_t)seconds;
+	time.tv_usec = (suseconds_t)((seconds - (double)time.tv_sec) * 1e6);
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof(time));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &time, sizeof(time));
+#endif
+	int no_delay = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+}
+
+// Splits "host:port" and resolves it. An empty host means every interface.
+inline bool farm_resolve(const char* address, bool passive, addrinfo** result) {
+	const char* colon = strrchr(address, ':');
+	if (!colon) {
+		return false;
+	}
+	std::string host(address, colon - address);
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	return getaddrinfo(host.empty() ? nullptr : host.c_str(), colon + 1, &hints, result) == 0;
+}
+
+inline bool farm_send_all(FarmSocket socket, const void* data, size_t size) {
+	const char* bytes = (const char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min(size, (size_t)1 << 30);
+#if defined(_WIN32)
+		int sent = send(socket, bytes, chunk, 0);
+#else
+		int sent = (int)send(socket, bytes, chunk, 0);
+#endif
+		if (sent <= 0) {
+			return false;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+inline bool farm_recv_all(FarmSocket socket, void* data, size_t size) {
+	char* bytes = (char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min(size, (size_t)1 << 30);
+		int received = (int)recv(socket, bytes, chunk, 0);
+		if (received <= 0) {
+			return false;
+		}
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+
+// One message with a payload in up to two parts, e.g. a struct and the pixels after it.
+inline bool farm_send(FarmSocket socket, FarmMessageType type, const void* data = nullptr, size_t size = 0, const void* extra = nullptr, size_t extra_size = 0) {
+	FarmMessageHeader header = { (uint32_t)type, (uint32_t)(size + extra_size) };
+	return farm_send_all(socket, &header, sizeof(header)) && farm_send_all(socket, data, size) && farm_send_all(socket, extra, extra_size);
+}
+
+// Receives one message of the expected type whose payload starts with a struct of size bytes. The rest of the payload
+// is left in the socket and its size returned in extra_size.
+inline bool farm_recv(FarmSocket socket, FarmMessageType type, void* data, size_t size, size_t* extra_size = nullptr) {
+	FarmMessageHeader header;
+	if (!farm_recv_all(socket, &header, sizeof(header)) || header.type != (uint32_t)type || header.size < size) {
+		return false;
+	}
+	if (!extra_size && header.size != size) {
+		return false;
+	}
+	if (extra_size) {
+		*extra_size = header.size - size;
+	}
+	return farm_recv_all(socket, data, size);
+}
+
+// Local worker processes
+
+struct FarmProcess {
+#if defined(_WIN32)
+	HANDLE process;
+#else
+	pid_t pid;
+#endif
+	bool running;
+};
+
+inline bool spawn_farm_process(const std::vector<std::string>& arguments, FarmProcess& process) {
+	process = {};
+#if defined(_WIN32)
+	char executable[MAX_PATH];
+	if (!GetModuleFileNameA(NULL, executable, MAX_PATH)) {
+		return false;
+	}
+	std::string command_line = std::string("\"") + executable + "\"";
+	for (size_t i = 1; i < arguments.size(); i++) {
+		command_line += " \"" + arguments[i] + "\"";
+	}
+	STARTUPINFOA startup = {};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION info = {};
+	if (!CreateProcessA(executable, &command_line[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &info)) {
+		return false;
+	}
+	CloseHandle(info.hThread);
+	process.process = info.hProcess;
+#else
+	std::vector<char*> argv;
+	for (const std::string& argument : arguments) {
+		argv.push_back(const_cast<char*>(argument.c_str()));
+	}
+	argv.push_back(nullptr);
+	extern char** environ;
+	if (posix_spawnp(&process.pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+		return false;
+	}
+#endif
+	process.running = true;
+	return true;
+}
+
+// Updates process.running without blocking.
+inline bool farm_process_running(FarmProcess& process) {
+	if (process.running) {
+#if defined(_WIN32)
+		if (WaitForSingleObject(process.process, 0) == WAIT_OBJECT_0) {
+			CloseHandle(process.process);
+			process.running = false;
+		}
+#else
+		int status;
+		if (waitpid(process.pid, &status, WNOHANG) == process.pid) {
+			process.running = false;
+		}
+#endif
+	}
+	return process.running;
+}
+
+inline void wait_farm_process(FarmProcess& process) {
+	if (process.running) {
+#if defined(_WIN32)
+		WaitForSingleObject(process.process, INFINITE);
+		CloseHandle(process.process);
+#else
+		int status;
+		waitpid(process.pid, &status, 0);
+#endif
+		process.running = false;
+	}
+}
+
+// Coordinator
+
+struct FarmJob {
+	int tile;
+	int first_pass;
+	int pass_count;
+	int attempts; // times it was given out
+};
+
+struct FarmWorkerStats {
+	std::string name; // address of the connection
+	int tiles; // finished over the whole render
+	double busy_ms; // render time reported by the worker in the current frame
+	bool connected;
+};
+
+struct FarmCoordinator {
+	FarmSocket listener;
+	std::string address; // host:port workers connect to
+	FarmSettings settings;
+	int tile_size;
+	int tiles_x;
+	double timeout_seconds; // a worker that doesn't answer for this long is dropped
+	std::vector<std::string> worker_arguments; // command line of local workers, see spawn_farm_workers
+	std::vector<FarmProcess> processes;
+	int respawns_left;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool shutting_down;
+	int frame;
+	Camera camera;
+	std::vector<FarmJob> jobs;
+	std::deque<int> queue; // jobs waiting for a worker
+	int jobs_left; // not merged yet
+	int jobs_merged; // in the current frame
+	bool failed;
+	std::vector<Vector4>* pixels; // accumulation buffer of the frame
+	std::vector<int> tile_samples; // per pixel of each tile, merged so far
+	FrameStats stats; // counters of the frame, summed over the merged tiles
+	int retries; // jobs of the frame given out again
+	int connections; // workers that are ready
+	std::vector<FarmWorkerStats> workers;
+	std::chrono::steady_clock::time_point last_progress;
+
+	std::thread accept_thread;
+	std::vector<std::thread> connection_threads;
+
+	FarmCoordinator() : listener(FARM_INVALID_SOCKET), tile_size(FARM_DEFAULT_TILE_SIZE), tiles_x(0), timeout_seconds(60), respawns_left(0),
+		shutting_down(false), frame(0), jobs_left(0), jobs_merged(0), failed(false), pixels(nullptr), retries(0), connections(0) {}
+};
+
+inline void farm_tile_rect(const FarmCoordinator& farm, int tile, int& x0, int& y0, int& x1, int& y1) {
+	x0 = (tile % farm.tiles_x) * farm.tile_size;
+	y0 = (tile / farm.tiles_x) * farm.tile_size;
+	x1 = std::min(x0 + farm.tile_size, farm.settings.width);
+	y1 = std::min(y0 + farm.tile_size, farm.settings.height);
+}
+
+// Weights the tile by its sample count against what the tile already holds. The first result of a tile is copied,
+// so a frame whose tiles are traced in one job each is bit for bit the local render.
+inline void merge_farm_tile(FarmCoordinator& farm, int tile, const FarmTileResult& result, const std::vector<Vector4>& tile_pixels) {
+	int x0, y0, x1, y1;
+	farm_tile_rect(farm, tile, x0, y0, x1, y1);
+	int held = farm.tile_samples[tile];
+	float weight = (float)result.samples / (float)(held + result.samples);
+	std::vector<Vector4>& pixels = *farm.pixels;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Vector4& pixel = pixels[(size_t)y * farm.settings.width + x];
+			const Vector4& value = tile_pixels[(size_t)(y - y0) * (x1 - x0) + (x - x0)];
+			pixel = held == 0 ? value : lerp(pixel, value, weight);
+		}
+	}
+	farm.tile_samples[tile] = held + result.samples;
+	farm.stats.rays += result.rays;
+	farm.stats.paths += result.paths;
+	farm.stats.intersection_tests += result.intersection_tests;
+	farm.stats.bvh_nodes_visited += result.bvh_nodes_visited;
+}
+
+// Serves one worker until the coordinator shuts down or the worker fails; a failed job is queued again.
+inline void farm_connection_loop(FarmCoordinator& farm, FarmSocket socket, int worker, std::string name) {
+	farm_set_timeout(socket, farm.timeout_seconds);
+	FarmHello hello;
+	bool ready = farm_recv(socket, FARM_HELLO, &hello, sizeof(hello)) && hello.magic == FARM_MAGIC && hello.version == FARM_VERSION
+		&& hello.settings_size == sizeof(FarmSettings) && hello.tile_size == sizeof(FarmTile)
+		&& farm_send(socket, FARM_SETTINGS, &farm.settings, sizeof(farm.settings)) && farm_recv(socket, FARM_READY, nullptr, 0);
+	if (!ready) {
+		fprintf(stderr, "farm: worker %s failed to start\n", name.c_str());
+		farm_close_socket(socket);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(farm.mutex);
+	farm.connections++;
+	farm.workers[worker].connected = true;
+	farm.changed.notify_all();
+	std::vector<Vector4> tile_pixels;
+	for (;;) {
+		farm.changed.wait(lock, [&]() { return farm.shutting_down || !farm.queue.empty(); });
+		if (farm.queue.empty()) {
+			break;
+		}
+		int job_index = farm.queue.front();
+		farm.queue.pop_front();
+		FarmJob job = farm.jobs[job_index];
+		farm.jobs[job_index].attempts++;
+		FarmTile tile;
+		tile.frame = farm.frame;
+		tile.job = job_index;
+		farm_tile_rect(farm, job.tile, tile.x0, tile.y0, tile.x1, tile.y1);
+		tile.first_pass = job.first_pass;
+		tile.pass_count = job.pass_count;
+		tile.camera = farm.camera;
+		lock.unlock();
+
+		size_t pixel_count = (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+		tile_pixels.resize(pixel_count);
+		FarmTileResult result;
+		size_t pixel_bytes = 0;
+		bool done = farm_send(socket, FARM_TILE, &tile, sizeof(tile)) && farm_recv(socket, FARM_TILE_DONE, &result, sizeof(result), &pixel_bytes)
+			&& result.frame == tile.frame && result.job == tile.job && pixel_bytes == pixel_count * sizeof(Vector4)
+			&& farm_recv_all(socket, tile_pixels.data(), pixel_bytes);
+
+		lock.lock();
+		// A frame that failed is over, its other jobs are dropped.
+		bool current = farm.pixels && farm.frame == tile.frame;
+		if (!done) {
+			if (current && farm.jobs[job_index].attempts >= FARM_MAX_ATTEMPTS) {
+				fprintf(stderr, "farm: tile %d of frame %d failed %d times\n", job.tile, tile.frame, FARM_MAX_ATTEMPTS);
+				farm.failed = true;
+			}
+			else if (current) {
+				farm.queue.push_front(job_index);
+				farm.retries++;
+			}
+			fprintf(stderr, "farm: lost worker %s\n", name.c_str());
+			break;
+		}
+		if (!current) {
+			continue;
+		}
+		merge_farm_tile(farm, job.tile, result, tile_pixels);
+		farm.workers[worker].tiles++;
+		farm.workers[worker].busy_ms += result.busy_ms;
+		farm.jobs_left--;
+		farm.jobs_merged++;
+		farm.last_progress = std::chrono::steady_clock::now();
+		farm.changed.notify_all();
+	}
+	if (farm.shutting_down) {
+		farm_send(socket, FARM_DONE);
+	}
+	farm.connections--;
+	farm.workers[worker].connected = false;
+	farm.changed.notify_all();
+	lock.unlock();
+	farm_close_socket(socket);
+}
+
+inline void farm_accept_loop(FarmCoordinator& farm) {
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(farm.mutex);
+			if (farm.shutting_down) {
+				return;
+			}
+		}
+		// Polled so that shutting down doesn't depend on closing a socket another thread is blocked on.
+#if defined(_WIN32)
+		WSAPOLLFD entry = { farm.listener, POLLRDNORM, 0 };
+		int ready = WSAPoll(&entry, 1, 100);
+#else
+		pollfd entry = { farm.listener, POLLIN, 0 };
+		int ready = poll(&entry, 1, 100);
+#endif
+		if (ready <= 0) {
+			continue;
+		}
+		sockaddr_in peer = {};
+		socklen_t peer_size = sizeof(peer);
+		FarmSocket socket = accept(farm.listener, (sockaddr*)&peer, &peer_size);
+		if (socket == FARM_INVALID_SOCKET) {
+			continue;
+		}
+		char host[INET_ADDRSTRLEN] = "?";
+		inet_ntop(AF_INET, &peer.sin_addr, host, sizeof(host));
+		std::string name = std::string(host) + ":" + std::to_string(ntohs(peer.sin_port));
+
+		std::lock_guard<std::mutex> lock(farm.mutex);
+		FarmWorkerStats worker = { name, 0, 0.0, false };
+		farm.workers.push_back(worker);
+		int index = (int)farm.workers.size() - 1;
+		farm.connection_threads.emplace_back([&farm, socket, index, name]() { farm_connection_loop(farm, socket, index, name); });
+	}
+}
+
+// Listens on address, "host:port" with port 0 picking a free one, and starts accepting workers.
+inline bool start_farm_coordinator(FarmCoordinator& farm, const char* address, const FarmSettings& settings, int tile_size, double timeout_seconds) {
+	addrinfo* info = nullptr;
+	if (!farm_sockets_init() || !farm_resolve(address, true, &info)) {
+		fprintf(stderr, "farm: can't resolve %s\n", address);
+		return false;
+	}
+	farm.listener = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	int reuse = 1;
+	setsockopt(farm.listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+	bool listening = farm.listener != FARM_INVALID_SOCKET && bind(farm.listener, info->ai_addr, (int)info->ai_addrlen) == 0
+		&& listen(farm.listener, 64) == 0;
+	freeaddrinfo(info);
+	sockaddr_in bound = {};
+	socklen_t bound_size = sizeof(bound);
+	if (!listening || getsockname(farm.listener, (sockaddr*)&bound, &bound_size) != 0) {
+		fprintf(stderr, "farm: can't listen on %s\n", address);
+		farm_close_socket(farm.listener);
+		farm.listener = FARM_INVALID_SOCKET;
+		return false;
+	}
+	// Workers on this machine reach a wildcard address through the loopback interface.
+	std::string host(address, strrchr(address, ':') - address);
+	if (host.empty() || host == "0.0.0.0") {
+		host = "127.0.0.1";
+	}
+	farm.address = host + ":" + std::to_string(ntohs(bound.sin_port));
+
+	farm.settings = settings;
+	farm.tile_size = tile_size;
+	farm.tiles_x = (settings.width + tile_size - 1) / tile_size;
+	farm.timeout_seconds = timeout_seconds;
+	farm.last_progress = std::chrono::steady_clock::now();
+	farm.accept_thread = std::thread([&farm]() { farm_accept_loop(farm); });
+	return true;
+}
+
+// Starts count worker processes of this executable with arguments after the program name, e.g. {"--worker", address}.
+// As many more are started over the render to replace workers that die.
+inline bool spawn_farm_workers(FarmCoordinator& farm, const char* executable, const std::vector<std::string>& arguments, int count) {
+	farm.worker_arguments.assign(1, executable);
+	farm.worker_arguments.insert(farm.worker_arguments.end(), arguments.begin(), arguments.end());
+	farm.respawns_left = count;
+	for (int i = 0; i < count; i++) {
+		FarmProcess process;
+		if (!spawn_farm_process(farm.worker_arguments, process)) {
+			fprintf(stderr, "farm: can't start %s\n", executable);
+			return false;
+		}
+		farm.processes.push_back(process);
+	}
+	return true;
+}
+
+// Restarts local workers that exited while there is work left. Called with the mutex held.
+inline int farm_running_processes(FarmCoordinator& farm) {
+	int running = 0;
+	for (FarmProcess& process : farm.processes) {
+		if (!farm_process_running(process) && farm.jobs_left > 0 && farm.respawns_left > 0) {
+			farm.respawns_left--;
+			if (spawn_farm_process(farm.worker_arguments, process)) {
+				fprintf(stderr, "farm: restarted a local worker\n");
+			}
+		}
+		running += process.running ? 1 : 0;
+	}
+	return running;
+}
+
+// Traces passes [0, passes) of a frame on the workers into pixels, which gets width * height values. Each tile is
+// one job of passes_per_job passes, 0 for all of them. While jobs come in, progress is called with the image as it
+// is, at most every FARM_PROGRESS_SECONDS; merging waits meanwhile. Returns false if a job failed
+// FARM_MAX_ATTEMPTS times or no worker was connected or starting for timeout_seconds.
+inline bool farm_render_frame(FarmCoordinator& farm, int frame, const Camera& camera, int passes, int passes_per_job, std::vector<Vector4>& pixels,
+	const std::function<void()>& progress = nullptr) {
+	auto frame_start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(farm.mutex);
+	const int tiles_y = (farm.settings.height + farm.tile_size - 1) / farm.tile_size;
+	const int tile_count = farm.tiles_x * tiles_y;
+	if (passes_per_job <= 0 || passes_per_job > passes) {
+		passes_per_job = passes;
+	}
+	farm.frame = frame;
+	farm.camera = camera;
+	farm.jobs.clear();
+	for (int tile = 0; tile < tile_count; tile++) {
+		for (int pass = 0; pass < passes; pass += passes_per_job) {
+			FarmJob job = { tile, pass, std::min(passes_per_job, passes - pass), 0 };
+			farm.jobs.push_back(job);
+		}
+	}
+	farm.queue.clear();
+	for (int i = 0; i < (int)farm.jobs.size(); i++) {
+		farm.queue.push_back(i);
+	}
+	farm.jobs_left = (int)farm.jobs.size();
+	farm.jobs_merged = 0;
+	farm.failed = false;
+	pixels.assign((size_t)farm.settings.width * farm.settings.height, Vector4());
+	farm.pixels = &pixels;
+	farm.tile_samples.assign(tile_count, 0);
+	farm.stats = create_frame_stats();
+	farm.stats.frame = frame;
+	farm.stats.passes = passes;
+	farm.retries = 0;
+	for (FarmWorkerStats& worker : farm.workers) {
+		worker.busy_ms = 0;
+	}
+	farm.last_progress = std::chrono::steady_clock::now();
+	farm.changed.notify_all();
+
+	int reported = 0;
+	auto last_report = std::chrono::steady_clock::now();
+	while (farm.jobs_left > 0 && !farm.failed) {
+		farm.changed.wait_for(lock, std::chrono::milliseconds(100));
+		auto now = std::chrono::steady_clock::now();
+		if (progress && farm.jobs_merged > reported && farm.jobs_left > 0 && std::chrono::duration<double>(now - last_report).count() >= FARM_PROGRESS_SECONDS) {
+			progress();
+			reported = farm.jobs_merged;
+			last_report = now;
+		}
+		bool starting = farm_running_processes(farm) > farm.connections;
+		if (farm.connections > 0 || starting) {
+			continue;
+		}
+		double idle = std::chrono::duration<double>(std::chrono::steady_clock::now() - farm.last_progress).count();
+		if (idle > farm.timeout_seconds) {
+			fprintf(stderr, "farm: no workers for %.0f s\n", idle);
+			farm.failed = true;
+		}
+	}
+	farm.queue.clear();
+	farm.pixels = nullptr;
+	farm.stats.frame_ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count() * 1000.0;
+	for (const FarmWorkerStats& worker : farm.workers) {
+		farm.stats.thread_busy_ms.push_back(worker.busy_ms);
+		farm.stats.thread_idle_ms.push_back(std::max(0.0, farm.stats.frame_ms - worker.busy_ms));
+	}
+	return !farm.failed;
+}
+
+// Tells the workers to exit and waits for them and the local processes.
+inline void stop_farm_coordinator(FarmCoordinator& farm) {
+	{
+		std::lock_guard<std::mutex> lock(farm.mutex);
+		farm.shutting_down = true;
+		farm.queue.clear();
+		farm.changed.notify_all();
+	}
+	if (farm.accept_thread.joinable()) {
+		farm.accept_thread.join();
+	}
+	for (std::thread& thread : farm.connection_threads) {
+		thread.join();
+	}
+	farm.connection_threads.clear();
+	for (FarmProcess& process : farm.processes) {
+		wait_farm_process(process);
+	}
+	farm_close_socket(farm.listener);
+	farm.listener = FARM_INVALID_SOCKET;
+}
+
+// Worker
+
+struct FarmWorker {
+	FarmSocket socket;
+	FarmSettings settings;
+};
+
+// Connects to the coordinator at "host:port" and receives the settings of the render. The coordinator only hands out
+// tiles after farm_worker_ready.
+inline bool connect_farm_worker(const char* address, FarmWorker& worker) {
+	worker.socket = FARM_INVALID_SOCKET;
+	addrinfo* info = nullptr;
+	if (!farm_sockets_init() || !farm_resolve(address, false, &info)) {
+		fprintf(stderr, "farm: can't resolve %s\n", address);
+		return false;
+	}
+	worker.socket = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	bool connected = worker.socket != FARM_INVALID_SOCKET && connect(worker.socket, info->ai_addr, (int)info->ai_addrlen) == 0;
+	freeaddrinfo(info);
+	FarmHello hello = { FARM_MAGIC, FARM_VERSION, (uint32_t)sizeof(FarmSettings), (uint32_t)sizeof(FarmTile) };
+	if (!connected || !farm_send(worker.socket, FARM_HELLO, &hello, sizeof(hello))
+		|| !farm_recv(worker.socket, FARM_SETTINGS, &worker.settings, sizeof(worker.settings))) {
+		fprintf(stderr, "farm: can't connect to %s\n", address);
+		farm_close_socket(worker.socket);
+		worker.socket = FARM_INVALID_SOCKET;
+		return false;
+	}
+	worker.settings.scene[FARM_PATH_MAX - 1] = '\0';
+	// Tiles come whenever the coordinator has work, so only the coordinator times out.
+	farm_set_timeout(worker.socket, 0);
+	return true;
+}
+
+inline bool farm_worker_ready(FarmWorker& worker) {
+	return farm_send(worker.socket, FARM_READY);
+}
+
+// Waits for the next tile. False once the coordinator is done or gone.
+inline bool farm_worker_next_tile(FarmWorker& worker, FarmTile& tile) {
+	FarmMessageHeader header;
+	if (!farm_recv_all(worker.socket, &header, sizeof(header)) || header.type != FARM_TILE || header.size != sizeof(tile)) {
+		return false;
+	}
+	return farm_recv_all(worker.socket, &tile, sizeof(tile));
+}
+
+// pixels holds the tile's rows, (x1 - x0) * (y1 - y0) values.
+inline bool farm_worker_send_tile(FarmWorker& worker, const FarmTileResult& result, const std::vector<Vector4>& pixels) {
+	return farm_send(worker.socket, FARM_TILE_DONE, &result, sizeof(result), pixels.data(), pixels.size() * sizeof(Vector4));
+}
+
+inline void close_farm_worker(FarmWorker& worker) {
+	farm_close_socket(worker.socket);
+	worker.socket = FARM_INVALID_SOCKET;
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool for tile passes. Each pass deals its tiles out in contiguous blocks to per-worker deques;
+// a worker takes tiles from the front of its own deque and, once that is empty, steals from the back of the others.
+// This keeps neighbouring tiles on one core while letting idle workers pick up the expensive regions of the image.
+// A pass can be cancelled from another thread: workers stop taking tiles and the tiles in flight finish.
+
+struct TileQueue {
+	std::mutex mutex;
+	std::deque<int> tiles;
+	double busy_seconds; // spent in run_tile by the queue's worker during the current pass
+};
+
+struct TileScheduler {
+	std::vector<std::thread> threads;
+	std::unique_ptr<TileQueue[]> queues;
+	int worker_count;
+
+	std::mutex mutex;
+	std::condition_variable pass_started;
+	std::condition_variable pass_finished;
+	std::function<void(int tile, int worker)> run_tile;
+	int pass; // bumped by begin_tile_pass, workers wait for a new value
+	int busy_workers;
+	bool running;
+	bool shutting_down;
+	std::atomic<bool> cancelled;
+	std::atomic<int> steal_count; // tiles taken from another worker's deque during the current pass
+	std::chrono::steady_clock::time_point pass_start;
+	double pass_seconds; // wall time of the last finished pass
+
+	TileScheduler() : worker_count(0), pass(0), busy_workers(0), running(false), shutting_down(false), cancelled(false), steal_count(0), pass_seconds(0) {}
+	~TileScheduler();
+};
+
+inline bool take_tile(TileScheduler& scheduler, int worker, int& tile) {
+	{
+		TileQueue& own = scheduler.queues[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tiles.empty()) {
+			tile = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+
+	// Tiles are only added at the start of a pass, so one sweep over the other deques finding nothing means the pass
+	// has no tiles left to start.
+	for (int i = 1; i < scheduler.worker_count; i++) {
+		TileQueue& victim = scheduler.queues[(worker + i) % scheduler.worker_count];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tiles.empty()) {
+			tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			scheduler.steal_count++;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline void tile_worker_loop(TileScheduler& scheduler, int worker) {
+	int seen_pass = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(scheduler.mutex);
+			scheduler.pass_started.wait(lock, [&]() { return scheduler.shutting_down || scheduler.pass != seen_pass; });
+			if (scheduler.shutting_down) {
+				return;
+			}
+			seen_pass = scheduler.pass;
+		}
+
+		int tile;
+		double busy_seconds = 0;
+		while (!scheduler.cancelled.load(std::memory_order_relaxed) && take_tile(scheduler, worker, tile)) {
+			auto tile_start = std::chrono::steady_clock::now();
+			scheduler.run_tile(tile, worker);
+			busy_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+		}
+
+		std::lock_guard<std::mutex> lock(scheduler.mutex);
+		scheduler.queues[worker].busy_seconds = busy_seconds;
+		if (--scheduler.busy_workers == 0) {
+			scheduler.pass_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scheduler.pass_start).count();
+			scheduler.running = false;
+			scheduler.pass_finished.notify_all();
+		}
+	}
+}
+
+inline void start_tile_scheduler(TileScheduler& scheduler, int worker_count) {
+	scheduler.worker_count = worker_count;
+	scheduler.queues.reset(new TileQueue[worker_count]());
+	for (int i = 0; i < worker_count; i++) {
+		scheduler.threads.emplace_back(tile_worker_loop, std::ref(scheduler), i);
+	}
+}
+
+inline void stop_tile_scheduler(TileScheduler& scheduler) {
+	{
+		std::lock_guard<std::mutex> lock(scheduler.mutex);
+		scheduler.shutting_down = true;
+		scheduler.cancelled = true;
+	}
+	scheduler.pass_started.notify_all();
+	for (auto& thread : scheduler.threads) {
+		thread.join();
+	}
+	scheduler.threads.clear();
+}
+
+inline TileScheduler::~TileScheduler() {
+	if (!threads.empty()) {
+		stop_tile_scheduler(*this);
+	}
+}
+
+// Blocks until the current pass has finished or was cancelled. Returns false if it was cancelled.
+inline bool wait_tile_pass(TileScheduler& scheduler) {
+	std::unique_lock<std::mutex> lock(scheduler.mutex);
+	scheduler.pass_finished.wait(lock, [&]() { return !scheduler.running; });
+	return !scheduler.cancelled;
+}
+
+inline bool tile_pass_running(TileScheduler& scheduler) {
+	std::lock_guard<std::mutex> lock(scheduler.mutex);
+	return scheduler.running;
+}
+
+// Stops handing out tiles and waits for the ones being rendered, so the caller can change what the tiles read.
+inline void cancel_tile_pass(TileScheduler& scheduler) {
+	scheduler.cancelled = true;
+	wait_tile_pass(scheduler);
+}
+
+// Starts rendering tiles [0, tile_count) in the background. run_tile is called from the worker threads and
+// must stay valid until the pass is waited for or cancelled.
+inline void begin_tile_pass(TileScheduler& scheduler, int tile_count, std::function<void(int tile, int worker)> run_tile) {
+	wait_tile_pass(scheduler);
+
+	for (int i = 0; i < scheduler.worker_count; i++) {
+		int first = (int)((long long)tile_count * i / scheduler.worker_count);
+		int end = (int)((long long)tile_count * (i + 1) / scheduler.worker_count);
+		TileQueue& queue = scheduler.queues[i];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tiles.clear();
+		for (int tile = first; tile < end; tile++) {
+			queue.tiles.push_back(tile);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(scheduler.mutex);
+		scheduler.run_tile = std::move(run_tile);
+		scheduler.cancelled = false;
+		scheduler.steal_count = 0;
+		scheduler.busy_workers = scheduler.worker_count;
+		scheduler.running = true;
+		scheduler.pass_start = std::chrono::steady_clock::now();
+		scheduler.pass++;
+	}
+	scheduler.pass_started.notify_all();
+}
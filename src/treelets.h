@@ -0,0 +1,674 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "mapped_file.h"
+#include "scene.h"
+#include "wavefront.h"
+
+// Out-of-core scenes. A treelet file (.pgtreelets) holds the sphere BVH cut into subtrees of at most a few thousand
+// spheres, the treelets, each stored with its spheres and materials in one page aligned block, plus the small top
+// of the BVH above the cut. Rendering keeps only the top, the lights and the treelets that fit a memory budget
+// in memory: blocks are copied out of the mapped file into an LRU cache when rays need them and the mapped pages are
+// released again, so neither the cache nor the file mapping grows past the budget.
+//
+// Tiles are traced in wavefront stages (see wavefront.h) with the intersection stages replaced: every ray first
+// walks the top of the BVH to the list of treelets it enters, nearest first, and waits in the queue of the first.
+// The queues are then worked off one treelet at a time, those in memory first, so a treelet is paged in once for
+// all the rays of the tile that wait on it. Rays that can still find a closer hit move on to the queue of their
+// next treelet. The image is the one trace_tile_wavefront renders from the same spheres.
+//
+// Writing a treelet file needs the spheres and their BVH in memory (playground-scene maps its input, so a .pgscene
+// source is paged by the OS), rendering one doesn't.
+
+#define TREELET_FILE_MAGIC "PGTRLETS"
+#define TREELET_FILE_VERSION 1
+#define TREELET_FILE_ALIGNMENT 4096 // treelets start on a page, so paging one in or out doesn't touch its neighbours
+#define TREELET_DEFAULT_SPHERES 4096 // per treelet, up to about 400 KB with its nodes
+#define TREELET_DEFAULT_BUDGET_MB 512
+
+struct TreeletFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t treelet_count;
+	uint32_t top_node_count;
+	uint32_t light_count;
+	uint64_t sphere_count;
+	uint64_t top_nodes_offset; // BVHNode[top_node_count], leaves reference one treelet each
+	uint64_t records_offset; // TreeletRecord[treelet_count]
+	uint64_t lights_offset; // TreeletLight[light_count]
+	uint64_t file_size;
+	uint32_t material_features; // KERNEL_MATERIALS bits of all spheres
+	uint32_t padding;
+	CameraPlacement camera;
+};
+
+struct TreeletRecord {
+	Vector3 bounds_min;
+	int node_count;
+	Vector3 bounds_max;
+	int sphere_count;
+	uint64_t offset; // of the block, see treelet_view
+	uint64_t size;
+};
+
+// Emissive spheres are kept in memory for next event estimation. id is the sphere's index in the source scene.
+struct TreeletLight {
+	Sphere sphere;
+	Material material;
+	int id;
+};
+
+// A treelet's block: its BVH nodes, whose leaves index the spheres directly, then the spheres, their materials and
+// their ids, in leaf order.
+struct TreeletView {
+	const BVHNode* nodes;
+	const Sphere* spheres;
+	const Material* materials;
+	const int* ids;
+};
+
+inline size_t treelet_block_size(int node_count, int sphere_count) {
+	return (size_t)node_count * sizeof(BVHNode) + (size_t)sphere_count * (sizeof(Sphere) + sizeof(Material) + sizeof(int));
+}
+
+inline TreeletView treelet_view(const TreeletRecord& record, const char* block) {
+	TreeletView view;
+	view.nodes = (const BVHNode*)block;
+	view.spheres = (const Sphere*)(view.nodes + record.node_count);
+	view.materials = (const Material*)(view.spheres + record.sphere_count);
+	view.ids = (const int*)(view.materials + record.sphere_count);
+	return view;
+}
+
+struct TreeletSlot {
+	std::unique_ptr<char[]> block; // null while not resident
+	int pins; // threads tracing rays through the treelet, it isn't evicted before they are done
+	bool loading;
+	bool malformed; // its block failed treelet_block_valid, rays pass through it
+	std::list<int>::iterator lru_position;
+};
+
+struct TreeletCache {
+	std::mutex mutex;
+	std::condition_variable loaded;
+	std::vector<TreeletSlot> slots; // one per treelet
+	std::list<int> lru; // resident treelets, most recently used first
+	size_t budget_bytes = 0;
+	size_t resident_bytes = 0; // treelets being paged in included
+	size_t peak_bytes = 0;
+	int malformed_count = 0;
+};
+
+struct TreeletScene {
+	MappedFile file = {};
+	const TreeletFileHeader* header = nullptr;
+	const BVHNode* top_nodes = nullptr;
+	const TreeletRecord* records = nullptr;
+	const TreeletLight* lights = nullptr;
+	uint64_t serial = 0; // tells scenes loaded at the same address apart, see trace_tile_treelets
+	TreeletCache cache;
+};
+
+inline bool is_treelet_file(const char* path) {
+	size_t length = strlen(path);
+	return length >= 11 && strcmp(path + length - 11, ".pgtreelets") == 0;
+}
+
+inline int material_feature(const Material& material) {
+	return material.type == 0 ? KERNEL_EMISSIVE : material.type == 1 ? KERNEL_LAMBERTIAN : material.type == 2 ? KERNEL_METAL : KERNEL_MATERIALS;
+}
+
+// Cuts bvh, built over spheres, into treelets of at most max_spheres spheres and writes them with the BVH above the
+// cut. Blocks are written one at a time, so only one treelet is copied at once.
+inline bool write_treelet_file(const char* path, const Sphere* spheres, const Material* materials, int sphere_count, const CameraPlacement& camera,
+	const BVH& bvh, int max_spheres = TREELET_DEFAULT_SPHERES) {
+	const std::vector<BVHNode>& nodes = bvh.nodes;
+	if (nodes.empty()) {
+		fprintf(stderr, "%s: no spheres to write\n", path);
+		return false;
+	}
+
+	// Spheres and nodes per subtree, children always come after their parent.
+	std::vector<int> subtree_spheres(nodes.size()), subtree_nodes(nodes.size());
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		const BVHNode& node = nodes[i];
+		bool leaf = node.primitive_count > 0;
+		subtree_spheres[i] = leaf ? node.primitive_count : subtree_spheres[node.left_first] + subtree_spheres[node.left_first + 1];
+		subtree_nodes[i] = leaf ? 1 : 1 + subtree_nodes[node.left_first] + subtree_nodes[node.left_first + 1];
+	}
+
+	// The top keeps the node layout of bvh down to the first nodes that fit a treelet, which become its leaves.
+	std::vector<BVHNode> top_nodes(1, nodes[0]);
+	std::vector<int> treelet_roots;
+	std::vector<int> stack(1, 0), top_stack(1, 0);
+	while (!stack.empty()) {
+		int node_index = stack.back(), top_index = top_stack.back();
+		stack.pop_back();
+		top_stack.pop_back();
+		const BVHNode& node = nodes[node_index];
+		if (node.primitive_count > 0 || subtree_spheres[node_index] <= max_spheres) {
+			top_nodes[top_index].left_first = (int)treelet_roots.size();
+			top_nodes[top_index].primitive_count = 1;
+			treelet_roots.push_back(node_index);
+			continue;
+		}
+		int left_index = (int)top_nodes.size();
+		top_nodes[top_index].left_first = left_index;
+		top_nodes.push_back(nodes[node.left_first]);
+		top_nodes.push_back(nodes[node.left_first + 1]);
+		stack.push_back(node.left_first + 1);
+		top_stack.push_back(left_index + 1);
+		stack.push_back(node.left_first);
+		top_stack.push_back(left_index);
+	}
+
+	std::vector<TreeletLight> lights;
+	uint32_t material_features = 0;
+	for (int i = 0; i < sphere_count; i++) {
+		material_features |= material_feature(materials[i]);
+		if (materials[i].type == 0) {
+			lights.push_back({ spheres[i], materials[i], i });
+		}
+	}
+
+	auto align = [](uint64_t offset, uint64_t alignment) { return (offset + alignment - 1) / alignment * alignment; };
+	TreeletFileHeader header = {};
+	memcpy(header.magic, TREELET_FILE_MAGIC, sizeof(header.magic));
+	header.version = TREELET_FILE_VERSION;
+	header.treelet_count = (uint32_t)treelet_roots.size();
+	header.top_node_count = (uint32_t)top_nodes.size();
+	header.light_count = (uint32_t)lights.size();
+	header.sphere_count = (uint64_t)sphere_count;
+	header.material_features = material_features;
+	header.camera = camera;
+	header.top_nodes_offset = align(sizeof(TreeletFileHeader), 64);
+	header.records_offset = align(header.top_nodes_offset + top_nodes.size() * sizeof(BVHNode), 64);
+	header.lights_offset = align(header.records_offset + treelet_roots.size() * sizeof(TreeletRecord), 64);
+
+	std::vector<TreeletRecord> records(treelet_roots.size());
+	uint64_t offset = header.lights_offset + lights.size() * sizeof(TreeletLight);
+	for (size_t i = 0; i < treelet_roots.size(); i++) {
+		int root = treelet_roots[i];
+		TreeletRecord& record = records[i];
+		record.bounds_min = nodes[root].bounds_min;
+		record.bounds_max = nodes[root].bounds_max;
+		record.node_count = subtree_nodes[root];
+		record.sphere_count = subtree_spheres[root];
+		record.offset = align(offset, TREELET_FILE_ALIGNMENT);
+		record.size = treelet_block_size(record.node_count, record.sphere_count);
+		offset = record.offset + record.size;
+	}
+	header.file_size = offset;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "%s: can't create file\n", path);
+		return false;
+	}
+	uint64_t position = 0;
+	bool ok = true;
+	auto write_at = [&](uint64_t at, const void* data, size_t size) {
+		static const char padding[TREELET_FILE_ALIGNMENT] = {};
+		size_t padding_size = (size_t)(at - position);
+		ok = ok && fwrite(padding, 1, padding_size, file) == padding_size;
+		ok = ok && fwrite(data, 1, size, file) == size;
+		position = at + size;
+	};
+	write_at(0, &header, sizeof(header));
+	write_at(header.top_nodes_offset, top_nodes.data(), top_nodes.size() * sizeof(BVHNode));
+	write_at(header.records_offset, records.data(), records.size() * sizeof(TreeletRecord));
+	write_at(header.lights_offset, lights.data(), lights.size() * sizeof(TreeletLight));
+
+	// Each subtree is copied with the same layout, sibling pairs stay next to each other.
+	std::vector<char> block;
+	std::vector<BVHNode> treelet_nodes;
+	std::vector<Sphere> treelet_spheres;
+	std::vector<Material> treelet_materials;
+	std::vector<int> treelet_ids;
+	for (size_t i = 0; i < treelet_roots.size() && ok; i++) {
+		treelet_nodes.assign(1, nodes[treelet_roots[i]]);
+		treelet_spheres.clear();
+		treelet_materials.clear();
+		treelet_ids.clear();
+		stack.assign(1, treelet_roots[i]);
+		top_stack.assign(1, 0);
+		while (!stack.empty()) {
+			int node_index = stack.back(), local_index = top_stack.back();
+			stack.pop_back();
+			top_stack.pop_back();
+			const BVHNode& node = nodes[node_index];
+			if (node.primitive_count > 0) {
+				treelet_nodes[local_index].left_first = (int)treelet_spheres.size();
+				for (int j = 0; j < node.primitive_count; j++) {
+					int sphere = bvh.primitive_indices[node.left_first + j];
+					treelet_spheres.push_back(spheres[sphere]);
+					treelet_materials.push_back(materials[sphere]);
+					treelet_ids.push_back(sphere);
+				}
+				continue;
+			}
+			int left_index = (int)treelet_nodes.size();
+			treelet_nodes[local_index].left_first = left_index;
+			treelet_nodes.push_back(nodes[node.left_first]);
+			treelet_nodes.push_back(nodes[node.left_first + 1]);
+			stack.push_back(node.left_first + 1);
+			top_stack.push_back(left_index + 1);
+			stack.push_back(node.left_first);
+			top_stack.push_back(left_index);
+		}
+
+		const TreeletRecord& record = records[i];
+		block.resize(record.size);
+		char* at = block.data();
+		memcpy(at, treelet_nodes.data(), treelet_nodes.size() * sizeof(BVHNode));
+		at += treelet_nodes.size() * sizeof(BVHNode);
+		memcpy(at, treelet_spheres.data(), treelet_spheres.size() * sizeof(Sphere));
+		at += treelet_spheres.size() * sizeof(Sphere);
+		memcpy(at, treelet_materials.data(), treelet_materials.size() * sizeof(Material));
+		at += treelet_materials.size() * sizeof(Material);
+		memcpy(at, treelet_ids.data(), treelet_ids.size() * sizeof(int));
+		write_at(record.offset, block.data(), block.size());
+	}
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "%s: write failed\n", path);
+	}
+	return ok;
+}
+
+inline void free_treelet_scene(TreeletScene& scene) {
+	unmap_file(scene.file);
+	scene.header = nullptr;
+	scene.top_nodes = nullptr;
+	scene.records = nullptr;
+	scene.lights = nullptr;
+	TreeletCache& cache = scene.cache;
+	cache.slots.clear();
+	cache.lru.clear();
+	cache.resident_bytes = cache.peak_bytes = 0;
+	cache.malformed_count = 0;
+}
+
+// Checks a block read from the file, not the mapping, so it can't change after the check: its BVH stays within its
+// nodes and spheres, and its materials and ids are ones the header promised.
+inline bool treelet_block_valid(const TreeletFileHeader& header, const TreeletRecord& record, const TreeletView& view) {
+	if (!bvh_valid(view.nodes, record.node_count, nullptr, record.sphere_count, record.sphere_count)) {
+		return false;
+	}
+	for (int i = 0; i < record.sphere_count; i++) {
+		if (!material_valid(view.materials[i]) || (material_feature(view.materials[i]) & ~header.material_features) != 0
+			|| view.ids[i] < 0 || (uint64_t)view.ids[i] >= header.sphere_count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Maps the file and checks its tables; no treelet is read until a ray needs it. budget_bytes bounds the treelets
+// kept in memory, it should hold at least one treelet per render thread (they are kept while rays are traced
+// through them, past the budget if need be).
+inline bool load_treelet_scene(const char* path, TreeletScene& scene, size_t budget_bytes) {
+	free_treelet_scene(scene);
+	if (!map_file(path, scene.file)) {
+		fprintf(stderr, "%s: can't open file\n", path);
+		return false;
+	}
+
+	const MappedFile& file = scene.file;
+	const TreeletFileHeader* header = (const TreeletFileHeader*)file.data;
+	const char* error = nullptr;
+	if (file.size < sizeof(TreeletFileHeader) || memcmp(header->magic, TREELET_FILE_MAGIC, sizeof(header->magic)) != 0) {
+		error = "not a treelet file";
+	}
+	else if (header->version != TREELET_FILE_VERSION) {
+		error = "unsupported treelet file version, convert it again";
+	}
+	else if (header->file_size != file.size || header->top_node_count == 0 || header->treelet_count == 0
+		|| header->top_nodes_offset > file.size || header->top_node_count > (file.size - header->top_nodes_offset) / sizeof(BVHNode)
+		|| header->records_offset > file.size || header->treelet_count > (file.size - header->records_offset) / sizeof(TreeletRecord)
+		|| header->lights_offset > file.size || header->light_count > (file.size - header->lights_offset) / sizeof(TreeletLight)) {
+		error = "truncated treelet file";
+	}
+	else if (header->sphere_count > INT32_MAX || (header->material_features & ~KERNEL_MATERIALS) != 0) {
+		error = "malformed treelet file header";
+	}
+	else {
+		const TreeletRecord* records = (const TreeletRecord*)((const char*)file.data + header->records_offset);
+		for (uint32_t i = 0; i < header->treelet_count && !error; i++) {
+			const TreeletRecord& record = records[i];
+			if (record.node_count <= 0 || record.sphere_count <= 0 || record.size != treelet_block_size(record.node_count, record.sphere_count)
+				|| record.offset % TREELET_FILE_ALIGNMENT != 0 || record.offset > file.size || record.size > file.size - record.offset) {
+				error = "malformed treelet table";
+			}
+		}
+		// The top leaves reference one treelet each.
+		const BVHNode* top_nodes = (const BVHNode*)((const char*)file.data + header->top_nodes_offset);
+		if (!error && !bvh_valid(top_nodes, (int)header->top_node_count, nullptr, (int)header->treelet_count, (int)header->treelet_count)) {
+			error = "malformed top bvh";
+		}
+		const TreeletLight* lights = (const TreeletLight*)((const char*)file.data + header->lights_offset);
+		for (uint32_t i = 0; i < header->light_count && !error; i++) {
+			if (lights[i].material.type != 0 || lights[i].id < 0 || (uint64_t)lights[i].id >= header->sphere_count) {
+				error = "malformed light table";
+			}
+		}
+	}
+	if (error) {
+		free_treelet_scene(scene);
+		fprintf(stderr, "%s: %s\n", path, error);
+		return false;
+	}
+
+	static std::atomic<uint64_t> next_serial(1);
+	scene.header = header;
+	scene.top_nodes = (const BVHNode*)((const char*)file.data + header->top_nodes_offset);
+	scene.records = (const TreeletRecord*)((const char*)file.data + header->records_offset);
+	scene.lights = (const TreeletLight*)((const char*)file.data + header->lights_offset);
+	scene.serial = next_serial++;
+	TreeletCache& cache = scene.cache;
+	cache.slots.resize(header->treelet_count);
+	for (TreeletSlot& slot : cache.slots) {
+		slot.pins = 0;
+		slot.loading = false;
+		slot.malformed = false;
+	}
+	cache.budget_bytes = budget_bytes;
+	return true;
+}
+
+// Points raytracer_data at an out-of-core scene instead of spheres, materials and a BVH. The camera is left to
+// the caller, see create_camera.
+inline void set_treelet_scene(RaytracerData& raytracer_data, TreeletScene& scene) {
+	raytracer_data.properties.sphere_count = 0;
+	raytracer_data.properties.bvh_node_count = 0;
+	raytracer_data.properties.light_count = (int)scene.header->light_count;
+	raytracer_data.spheres = nullptr;
+	raytracer_data.materials = nullptr;
+	raytracer_data.bvh_nodes = nullptr;
+	raytracer_data.bvh_primitive_indices = nullptr;
+	raytracer_data.lights = nullptr;
+	raytracer_data.sphere_soa = nullptr;
+	raytracer_data.meshes = nullptr;
+	raytracer_data.mesh_instances = nullptr;
+	raytracer_data.mesh_instance_count = 0;
+	raytracer_data.treelets = &scene;
+}
+
+inline int treelet_scene_material_features(const TreeletScene& scene) {
+	return (int)scene.header->material_features;
+}
+
+// Returns the treelet's block, paging it in first if it isn't resident, and keeps it resident until
+// release_treelet. Paging in evicts the least recently used treelets nobody traces through until the new one fits
+// the budget. Another thread asking for a treelet that is being paged in waits for it instead of reading it again.
+// Returns null, and reports it once, for a treelet whose block is malformed; it isn't pinned then.
+inline const char* acquire_treelet(TreeletScene& scene, int treelet) {
+	TreeletCache& cache = scene.cache;
+	TreeletSlot& slot = cache.slots[treelet];
+	ThreadCounters& counters = thread_counters();
+	std::unique_lock<std::mutex> lock(cache.mutex);
+	cache.loaded.wait(lock, [&]() { return !slot.loading; });
+	if (slot.malformed) {
+		return nullptr;
+	}
+	slot.pins++;
+	if (slot.block) {
+		cache.lru.splice(cache.lru.begin(), cache.lru, slot.lru_position);
+		counters.treelet_hits++;
+		return slot.block.get();
+	}
+
+	const TreeletRecord& record = scene.records[treelet];
+	std::vector<std::unique_ptr<char[]>> evicted;
+	for (auto it = cache.lru.end(); it != cache.lru.begin() && cache.resident_bytes + record.size > cache.budget_bytes;) {
+		--it;
+		TreeletSlot& victim = cache.slots[*it];
+		if (victim.pins == 0) {
+			cache.resident_bytes -= scene.records[*it].size;
+			evicted.push_back(std::move(victim.block));
+			it = cache.lru.erase(it);
+		}
+	}
+	cache.resident_bytes += record.size;
+	cache.peak_bytes = std::max(cache.peak_bytes, cache.resident_bytes);
+	slot.loading = true;
+	counters.treelet_misses++;
+	counters.treelet_evictions += evicted.size();
+	counters.treelet_bytes_paged += record.size;
+	lock.unlock();
+
+	evicted.clear();
+	std::unique_ptr<char[]> block(new char[record.size]);
+	memcpy(block.get(), (const char*)scene.file.data + record.offset, record.size);
+	release_mapped_range(scene.file, (size_t)record.offset, (size_t)record.size);
+	bool valid = treelet_block_valid(*scene.header, record, treelet_view(record, block.get()));
+
+	lock.lock();
+	if (!valid) {
+		fprintf(stderr, "treelet %d: malformed block, its spheres are left out\n", treelet);
+		cache.resident_bytes -= record.size;
+		cache.malformed_count++;
+		slot.pins--;
+		slot.loading = false;
+		slot.malformed = true;
+		cache.loaded.notify_all();
+		return nullptr;
+	}
+	slot.block = std::move(block);
+	slot.loading = false;
+	cache.lru.push_front(treelet);
+	slot.lru_position = cache.lru.begin();
+	cache.loaded.notify_all();
+	return slot.block.get();
+}
+
+inline void release_treelet(TreeletScene& scene, int treelet) {
+	std::lock_guard<std::mutex> lock(scene.cache.mutex);
+	scene.cache.slots[treelet].pins--;
+}
+
+struct TreeletVisit {
+	float t; // where the ray enters the treelet's bounds
+	int treelet;
+};
+
+struct TreeletWait {
+	int treelet;
+	int query;
+	int resident; // when the round started, resident treelets go first
+};
+
+// Closest hit queries traced through the treelets together, one per ray.
+struct TreeletQueries {
+	std::vector<Ray> rays;
+	std::vector<float> t_max; // lowered to the closest hit found so far
+	std::vector<int> objects; // id of the sphere hit, -1 if none
+	std::vector<Hit> hits;
+	std::vector<TreeletVisit> visits; // the treelets each ray enters, nearest first
+	std::vector<int> next_visit; // per query, its next entry of visits
+	std::vector<int> visit_end;
+	std::vector<TreeletWait> waiting; // queries of the current round, grouped by treelet
+	std::vector<TreeletWait> next_waiting;
+};
+
+// Finds the closest sphere of every query in (t_min, t_max). on_hit(query, view, sphere) is called while the treelet
+// in view is resident whenever a query's closest hit moves to one of its spheres, to copy out what the caller needs.
+template <typename OnHit>
+inline void treelet_closest_hits(TreeletScene& scene, TreeletQueries& queries, float t_min, OnHit on_hit) {
+	const int count = (int)queries.rays.size();
+	queries.objects.assign(count, -1);
+	queries.hits.resize(count);
+	queries.next_visit.resize(count);
+	queries.visit_end.resize(count);
+	queries.visits.clear();
+	queries.waiting.clear();
+	int visited = 0, tests = 0;
+
+	for (int query = 0; query < count; query++) {
+		const Ray& ray = queries.rays[query];
+		Vector3 inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+		int first = (int)queries.visits.size();
+		float t_max = queries.t_max[query];
+		visited += bvh_traverse(scene.top_nodes, (int)scene.header->top_node_count, (int)scene.header->treelet_count, ray, t_min, t_max, [&](int treelet, int, float&) {
+			const TreeletRecord& record = scene.records[treelet];
+			queries.visits.push_back({ aabb_hit(record.bounds_min, record.bounds_max, ray.origin_point, inv_dir, t_min, t_max), treelet });
+		});
+		std::sort(queries.visits.begin() + first, queries.visits.end(), [](const TreeletVisit& a, const TreeletVisit& b) { return a.t < b.t; });
+		queries.next_visit[query] = first;
+		queries.visit_end[query] = (int)queries.visits.size();
+		if (first < (int)queries.visits.size()) {
+			queries.waiting.push_back({ queries.visits[first].treelet, query, 0 });
+		}
+	}
+
+	while (!queries.waiting.empty()) {
+		{
+			std::lock_guard<std::mutex> lock(scene.cache.mutex);
+			for (TreeletWait& wait : queries.waiting) {
+				wait.resident = scene.cache.slots[wait.treelet].block ? 1 : 0;
+			}
+		}
+		std::sort(queries.waiting.begin(), queries.waiting.end(), [](const TreeletWait& a, const TreeletWait& b) {
+			return a.resident != b.resident ? a.resident > b.resident : a.treelet != b.treelet ? a.treelet < b.treelet : a.query < b.query;
+		});
+
+		queries.next_waiting.clear();
+		for (size_t begin = 0, end = 0; begin < queries.waiting.size(); begin = end) {
+			int treelet = queries.waiting[begin].treelet;
+			while (end < queries.waiting.size() && queries.waiting[end].treelet == treelet) {
+				end++;
+			}
+			// A malformed treelet has no block, its rays only move on to their next treelet.
+			const char* block = acquire_treelet(scene, treelet);
+			TreeletView view = block ? treelet_view(scene.records[treelet], block) : TreeletView();
+			for (size_t i = begin; i < end; i++) {
+				int query = queries.waiting[i].query;
+				const Ray& ray = queries.rays[query];
+				int selected = -1;
+				if (block) {
+					visited += bvh_traverse(view.nodes, scene.records[treelet].node_count, scene.records[treelet].sphere_count, ray, t_min, queries.t_max[query], [&](int first, int sphere_count, float& closest) {
+						tests += sphere_count;
+						for (int j = first; j < first + sphere_count; j++) {
+							if (sphere_hit(view.spheres[j], ray, t_min, closest, queries.hits[query])) {
+								closest = queries.hits[query].t;
+								selected = j;
+							}
+						}
+					});
+				}
+				if (selected != -1) {
+					queries.objects[query] = view.ids[selected];
+					on_hit(query, view, selected);
+				}
+
+				// Treelets entered behind the closest hit can't have a closer one.
+				int next = ++queries.next_visit[query];
+				if (next < queries.visit_end[query] && queries.visits[next].t < queries.t_max[query]) {
+					queries.next_waiting.push_back({ queries.visits[next].treelet, query, 0 });
+				}
+			}
+			if (block) {
+				release_treelet(scene, treelet);
+			}
+		}
+		queries.waiting.swap(queries.next_waiting);
+	}
+
+	ThreadCounters& counters = thread_counters();
+	counters.intersection_tests += tests;
+	counters.bvh_nodes_visited += visited;
+}
+
+// Per thread state of trace_tile_treelets. The shading stages find the spheres and materials the rays hit through
+// a RaytracerData whose arrays are slots: the lights first, then one per path with what the path hit last.
+struct TreeletTileState {
+	uint64_t scene_serial;
+	std::vector<Sphere> slot_spheres;
+	std::vector<Material> slot_materials;
+	std::vector<int> light_slots;
+	TreeletQueries queries;
+};
+
+inline TreeletTileState& treelet_tile_state() {
+	static thread_local TreeletTileState state;
+	return state;
+}
+
+// trace_tile_wavefront for data.treelets.
+inline void trace_tile_treelets(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1) {
+	TreeletScene& scene = *data.treelets;
+	TreeletTileState& state = treelet_tile_state();
+	const int light_count = (int)scene.header->light_count;
+	const size_t path_count = (size_t)(x1 - x0) * (y1 - y0) * data.properties.samples;
+	if (state.scene_serial != scene.serial) {
+		state.slot_spheres.assign(light_count, Sphere(Vector3(), 0.0f));
+		state.slot_materials.resize(light_count);
+		state.light_slots.resize(light_count);
+		for (int i = 0; i < light_count; i++) {
+			state.slot_spheres[i] = scene.lights[i].sphere;
+			state.slot_materials[i] = scene.lights[i].material;
+			state.light_slots[i] = i;
+		}
+		state.scene_serial = scene.serial;
+	}
+	state.slot_spheres.resize(light_count + path_count, Sphere(Vector3(), 0.0f));
+	state.slot_materials.resize(light_count + path_count);
+
+	RaytracerData shading = data;
+	shading.properties.sphere_count = (int)(light_count + path_count);
+	shading.spheres = state.slot_spheres.data();
+	shading.materials = state.slot_materials.data();
+	shading.lights = state.light_slots.data();
+	// The first hit AOVs look through mirrors with the regular hit tests, which can't see treelets.
+	PassTarget tile_target = target;
+	tile_target.aovs = nullptr;
+
+	TreeletQueries& queries = state.queries;
+	auto intersect = [&](WavefrontPaths& paths, int) {
+		const size_t count = paths.active.size();
+		queries.rays.resize(count);
+		queries.t_max.assign(count, 1.0e7f);
+		for (size_t i = 0; i < count; i++) {
+			queries.rays[i] = paths.rays[paths.active[i]];
+		}
+		treelet_closest_hits(scene, queries, 0.001f, [&](int query, const TreeletView& view, int sphere) {
+			size_t slot = light_count + paths.active[query];
+			state.slot_spheres[slot] = view.spheres[sphere];
+			state.slot_materials[slot] = view.materials[sphere];
+		});
+		for (size_t i = 0; i < count; i++) {
+			int path = paths.active[i];
+			paths.objects[path] = queries.objects[i] == -1 ? -1 : light_count + path;
+			paths.hits[path] = queries.hits[i];
+		}
+		thread_counters().rays += count;
+	};
+	auto trace_shadow_rays = [&](WavefrontPaths& paths) {
+		const size_t count = paths.shadow_rays.size();
+		queries.rays.resize(count);
+		queries.t_max.resize(count);
+		for (size_t i = 0; i < count; i++) {
+			queries.rays[i] = paths.shadow_rays[i].sample.ray;
+			queries.t_max[i] = paths.shadow_rays[i].sample.t_max;
+		}
+		treelet_closest_hits(scene, queries, 0.001f, [](int, const TreeletView&, int) {});
+		for (size_t i = 0; i < count; i++) {
+			const WavefrontShadowRay& shadow_ray = paths.shadow_rays[i];
+			if (queries.objects[i] == scene.lights[shadow_ray.sample.light].id) {
+				paths.radiance[shadow_ray.path] += shadow_ray.sample.contribution;
+			}
+		}
+		thread_counters().rays += count;
+		paths.shadow_rays.clear();
+	};
+	trace_tile_wavefront_stages(shading, tile_target, x0, y0, x1, y1, intersect, trace_shadow_rays);
+}
@@ -0,0 +1,364 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "cpu_raytracer.h"
+#include "sphere_soa.h"
+
+// Wavefront mode of the CPU tracer. Instead of following one path to its end like trace_ray, a tile starts every
+// path of every pixel at once and advances them a bounce at a time: intersect all active rays, group them by what
+// they hit (sky, emitter, lambertian, metal), shade each group as one batch and trace the shadow rays of the
+// lambertian batch together. Shading batches only contain one material, so the Vector3x8 kernels run on full lanes.
+// The estimator is the same as trace_ray's. With SAMPLER_WANG every path draws from its own random stream instead of
+// the pixel's samples sharing one, so images match in expectation rather than bit for bit; the counter based samplers
+// draw the same numbers in both modes.
+//
+// Out-of-core scenes are always traced with these stages, see treelets.h. For scenes in memory they are an opt-in
+// mode (CpuRenderer::wavefront, --wavefront on) that is slower than the per-pixel path with camera ray packets on the
+// benchmark scenes: shading is a small part of a bounce there, and path state kept in memory between stages costs
+// more than batching saves. playground-benchmark keeps the comparison.
+
+enum WavefrontBucket {
+	WAVEFRONT_MISS,
+	WAVEFRONT_EMISSIVE, // and anything else that doesn't scatter
+	WAVEFRONT_LAMBERTIAN,
+	WAVEFRONT_METAL,
+	WAVEFRONT_BUCKET_COUNT
+};
+
+#define WAVEFRONT_PACKET_RAYS 64 // consecutive camera rays intersected as one packet, about one pixel's samples
+
+typedef std::vector<Vector3x8, AlignedAllocator<Vector3x8>> aligned_batch_vector;
+
+struct WavefrontShadowRay {
+	LightSample sample;
+	int path;
+};
+
+// Path state of one tile, one element per path. Kept per thread and reused, so a pass doesn't allocate.
+struct WavefrontPaths {
+	std::vector<Ray> rays;
+	std::vector<Vector3> throughput;
+	std::vector<Vector3> radiance;
+	std::vector<PathSampler> random_states;
+	std::vector<float> bsdf_pdfs; // see trace_ray
+	std::vector<Vector3> bounce_origins;
+	std::vector<Hit> hits;
+	std::vector<int> objects;
+	std::vector<float> closest; // scratch of stream_check_object_hit
+	BVHStream stream;
+
+	std::vector<int> active; // paths still tracing
+	std::vector<int> next_active;
+	std::vector<int> sorted; // active paths grouped by WavefrontBucket
+	int bucket_first[WAVEFRONT_BUCKET_COUNT + 1];
+	std::vector<WavefrontShadowRay> shadow_rays;
+	aligned_batch_vector batch_a; // SIMD shading scratch
+	aligned_batch_vector batch_b;
+	aligned_float_vector batch_t;
+};
+
+// The shading batches are short bursts between scalar code. On CPUs that lower their clock for a while after AVX-512
+// instructions that cost more than it saved (measured on the default scene), so AVX2 is the widest used here.
+inline const VectorBatchKernels& wavefront_batch_kernels() {
+	static const VectorBatchKernels kernels = get_vector_batch_kernels(std::min(detect_simd_level(), SIMD_LEVEL_AVX2));
+	return kernels;
+}
+
+inline WavefrontPaths& wavefront_paths() {
+	static thread_local WavefrontPaths paths;
+	return paths;
+}
+
+inline void wavefront_generate(const RaytracerData& data, WavefrontPaths& paths, int x0, int y0, int x1, int y1) {
+	const RaytracerProperties& properties = data.properties;
+	const int samples = properties.samples;
+	const size_t count = (size_t)(x1 - x0) * (y1 - y0) * samples;
+	paths.rays.resize(count);
+	paths.throughput.assign(count, Vector3(1.0f, 1.0f, 1.0f));
+	paths.radiance.assign(count, Vector3());
+	paths.random_states.resize(count);
+	paths.bsdf_pdfs.assign(count, 0.0f);
+	paths.bounce_origins.resize(count);
+	paths.hits.resize(count);
+	paths.objects.resize(count);
+	paths.closest.resize(count);
+	paths.active.resize(count);
+
+	size_t path = 0;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			PathSampler pixel_sampler = create_path_sampler(data.sampler, x, y, properties.frame_count);
+			for (int i = 0; i < samples; i++, path++) {
+				PathSampler random_state = pixel_sampler;
+				random_state.state = (pixel_sampler.state ^ ((uint32_t)i * 0x9E3779B9u)) | 1;
+				wang_hash(random_state.state);
+				sampler_begin_sample(random_state, (uint32_t)properties.frame_count * samples + i);
+				float u = float(x + random_float(random_state)) / float(properties.width);
+				float v = (properties.height - float(y + random_float(random_state))) / float(properties.height);
+				paths.rays[path] = get_camera_ray(random_state, properties.camera, u, v);
+				paths.random_states[path] = random_state;
+				paths.active[path] = (int)path;
+			}
+		}
+	}
+	thread_counters().paths += count;
+}
+
+// Camera rays are generated in path order, the samples of a pixel next to each other, so without depth of field runs
+// of them share an origin and nearly a direction and go through the BVH as packets. Bounce rays, which share neither,
+// go through it as one stream, and every leaf tests all the rays that reach it in one soa_closest_hits call.
+inline void wavefront_intersect(const RaytracerData& data, WavefrontPaths& paths, int depth) {
+	const size_t count = paths.active.size();
+	if (depth == 0 && packets_usable(data) && !data.compressed_bvh) {
+		for (size_t first = 0; first < count; first += WAVEFRONT_PACKET_RAYS) {
+			int packet_rays = (int)std::min(count - first, (size_t)WAVEFRONT_PACKET_RAYS);
+			packet_check_object_hit(data, &paths.rays[first], packet_rays, 0.001f, 1.0e7f, &paths.objects[first], &paths.hits[first]);
+		}
+	}
+	else if (data.properties.bvh_node_count > 0 && !data.compressed_bvh) {
+		stream_check_object_hit(data, paths.rays.data(), paths.active.data(), (int)count, 0.001f, 1.0e7f, paths.closest.data(), paths.objects.data(), paths.hits.data(),
+			paths.stream);
+	}
+	else {
+		for (int path : paths.active) {
+			paths.objects[path] = check_object_hit(data, paths.rays[path], 0.001f, 1.0e7f, paths.hits[path]);
+		}
+	}
+	thread_counters().rays += count;
+}
+
+inline WavefrontBucket wavefront_bucket(const RaytracerData& data, int object) {
+	if (object == -1) {
+		return WAVEFRONT_MISS;
+	}
+	int type = object_material(data, object).type;
+	return type == 1 ? WAVEFRONT_LAMBERTIAN : type == 2 ? WAVEFRONT_METAL : WAVEFRONT_EMISSIVE;
+}
+
+// Counting sort of the active paths by bucket, stable so paths of one pixel stay together.
+inline void wavefront_sort(const RaytracerData& data, WavefrontPaths& paths) {
+	int counts[WAVEFRONT_BUCKET_COUNT] = {};
+	for (int path : paths.active) {
+		counts[wavefront_bucket(data, paths.objects[path])]++;
+	}
+	paths.bucket_first[0] = 0;
+	for (int i = 0; i < WAVEFRONT_BUCKET_COUNT; i++) {
+		paths.bucket_first[i + 1] = paths.bucket_first[i] + counts[i];
+	}
+
+	int next[WAVEFRONT_BUCKET_COUNT];
+	std::copy(paths.bucket_first, paths.bucket_first + WAVEFRONT_BUCKET_COUNT, next);
+	paths.sorted.resize(paths.active.size());
+	for (int path : paths.active) {
+		paths.sorted[next[wavefront_bucket(data, paths.objects[path])]++] = path;
+	}
+}
+
+// Gathers one Vector3 per path of a bucket into SoA batches. Lanes past the end repeat fill, so the batch kernels
+// never see garbage.
+template <typename Get>
+inline void wavefront_gather(const int* bucket, int count, aligned_batch_vector& batches, Vector3 fill, Get get) {
+	batches.resize((count + 7) / 8);
+	for (int i = 0; i < (int)batches.size() * 8; i++) {
+		batches[i / 8].set(i % 8, i < count ? get(bucket[i]) : fill);
+	}
+}
+
+// Paths that left the scene pick up the sky, with direction normalization and the sky gradient done in batches.
+inline void wavefront_shade_miss(WavefrontPaths& paths, const int* bucket, int count, int depth) {
+	if (count == 0) {
+		return;
+	}
+	wavefront_gather(bucket, count, paths.batch_a, Vector3(0, 1, 0), [&](int path) { return paths.rays[path].direction; });
+	size_t batch_count = paths.batch_a.size();
+	const VectorBatchKernels& kernels = wavefront_batch_kernels();
+	kernels.unit_vector(paths.batch_a.data(), paths.batch_a.data(), batch_count);
+
+	paths.batch_t.resize(batch_count * 8);
+	for (size_t i = 0; i < batch_count * 8; i++) {
+		paths.batch_t[i] = 0.5f * paths.batch_a[i / 8].y[i % 8] + 0.5f;
+	}
+	paths.batch_b.resize(batch_count);
+	for (size_t i = 0; i < batch_count * 8; i++) {
+		paths.batch_a[i / 8].set(i % 8, Vector3(1, 1, 1));
+		paths.batch_b[i / 8].set(i % 8, Vector3(0.5f, 0.7f, 1.0f));
+	}
+	aligned_batch_vector& sky = paths.batch_b;
+	kernels.lerp(paths.batch_a.data(), paths.batch_b.data(), paths.batch_t.data(), sky.data(), batch_count);
+
+	for (int i = 0; i < count; i++) {
+		int path = bucket[i];
+		paths.radiance[path] += paths.throughput[path] * sky[i / 8].get(i % 8);
+	}
+	thread_counters().bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)] += count;
+}
+
+inline void wavefront_shade_emissive(const RaytracerData& data, WavefrontPaths& paths, const int* bucket, int count, int depth) {
+	for (int i = 0; i < count; i++) {
+		int path = bucket[i];
+		int object = paths.objects[path];
+		float weight = 1.0f;
+		if (paths.bsdf_pdfs[path] > 0.0f && object < data.properties.sphere_count) {
+			float light_pdf = sphere_light_pdf(data.spheres[object], paths.bounce_origins[path]) / data.properties.light_count;
+			weight = power_heuristic(paths.bsdf_pdfs[path], light_pdf);
+		}
+		paths.radiance[path] += paths.throughput[path] * emit(object_material(data, object)) * weight;
+	}
+	thread_counters().bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)] += count;
+}
+
+// Scattered paths that survive Russian roulette go on to the next bounce.
+inline void wavefront_continue(const RaytracerData& data, WavefrontPaths& paths, int path, int depth, const Ray& outgoing_ray, const Vector3& attenuation) {
+	paths.throughput[path] *= attenuation;
+	paths.rays[path] = outgoing_ray;
+	sampler_seek_bounce(paths.random_states[path], depth, SAMPLE_DIM_ROULETTE);
+	if (russian_roulette(paths.random_states[path], data.properties, depth, paths.throughput[path])) {
+		paths.next_active.push_back(path);
+	}
+	else {
+		thread_counters().bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)]++;
+	}
+}
+
+inline void wavefront_shade_lambertian(const RaytracerData& data, WavefrontPaths& paths, const int* bucket, int count, int depth) {
+	bool light_sampling = data.properties.light_sampling && data.properties.light_count > 0;
+	for (int i = 0; i < count; i++) {
+		int path = bucket[i];
+		const Material& material = object_material(data, paths.objects[path]);
+		const Hit& hit = paths.hits[path];
+		PathSampler& random_state = paths.random_states[path];
+		Ray outgoing_ray;
+		Vector3 attenuation;
+		sampler_seek_bounce(random_state, depth, SAMPLE_DIM_SCATTER);
+		lambertian_scatter(random_state, material, paths.rays[path], hit, attenuation, outgoing_ray);
+
+		paths.bsdf_pdfs[path] = 0.0f;
+		if (light_sampling) {
+			WavefrontShadowRay shadow_ray;
+			shadow_ray.path = path;
+			sampler_seek_bounce(random_state, depth, SAMPLE_DIM_LIGHT);
+			if (sample_light(random_state, data, hit, material, shadow_ray.sample)) {
+				shadow_ray.sample.contribution *= paths.throughput[path];
+				paths.shadow_rays.push_back(shadow_ray);
+			}
+			paths.bsdf_pdfs[path] = lambertian_pdf(hit, outgoing_ray.direction);
+			paths.bounce_origins[path] = hit.pos;
+		}
+		wavefront_continue(data, paths, path, depth, outgoing_ray, attenuation);
+	}
+}
+
+// Reflections of the whole bucket are computed in batches; only the fuzz, which needs random numbers, is per path.
+inline void wavefront_shade_metal(const RaytracerData& data, WavefrontPaths& paths, const int* bucket, int count, int depth) {
+	if (count == 0) {
+		return;
+	}
+	wavefront_gather(bucket, count, paths.batch_a, Vector3(0, 1, 0), [&](int path) { return paths.rays[path].direction; });
+	wavefront_gather(bucket, count, paths.batch_b, Vector3(0, 1, 0), [&](int path) { return paths.hits[path].normal; });
+	size_t batch_count = paths.batch_a.size();
+	const VectorBatchKernels& kernels = wavefront_batch_kernels();
+	kernels.unit_vector(paths.batch_a.data(), paths.batch_a.data(), batch_count);
+	kernels.reflect(paths.batch_a.data(), paths.batch_b.data(), paths.batch_a.data(), batch_count);
+
+	for (int i = 0; i < count; i++) {
+		int path = bucket[i];
+		const Material& material = object_material(data, paths.objects[path]);
+		const Hit& hit = paths.hits[path];
+		sampler_seek_bounce(paths.random_states[path], depth, SAMPLE_DIM_SCATTER);
+		Ray outgoing_ray(hit.pos, paths.batch_a[i / 8].get(i % 8) + random_in_unit_sphere(paths.random_states[path]) * material.fuzziness);
+		paths.bsdf_pdfs[path] = 0.0f;
+		if (dot(outgoing_ray.direction, hit.normal) > 0) {
+			wavefront_continue(data, paths, path, depth, outgoing_ray, material.albedo);
+		}
+		else {
+			thread_counters().bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)]++; // absorbed
+		}
+	}
+}
+
+inline void wavefront_trace_shadow_rays(const RaytracerData& data, WavefrontPaths& paths) {
+	for (const WavefrontShadowRay& shadow_ray : paths.shadow_rays) {
+		if (light_sample_visible(data, shadow_ray.sample)) {
+			paths.radiance[shadow_ray.path] += shadow_ray.sample.contribution;
+		}
+	}
+	paths.shadow_rays.clear();
+}
+
+// Adds the camera rays' first hits to the AOVs of their pixels, right after the first wavefront_intersect.
+inline void wavefront_write_aovs(const RaytracerData& data, const WavefrontPaths& paths, PixelAov* aovs, int x0, int y0, int x1, int y1) {
+	const int samples = data.properties.samples;
+	size_t path = 0;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			PixelAov aov;
+			for (int i = 0; i < samples; i++, path++) {
+				add_first_hit_aov(data, paths.rays[path], paths.objects[path], paths.hits[path], aov);
+			}
+			average_aov(aov, samples);
+			aovs[(size_t)y * data.properties.width + x] = aov;
+		}
+	}
+}
+
+// Renders tile [x0, x1) x [y0, y1) into target with the given stages for the ones that look at the geometry:
+// intersect(paths, depth) sets objects and hits of the active paths, trace_shadow_rays(paths) adds the visible shadow_rays
+// to radiance and clears them. The shading stages only see the objects intersect returned, through data.
+template <typename Intersect, typename TraceShadowRays>
+inline void trace_tile_wavefront_stages(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1, Intersect intersect,
+	TraceShadowRays trace_shadow_rays) {
+	const RaytracerProperties& properties = data.properties;
+	WavefrontPaths& paths = wavefront_paths();
+	ThreadCounters& counters = thread_counters();
+
+	uint64_t generation_start = stats_ticks();
+	wavefront_generate(data, paths, x0, y0, x1, y1);
+	uint64_t trace_start = stats_ticks();
+
+	int depth = 0;
+	for (; depth < properties.max_depth && !paths.active.empty(); depth++) {
+		intersect(paths, depth);
+		if (depth == 0 && target.aovs) {
+			wavefront_write_aovs(data, paths, target.aovs, x0, y0, x1, y1);
+		}
+		wavefront_sort(data, paths);
+
+		const int* sorted = paths.sorted.data();
+		const int* first = paths.bucket_first;
+		paths.next_active.clear();
+		wavefront_shade_miss(paths, sorted + first[WAVEFRONT_MISS], first[WAVEFRONT_MISS + 1] - first[WAVEFRONT_MISS], depth);
+		wavefront_shade_emissive(data, paths, sorted + first[WAVEFRONT_EMISSIVE], first[WAVEFRONT_EMISSIVE + 1] - first[WAVEFRONT_EMISSIVE], depth);
+		wavefront_shade_lambertian(data, paths, sorted + first[WAVEFRONT_LAMBERTIAN], first[WAVEFRONT_LAMBERTIAN + 1] - first[WAVEFRONT_LAMBERTIAN], depth);
+		wavefront_shade_metal(data, paths, sorted + first[WAVEFRONT_METAL], first[WAVEFRONT_METAL + 1] - first[WAVEFRONT_METAL], depth);
+		trace_shadow_rays(paths);
+		paths.active.swap(paths.next_active);
+	}
+	counters.bounce_histogram[std::min(depth, FRAME_STATS_BOUNCE_BUCKETS - 1)] += paths.active.size(); // hit max_depth
+
+	uint64_t accumulation_start = stats_ticks();
+	const int samples = properties.samples;
+	size_t path = 0;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Vector3 color;
+			for (int i = 0; i < samples; i++, path++) {
+				color += paths.radiance[path];
+			}
+			color /= float(samples);
+			accumulate_pixel(properties, target, (size_t)y * properties.width + x, color);
+		}
+	}
+
+	uint64_t end = stats_ticks();
+	counters.ray_generation_ticks += trace_start - generation_start;
+	counters.trace_ticks += accumulation_start - trace_start;
+	counters.accumulation_ticks += end - accumulation_start;
+}
+
+// Renders tile [x0, x1) x [y0, y1) into target like trace_pixel does for each of its pixels.
+inline void trace_tile_wavefront(const RaytracerData& data, const PassTarget& target, int x0, int y0, int x1, int y1) {
+	trace_tile_wavefront_stages(data, target, x0, y0, x1, y1,
+		[&](WavefrontPaths& paths, int depth) { wavefront_intersect(data, paths, depth); },
+		[&](WavefrontPaths& paths) { wavefront_trace_shadow_rays(data, paths); });
+}